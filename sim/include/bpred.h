@@ -0,0 +1,69 @@
+#ifndef BPRED_H
+#define BPRED_H
+
+#include <stdint.h>
+
+// Branch prediction for the pipeline: IF asks for the next pc, EX tells
+// the outcome. The BTB supplies targets and what kind of control transfer
+// sits at a pc, a direction predictor decides conditional branches and the
+// return address stack predicts returns.
+
+typedef enum {
+    BP_NONE,        // not configured, IF fetches pc + 4 and keeps no statistics
+    BP_NT,          // static not-taken
+    BP_BTFN,        // static backward taken, forward not-taken
+    BP_BIMODAL,     // 2-bit counters indexed by pc
+    BP_GSHARE,      // 2-bit counters indexed by pc ^ global history
+    BP_TAGE,        // bimodal base and 4 tagged tables of geometric history lengths
+} BpKind;
+
+typedef struct {
+    BpKind kind;
+    int entries;        // counters (bimodal, gshare, TAGE base), 0: default
+    int btb_entries;
+    int ras_entries;    // 0: returns are predicted by the BTB
+} BpConfig;
+
+// What kind of control transfer an instruction is, learnt in EX
+typedef enum {
+    CF_NONE, CF_BRANCH, CF_JUMP, CF_CALL, CF_RETURN, CF_INDIRECT, CF_NUM
+} CfKind;
+
+#define TAGE_TABLES 4
+
+// Everything a prediction was made from, it travels down the pipeline with
+// the instruction. EX uses it to train the tables that were read and to
+// repair the RAS after a misprediction.
+typedef struct {
+    uint64_t next_pc;   // pc + 4 unless the prediction redirected fetch
+    int taken;          // direction of a conditional branch
+    int btb_hit;
+    int ras_action;     // +1 pushed, -1 popped, 0 left alone
+    int ras_top;        // RAS before the instruction touched it
+    uint64_t ras_top_value;
+    uint32_t index;     // bimodal/gshare counter, TAGE base
+    // TAGE
+    uint32_t tage_index[TAGE_TABLES];
+    uint16_t tage_tag[TAGE_TABLES];
+    int provider;       // table giving the prediction, -1: the base
+    int alt_taken;      // what the next shorter history would say
+} BpMeta;
+
+typedef struct BranchPredictor BranchPredictor;
+
+// Returns NULL (and logs why) if cfg does not describe a valid predictor
+BranchPredictor *bp_create(const BpConfig *cfg);
+void bp_free(BranchPredictor *bp);
+// IF: predict what follows the instruction at pc
+void bp_predict(BranchPredictor *bp, uint64_t pc, BpMeta *m);
+// EX: kind and outcome of the instruction predicted with m. mispredicted
+// means fetch went the wrong way, the younger instructions are flushed.
+void bp_update(BranchPredictor *bp, uint64_t pc, const BpMeta *m, CfKind kind,
+               int taken, uint64_t target, int mispredicted);
+// What kind of control transfer inst is, from its bits
+CfKind bp_classify(uint32_t inst);
+void bp_report(const BranchPredictor *bp);
+struct Stats;
+void bp_register_stats(const BranchPredictor *bp, struct Stats *s);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+// Timing-only model of a set-associative cache: it tracks tags, not data,
+// and tells how many cycles an access takes. The data always comes from
+// guest memory, so a cache can never change what a program computes.
+
+typedef enum { REPL_LRU, REPL_PLRU, REPL_RANDOM } CacheRepl;
+
+typedef enum {
+    WRITE_BACK,     // write-allocate, dirty lines are written back on eviction
+    WRITE_THROUGH,  // no write-allocate, every store goes to the next level
+} CacheWrite;
+
+typedef struct {
+    uint64_t size;          // bytes, 0 when the cache is not modelled
+    int ways;
+    int line;               // bytes per line
+    CacheRepl repl;
+    CacheWrite write;
+    int latency;            // cycles of a hit
+} CacheConfig;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;    // dirty evictions, and stores sent through
+} CacheStats;
+
+typedef struct {
+    uint64_t tag;           // line address, addr >> line_shift
+    uint64_t stamp;         // LRU: last access
+    uint8_t valid;
+    uint8_t dirty;
+} CacheLine;
+
+typedef struct Cache {
+    const char *name;
+    CacheConfig cfg;
+    int nsets;
+    int line_shift;
+    CacheLine *lines;       // nsets * ways
+    uint64_t *plru;         // PLRU: one tree of ways - 1 bits per set
+    uint64_t tick;
+    uint64_t rng;           // random replacement, fixed seed so runs repeat
+    struct Cache *next;     // NULL: misses go to memory
+    int mem_latency;        // cycles of a memory access, when next is NULL
+    CacheStats st;
+} Cache;
+
+// Returns NULL (and logs why) if cfg does not describe a valid cache
+Cache *cache_create(const char *name, const CacheConfig *cfg, Cache *next, int mem_latency);
+void cache_free(Cache *c);
+// Cycles taken by an access to addr, hit latency included
+int cache_access(Cache *c, uint64_t addr, int write);
+void cache_report(const Cache *c);
+struct Stats;
+// Under the lowercase name of the cache: l1d.misses, ...
+void cache_register_stats(const Cache *c, struct Stats *s);
+
+// Cycles an access stalls the stage doing it, whose own cycle already
+// covers a one-cycle hit. No cache: no stall, as without the model.
+static inline int cache_stall(Cache *c, uint64_t addr, int write) {
+    return c ? cache_access(c, addr, write) - 1 : 0;
+}
+
+#endif
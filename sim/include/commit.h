@@ -0,0 +1,40 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdint.h>
+#include <cpu.h>
+
+// What a timing model needs to know about one instruction the ISS ran. The
+// model decides when it happens, the ISS already made it happen.
+typedef struct {
+    uint64_t pc;
+    uint64_t next_pc;   // where it went: the outcome of a branch or jump
+    uint64_t addr;      // loads, stores and AMOs
+    uint64_t value;     // rd after it
+    uint32_t inst;
+    uint8_t op;         // IsaOp
+    uint8_t rd, rs1, rs2;   // 0 when it does not use them
+    uint8_t fault;      // raised an exception: nothing of it happened, the machine stopped
+} CommitRec;
+
+// Run the next instruction of ctx on the ISS and describe it in r. Returns 0
+// if the machine had already stopped.
+int iss_exec_commit(SimContext *ctx, CommitRec *r);
+// The same without the hooks: the reference of --difftest runs next to a
+// model that may be tracing, and must not trace a second time
+int iss_exec_reference(SimContext *ctx, CommitRec *r);
+
+// --decoupled: ctx->iss runs the program on a thread of its own, ahead of
+// the timing model, and hands it the records through a lock-free ring with
+// one producer and one consumer.
+int decoupled_start(SimContext *ctx);
+// Stops the ISS thread if it is still running, frees the ring
+void decoupled_free(SimContext *ctx);
+
+// The next instruction for the timing model of ctx: from the ring with
+// --decoupled, else run on ctx itself. Either way ctx->ninst counts it.
+// Returns 0 once the program has stopped and every record was taken, then
+// ctx->running is 0 and ctx->exit_code is set.
+int commit_next(SimContext *ctx, CommitRec *r);
+
+#endif
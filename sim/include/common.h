@@ -8,6 +8,7 @@
 #include <malloc.h>
 #include <dbg.h>
 
+// Default guest RAM, see --mem-size and --mem-base
 #define MEM_SIZE 0x8000000
 #define MEM_BASE 0x80000000
 
@@ -0,0 +1,37 @@
+#ifndef CPISTACK_H
+#define CPISTACK_H
+
+#include <stdint.h>
+#include "ftrace.h"
+
+// Every simulated cycle of mc and pl goes to one cause, and to the static
+// instruction it is blamed on (--cpi-stack).
+
+typedef enum {
+    CPI_BASE,       // an instruction retired, or a stage did its own work
+    CPI_RAW,        // waiting for a register, ecall included
+    CPI_LOAD_USE,   // waiting for a load or AMO
+    CPI_CONTROL,    // flushed after a mispredicted branch or jump
+    CPI_LONG,       // waiting for a result of more than one cycle, e.g. a divide
+    CPI_ICACHE,     // I$ miss
+    CPI_DCACHE,     // D$ miss
+    CPI_STRUCT,     // no functional unit free
+    CPI_NUM
+} CpiCause;
+
+typedef struct CpiStack CpiStack;
+
+CpiStack *cpi_create(void);
+void cpi_free(CpiStack *c);
+// n cycles of cause, blamed on the instruction at pc (0: on none)
+void cpi_charge(CpiStack *c, CpiCause cause, uint64_t pc, uint64_t n);
+void cpi_retire(CpiStack *c, uint64_t pc);
+// cycles charged so far
+uint64_t cpi_cycles(const CpiStack *c);
+// Totals, then the functions and static instructions that took the most
+// cycles
+void cpi_report(const CpiStack *c, SymbolTable *symbols);
+struct Stats;
+void cpi_register_stats(const CpiStack *c, struct Stats *s);
+
+#endif
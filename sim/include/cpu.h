@@ -5,8 +5,15 @@
 
 #define CSR_MEPC 0x341
 #define CSR_MCAUSE 0x342
+#define CSR_MTVAL 0x343
 #define CSR_MSTATUS 0x300
 #define CSR_MTVEC 0x305
+#define CSR_MSCRATCH 0x340
+#define CSR_MCYCLE 0xb00
+#define CSR_MINSTRET 0xb02
+#define CSR_CYCLE 0xc00
+#define CSR_INSTRET 0xc02
+#define CSR_MHARTID 0xf14
 
 typedef struct {
     uint64_t reg[32];
@@ -14,22 +21,45 @@ typedef struct {
     uint64_t csr[4096];
 } CPU_state;
 
-void init_cpu();
-void halt_trap(uint64_t pc, uint64_t code);
+// Defined in sim.h
+typedef struct SimContext SimContext;
+
+// CSR_RW/RS/RC are csrrw, csrrs and csrrc
+typedef enum { CSR_RW, CSR_RS, CSR_RC } CsrOp;
+
+// mcause values of the exceptions the simulator raises
+#define EXC_INST_ACCESS      1
+#define EXC_LOAD_MISALIGNED  4
+#define EXC_LOAD_ACCESS      5
+#define EXC_STORE_MISALIGNED 6
+#define EXC_STORE_ACCESS     7
+
+void init_cpu(SimContext *ctx);
+void halt_trap(SimContext *ctx, uint64_t pc, uint64_t code);
+uint64_t csr_access(SimContext *ctx, uint32_t csr, CsrOp op, uint64_t val);
+// Exceptions are precise: the memory layer raises one, the instruction
+// leaves registers, memory and pc alone, and the model takes it before
+// anything younger runs.
+void raise_exception(SimContext *ctx, uint64_t cause, uint64_t tval);
+void take_exception(SimContext *ctx, uint64_t pc);
 
 // ------------ ISS SIM ------------
 
-void iss_cpu_exec();
-void iss_exec_once();
+void iss_cpu_exec(SimContext *ctx);
+void iss_exec_once(SimContext *ctx);
 
 // --------- Multi-cycle SIM ---------
 
-void mc_cpu_exec();
-void mc_exec_once();
+void mc_cpu_exec(SimContext *ctx);
+void mc_exec_once(SimContext *ctx);
 
 // ---------- Pipeline SIM -----------
 
-void pl_cpu_exec();
-void pl_exec_once();
+void pl_cpu_exec(SimContext *ctx);
+void pl_exec_once(SimContext *ctx);
+
+// -------- Out-of-order SIM ---------
+
+void ooo_cpu_exec(SimContext *ctx);
 
 #endif
\ No newline at end of file
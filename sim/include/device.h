@@ -0,0 +1,15 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <cpu.h>
+
+// MMIO devices at the addresses QEMU's virt machine uses, so guest code
+// written for it finds them where it expects
+#define DEV_EXIT_BASE   0x00100000  // SiFive test finisher
+#define DEV_CLINT_BASE  0x02000000  // mtime and mtimecmp
+#define DEV_UART_BASE   0x10000000  // 16550, transmit only
+
+// Add every device to the memory map of ctx (hart 0)
+int init_devices(SimContext *ctx);
+
+#endif
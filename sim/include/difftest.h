@@ -0,0 +1,44 @@
+#ifndef DIFFTEST_H
+#define DIFFTEST_H
+
+#include <stdint.h>
+#include <sim.h>
+
+// --difftest: an ISS runs the same program next to mc or pl, one instruction
+// each time the model retires one, and the two must agree on where it went,
+// the register it wrote and the memory it stored to. The first instruction
+// they disagree on stops the run.
+//
+// Instructions whose outcome depends on the model and not on the program,
+// like reading the cycle counter, a device or making a system call, are not
+// run on the ISS: it takes the registers of the model instead.
+
+typedef struct Difftest {
+    SimContext *ref;
+    // stores retired since the last difftest_sync()
+    uint64_t store_addr[PL_MAX_WIDTH];
+    int store_len[PL_MAX_WIDTH];
+    uint64_t store_pc[PL_MAX_WIDTH];
+    int nstores;
+    uint64_t compared, copied;
+    int failed;
+    // the ecall or ebreak that ends the program on the ISS
+    int halted;
+    uint64_t halt_pc, exit_code;
+    uint64_t device_next;   // next pc after the last device store taken from the model
+} Difftest;
+
+// A machine running image from the start, with the memory of cfg
+Difftest *difftest_create(const char *image, const SimConfig *cfg);
+void difftest_free(Difftest *dt);
+
+// ctx retired inst at pc, which went to next_pc and wrote its register
+void difftest_commit(SimContext *ctx, uint64_t pc, uint32_t inst, uint64_t next_pc);
+// Compare the memory written by the stores retired since the last call.
+// pl retires a group at a time, a younger store of the group may write the
+// same bytes, so the memory is compared once the whole group is done.
+void difftest_sync(SimContext *ctx);
+// The run ended: compare where and how it ended, every register, and report
+void difftest_finish(SimContext *ctx);
+
+#endif
@@ -15,6 +15,10 @@ void cleanup_disasm(LLVMDisasmContextRef disasm_ctx);
 void init_llvm_disassembler();
 void cleanup_llvm_disassembler();
 
+// The disassembly of inst at pc, remembered per pc by the calling thread.
+// Valid until the next call.
+const char *disasm_memo(uint64_t pc, uint32_t inst);
+
 void handle_itrace(Decode *s);
 
 #endif
\ No newline at end of file
@@ -25,6 +25,34 @@ const FuncSymbol* find_func(SymbolTable *table, uint64_t addr);
 
 void free_symbol_table(SymbolTable *table);
 
-void handle_ftrace(Decode *s);
+// Calls and returns by the ABI: jal/jalr linking ra, and jalr x0, 0(ra).
+// ftrace and the profile follow the same ones.
+static inline int is_call(uint32_t inst) {
+    uint32_t opcode = inst & 0x7f;
+    uint32_t rd = (inst >> 7) & 0x1f;
+    if (opcode == 0x6f && rd == 1) { // JAL && rd == x1 (ra)
+        return 1;
+    }
+    if (opcode == 0x67 && rd == 1) { // JALR && rd == x1 (ra)
+        return 1;
+    }
+    return 0;
+}
+
+static inline int is_ret(uint32_t inst) {
+    uint32_t opcode = inst & 0x7f;
+    uint32_t rs1 = (inst >> 15) & 0x1f;
+    uint32_t rd = (inst >> 7) & 0x1f;
+    uint32_t imm = (inst >> 20) & 0xfff; 
+    if (opcode == 0x67 && rs1 == 1 && rd == 0 && imm == 0) { // JALR x0, 0(x1)
+        return 1;
+    }
+    return 0;
+}
+
+// Where the call in s goes, from the registers before it runs
+uint64_t get_call_target_addr(SimContext *ctx, Decode *s);
+
+void handle_ftrace(SimContext *ctx, Decode *s);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+// The last instructions a machine ran, always recorded so a run that hits a
+// bad trap can show how it got there. Only the pc and the word are kept,
+// the disassembly is done when the history is printed.
+
+#define HIST_SIZE 32        // instructions kept, a power of 2
+
+typedef struct {
+    uint64_t pc[HIST_SIZE];
+    uint32_t inst[HIST_SIZE];
+    uint64_t n;             // instructions recorded since the start
+} InstHistory;
+
+static inline void hist_push(InstHistory *h, uint64_t pc, uint32_t inst) {
+    int i = h->n++ & (HIST_SIZE - 1);
+    h->pc[i] = pc;
+    h->inst[i] = inst;
+}
+
+struct SimContext;
+// Print the last n instructions of ctx, oldest first, the last one marked
+void hist_dump(struct SimContext *ctx, int n);
+
+#endif
@@ -5,7 +5,7 @@
 #include <pattern.h>
 #include <macro.h>
 #include <dbg.h>
-#include <memory.h>
+#include <cpu.h>
 
 typedef enum {
     TYPE_R, TYPE_I, TYPE_S, TYPE_B, TYPE_U, TYPE_J, TYPE_N
@@ -18,20 +18,34 @@ typedef struct {
   uint32_t inst;
   DecodeType type;
   uint8_t is_load;
+  // filled by isa_decode_inst()
+  uint8_t op;
+  uint8_t rd, rs1, rs2;
+  uint64_t imm;
 } Decode;
 
-void decode_operand(Decode *s, int *rd, uint64_t *src1, uint64_t *src2, uint64_t *imm, DecodeType type);
-DecodeType get_inst_type(uint64_t inst);
-int is_load(uint64_t inst);
-
-#define R(i) (cpu.reg[i])
-#define Mr mem_read
-#define Mw mem_write
-#define HALT(thispc, code) halt_trap(thispc, code)
+void decode_imm(uint32_t i, DecodeType type, uint64_t *imm);
+
+// The helpers below work on the machine `ctx` in scope (see sim.h)
+#define R(i) (ctx->cpu.reg[i])
+#define Mr(addr, len) mem_read(ctx, addr, len)
+#define Mw(addr, len, data) mem_write(ctx, addr, len, data)
+#define HALT(thispc, code) halt_trap(ctx, thispc, code)
+#define Lr(addr, len) mem_lr(ctx, addr, len)
+#define Sc(addr, len, data) mem_sc(ctx, addr, len, data)
+#define Amo(addr, len, op, data) mem_amo(ctx, addr, len, concat(AMO_, op), data)
+#define Csr(op, val) csr_access(ctx, BITS(s->inst, 31, 20), concat(CSR_, op), val)
+#define UIMM BITS(s->inst, 19, 15)
 #define NOP do {} while(0)
 
-#define src1R() do { *src1 = R(rs1); } while (0)
-#define src2R() do { *src2 = R(rs2); } while (0)
+// Division never traps in RISC-V: by zero the quotient is all ones and the
+// remainder the dividend, and MIN / -1 gives MIN with remainder 0. The host
+// would raise SIGFPE on both, so they are never handed to it.
+static inline int64_t div64(int64_t a, int64_t b) { return b == 0 ? -1 : b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b; }
+static inline int64_t rem64(int64_t a, int64_t b) { return b == 0 ? a : b == -1 ? 0 : a % b; }
+static inline int32_t div32(int32_t a, int32_t b) { return b == 0 ? -1 : b == -1 ? (int32_t)(0 - (uint32_t)a) : a / b; }
+static inline int32_t rem32(int32_t a, int32_t b) { return b == 0 ? a : b == -1 ? 0 : a % b; }
+
 #define immI() do { *imm = SEXT(BITS(i, 31, 20), 12); } while(0)
 #define immU() do { *imm = SEXT(BITS(i, 31, 12), 20) << 12; } while(0)
 #define immJ() do { *imm = SEXT(BITS(i, 31, 31) << 20 | \
@@ -44,10 +58,4 @@ int is_load(uint64_t inst);
                                 BITS(i, 30, 25) << 5 | \
                                 BITS(i, 11, 8) << 1, 13);} while(0)
 
-#define INSTPAT_INST(s) ((s)->inst)
-#define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-  __VA_ARGS__ ; \
-}
-
 #endif
\ No newline at end of file
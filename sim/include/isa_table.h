@@ -0,0 +1,202 @@
+#ifndef ISA_TABLE_H
+#define ISA_TABLE_H
+
+#include <isa_decode.h>
+
+// The one description of RV64IMA + Zicsr shared by every model. Order matters: the
+// first matching pattern wins.
+//
+// f(name, pattern, format, class, latency, registers, semantics)
+//   latency   - cycles spent in EX, the default latency of its functional unit
+//               (uarch_defaults(), --uarch overrides it)
+//   registers - which of rd/rs1/rs2 the instruction really uses
+//   semantics - depends on the class:
+//     ALU, MUL, DIV  value written to rd
+//     LOAD           value written to rd, read from `addr`
+//     AMO            value written to rd, `addr` is rs1
+//     CSR            value written to rd, the old value of the CSR
+//     STORE          statement storing `src2` to `addr`
+//     BRANCH         condition to take the branch to pc + imm
+//     JUMP           target, rd gets pc + 4
+//     SYSTEM, FENCE  statement
+// The semantics can use s (Decode *), src1, src2 and imm.
+#define ISA_TABLE(f) \
+  /* RV64I */ \
+  f(lui    , "??????? ????? ????? ??? ????? 01101 11", U, ALU   ,  1, rd        , imm) \
+  f(auipc  , "??????? ????? ????? ??? ????? 00101 11", U, ALU   ,  1, rd        , s->pc + imm) \
+  f(jal    , "??????? ????? ????? ??? ????? 11011 11", J, JUMP  ,  1, rd        , s->pc + imm) \
+  f(jalr   , "??????? ????? ????? 000 ????? 11001 11", I, JUMP  ,  1, rd_rs1    , (src1 + imm) & ~1) \
+  /* BEQ, BNE, BLT, BGE, BLTU, BGEU */ \
+  f(beq    , "??????? ????? ????? 000 ????? 11000 11", B, BRANCH,  1, rs1_rs2   , src1 == src2) \
+  f(bne    , "??????? ????? ????? 001 ????? 11000 11", B, BRANCH,  1, rs1_rs2   , src1 != src2) \
+  f(blt    , "??????? ????? ????? 100 ????? 11000 11", B, BRANCH,  1, rs1_rs2   , (int64_t)src1 < (int64_t)src2) \
+  f(bge    , "??????? ????? ????? 101 ????? 11000 11", B, BRANCH,  1, rs1_rs2   , (int64_t)src1 >= (int64_t)src2) \
+  f(bltu   , "??????? ????? ????? 110 ????? 11000 11", B, BRANCH,  1, rs1_rs2   , src1 < src2) \
+  f(bgeu   , "??????? ????? ????? 111 ????? 11000 11", B, BRANCH,  1, rs1_rs2   , src1 >= src2) \
+  /* LB, LH, LW, LBU, LHU, LWU, LD */ \
+  f(lb     , "??????? ????? ????? 000 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , SEXT(Mr(addr, 1), 8)) \
+  f(lh     , "??????? ????? ????? 001 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , SEXT(Mr(addr, 2), 16)) \
+  f(lw     , "??????? ????? ????? 010 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , SEXT(Mr(addr, 4), 32)) \
+  f(lbu    , "??????? ????? ????? 100 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , Mr(addr, 1)) \
+  f(lhu    , "??????? ????? ????? 101 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , Mr(addr, 2)) \
+  f(lwu    , "??????? ????? ????? 110 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , Mr(addr, 4)) \
+  f(ld     , "??????? ????? ????? 011 ????? 00000 11", I, LOAD  ,  1, rd_rs1    , Mr(addr, 8)) \
+  /* SB, SH, SW, SD */ \
+  f(sb     , "??????? ????? ????? 000 ????? 01000 11", S, STORE ,  1, rs1_rs2   , Mw(addr, 1, src2)) \
+  f(sh     , "??????? ????? ????? 001 ????? 01000 11", S, STORE ,  1, rs1_rs2   , Mw(addr, 2, src2)) \
+  f(sw     , "??????? ????? ????? 010 ????? 01000 11", S, STORE ,  1, rs1_rs2   , Mw(addr, 4, src2)) \
+  f(sd     , "??????? ????? ????? 011 ????? 01000 11", S, STORE ,  1, rs1_rs2   , Mw(addr, 8, src2)) \
+  f(addi   , "??????? ????? ????? 000 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 + imm) \
+  /* SLTI, SLTIU */ \
+  f(slti   , "??????? ????? ????? 010 ????? 00100 11", I, ALU   ,  1, rd_rs1    , (int64_t)src1 < (int64_t)imm) \
+  f(sltiu  , "??????? ????? ????? 011 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 < imm) \
+  /* SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW */ \
+  f(slli   , "000000? ????? ????? 001 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 << (imm & 0x3f)) \
+  f(srli   , "000000? ????? ????? 101 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 >> (imm & 0x3f)) \
+  f(srai   , "010000? ????? ????? 101 ????? 00100 11", I, ALU   ,  1, rd_rs1    , (int64_t)src1 >> (imm & 0x3f)) \
+  f(slliw  , "0000000 ????? ????? 001 ????? 00110 11", I, ALU   ,  1, rd_rs1    , SEXT((uint32_t)src1 << (imm & 0x1f), 32)) \
+  f(srliw  , "0000000 ????? ????? 101 ????? 00110 11", I, ALU   ,  1, rd_rs1    , SEXT((uint32_t)src1 >> (imm & 0x1f), 32)) \
+  f(sraiw  , "0100000 ????? ????? 101 ????? 00110 11", I, ALU   ,  1, rd_rs1    , SEXT((int32_t)src1 >> (imm & 0x1f), 32)) \
+  /* XORI, ORI, ANDI, ADDIW */ \
+  f(xori   , "??????? ????? ????? 100 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 ^ imm) \
+  f(ori    , "??????? ????? ????? 110 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 | imm) \
+  f(andi   , "??????? ????? ????? 111 ????? 00100 11", I, ALU   ,  1, rd_rs1    , src1 & imm) \
+  f(addiw  , "??????? ????? ????? 000 ????? 00110 11", I, ALU   ,  1, rd_rs1    , SEXT((int32_t)src1 + (int32_t)imm, 32)) \
+  /* ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND */ \
+  f(add    , "0000000 ????? ????? 000 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 + src2) \
+  f(sub    , "0100000 ????? ????? 000 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 - src2) \
+  f(sll    , "0000000 ????? ????? 001 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 << (src2 & 0x3f)) \
+  f(slt    , "0000000 ????? ????? 010 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, (int64_t)src1 < (int64_t)src2) \
+  f(sltu   , "0000000 ????? ????? 011 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 < src2) \
+  f(xor    , "0000000 ????? ????? 100 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 ^ src2) \
+  f(srl    , "0000000 ????? ????? 101 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 >> (src2 & 0x3f)) \
+  f(sra    , "0100000 ????? ????? 101 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, (int64_t)src1 >> (src2 & 0x3f)) \
+  f(or     , "0000000 ????? ????? 110 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 | src2) \
+  f(and    , "0000000 ????? ????? 111 ????? 01100 11", R, ALU   ,  1, rd_rs1_rs2, src1 & src2) \
+  /* ADDW, SUBW, SLLW, SRLW, SRAW */ \
+  f(addw   , "0000000 ????? ????? 000 ????? 01110 11", R, ALU   ,  1, rd_rs1_rs2, SEXT((uint32_t)src1 + (uint32_t)src2, 32)) \
+  f(subw   , "0100000 ????? ????? 000 ????? 01110 11", R, ALU   ,  1, rd_rs1_rs2, SEXT((uint32_t)src1 - (uint32_t)src2, 32)) \
+  f(sllw   , "0000000 ????? ????? 001 ????? 01110 11", R, ALU   ,  1, rd_rs1_rs2, SEXT((uint32_t)src1 << (src2 & 0x1f), 32)) \
+  f(srlw   , "0000000 ????? ????? 101 ????? 01110 11", R, ALU   ,  1, rd_rs1_rs2, SEXT((uint32_t)src1 >> (src2 & 0x1f), 32)) \
+  f(sraw   , "0100000 ????? ????? 101 ????? 01110 11", R, ALU   ,  1, rd_rs1_rs2, SEXT((int32_t)src1 >> (src2 & 0x1f), 32)) \
+  /* FENCE, FENCE.I */ \
+  f(fence  , "0000??? ????? 00000 000 00000 00011 11", N, FENCE ,  1, none      , NOP) \
+  f(fencei , "??????? ????? ????? 001 ????? 00011 11", N, FENCE ,  1, none      , decode_cache_flush(ctx)) \
+  /* EBREAK, ECALL */ \
+  f(ebreak , "0000000 00001 00000 000 00000 11100 11", I, SYSTEM,  1, none      , HALT(s->pc, R(10))) /* R(10) is $a0 */ \
+  f(ecall  , "0000000 00000 00000 000 00000 11100 11", I, SYSTEM,  1, none      , ecall_handler(ctx, s)) \
+  /* CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI */ \
+  f(csrrw  , "??????? ????? ????? 001 ????? 11100 11", I, CSR   ,  1, rd_rs1    , Csr(RW, src1)) \
+  f(csrrs  , "??????? ????? ????? 010 ????? 11100 11", I, CSR   ,  1, rd_rs1    , Csr(RS, src1)) \
+  f(csrrc  , "??????? ????? ????? 011 ????? 11100 11", I, CSR   ,  1, rd_rs1    , Csr(RC, src1)) \
+  f(csrrwi , "??????? ????? ????? 101 ????? 11100 11", I, CSR   ,  1, rd        , Csr(RW, UIMM)) \
+  f(csrrsi , "??????? ????? ????? 110 ????? 11100 11", I, CSR   ,  1, rd        , Csr(RS, UIMM)) \
+  f(csrrci , "??????? ????? ????? 111 ????? 11100 11", I, CSR   ,  1, rd        , Csr(RC, UIMM)) \
+  /* RV64M */ \
+  /* MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU */ \
+  f(mul    , "0000001 ????? ????? 000 ????? 01100 11", R, MUL   ,  2, rd_rs1_rs2, src1 * src2) \
+  f(mulh   , "0000001 ????? ????? 001 ????? 01100 11", R, MUL   ,  2, rd_rs1_rs2, (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(int64_t)src2 >> 64)) \
+  f(mulhsu , "0000001 ????? ????? 010 ????? 01100 11", R, MUL   ,  2, rd_rs1_rs2, (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(uint64_t)src2 >> 64)) \
+  f(mulhu  , "0000001 ????? ????? 011 ????? 01100 11", R, MUL   ,  2, rd_rs1_rs2, (uint64_t)((__uint128_t)(uint64_t)src1 * (__uint128_t)(uint64_t)src2 >> 64)) \
+  f(div    , "0000001 ????? ????? 100 ????? 01100 11", R, DIV   , 40, rd_rs1_rs2, div64(src1, src2)) \
+  f(divu   , "0000001 ????? ????? 101 ????? 01100 11", R, DIV   , 40, rd_rs1_rs2, src2 == 0 ? -1 : src1 / src2) \
+  f(rem    , "0000001 ????? ????? 110 ????? 01100 11", R, DIV   , 40, rd_rs1_rs2, rem64(src1, src2)) \
+  f(remu   , "0000001 ????? ????? 111 ????? 01100 11", R, DIV   , 40, rd_rs1_rs2, src2 == 0 ? src1 : src1 % src2) \
+  /* MULW, DIVW, DIVUW, REMW, REMUW */ \
+  f(mulw   , "0000001 ????? ????? 000 ????? 01110 11", R, MUL   ,  2, rd_rs1_rs2, SEXT((int32_t)src1 * (int32_t)src2, 32)) \
+  f(divw   , "0000001 ????? ????? 100 ????? 01110 11", R, DIV   , 40, rd_rs1_rs2, SEXT(div32(src1, src2), 32)) \
+  f(divuw  , "0000001 ????? ????? 101 ????? 01110 11", R, DIV   , 40, rd_rs1_rs2, (uint32_t)src2 == 0 ? -1 : SEXT((uint32_t)src1 / (uint32_t)src2, 32)) \
+  f(remw   , "0000001 ????? ????? 110 ????? 01110 11", R, DIV   , 40, rd_rs1_rs2, SEXT(rem32(src1, src2), 32)) \
+  f(remuw  , "0000001 ????? ????? 111 ????? 01110 11", R, DIV   , 40, rd_rs1_rs2, (uint32_t)src2 == 0 ? SEXT((uint32_t)src1, 32) : SEXT((uint32_t)src1 % (uint32_t)src2, 32)) \
+  /* RV64A */ \
+  /* LR.W, SC.W, AMO*.W */ \
+  f(lr_w     , "00010?? 00000 ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1    , SEXT(Lr(addr, 4), 32)) \
+  f(sc_w     , "00011?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Sc(addr, 4, src2)) \
+  f(amoswap_w, "00001?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, SWAP, src2), 32)) \
+  f(amoadd_w , "00000?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, ADD , src2), 32)) \
+  f(amoxor_w , "00100?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, XOR , src2), 32)) \
+  f(amoand_w , "01100?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, AND , src2), 32)) \
+  f(amoor_w  , "01000?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, OR  , src2), 32)) \
+  f(amomin_w , "10000?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, MIN , src2), 32)) \
+  f(amomax_w , "10100?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, MAX , src2), 32)) \
+  f(amominu_w, "11000?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, MINU, src2), 32)) \
+  f(amomaxu_w, "11100?? ????? ????? 010 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, SEXT(Amo(addr, 4, MAXU, src2), 32)) \
+  /* LR.D, SC.D, AMO*.D */ \
+  f(lr_d     , "00010?? 00000 ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1    , Lr(addr, 8)) \
+  f(sc_d     , "00011?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Sc(addr, 8, src2)) \
+  f(amoswap_d, "00001?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, SWAP, src2)) \
+  f(amoadd_d , "00000?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, ADD , src2)) \
+  f(amoxor_d , "00100?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, XOR , src2)) \
+  f(amoand_d , "01100?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, AND , src2)) \
+  f(amoor_d  , "01000?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, OR  , src2)) \
+  f(amomin_d , "10000?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, MIN , src2)) \
+  f(amomax_d , "10100?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, MAX , src2)) \
+  f(amominu_d, "11000?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, MINU, src2)) \
+  f(amomaxu_d, "11100?? ????? ????? 011 ????? 01011 11", R, AMO   ,  1, rd_rs1_rs2, Amo(addr, 8, MAXU, src2)) \
+  /* Invalid Opcode */ \
+  f(unk    , "??????? ????? ????? ??? ????? ????? ??", N, UNK   ,  1, none      , printf(ANSI_FMT("Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1))
+
+#define def_ISA_OP(name, ...) concat(OP_, name),
+typedef enum {
+    ISA_TABLE(def_ISA_OP)
+    OP_NUM
+} IsaOp;
+
+typedef enum {
+    CLASS_ALU, CLASS_MUL, CLASS_DIV, CLASS_LOAD, CLASS_STORE, CLASS_AMO,
+    CLASS_BRANCH, CLASS_JUMP, CLASS_CSR, CLASS_SYSTEM, CLASS_FENCE, CLASS_UNK
+} InstClass;
+
+#define USE_RD  1
+#define USE_RS1 2
+#define USE_RS2 4
+#define REGS_none       0
+#define REGS_rd         USE_RD
+#define REGS_rd_rs1     (USE_RD | USE_RS1)
+#define REGS_rs1_rs2    (USE_RS1 | USE_RS2)
+#define REGS_rd_rs1_rs2 (USE_RD | USE_RS1 | USE_RS2)
+
+typedef struct {
+    const char *name;
+    const char *pattern;
+    uint32_t mask;  // filled in by init_isa()
+    uint32_t match;
+    DecodeType type;
+    InstClass cls;
+    uint8_t latency;
+    uint8_t regs;
+} IsaInfo;
+
+extern IsaInfo isa_info[OP_NUM];
+
+// The decoder is a table indexed by opcode[6:2], funct3 and funct7. Each
+// entry points to the few instructions sharing those bits, in table order;
+// the list always ends with unk, whose mask is 0.
+#define ISA_KEY(i) ((BITS(i, 6, 2) << 10) | (BITS(i, 14, 12) << 7) | BITS(i, 31, 25))
+#define ISA_KEY_BITS 15
+
+extern uint16_t isa_lut[1 << ISA_KEY_BITS];
+extern uint8_t isa_cand[];
+
+void init_isa();
+
+static inline int isa_decode(uint32_t inst) {
+    const uint8_t *c = &isa_cand[isa_lut[ISA_KEY(inst)]];
+    while ((inst & isa_info[*c].mask) != isa_info[*c].match) c++;
+    return *c;
+}
+
+// Decode s->inst into s->op, s->type, the register numbers and imm
+void isa_decode_inst(Decode *s);
+
+// Semantics of the table, for the models that split them over stages
+uint64_t isa_alu(const Decode *s, uint64_t src1, uint64_t src2);
+int isa_branch_taken(const Decode *s, uint64_t src1, uint64_t src2);
+uint64_t isa_jump_target(const Decode *s, uint64_t src1);
+uint64_t isa_load(SimContext *ctx, const Decode *s, uint64_t addr);
+void isa_store(SimContext *ctx, const Decode *s, uint64_t addr, uint64_t src2);
+uint64_t isa_amo(SimContext *ctx, const Decode *s, uint64_t addr, uint64_t src2);
+uint64_t isa_csr(SimContext *ctx, const Decode *s, uint64_t src1);
+void isa_system(SimContext *ctx, Decode *s);
+
+#endif
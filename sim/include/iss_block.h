@@ -0,0 +1,49 @@
+#ifndef ISS_BLOCK_H
+#define ISS_BLOCK_H
+
+#include <iss_core.h>
+
+#define TB_MAX_INSTS 64
+#define TB_HASH_SIZE 4096
+#define TB_ARENA_SIZE (16 << 20)
+
+typedef struct TransBlock TransBlock;
+
+// A guest basic block translated into an array of predecoded micro-ops.
+// The block ends at the first jal/jalr/branch/ecall/ebreak/fence.i (or an
+// unknown instruction), which is always the last op.
+struct TransBlock {
+    uint64_t pc;
+    int ninst;
+    TransBlock *hnext;     // hash chain
+    TransBlock *link[2];   // chained successors: [0] fall-through, [1] taken
+    uint64_t link_pc[2];
+    uint64_t exec_count;   // profiled by the JIT
+    void *jit_code;        // native code, NULL while interpreted
+    DecodedInst ops[];
+};
+
+TransBlock *tb_lookup(SimContext *ctx, uint64_t pc);
+void tb_flush(SimContext *ctx);
+void tb_invalidate(SimContext *ctx, uint64_t addr, int len);
+// Interpret every op of tb, implemented by the ISS run loop
+void tb_exec(SimContext *ctx, TransBlock *tb);
+void tb_free(SimContext *ctx);
+
+// Follow (or create) the direct link from tb to the block at next_pc
+static inline TransBlock *tb_chain(SimContext *ctx, TransBlock *tb, uint64_t next_pc) {
+    int slot = (next_pc != tb->pc + 4 * tb->ninst);
+    if (likely(tb->link_pc[slot] == next_pc && tb->link[slot])) {
+        return tb->link[slot];
+    }
+    uint64_t gen = ctx->tb_generation;
+    TransBlock *next = tb_lookup(ctx, next_pc);
+    // translating it may have flushed a full arena, tb is gone then
+    if (likely(ctx->tb_generation == gen)) {
+        tb->link[slot] = next;
+        tb->link_pc[slot] = next_pc;
+    }
+    return next;
+}
+
+#endif
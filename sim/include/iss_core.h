@@ -2,7 +2,56 @@
 #define ISS_CORE_H
 
 #include <isa_decode.h>
+#include <sim.h>
 
-void decode_exec(Decode *s);
+#define DECODE_CACHE_SIZE 65536
 
-#endif
\ No newline at end of file
+typedef struct DecodedInst DecodedInst;
+typedef void (*ExecHandler)(SimContext *ctx, Decode *s, const DecodedInst *d);
+
+// Instruction decoded once and kept in the decode cache
+struct DecodedInst {
+    uint64_t pc;
+    ExecHandler handler;
+    uint64_t imm; // sign-extended immediate
+    uint32_t inst;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t ends_block; // control transfer, system or unknown instruction
+    uint8_t is_store;
+    uint8_t is_csr;     // may read instret, which must be up to date
+    uint8_t op; // IsaOp
+    DecodeType type;
+};
+
+void decode_exec(SimContext *ctx, Decode *s);
+void iss_predecode(Decode *s, DecodedInst *d);
+
+// Direct-mapped, indexed by pc. An entry is valid when its handler is set
+// and its pc tag matches.
+typedef struct DecodeCache {
+    DecodedInst entry[DECODE_CACHE_SIZE];
+    // Pages holding at least one cached instruction, used to filter stores,
+    // one byte per page of guest RAM
+    uint8_t *code_page;
+} DecodeCache;
+
+int decode_cache_init(SimContext *ctx);
+void decode_cache_free(SimContext *ctx);
+
+DecodedInst *decode_cache_fill(SimContext *ctx, uint64_t pc);
+void decode_cache_flush(SimContext *ctx);
+void decode_cache_invalidate(SimContext *ctx, uint64_t addr, int len);
+
+#define DC_INDEX(pc) (((pc) >> 2) & (DECODE_CACHE_SIZE - 1))
+
+static inline DecodedInst *decode_cache_lookup(SimContext *ctx, uint64_t pc) {
+    DecodedInst *d = &ctx->dc->entry[DC_INDEX(pc)];
+    if (likely(d->pc == pc && d->handler)) {
+        return d;
+    }
+    return decode_cache_fill(ctx, pc);
+}
+
+#endif
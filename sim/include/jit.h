@@ -0,0 +1,30 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <iss_block.h>
+
+// Interpreted executions before a block gets compiled
+#define JIT_HOT_THRESHOLD 64
+
+// A compiled block takes the machine it runs on and returns the next pc
+typedef uint64_t (*JitFunc)(SimContext *ctx);
+
+// Stores done while the cross-check is recording, so they can be undone
+typedef struct {
+    uint64_t addr;
+    uint64_t old;
+    uint64_t data;
+    int len;
+} StoreRecord;
+
+typedef struct StoreLog {
+    int n;
+    StoreRecord rec[TB_MAX_INSTS];
+} StoreLog;
+
+void init_jit();
+void *jit_compile(SimContext *ctx, TransBlock *tb);
+void jit_free(SimContext *ctx);
+void jit_check_exec(SimContext *ctx, TransBlock *tb);
+
+#endif
@@ -2,6 +2,10 @@
 #define MC_CORE_H
 
 #include <isa_decode.h>
+#include <isa_table.h>
+#include <commit.h>
+#include <memory.h>
+#include <sim.h>
 
 typedef enum {
     STAGE_IF,
@@ -12,12 +16,41 @@ typedef enum {
     STAGE_DONE // check inst finish
 } Multi_Cycle_Stage;
 
-void mc_IF(Decode *s);
-void mc_ID(Decode *s);
-void mc_EX(Decode *s, uint64_t *alu_result);
-void mc_MEM(Decode *s, uint64_t alu_result, uint64_t *mem_result);
-void mc_WB(Decode *s, uint64_t alu_result, uint64_t mem_result);
+void mc_IF(SimContext *ctx, Decode *s);
+void mc_ID(SimContext *ctx, Decode *s);
+void mc_EX(SimContext *ctx, Decode *s, uint64_t *alu_result);
+void mc_MEM(SimContext *ctx, Decode *s, uint64_t alu_result, uint64_t *mem_result);
+void mc_WB(SimContext *ctx, Decode *s, uint64_t alu_result, uint64_t mem_result);
 
 void push_stage(Decode *s, Multi_Cycle_Stage *stage);
 
+// What the stages cost one kind of instruction, without the caches. The
+// path through push_stage() only depends on the type, and the latencies on
+// the functional unit, so the table is filled once per IsaOp.
+typedef struct {
+    uint32_t before;    // IF, ID, EX and MEM, all charged before the work is done
+    uint32_t wb;        // 1 if it goes through WB
+    uint32_t extra;     // of before, the cycles units take beyond the first: CPI_LONG
+    uint8_t mem;        // MEM accesses the D$
+    uint8_t write;      // as a write: stores and AMOs
+} McLatency;
+
+void mc_latency_table(const UarchConfig *uarch, McLatency lat[OP_NUM]);
+
+// Charge IF to MEM of an instruction at pc accessing addr, with the cache
+// stalls in the order the stages see them. It was fetched from RAM.
+static inline void mc_charge(SimContext *ctx, const McLatency *t, uint64_t pc, uint64_t addr) {
+    uint64_t istall = cache_stall(ctx->icache, pc, 0);
+    uint64_t dstall = t->mem && mem_in_ram(ctx, addr, 1) ? cache_stall(ctx->dcache, addr, t->write) : 0;
+    ctx->global_cycle_count += t->before + istall + dstall;
+    if (ctx->cpi) {
+        cpi_charge(ctx->cpi, CPI_ICACHE, pc, istall);
+        cpi_charge(ctx->cpi, CPI_LONG, pc, t->extra);
+        cpi_charge(ctx->cpi, CPI_DCACHE, pc, dstall);
+    }
+}
+
+// The cycles the stages above take for an instruction the ISS already ran
+void mc_time(SimContext *ctx, const McLatency lat[OP_NUM], const CommitRec *r);
+
 #endif
\ No newline at end of file
@@ -2,12 +2,121 @@
 #define MEMORY_H
 
 #include <stdint.h>
+#include <cpu.h>
+#include <sim.h>
+#include <iss_core.h>
 
-void load_image(char *filepath);
-void load_elf_symbols(const char *filepath);
-uint8_t* guest_to_host(uint64_t vaddr);
-uint32_t inst_fetch(uint64_t pc);
-uint64_t mem_read(uint64_t addr, int len);
-void mem_write(uint64_t addr, int len, uint64_t data);
+// ------------ Memory map ------------
+
+// The physical address space is a set of page-aligned regions. RAM regions
+// are backed by host memory, MMIO regions call back into a device.
+#define MEM_PAGE_SHIFT   12
+#define MEM_MAX_REGIONS  16
+#define MEM_TLB_SIZE     16
+
+typedef struct {
+    uint64_t (*read)(SimContext *ctx, void *dev, uint64_t off, int len);
+    void (*write)(SimContext *ctx, void *dev, uint64_t off, int len, uint64_t data);
+} MmioOps;
+
+typedef struct {
+    const char *name;
+    uint64_t base;
+    uint64_t size;
+    uint8_t *host;          // RAM: host copy of the region, NULL for MMIO
+    const MmioOps *ops;     // MMIO: device callbacks
+    void *dev;              // MMIO: device state, freed with the map
+} MemRegion;
+
+// One per machine, shared by its harts. Regions are sorted by base.
+typedef struct MemMap {
+    MemRegion region[MEM_MAX_REGIONS];
+    int nregions;
+} MemMap;
+
+// Per hart: the region of the last pages accessed off the RAM fast path
+typedef struct MemTlb {
+    struct {
+        uint64_t page;
+        MemRegion *r;       // NULL when the entry is empty
+    } e[MEM_TLB_SIZE];
+} MemTlb;
+
+// Map guest RAM and build the memory map around it (hart 0)
+int mem_map(SimContext *ctx);
+// Point hart h at the memory of boot, with a TLB of its own
+int mem_share(SimContext *h, SimContext *boot);
+void mem_unmap(SimContext *ctx);
+int mem_add_mmio(SimContext *ctx, const char *name, uint64_t base, uint64_t size,
+                 const MmioOps *ops, void *dev);
+void mem_dump_map(SimContext *ctx);
+
+// Put the PT_LOAD segments of an ELF in guest memory and set the entry
+// point. With symbols, also fill the symbol table for ftrace.
+int load_elf(SimContext *ctx, const char *filepath, int symbols);
+
+// ------------ Accesses ------------
+
+// Accesses outside of the map (or crossing a region) raise an access fault,
+// see raise_exception(). The faulting load returns 0 and changes nothing.
+uint8_t* guest_to_host(SimContext *ctx, uint64_t vaddr);
+uint32_t inst_fetch(SimContext *ctx, uint64_t pc);
+// Out-of-line mem_read()/mem_write() for any address, the JIT calls these
+uint64_t mem_read_slow(SimContext *ctx, uint64_t addr, int len);
+void mem_write_slow(SimContext *ctx, uint64_t addr, int len, uint64_t data);
+// For the debugger: reads RAM without faulting or touching devices.
+// Returns -1 if addr is not in RAM.
+int mem_peek(SimContext *ctx, uint64_t addr, int len, uint64_t *data);
+
+static inline int mem_in_ram(SimContext *ctx, uint64_t addr, int len) {
+    return addr - ctx->mem_base <= ctx->mem_size - len;
+}
+
+static inline uint64_t host_read(void *addr, int len) {
+    switch (len) {
+        case 1:  return *(uint8_t  *)addr;
+        case 2:  return *(uint16_t *)addr;
+        case 4:  return *(uint32_t *)addr;
+        default: return *(uint64_t *)addr;
+    }
+}
+
+static inline void host_write(void *addr, int len, uint64_t data) {
+    switch (len) {
+        case 1:  *(uint8_t  *)addr = data; return;
+        case 2:  *(uint16_t *)addr = data; return;
+        case 4:  *(uint32_t *)addr = data; return;
+        default: *(uint64_t *)addr = data; return;
+    }
+}
+
+// RAM is one range check and a host access, len is a constant at every
+// call site so the switch folds away. Everything else goes through the TLB.
+static inline uint64_t mem_read(SimContext *ctx, uint64_t addr, int len) {
+    if (likely(mem_in_ram(ctx, addr, len))) {
+        return host_read(ctx->mem + (addr - ctx->mem_base), len);
+    }
+    return mem_read_slow(ctx, addr, len);
+}
+
+static inline void mem_write(SimContext *ctx, uint64_t addr, int len, uint64_t data) {
+    if (likely(mem_in_ram(ctx, addr, len) && ctx->store_log == NULL)) {
+        host_write(ctx->mem + (addr - ctx->mem_base), len, data);
+        decode_cache_invalidate(ctx, addr, len);
+        return;
+    }
+    mem_write_slow(ctx, addr, len, data);
+}
+
+// A extension, done with host atomics so harts on other threads see them.
+// Only RAM supports them.
+typedef enum {
+    AMO_SWAP, AMO_ADD, AMO_XOR, AMO_AND, AMO_OR,
+    AMO_MIN, AMO_MAX, AMO_MINU, AMO_MAXU
+} AmoOp;
+
+uint64_t mem_amo(SimContext *ctx, uint64_t addr, int len, AmoOp op, uint64_t data);
+uint64_t mem_lr(SimContext *ctx, uint64_t addr, int len);
+uint64_t mem_sc(SimContext *ctx, uint64_t addr, int len, uint64_t data);
 
 #endif
@@ -0,0 +1,38 @@
+#ifndef OOO_CORE_H
+#define OOO_CORE_H
+
+#include <stdint.h>
+#include <cpu.h>
+
+// Out-of-order core timing model. The ISS executes every instruction as it
+// is fetched (or ahead of it, with --decoupled), in program order, so
+// register and memory values are always right and no wrong path is ever
+// run. The model decides when each
+// instruction would rename, issue, complete and commit: fetch stops at a
+// mispredicted control transfer until it has executed.
+
+typedef struct {
+    int width;          // fetched, renamed and committed per cycle
+    int issue_width;    // sent to the functional units per cycle
+    int rob;            // reorder buffer entries, 0: not an ooo machine
+    int iq;             // issue queue entries
+    int lq;             // load queue entries
+    int sq;             // store queue entries
+    int prf;            // physical registers, 32 of them hold the committed state
+} OooConfig;
+
+#define OOO_MAX_WIDTH 8
+
+typedef struct OooCore OooCore;
+
+// Returns NULL (and logs why) if cfg does not describe a valid core
+OooCore *ooo_create(const OooConfig *cfg);
+void ooo_free(OooCore *o);
+// One cycle: commit, issue, rename/dispatch and fetch. Returns 0 once the
+// program has stopped and its last instruction has committed.
+int ooo_step(SimContext *ctx);
+void ooo_report(const SimContext *ctx);
+struct Stats;
+void ooo_register_stats(const OooCore *o, struct Stats *s);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PIPEVIEW_H
+#define PIPEVIEW_H
+
+#include <stdint.h>
+
+// Pipeline view of pl in the Konata format (--pipeview): the cycle every
+// dynamic instruction entered each stage, why it stalled, and whether it
+// retired or was flushed. Open the file with Konata
+// (https://github.com/shioyadan/Konata).
+
+typedef enum { PV_IF, PV_ID, PV_EX, PV_MEM, PV_WB, PV_NUM } PvStage;
+
+typedef struct {
+    const char *path;       // NULL: no pipeline view
+    // instructions fetched in [from, to) are traced, to 0: to the end
+    uint64_t from, to;
+    int cycles;             // from and to are cycles, not instructions
+} PipeViewConfig;
+
+typedef struct PipeView PipeView;
+
+PipeView *pv_create(const PipeViewConfig *cfg, const uint64_t *cycle, const uint64_t *ninst);
+// Flush what is still in flight and close the file
+void pv_close(PipeView *pv);
+
+// A new instruction enters IF. Returns its id, 0 if it is outside the
+// window: the calls below ignore id 0.
+uint64_t pv_fetch(PipeView *pv, uint64_t pc, uint32_t inst);
+// Entering a stage again while already in it is a no-op
+void pv_stage(PipeView *pv, uint64_t id, PvStage stage);
+// Why it waits, shown when the mouse is over it. note is a string
+// literal, the same note twice in a row is written once.
+void pv_note(PipeView *pv, uint64_t id, const char *note);
+void pv_retire(PipeView *pv, uint64_t id);
+void pv_flush(PipeView *pv, uint64_t id);
+
+#endif
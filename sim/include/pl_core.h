@@ -1,12 +1,18 @@
 #ifndef PL_CORE_H
 #define PL_CORE_H
 
+#include <stdbool.h>
 #include <isa_decode.h>
+#include <bpred.h>
+#include <uarch.h>
+#include <cpistack.h>
 
 // Defination of pipeline registers
 typedef struct {
     Decode s;
     uint64_t predict_pc;
+    BpMeta bp;          // how predict_pc was predicted, with --bp
+    uint64_t id;        // in the pipeline view, 0: not traced
     int valid;
 } IF_ID_Reg;
 
@@ -38,7 +44,6 @@ typedef struct {
     PL_SIGNAL ALU_src2; // rs2: 0, imm: 1
     REG_NO rs1;
     REG_NO rs2;
-    // ALU_op: use MARCO INSTPAT to hard encode
     // ---- not used in stage EX but need to pass to MEM and WB ----
     PL_SIGNAL MEM_read; // Does this instruction read memory? no: 0, yes: 1
     PL_SIGNAL MEM_write; // Does this instruction write memory? no: 0, yes: 1
@@ -47,6 +52,8 @@ typedef struct {
     REG_NO REG_dst; // Which register does this instruction write to? (equals to rd, maybe)
     PL_SIGNAL REG_src; // Where is the value written to the register read from? alu_result: 0, mem_result: 1, pc+4: 2
     uint64_t predict_pc;
+    BpMeta bp;
+    uint64_t id;
     int valid;
 } ID_EX_Reg;
 
@@ -59,6 +66,7 @@ typedef struct {
     PL_SIGNAL REG_write; // Does this instruction write register? no: 0, yes: 1
     REG_NO REG_dst; // Which register does this instruction write to? (equals to rd, maybe)
     PL_SIGNAL REG_src; // Where is the value written to the register read from? alu_result: 0, mem_result: 1, pc+4: 2
+    uint64_t id;
     int valid;
 } EX_MEM_Reg;
 
@@ -69,14 +77,62 @@ typedef struct {
     PL_SIGNAL REG_write; // Does this instruction write register? no: 0, yes: 1
     REG_NO REG_dst; // Which register does this instruction write to? (equals to rd, maybe)
     PL_SIGNAL REG_src; // Where is the value written to the register read from? alu_result: 0, mem_result: 1, pc+4: 2
+    uint64_t id;
     int valid;
 } MEM_WB_Reg;
 
-void init_pipeline();
-void pl_IF();
-void pl_ID();
-void pl_EX();
-void pl_MEM();
-void pl_WB();
+// Widest issue group of the superscalar variant
+#define PL_MAX_WIDTH 4
+
+// Every pipeline register holds one issue group, lane 0 is the oldest
+typedef struct {
+    IF_ID_Reg if_id_reg[PL_MAX_WIDTH];
+    ID_EX_Reg id_ex_reg[PL_MAX_WIDTH];
+    EX_MEM_Reg ex_mem_reg[PL_MAX_WIDTH];
+    MEM_WB_Reg mem_wb_reg[PL_MAX_WIDTH];
+    int width;          // instructions fetched, issued and retired per cycle
+
+    bool PC_Write_Enable;
+    bool IF_ID_Write_Enbale;
+    bool ID_EX_Bubble_Insert;
+    bool Predict_Right;
+
+    bool forwarding;    // bypass MEM/WB into EX, only a load stalls its user
+
+    // Scoreboard: multi-cycle results leave EX (or MEM) with the
+    // instruction, their users wait in ID until they are there
+    uint64_t reg_ready[32];                     // cycle EX can use the register
+    uint64_t fu_free[FU_NUM][FU_MAX_UNITS];     // cycle a unit takes its next operation
+
+    // CPI stack: why lane 0 of IF/ID, ID/EX, EX/MEM and MEM/WB holds a
+    // bubble, and the instruction it is blamed on. The cause travels with
+    // the bubble, WB charges it for the cycle nothing retires.
+    CpiCause bubble_cause[4];
+    uint64_t bubble_pc[4];
+    uint64_t mispredict_pc;     // the last branch or jump that went the wrong way
+
+    uint64_t RAW_harzard_count;
+    uint64_t control_harzard_count;
+    // RAW stalls by cause, and what forwarding saved
+    uint64_t stall_alu;         // waiting for an ALU result, never with forwarding
+    uint64_t stall_load_use;    // waiting for a load or AMO
+    uint64_t stall_ecall;       // ecall waits for every older write
+    uint64_t stall_long;        // waiting for a result of more than one cycle
+    uint64_t stall_fu;          // waiting for a functional unit to take it
+    uint64_t forwarded;         // operands taken from the bypass
+    // issue groups: cycles ID issued n instructions, and why a group was cut short
+    uint64_t issue_hist[PL_MAX_WIDTH + 1];
+    uint64_t split_dep;         // needs a result of an older instruction of its group
+    uint64_t split_unit;        // no functional unit of its kind left
+    uint64_t split_serial;      // CSR, system and fence instructions issue alone
+} PipelineState;
+
+void init_pipeline(SimContext *ctx);
+void pl_IF(SimContext *ctx);
+void pl_ID(SimContext *ctx);
+void pl_EX(SimContext *ctx);
+void pl_MEM(SimContext *ctx);
+void pl_WB(SimContext *ctx);
+void pl_register_stats(SimContext *ctx);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <macro.h>
+#include "ftrace.h"
+
+// Execution profile of the ISS (--profile): how many times every instruction
+// ran, and a shadow call stack giving the instructions spent in each
+// function and below it. Written like gprof: a flat profile, then a call
+// graph, counted in instructions.
+
+typedef struct {
+    int func;               // index in the symbol table, count: outside every function
+    uint64_t ret;           // where its return goes
+    uint64_t entry;         // instructions run when it was called
+} ProfFrame;
+
+typedef struct Profile {
+    uint64_t *count;        // runs of the instruction at base + 4 * i
+    uint64_t base, size;
+    uint64_t lo, hi;        // offsets of the lowest and highest pc counted
+    SymbolTable *symbols;
+    struct ProfFunc *funcs;     // one per symbol, one more for code outside them
+    struct ProfArc *arcs;       // caller -> callee, open addressing
+    int narcs, arc_cap;
+    ProfFrame *stack;
+    int depth, stack_cap;
+} Profile;
+
+// The machine's RAM, its sorted symbols and where it starts
+Profile *prof_create(uint64_t base, uint64_t size, SymbolTable *symbols, uint64_t entry);
+void prof_free(Profile *p);
+
+// One more run of the instruction at pc
+static inline void prof_count(Profile *p, uint64_t pc) {
+    uint64_t off = pc - p->base;
+    if (likely(off < p->size)) {
+        p->count[off >> 2]++;
+        if (unlikely(off < p->lo)) p->lo = off;
+        if (unlikely(off > p->hi)) p->hi = off;
+    }
+}
+
+// A call at pc to target, ninst instructions ran before it
+void prof_call(Profile *p, uint64_t pc, uint64_t target, uint64_t ninst);
+// A return to target. Frames above the one returning there are dropped,
+// a return no call matches is ignored.
+void prof_ret(Profile *p, uint64_t target, uint64_t ninst);
+
+// Close the frames left open, ninst instructions ran in total, and write
+// the report to path
+int prof_report(Profile *p, const char *path, const char *image, uint64_t ninst);
+
+#endif
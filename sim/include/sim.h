@@ -0,0 +1,149 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <common.h>
+#include <cpu.h>
+#include <pl_core.h>
+#include <cache.h>
+#include <bpred.h>
+#include <ooo_core.h>
+#include <uarch.h>
+#include <cpistack.h>
+#include <stats.h>
+#include <pipeview.h>
+#include <history.h>
+#include "ftrace.h"
+
+// How the machine is built, from the command line
+typedef struct {
+    uint64_t mem_base;
+    uint64_t mem_size;
+    int symbols;            // read the function symbols too, for ftrace
+    // mc and pl: caches, a size of 0 leaves one out
+    CacheConfig icache;
+    CacheConfig dcache;
+    CacheConfig l2;         // unified, behind both L1s
+    int mem_latency;        // cycles of an access that misses every cache
+    UarchConfig uarch;      // mc, pl and ooo: functional units
+    BpConfig bp;            // pl: branch predictor
+    int forward;            // pl: forwarding network
+    int width;              // pl: instructions per issue group, ooo: per fetch/commit group, 0: the model's default
+    OooConfig ooo;          // ooo: window sizes, rob 0 for the other models
+    int cpi_stack;          // mc and pl: blame every cycle on a cause and an instruction
+    int stats;              // mc, pl and ooo: keep a statistics registry
+    uint64_t stats_interval;    // instructions (or cycles) between two snapshots, 0: none
+    int stats_cycles;       // the interval counts cycles
+    PipeViewConfig pipeview;    // pl: --pipeview
+    int decoupled;          // mc and ooo: run the ISS on a thread of its own
+    int fast;               // mc: run the ISS, take the cycles from a latency table
+    int fast_check;         // mc: check the latency table against the stages
+    int difftest;           // mc and pl: check every retired instruction against an ISS
+    int profile;            // iss: count the runs of every instruction, follow the calls
+    const char *trace;      // iss: write a binary trace to this file, NULL: none
+} SimConfig;
+
+struct CommitQueue;
+struct Profile;
+struct Difftest;
+struct TraceWriter;
+struct DecodeCache;
+struct BlockCache;
+struct StoreLog;
+struct MemMap;
+struct MemTlb;
+
+// Everything one simulated machine owns. Contexts only share the read-only
+// ISA tables and the JIT, so each of them can run on its own host thread.
+//
+// A machine with several harts has one context per hart. Hart 0 owns the
+// memory and the symbol table, the other harts point to them.
+struct SimContext {
+    const char *image;      // test name given on the command line
+    CPU_state cpu;
+    uint8_t *mem;           // mem_size bytes of guest RAM at mem_base, mapped lazily
+    uint64_t mem_base;
+    uint64_t mem_size;
+    uint64_t entry;         // e_entry of the image, where every hart starts
+    struct MemMap *map;     // RAM and MMIO regions, owned by hart 0
+    struct MemTlb *tlb;
+    SymbolTable sym_table;
+    int running;
+    uint64_t exit_code;
+    uint64_t halt_pc;       // where the program ended, with exit_code
+    int exc_pending;        // raised by the current instruction, mcause/mtval are set
+
+    // harts
+    int hartid;
+    int nharts;                 // only valid on hart 0
+    struct SimContext **harts;  // only set on hart 0, harts[0] is hart 0
+    struct SimContext *boot;    // hart 0
+
+    // lr/sc reservation
+    int resv_valid;
+    uint64_t resv_addr;
+    uint64_t resv_value;
+
+    // statistics
+    uint64_t ninst;
+    uint64_t global_cycle_count;
+
+    // ftrace
+    int indentation_level;
+
+    // the last instructions, printed on a bad trap
+    InstHistory hist;
+
+    // iss: decode cache, translated blocks and the JIT cross-check
+    struct DecodeCache *dc;
+    struct BlockCache *bc;
+    uint64_t tb_generation; // bumped every time the translated blocks are thrown away
+    void *jit_rt;           // owns the native code compiled in generation jit_rt_gen
+    uint64_t jit_rt_gen;
+    struct StoreLog *store_log;
+
+    // pl: pipeline registers, control signals and hazard counters
+    PipelineState pl;
+
+    // mc, pl and ooo: functional units, and timing of fetches and data
+    // accesses, NULL if not modelled
+    UarchConfig uarch;
+    struct Cache *icache;
+    struct Cache *dcache;
+    struct Cache *l2;
+    struct BranchPredictor *bp;     // pl and ooo, NULL: always predict not-taken
+    struct OooCore *ooo;            // ooo: the out-of-order window
+    struct CpiStack *cpi;           // mc and pl, NULL: no CPI stack
+    struct Stats *stats;            // NULL: no --stats
+    const uint64_t *stats_clock;    // ninst or global_cycle_count
+    uint64_t stats_next;            // clock value of the next snapshot, 0: none
+    struct PipeView *pv;            // pl, NULL: no --pipeview
+    // mc and ooo with --decoupled: the machine that runs the program, and
+    // the ring its records come through. NULL: this one runs it.
+    struct SimContext *iss;
+    struct CommitQueue *cq;
+    // mc --fast: the ISS runs the program, the cycles come from the table
+    // of mc_latency_table(). --fast-check: the stages run it, and this
+    // machine times it again from the table. NULL: no check.
+    int mc_fast;
+    struct SimContext *mc_check;
+    struct Difftest *dt;            // mc and pl, NULL: no --difftest
+    struct Profile *prof;           // iss, NULL: no --profile
+    struct TraceWriter *trace;      // iss, NULL: no --trace
+};
+
+// Allocate a machine and load test/build/<image>.elf. Returns NULL if the
+// image can not be loaded.
+SimContext *sim_create(const char *image, const SimConfig *cfg);
+// test/scripts/linker.ld reserves a stack for this many harts, more would
+// put theirs on top of .data and .bss
+#define MAX_HARTS 8
+
+// Give the machine nharts harts in total, all of them reset
+int sim_add_harts(SimContext *ctx, int nharts);
+// Free guest memory and caches of every hart, keep the statistics
+void sim_release(SimContext *ctx);
+void sim_destroy(SimContext *ctx);
+// Instructions retired by all harts
+uint64_t sim_ninst(SimContext *ctx);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Named statistics of one machine (--stats). The subsystems register the
+// counters they keep and go on counting in their own fields; the registry
+// reads them through pointers when it takes a snapshot or dumps them.
+// Names are hierarchical, dot separated: "l1d.misses" is "misses" in the
+// "l1d" object of the JSON dump.
+
+typedef struct Stats Stats;
+
+// Snapshots are taken every period of *clock (ninst or cycles), 0: only
+// the totals at the end
+Stats *stats_create(const uint64_t *clock, uint64_t period);
+void stats_free(Stats *s);
+
+void stats_counter(Stats *s, const uint64_t *val, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+void stats_histogram(Stats *s, const uint64_t *buckets, int n, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+// scale * num / den, both a counter or a sum of counters registered
+// before: "l1d.misses" / "l1d.reads+l1d.writes". Intervals get it from
+// their own counts.
+void stats_formula(Stats *s, const char *num, const char *den, double scale, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+// Snapshot for the interval that just ended, returns the clock value the
+// next one is due at
+uint64_t stats_interval(Stats *s);
+// The totals and every interval, as JSON, or CSV if path ends in .csv.
+// Returns -1 if the file can not be written.
+int stats_dump(Stats *s, const char *path, const char *image);
+
+#endif
@@ -6,6 +6,7 @@
 #define SYSCALL_EXIT 93
 #define SYSCALL_WRITE 64
 
-void handle_syscall(Decode *s);
+void ecall_handler(SimContext *ctx, Decode *s);
+void handle_syscall(SimContext *ctx, Decode *s);
 
 #endif
\ No newline at end of file
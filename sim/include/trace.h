@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <macro.h>
+#include "ftrace.h"
+
+// Binary trace of the ISS (--trace): every instruction and every call and
+// return, the way itrace and ftrace print them but without formatting
+// anything while the program runs. sim/build/simtrace prints the file.
+//
+// Layout, little endian:
+//   "RVTRACE\0", u32 version, u32 number of symbols,
+//   per symbol: u64 address, u16 length, the name without its NUL,
+//   then one record after the other, each starting with a tag byte.
+//
+// An instruction record tells how its pc differs from the pc after the last
+// one, and only carries the instruction word when the writer can not be
+// sure the reader knows it: a straight-line instruction seen before is a
+// single byte.
+
+#define TRACE_MAGIC   "RVTRACE"
+#define TRACE_VERSION 1
+
+typedef enum {
+    TR_SEQ,         // at the next pc, word seen before
+    TR_SEQ_INST,    // at the next pc, u32 word follows
+    TR_JUMP,        // varint zigzag(pc - next pc) follows, word seen before
+    TR_JUMP_INST,   // varint zigzag(pc - next pc), then u32 word
+    TR_CALL,        // by the last instruction, varint symbol index + 1 (0: outside every symbol)
+    TR_RET,         // by the last instruction
+    TR_END,         // varint number of instruction records, the file is complete
+} TraceTag;
+
+#define TRACE_BUF_SIZE (4 << 20)
+#define TRACE_REC_MAX  16       // longest record
+#define TRACE_SEEN     65536    // words the writer remembers, a power of 2
+
+typedef struct TraceWriter {
+    FILE *fp;
+    const char *path;
+    uint8_t *buf;           // records not written yet
+    size_t len;
+    uint64_t next_pc;       // after the last instruction
+    uint64_t ninst;
+    int failed;             // a write failed, the file is incomplete
+    // the last word written for a pc, direct-mapped
+    uint64_t seen_pc[TRACE_SEEN];
+    uint32_t seen_inst[TRACE_SEEN];
+} TraceWriter;
+
+// Write the header and the symbols. Returns NULL if path can not be written.
+TraceWriter *trace_create(const char *path, const SymbolTable *symbols);
+// Write TR_END and what is left in the buffer, close the file
+void trace_close(TraceWriter *t);
+void trace_drain(TraceWriter *t);
+
+static inline uint8_t *trace_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline void trace_inst(TraceWriter *t, uint64_t pc, uint32_t inst) {
+    if (unlikely(t->len > TRACE_BUF_SIZE - TRACE_REC_MAX)) trace_drain(t);
+    uint8_t *p = t->buf + t->len;
+    int k = (pc >> 2) & (TRACE_SEEN - 1);
+    int known = t->seen_pc[k] == pc && t->seen_inst[k] == inst;
+    int jump = pc != t->next_pc;
+    *p++ = (jump ? TR_JUMP : TR_SEQ) + !known;
+    if (jump) {
+        int64_t delta = pc - t->next_pc;
+        p = trace_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    }
+    if (!known) {
+        memcpy(p, &inst, 4);
+        p += 4;
+        t->seen_pc[k] = pc;
+        t->seen_inst[k] = inst;
+    }
+    t->len = p - t->buf;
+    t->next_pc = pc + 4;
+    t->ninst++;
+}
+
+// sym: index in the symbol table, -1 outside every symbol
+static inline void trace_call(TraceWriter *t, int sym) {
+    if (unlikely(t->len > TRACE_BUF_SIZE - TRACE_REC_MAX)) trace_drain(t);
+    uint8_t *p = t->buf + t->len;
+    *p++ = TR_CALL;
+    p = trace_varint(p, sym + 1);
+    t->len = p - t->buf;
+}
+
+static inline void trace_ret(TraceWriter *t) {
+    if (unlikely(t->len > TRACE_BUF_SIZE - TRACE_REC_MAX)) trace_drain(t);
+    t->buf[t->len++] = TR_RET;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef UARCH_H
+#define UARCH_H
+
+#include <stdint.h>
+
+// Functional units of the timing models. Their latencies, issue intervals
+// and counts come from the ISA table, or from a microarchitecture file
+// given with --uarch.
+
+typedef enum {
+    FU_ALU,         // also CSR, system and fence instructions
+    FU_BRANCH,      // branches and jumps
+    FU_MUL,
+    FU_DIV,
+    FU_LOAD,        // also AMOs
+    FU_STORE,
+    FU_NUM
+} FuClass;
+
+#define FU_MAX_UNITS 8
+
+typedef struct {
+    int latency;    // cycles from the operands to the result
+    int interval;   // cycles before a unit takes the next operation, 1: pipelined
+    int units;
+} FuConfig;
+
+typedef struct {
+    FuConfig fu[FU_NUM];
+} UarchConfig;
+
+extern const char *fu_names[FU_NUM];
+// FuClass of each InstClass
+extern const uint8_t fu_of_class[];
+
+// Latencies of the ISA table: every unit pipelined but the divider, one
+// unit of each kind but the ALUs and branch units, which never run out.
+void uarch_defaults(UarchConfig *u);
+// Override u with an INI file, a section per unit:
+//     [div]
+//     latency = 40
+//     pipelined = no
+// Returns -1 (and logs where) if the file is malformed.
+int uarch_load(const char *path, UarchConfig *u);
+
+#endif
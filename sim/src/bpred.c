@@ -0,0 +1,410 @@
+#include <common.h>
+#include <bpred.h>
+#include <stats.h>
+
+#define TAGE_TAG_BITS  9
+#define TAGE_U_RESET   (1 << 18)    // updates between two halvings of the u bits
+#define BP_TOP_BRANCHES 10
+
+static const int tage_hist_len[TAGE_TABLES] = { 4, 9, 20, 44 };
+
+typedef struct {
+    uint64_t pc;        // 0: empty
+    uint64_t target;
+    CfKind kind;
+} BtbEntry;
+
+typedef struct {
+    int8_t ctr;         // -4..3, taken when >= 0
+    uint8_t u;          // 0..3, useful
+    uint16_t tag;
+} TageEntry;
+
+typedef struct {
+    uint64_t pc;        // 0: empty
+    CfKind kind;
+    uint64_t execs;
+    uint64_t mispredicts;
+} BranchStat;
+
+struct BranchPredictor {
+    BpConfig cfg;
+    BtbEntry *btb;
+    uint8_t *ctr;               // 2-bit counters, also the TAGE base
+    uint64_t ghr;               // global history, newest outcome in bit 0
+    int hist_bits;              // gshare
+    TageEntry *tage[TAGE_TABLES];
+    int tage_entries;
+    uint64_t tage_updates;
+    uint64_t *ras;
+    int ras_top;
+
+    // statistics
+    uint64_t execs[CF_NUM];
+    uint64_t mispredicts[CF_NUM];
+    BranchStat *stat;           // per static branch, open addressing
+    int stat_cap;
+    int stat_n;
+};
+
+static const char *bp_name[] = { "none", "nt", "btfn", "bimodal", "gshare", "tage" };
+static const char *cf_name[CF_NUM] = { "other", "branch", "jump", "call", "return", "indirect" };
+
+static int is_pow2(uint64_t x) {
+    return x && !(x & (x - 1));
+}
+
+static int log2i(uint64_t x) {
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+}
+
+BranchPredictor *bp_create(const BpConfig *cfg) {
+    BranchPredictor *bp = calloc(1, sizeof(BranchPredictor));
+    check_mem(bp);
+    bp->cfg = *cfg;
+    if (bp->cfg.entries == 0) bp->cfg.entries = 4096;
+    check(is_pow2(bp->cfg.entries) && bp->cfg.entries >= 16, "The predictor needs a power of 2 counters, at least 16.");
+    check(is_pow2(cfg->btb_entries), "The BTB needs a power of 2 entries.");
+    check(cfg->ras_entries >= 0, "The RAS can not have a negative size.");
+
+    bp->btb = calloc(cfg->btb_entries, sizeof(BtbEntry));
+    check_mem(bp->btb);
+    bp->ctr = malloc(bp->cfg.entries);
+    check_mem(bp->ctr);
+    // weakly not-taken
+    memset(bp->ctr, 1, bp->cfg.entries);
+    bp->hist_bits = log2i(bp->cfg.entries);
+    if (cfg->kind == BP_TAGE) {
+        bp->tage_entries = bp->cfg.entries / 2;
+        for (int i = 0; i < TAGE_TABLES; i++) {
+            bp->tage[i] = calloc(bp->tage_entries, sizeof(TageEntry));
+            check_mem(bp->tage[i]);
+        }
+    }
+    if (cfg->ras_entries) {
+        bp->ras = calloc(cfg->ras_entries, sizeof(uint64_t));
+        check_mem(bp->ras);
+    }
+    bp->stat_cap = 256;
+    bp->stat = calloc(bp->stat_cap, sizeof(BranchStat));
+    check_mem(bp->stat);
+    return bp;
+
+error:
+    bp_free(bp);
+    return NULL;
+}
+
+void bp_free(BranchPredictor *bp) {
+    if (!bp) return;
+    free(bp->btb);
+    free(bp->ctr);
+    for (int i = 0; i < TAGE_TABLES; i++) free(bp->tage[i]);
+    free(bp->ras);
+    free(bp->stat);
+    free(bp);
+}
+
+CfKind bp_classify(uint32_t inst) {
+    int rd = (inst >> 7) & 0x1f, rs1 = (inst >> 15) & 0x1f;
+    int rd_link = rd == 1 || rd == 5, rs1_link = rs1 == 1 || rs1 == 5;
+    switch (inst & 0x7f) {
+        case 0x63: return CF_BRANCH;
+        case 0x6f: return rd_link ? CF_CALL : CF_JUMP;
+        case 0x67:
+            if (rd_link) return CF_CALL;
+            if (rs1_link && rd == 0) return CF_RETURN;
+            return CF_INDIRECT;
+        default:   return CF_NONE;
+    }
+}
+
+// ------------ Direction ------------
+
+// Fold the newest len bits of history into bits bits
+static uint32_t fold(uint64_t ghr, int len, int bits) {
+    uint64_t h = len < 64 ? ghr & ((1ull << len) - 1) : ghr;
+    uint32_t r = 0;
+    while (h) {
+        r ^= h & ((1u << bits) - 1);
+        h >>= bits;
+    }
+    return r;
+}
+
+static void tage_predict(BranchPredictor *bp, uint64_t pc, BpMeta *m) {
+    int bits = log2i(bp->tage_entries);
+    int taken = bp->ctr[m->index] >= 2, alt = taken;
+    m->provider = -1;
+    for (int i = 0; i < TAGE_TABLES; i++) {
+        int len = tage_hist_len[i];
+        m->tage_index[i] = ((pc >> 2) ^ (pc >> (2 + bits)) ^ fold(bp->ghr, len, bits)) & (bp->tage_entries - 1);
+        m->tage_tag[i] = ((pc >> 2) ^ fold(bp->ghr, len, TAGE_TAG_BITS) ^ (fold(bp->ghr, len, TAGE_TAG_BITS - 1) << 1)) &
+                         ((1 << TAGE_TAG_BITS) - 1);
+        TageEntry *e = &bp->tage[i][m->tage_index[i]];
+        if (e->tag == m->tage_tag[i]) {
+            alt = taken;
+            taken = e->ctr >= 0;
+            m->provider = i;
+        }
+    }
+    m->taken = taken;
+    m->alt_taken = alt;
+}
+
+static void tage_update(BranchPredictor *bp, const BpMeta *m, int taken) {
+    int p = m->provider;
+    if (p >= 0) {
+        TageEntry *e = &bp->tage[p][m->tage_index[p]];
+        if (e->tag == m->tage_tag[p]) {
+            if (taken && e->ctr < 3) e->ctr++;
+            if (!taken && e->ctr > -4) e->ctr--;
+            // only useful if it beat the shorter history
+            if (m->taken != m->alt_taken) {
+                if (m->taken == taken && e->u < 3) e->u++;
+                if (m->taken != taken && e->u > 0) e->u--;
+            }
+        }
+    } else {
+        uint8_t *c = &bp->ctr[m->index];
+        if (taken && *c < 3) (*c)++;
+        if (!taken && *c > 0) (*c)--;
+    }
+    // on a misprediction, try a longer history
+    if (m->taken != taken && p < TAGE_TABLES - 1) {
+        int allocated = 0;
+        for (int i = p + 1; i < TAGE_TABLES && !allocated; i++) {
+            TageEntry *e = &bp->tage[i][m->tage_index[i]];
+            if (e->u == 0) {
+                e->tag = m->tage_tag[i];
+                e->ctr = taken ? 0 : -1;
+                allocated = 1;
+            }
+        }
+        for (int i = p + 1; i < TAGE_TABLES && !allocated; i++) {
+            TageEntry *e = &bp->tage[i][m->tage_index[i]];
+            if (e->u > 0) e->u--;
+        }
+    }
+    if (++bp->tage_updates % TAGE_U_RESET == 0) {
+        for (int i = 0; i < TAGE_TABLES; i++) {
+            for (int k = 0; k < bp->tage_entries; k++) bp->tage[i][k].u >>= 1;
+        }
+    }
+}
+
+// ------------ RAS ------------
+
+static void ras_push(BranchPredictor *bp, uint64_t ret) {
+    bp->ras_top = (bp->ras_top + 1) % bp->cfg.ras_entries;
+    bp->ras[bp->ras_top] = ret;
+}
+
+static uint64_t ras_pop(BranchPredictor *bp) {
+    uint64_t ret = bp->ras[bp->ras_top];
+    bp->ras_top = (bp->ras_top + bp->cfg.ras_entries - 1) % bp->cfg.ras_entries;
+    return ret;
+}
+
+// ------------ Interface ------------
+
+void bp_predict(BranchPredictor *bp, uint64_t pc, BpMeta *m) {
+    BtbEntry *e = &bp->btb[(pc >> 2) & (bp->cfg.btb_entries - 1)];
+    m->next_pc = pc + 4;
+    m->taken = 0;
+    m->btb_hit = 0;
+    m->ras_action = 0;
+    m->provider = -1;
+    if (bp->ras) {
+        m->ras_top = bp->ras_top;
+        m->ras_top_value = bp->ras[bp->ras_top];
+    }
+    if (bp->cfg.kind == BP_NT) return;
+
+    // the direction tables are read for every fetch, EX trains them when
+    // the instruction turns out to be a branch
+    switch (bp->cfg.kind) {
+        case BP_BIMODAL:
+            m->index = (pc >> 2) & (bp->cfg.entries - 1);
+            m->taken = bp->ctr[m->index] >= 2;
+            break;
+        case BP_GSHARE:
+            m->index = ((pc >> 2) ^ fold(bp->ghr, bp->hist_bits, bp->hist_bits)) & (bp->cfg.entries - 1);
+            m->taken = bp->ctr[m->index] >= 2;
+            break;
+        case BP_TAGE:
+            m->index = (pc >> 2) & (bp->cfg.entries - 1);
+            tage_predict(bp, pc, m);
+            break;
+        default:
+            break;
+    }
+
+    if (e->pc != pc) return;
+    m->btb_hit = 1;
+    switch (e->kind) {
+        case CF_BRANCH:
+            if (bp->cfg.kind == BP_BTFN) m->taken = e->target < pc;
+            if (m->taken) m->next_pc = e->target;
+            break;
+        case CF_CALL:
+            m->next_pc = e->target;
+            if (bp->ras) {
+                ras_push(bp, pc + 4);
+                m->ras_action = 1;
+            }
+            break;
+        case CF_RETURN:
+            m->next_pc = e->target;
+            if (bp->ras) {
+                m->next_pc = ras_pop(bp);
+                m->ras_action = -1;
+            }
+            break;
+        default:
+            m->next_pc = e->target;
+            break;
+    }
+}
+
+static BranchStat *branch_stat(BranchPredictor *bp, uint64_t pc) {
+    if (bp->stat_n * 2 >= bp->stat_cap) {
+        BranchStat *old = bp->stat;
+        int old_cap = bp->stat_cap;
+        BranchStat *grown = calloc(old_cap * 2, sizeof(BranchStat));
+        if (!grown) return NULL;
+        bp->stat = grown;
+        bp->stat_cap = old_cap * 2;
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].pc) continue;
+            int k = (old[i].pc >> 2) & (bp->stat_cap - 1);
+            while (bp->stat[k].pc) k = (k + 1) & (bp->stat_cap - 1);
+            bp->stat[k] = old[i];
+        }
+        free(old);
+    }
+    int k = (pc >> 2) & (bp->stat_cap - 1);
+    while (bp->stat[k].pc && bp->stat[k].pc != pc) k = (k + 1) & (bp->stat_cap - 1);
+    if (!bp->stat[k].pc) {
+        bp->stat[k].pc = pc;
+        bp->stat_n++;
+    }
+    return &bp->stat[k];
+}
+
+void bp_update(BranchPredictor *bp, uint64_t pc, const BpMeta *m, CfKind kind,
+               int taken, uint64_t target, int mispredicted) {
+    BtbEntry *e = &bp->btb[(pc >> 2) & (bp->cfg.btb_entries - 1)];
+    int ras_action = kind == CF_CALL ? 1 : kind == CF_RETURN ? -1 : 0;
+
+    bp->execs[kind]++;
+    bp->mispredicts[kind] += mispredicted;
+    if (kind != CF_NONE) {
+        BranchStat *st = branch_stat(bp, pc);
+        if (st) {
+            st->kind = kind;
+            st->execs++;
+            st->mispredicts += mispredicted;
+        }
+    }
+
+    // undo what the wrong path did to the RAS, then do what this
+    // instruction really does
+    if (bp->ras && (mispredicted || ras_action != m->ras_action)) {
+        bp->ras_top = m->ras_top;
+        bp->ras[m->ras_top] = m->ras_top_value;
+        if (ras_action > 0) ras_push(bp, pc + 4);
+        if (ras_action < 0) ras_pop(bp);
+    }
+
+    if (kind == CF_NONE) {
+        // the BTB entry is stale, the code changed
+        if (e->pc == pc) e->pc = 0;
+        return;
+    }
+    if (kind == CF_BRANCH) {
+        switch (bp->cfg.kind) {
+            case BP_BIMODAL:
+            case BP_GSHARE: {
+                uint8_t *c = &bp->ctr[m->index];
+                if (taken && *c < 3) (*c)++;
+                if (!taken && *c > 0) (*c)--;
+                break;
+            }
+            case BP_TAGE:
+                tage_update(bp, m, taken);
+                break;
+            default:
+                break;
+        }
+        bp->ghr = (bp->ghr << 1) | taken;
+    }
+    // not-taken branches only keep the entry they have
+    if (kind != CF_BRANCH || taken) {
+        e->pc = pc;
+        e->target = target;
+        e->kind = kind;
+    }
+}
+
+static int by_mispredicts(const void *a, const void *b) {
+    const BranchStat *x = a, *y = b;
+    if (x->mispredicts != y->mispredicts) return x->mispredicts < y->mispredicts ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+void bp_report(const BranchPredictor *bp) {
+    uint64_t execs = 0, mispredicts = 0;
+    for (int k = CF_BRANCH; k < CF_NUM; k++) {
+        execs += bp->execs[k];
+        mispredicts += bp->mispredicts[k];
+    }
+    printf(ANSI_FMT("Branch predictor: %s, %d counters, BTB %d, RAS %d\n", ANSI_FG_YELLOW),
+           bp_name[bp->cfg.kind], bp->cfg.entries, bp->cfg.btb_entries, bp->cfg.ras_entries);
+    printf(ANSI_FMT("\tCONTROL     = %lu\n\tMISPREDICTS = %lu\n\tACCURACY    = %.2f%%\n", ANSI_FG_YELLOW),
+           execs, mispredicts, execs ? 100.0 * (execs - mispredicts) / execs : 100.0);
+    for (int k = CF_BRANCH; k < CF_NUM; k++) {
+        if (!bp->execs[k]) continue;
+        printf(ANSI_FMT("\t  %-8s %10lu, %8lu mispredicted (%.2f%%)\n", ANSI_FG_YELLOW), cf_name[k], bp->execs[k],
+               bp->mispredicts[k], 100.0 * (bp->execs[k] - bp->mispredicts[k]) / bp->execs[k]);
+    }
+    if (bp->mispredicts[CF_NONE]) {
+        printf(ANSI_FMT("\t  stale BTB entries: %lu\n", ANSI_FG_YELLOW), bp->mispredicts[CF_NONE]);
+    }
+
+    // the static branches that cost the most
+    BranchStat *sorted = malloc(bp->stat_n * sizeof(BranchStat));
+    if (!sorted) return;
+    int n = 0;
+    for (int i = 0; i < bp->stat_cap; i++) {
+        if (bp->stat[i].pc) sorted[n++] = bp->stat[i];
+    }
+    qsort(sorted, n, sizeof(BranchStat), by_mispredicts);
+    printf(ANSI_FMT("\tMost mispredicted:\n\t  %-16s %-8s %10s %10s %9s\n", ANSI_FG_YELLOW), "pc", "kind", "execs", "mispred", "accuracy");
+    for (int i = 0; i < n && i < BP_TOP_BRANCHES && sorted[i].mispredicts; i++) {
+        BranchStat *s = &sorted[i];
+        printf(ANSI_FMT("\t  %016lx %-8s %10lu %10lu %8.2f%%\n", ANSI_FG_YELLOW), s->pc, cf_name[s->kind], s->execs,
+               s->mispredicts, 100.0 * (s->execs - s->mispredicts) / s->execs);
+    }
+    free(sorted);
+}
+
+void bp_register_stats(const BranchPredictor *bp, Stats *s) {
+    char execs[128] = "", mispredicts[128] = "";
+    for (int k = CF_BRANCH; k < CF_NUM; k++) {
+        stats_counter(s, &bp->execs[k], "bp.%s.execs", cf_name[k]);
+        stats_counter(s, &bp->mispredicts[k], "bp.%s.mispredicts", cf_name[k]);
+        char num[32], den[32];
+        snprintf(num, sizeof(num), "bp.%s.mispredicts", cf_name[k]);
+        snprintf(den, sizeof(den), "bp.%s.execs", cf_name[k]);
+        stats_formula(s, num, den, 1, "bp.%s.mispredict_rate", cf_name[k]);
+        // and the sums over every kind
+        size_t n = strlen(execs), m = strlen(mispredicts);
+        snprintf(execs + n, sizeof(execs) - n, "%s%s", n ? "+" : "", den);
+        snprintf(mispredicts + m, sizeof(mispredicts) - m, "%s%s", m ? "+" : "", num);
+    }
+    stats_counter(s, &bp->mispredicts[CF_NONE], "bp.stale_btb");
+    stats_formula(s, mispredicts, execs, 1, "bp.mispredict_rate");
+}
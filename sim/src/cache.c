@@ -0,0 +1,178 @@
+#include <common.h>
+#include <ctype.h>
+#include <stats.h>
+#include <cache.h>
+
+static int is_pow2(uint64_t x) {
+    return x && !(x & (x - 1));
+}
+
+static int log2i(uint64_t x) {
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+}
+
+Cache *cache_create(const char *name, const CacheConfig *cfg, Cache *next, int mem_latency) {
+    Cache *c = NULL;
+    check(is_pow2(cfg->line) && cfg->line >= 4, "%s: the line size must be a power of 2, at least 4.", name);
+    check(cfg->ways >= 1 && cfg->size % ((uint64_t)cfg->ways * cfg->line) == 0,
+          "%s: the size must be a multiple of ways * line size.", name);
+    check(is_pow2(cfg->size / cfg->ways / cfg->line), "%s: the number of sets must be a power of 2.", name);
+    check(cfg->repl != REPL_PLRU || (is_pow2(cfg->ways) && cfg->ways <= 64),
+          "%s: PLRU needs a power of 2 ways, at most 64.", name);
+    check(cfg->latency >= 1, "%s: the hit latency is at least one cycle.", name);
+
+    c = calloc(1, sizeof(Cache));
+    check_mem(c);
+    c->name = name;
+    c->cfg = *cfg;
+    c->nsets = cfg->size / cfg->ways / cfg->line;
+    c->line_shift = log2i(cfg->line);
+    c->lines = calloc((uint64_t)c->nsets * cfg->ways, sizeof(CacheLine));
+    check_mem(c->lines);
+    c->plru = calloc(c->nsets, sizeof(uint64_t));
+    check_mem(c->plru);
+    c->rng = 0x9e3779b97f4a7c15ull;
+    c->next = next;
+    c->mem_latency = mem_latency;
+    return c;
+
+error:
+    cache_free(c);
+    return NULL;
+}
+
+void cache_free(Cache *c) {
+    if (!c) return;
+    free(c->lines);
+    free(c->plru);
+    free(c);
+}
+
+// ------------ Replacement ------------
+
+// The PLRU tree of a set is a heap: node n has children 2n and 2n+1, the
+// leaves are ways + way. A bit tells which half to evict from next.
+static void plru_touch(Cache *c, int set, int way) {
+    int node = 1;
+    for (int level = log2i(c->cfg.ways) - 1; level >= 0; level--) {
+        int half = (way >> level) & 1;
+        if (half) c->plru[set] &= ~(1ull << node);
+        else      c->plru[set] |= 1ull << node;
+        node = node * 2 + half;
+    }
+}
+
+static int plru_victim(Cache *c, int set) {
+    int node = 1;
+    while (node < c->cfg.ways) {
+        node = node * 2 + ((c->plru[set] >> node) & 1);
+    }
+    return node - c->cfg.ways;
+}
+
+static void touch(Cache *c, int set, int way) {
+    c->lines[set * c->cfg.ways + way].stamp = ++c->tick;
+    if (c->cfg.repl == REPL_PLRU) plru_touch(c, set, way);
+}
+
+static int victim(Cache *c, int set) {
+    CacheLine *l = &c->lines[set * c->cfg.ways];
+    for (int w = 0; w < c->cfg.ways; w++) {
+        if (!l[w].valid) return w;
+    }
+    switch (c->cfg.repl) {
+        case REPL_PLRU:
+            return plru_victim(c, set);
+        case REPL_RANDOM:
+            // xorshift64
+            c->rng ^= c->rng << 13;
+            c->rng ^= c->rng >> 7;
+            c->rng ^= c->rng << 17;
+            return c->rng % c->cfg.ways;
+        default: {
+            int lru = 0;
+            for (int w = 1; w < c->cfg.ways; w++) {
+                if (l[w].stamp < l[lru].stamp) lru = w;
+            }
+            return lru;
+        }
+    }
+}
+
+// ------------ Accesses ------------
+
+// Writes to the next level are buffered, they cost the cache nothing
+static void write_next(Cache *c, uint64_t addr) {
+    c->st.writebacks++;
+    if (c->next) cache_access(c->next, addr, 1);
+}
+
+int cache_access(Cache *c, uint64_t addr, int write) {
+    uint64_t tag = addr >> c->line_shift;
+    int set = tag & (c->nsets - 1);
+    CacheLine *l = &c->lines[set * c->cfg.ways];
+
+    if (write) c->st.writes++;
+    else       c->st.reads++;
+
+    for (int w = 0; w < c->cfg.ways; w++) {
+        if (l[w].valid && l[w].tag == tag) {
+            touch(c, set, w);
+            if (write && c->cfg.write == WRITE_BACK) l[w].dirty = 1;
+            if (write && c->cfg.write == WRITE_THROUGH) write_next(c, addr);
+            return c->cfg.latency;
+        }
+    }
+
+    c->st.misses++;
+    if (write && c->cfg.write == WRITE_THROUGH) {
+        write_next(c, addr);
+        return c->cfg.latency;
+    }
+
+    int w = victim(c, set);
+    if (l[w].valid) {
+        c->st.evictions++;
+        if (l[w].dirty) write_next(c, l[w].tag << c->line_shift);
+    }
+    int fill = c->next ? cache_access(c->next, addr, 0) : c->mem_latency;
+    l[w].tag = tag;
+    l[w].valid = 1;
+    l[w].dirty = write;
+    touch(c, set, w);
+    return c->cfg.latency + fill;
+}
+
+void cache_report(const Cache *c) {
+    static const char *repl[] = { "lru", "plru", "random" };
+    uint64_t accesses = c->st.reads + c->st.writes;
+    printf(ANSI_FMT("%s: %luK, %d-way, %dB lines, %s, %s\n", ANSI_FG_YELLOW),
+           c->name, c->cfg.size >> 10, c->cfg.ways, c->cfg.line, repl[c->cfg.repl],
+           c->cfg.write == WRITE_BACK ? "write-back" : "write-through");
+    printf(ANSI_FMT("\tACCESSES  = %lu (%lu reads, %lu writes)\n"
+                    "\tMISSES    = %lu\n"
+                    "\tMISS RATE = %.2f%%\n"
+                    "\tEVICTIONS = %lu\n"
+                    "\tWRITEBACKS = %lu\n", ANSI_FG_YELLOW),
+           accesses, c->st.reads, c->st.writes, c->st.misses,
+           accesses ? 100.0 * c->st.misses / accesses : 0.0,
+           c->st.evictions, c->st.writebacks);
+}
+
+void cache_register_stats(const Cache *c, Stats *s) {
+    char name[16];
+    int i;
+    for (i = 0; c->name[i] && i < (int)sizeof(name) - 1; i++) name[i] = tolower((unsigned char)c->name[i]);
+    name[i] = '\0';
+    stats_counter(s, &c->st.reads, "%s.reads", name);
+    stats_counter(s, &c->st.writes, "%s.writes", name);
+    stats_counter(s, &c->st.misses, "%s.misses", name);
+    stats_counter(s, &c->st.evictions, "%s.evictions", name);
+    stats_counter(s, &c->st.writebacks, "%s.writebacks", name);
+    char misses[32], accesses[64];
+    snprintf(misses, sizeof(misses), "%s.misses", name);
+    snprintf(accesses, sizeof(accesses), "%s.reads+%s.writes", name, name);
+    stats_formula(s, misses, accesses, 1, "%s.miss_rate", name);
+}
@@ -0,0 +1,107 @@
+#include <common.h>
+#include <pthread.h>
+#include <sched.h>
+#include <commit.h>
+#include <sim.h>
+
+#define CQ_SIZE  65536      // records in the ring, a power of 2
+#define CQ_BATCH 256        // records between two updates of head or tail
+
+// head and tail count records since the start, each side keeps the last
+// value it saw of the other one and only rereads it when that runs out.
+// Publishing every CQ_BATCH records keeps the two cache lines from
+// bouncing between the cores on every instruction.
+typedef struct CommitQueue {
+    CommitRec *buf;
+    SimContext *iss;
+    pthread_t thread;
+    // producer
+    __attribute__((aligned(64))) uint64_t head;     // records published
+    uint64_t tail_seen;
+    int done;               // the ISS stopped, head is final
+    // consumer
+    __attribute__((aligned(64))) uint64_t tail;     // records taken, published
+    uint64_t next;          // records taken
+    uint64_t head_seen;
+    int stop;               // the timing model gave up, the ISS must stop
+} CommitQueue;
+
+static inline void cq_wait(void) {
+    sched_yield();
+}
+
+static void *cq_producer(void *arg) {
+    CommitQueue *q = arg;
+    SimContext *iss = q->iss;
+    uint64_t head = 0;
+    while (iss->running) {
+        if (head - q->tail_seen == CQ_SIZE) {
+            // full, let the timing model see everything before waiting
+            __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+            while ((q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) + CQ_SIZE == head) {
+                if (__atomic_load_n(&q->stop, __ATOMIC_RELAXED)) goto out;
+                cq_wait();
+            }
+        }
+        if (!iss_exec_commit(iss, &q->buf[head & (CQ_SIZE - 1)])) break;
+        head++;
+        if ((head & (CQ_BATCH - 1)) == 0) __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+    }
+out:
+    __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&q->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int decoupled_start(SimContext *ctx) {
+    CommitQueue *q = calloc(1, sizeof(CommitQueue));
+    check_mem(q);
+    q->buf = malloc(CQ_SIZE * sizeof(CommitRec));
+    check_mem(q->buf);
+    q->iss = ctx->iss;
+    check(pthread_create(&q->thread, NULL, cq_producer, q) == 0, "Failed to start the ISS thread.");
+    ctx->cq = q;
+    return 0;
+
+error:
+    if (q) free(q->buf);
+    free(q);
+    return -1;
+}
+
+void decoupled_free(SimContext *ctx) {
+    CommitQueue *q = ctx->cq;
+    if (!q) return;
+    __atomic_store_n(&q->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(q->thread, NULL);
+    free(q->buf);
+    free(q);
+    ctx->cq = NULL;
+}
+
+static int decoupled_next(SimContext *ctx, CommitRec *r) {
+    CommitQueue *q = ctx->cq;
+    while (q->next == q->head_seen) {
+        // done before head: once done is set, head holds every record
+        int done = __atomic_load_n(&q->done, __ATOMIC_ACQUIRE);
+        q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (q->next != q->head_seen) break;
+        if (done) {
+            ctx->exit_code = q->iss->exit_code;
+            ctx->running = 0;
+            decoupled_free(ctx);
+            return 0;
+        }
+        cq_wait();
+    }
+    *r = q->buf[q->next & (CQ_SIZE - 1)];
+    q->next++;
+    if ((q->next & (CQ_BATCH - 1)) == 0) __atomic_store_n(&q->tail, q->next, __ATOMIC_RELEASE);
+    if (!r->fault) ++ctx->ninst;
+    return 1;
+}
+
+int commit_next(SimContext *ctx, CommitRec *r) {
+    if (ctx->cq) return decoupled_next(ctx, r);
+    return iss_exec_commit(ctx, r);
+}
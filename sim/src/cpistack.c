@@ -0,0 +1,171 @@
+#include <common.h>
+#include <cpistack.h>
+#include <stats.h>
+
+#define CPI_TOP 10
+
+typedef struct {
+    uint64_t pc;        // 0: empty
+    uint64_t insts;     // retired
+    uint64_t cycles[CPI_NUM];
+} CpiEntry;
+
+struct CpiStack {
+    uint64_t total[CPI_NUM];
+    uint64_t insts;
+    uint64_t cycles;
+    CpiEntry *pcs;      // per static instruction, open addressing
+    int cap;
+    int n;
+};
+
+static const char *cpi_name[CPI_NUM] = {
+    "base", "raw", "load-use", "control", "long", "I$ miss", "D$ miss", "struct"
+};
+
+CpiStack *cpi_create(void) {
+    CpiStack *c = calloc(1, sizeof(CpiStack));
+    check_mem(c);
+    c->cap = 1024;
+    c->pcs = calloc(c->cap, sizeof(CpiEntry));
+    check_mem(c->pcs);
+    return c;
+
+error:
+    cpi_free(c);
+    return NULL;
+}
+
+void cpi_free(CpiStack *c) {
+    if (!c) return;
+    free(c->pcs);
+    free(c);
+}
+
+static CpiEntry *cpi_entry(CpiStack *c, uint64_t pc) {
+    if (c->n * 2 >= c->cap) {
+        CpiEntry *old = c->pcs;
+        int old_cap = c->cap;
+        CpiEntry *grown = calloc(old_cap * 2, sizeof(CpiEntry));
+        if (!grown) return NULL;
+        c->pcs = grown;
+        c->cap = old_cap * 2;
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].pc) continue;
+            int k = (old[i].pc >> 2) & (c->cap - 1);
+            while (c->pcs[k].pc) k = (k + 1) & (c->cap - 1);
+            c->pcs[k] = old[i];
+        }
+        free(old);
+    }
+    int k = (pc >> 2) & (c->cap - 1);
+    while (c->pcs[k].pc && c->pcs[k].pc != pc) k = (k + 1) & (c->cap - 1);
+    if (!c->pcs[k].pc) {
+        c->pcs[k].pc = pc;
+        c->n++;
+    }
+    return &c->pcs[k];
+}
+
+void cpi_charge(CpiStack *c, CpiCause cause, uint64_t pc, uint64_t n) {
+    if (!n) return;
+    c->total[cause] += n;
+    c->cycles += n;
+    CpiEntry *e = pc ? cpi_entry(c, pc) : NULL;
+    if (e) e->cycles[cause] += n;
+}
+
+void cpi_retire(CpiStack *c, uint64_t pc) {
+    c->insts++;
+    CpiEntry *e = cpi_entry(c, pc);
+    if (e) e->insts++;
+}
+
+uint64_t cpi_cycles(const CpiStack *c) {
+    return c->cycles;
+}
+
+static uint64_t entry_cycles(const CpiEntry *e) {
+    uint64_t n = 0;
+    for (int k = 0; k < CPI_NUM; k++) n += e->cycles[k];
+    return n;
+}
+
+static int by_cycles(const void *a, const void *b) {
+    uint64_t x = entry_cycles(a), y = entry_cycles(b);
+    if (x != y) return x < y ? 1 : -1;
+    return ((const CpiEntry *)a)->pc < ((const CpiEntry *)b)->pc ? -1 : 1;
+}
+
+static void print_header(const char *what) {
+    char line[256];
+    int n = snprintf(line, sizeof(line), "\t  %-28s %10s %6s", what, "insts", "CPI");
+    for (int k = 0; k < CPI_NUM; k++) n += snprintf(line + n, sizeof(line) - n, " %9s", cpi_name[k]);
+    printf(ANSI_FMT("%s\n", ANSI_FG_YELLOW), line);
+}
+
+static void print_row(const char *name, const CpiEntry *e) {
+    char line[256];
+    int n = snprintf(line, sizeof(line), "\t  %-28.28s %10lu %6.2f", name, e->insts,
+                     e->insts ? (double)entry_cycles(e) / e->insts : 0.0);
+    for (int k = 0; k < CPI_NUM; k++) n += snprintf(line + n, sizeof(line) - n, " %9lu", e->cycles[k]);
+    printf(ANSI_FMT("%s\n", ANSI_FG_YELLOW), line);
+}
+
+void cpi_report(const CpiStack *c, SymbolTable *symbols) {
+    uint64_t insts = c->insts ? c->insts : 1;
+    printf(ANSI_FMT("CPI stack: %lu cycles, %lu instructions\n", ANSI_FG_YELLOW), c->cycles, c->insts);
+    for (int k = 0; k < CPI_NUM; k++) {
+        printf(ANSI_FMT("\t%-9s %12lu cycles %6.2f%%  CPI %.3f\n", ANSI_FG_YELLOW), cpi_name[k], c->total[k],
+               c->cycles ? 100.0 * c->total[k] / c->cycles : 0.0, (double)c->total[k] / insts);
+    }
+
+    CpiEntry *sorted = malloc(c->n * sizeof(CpiEntry));
+    // one bucket per function symbol, the last one for code outside them
+    int nfunc = symbols->count + 1;
+    CpiEntry *funcs = calloc(nfunc, sizeof(CpiEntry));
+    if (!sorted || !funcs) goto out;
+    int n = 0;
+    for (int i = 0; i < c->cap; i++) {
+        const CpiEntry *e = &c->pcs[i];
+        if (!e->pc) continue;
+        sorted[n++] = *e;
+        const FuncSymbol *f = find_func(symbols, e->pc);
+        CpiEntry *fe = &funcs[f ? f - symbols->symbols : nfunc - 1];
+        fe->pc = f ? f->address : 1;
+        fe->insts += e->insts;
+        for (int k = 0; k < CPI_NUM; k++) fe->cycles[k] += e->cycles[k];
+    }
+
+    qsort(funcs, nfunc, sizeof(CpiEntry), by_cycles);
+    printf(ANSI_FMT("\tFunctions taking the most cycles:\n", ANSI_FG_YELLOW));
+    print_header("function");
+    for (int i = 0; i < nfunc && i < CPI_TOP && funcs[i].pc; i++) {
+        const FuncSymbol *f = find_func(symbols, funcs[i].pc);
+        print_row(f && funcs[i].pc != 1 ? f->name : "?", &funcs[i]);
+    }
+
+    qsort(sorted, n, sizeof(CpiEntry), by_cycles);
+    printf(ANSI_FMT("\tInstructions taking the most cycles:\n", ANSI_FG_YELLOW));
+    print_header("pc");
+    for (int i = 0; i < n && i < CPI_TOP; i++) {
+        char name[64];
+        const FuncSymbol *f = find_func(symbols, sorted[i].pc);
+        if (f) snprintf(name, sizeof(name), "%08lx %s+0x%lx", sorted[i].pc, f->name, sorted[i].pc - f->address);
+        else snprintf(name, sizeof(name), "%08lx", sorted[i].pc);
+        print_row(name, &sorted[i]);
+    }
+
+out:
+    free(sorted);
+    free(funcs);
+}
+
+void cpi_register_stats(const CpiStack *c, Stats *s) {
+    static const char *key[CPI_NUM] = {
+        "base", "raw", "load_use", "control", "long", "icache", "dcache", "struct"
+    };
+    for (int k = 0; k < CPI_NUM; k++) {
+        stats_counter(s, &c->total[k], "cpi_stack.%s", key[k]);
+    }
+}
@@ -1,56 +1,386 @@
 #include <common.h>
+#include <pthread.h>
 #include <iss_core.h>
+#include <iss_block.h>
+#include <isa_table.h>
+#include <jit.h>
 #include <mc_core.h>
 #include <pl_core.h>
+#include <ooo_core.h>
+#include <commit.h>
+#include <difftest.h>
 #include <memory.h>
 #include <disasm.h>
 #include <macro.h>
+#include <profile.h>
+#include <trace.h>
+#include <sim.h>
 #include "ftrace.h"
 
 extern int itrace_enabled;
 extern int ftrace_enabled;
+extern int block_enabled;
+extern int jit_enabled;
+extern int jit_check_enabled;
+extern int hart_rr_enabled;
+extern int profile_enabled;
+extern int trace_enabled;
 extern LLVMDisasmContextRef disasm_ctx;
 
-int indentaton_level = 0;
-CPU_state cpu = {};
-static int running = 1;
-uint64_t global_cycle_count = 0;
-uint64_t ninst = 0;
+void init_cpu(SimContext *ctx){
+    ctx->cpu.pc = ctx->entry;
+    memset(ctx->cpu.reg, 0, sizeof(ctx->cpu.reg));
+    memset(ctx->cpu.csr, 0, sizeof(ctx->cpu.csr));
+    ctx->cpu.csr[CSR_MHARTID] = ctx->hartid;
+    // like an SBI boot: a0 = hart id, a1 = number of harts, a2 = RAM size
+    ctx->cpu.reg[10] = ctx->hartid;
+    ctx->cpu.reg[11] = ctx->boot->nharts;
+    ctx->cpu.reg[12] = ctx->mem_size;
+    ctx->resv_valid = 0;
+    ctx->running = 1;
+}
 
-void init_cpu(){
-    cpu.pc = MEM_BASE;
-    memset(cpu.reg, 0, sizeof(cpu.reg));
-    memset(cpu.csr, 0, sizeof(cpu.csr));
+// Returns the old value of csr. CSRs with csr[11:10] == 3 are read-only,
+// writes to them are dropped.
+uint64_t csr_access(SimContext *ctx, uint32_t csr, CsrOp op, uint64_t val) {
+    uint64_t *p = &ctx->cpu.csr[csr & 0xfff];
+    uint64_t old;
+    switch (csr) {
+        case CSR_CYCLE:
+        case CSR_MCYCLE:
+            // the ISS has no cycles, count one per instruction there
+            old = ctx->global_cycle_count ? ctx->global_cycle_count : ctx->ninst;
+            break;
+        case CSR_INSTRET:
+        case CSR_MINSTRET:
+            old = ctx->ninst;
+            break;
+        default:
+            old = *p;
+            break;
+    }
+    if (BITS(csr, 11, 10) == 3) {
+        return old;
+    }
+    switch (op) {
+        case CSR_RW: *p = val; break;
+        case CSR_RS: *p = old | val; break;
+        case CSR_RC: *p = old & ~val; break;
+    }
+    return old;
 }
 
 // ------------ ISS SIM ------------
 
-void iss_exec_once() {
+// ------------ Execution hooks ------------
+
+// Each combination of hooks gets its own copy of the execution loops, so the
+// loops never test a flag that is switched off.
+#define HOOK_ITRACE  1
+#define HOOK_FTRACE  2
+#define HOOK_PROFILE 4     // iss only
+#define HOOK_TRACE   8      // iss only
+#define HOOK_NUM     16
+#define TIMING_HOOK_NUM 4   // the timing models only have the first two
+
+static int exec_hooks() {
+    int hooks = 0;
+    if (itrace_enabled && disasm_ctx) hooks |= HOOK_ITRACE;
+    if (ftrace_enabled) hooks |= HOOK_FTRACE;
+    if (profile_enabled) hooks |= HOOK_PROFILE;
+    if (trace_enabled) hooks |= HOOK_TRACE;
+    return hooks;
+}
+
+static int timing_hooks() {
+    return exec_hooks() & (TIMING_HOOK_NUM - 1);
+}
+
+// Instantiates def(hooks) for every hook combination
+#define HOOK_FOREACH(def) def(0) def(1) def(2) def(3) def(4) def(5) def(6) def(7) \
+  def(8) def(9) def(10) def(11) def(12) def(13) def(14) def(15)
+#define TIMING_HOOK_FOREACH(def) def(0) def(1) def(2) def(3)
+#define HOOK_TABLE_ENTRY(hooks) concat(HOOK_LOOP_PREFIX, hooks),
+
+// --profile: follow calls and returns, with the registers from before they run
+__attribute__((always_inline))
+static inline void handle_profile(SimContext *ctx, Decode *s) {
+    // only jal and jalr can be either
+    if (likely((s->inst & 0x77) != 0x67)) return;
+    if (is_call(s->inst)) prof_call(ctx->prof, s->pc, get_call_target_addr(ctx, s), ctx->ninst);
+    else if (is_ret(s->inst)) prof_ret(ctx->prof, R(1), ctx->ninst);
+}
+
+// --trace: the instruction, then the call or return it makes
+__attribute__((always_inline))
+static inline void handle_trace(SimContext *ctx, Decode *s) {
+    trace_inst(ctx->trace, s->pc, s->inst);
+    if (likely((s->inst & 0x77) != 0x67)) return;
+    if (is_call(s->inst)) {
+        const FuncSymbol *f = find_func(&ctx->sym_table, get_call_target_addr(ctx, s));
+        trace_call(ctx->trace, f ? f - ctx->sym_table.symbols : -1);
+    } else if (is_ret(s->inst)) {
+        trace_ret(ctx->trace);
+    }
+}
+
+__attribute__((always_inline))
+static inline void iss_step(SimContext *ctx, int hooks) {
     Decode s;
-    s.pc   = cpu.pc;
-    s.inst = inst_fetch(s.pc);
+    s.pc   = ctx->cpu.pc;
+    const DecodedInst *d = decode_cache_lookup(ctx, s.pc);
+    s.inst = d->inst;
     s.snpc = s.pc + 4;
-    if (itrace_enabled && disasm_ctx) {
+    s.dnpc = s.snpc;
+    s.type = d->type;
+    hist_push(&ctx->hist, s.pc, s.inst);
+    if (hooks & HOOK_ITRACE) {
         handle_itrace(&s);
     }
-    if (ftrace_enabled) {
-        handle_ftrace(&s);
+    if (hooks & HOOK_FTRACE) {
+        handle_ftrace(ctx, &s);
+    }
+    if (hooks & HOOK_PROFILE) {
+        handle_profile(ctx, &s);
+    }
+    if (hooks & HOOK_TRACE) {
+        handle_trace(ctx, &s);
+    }
+    d->handler(ctx, &s, d);
+    if (unlikely(ctx->exc_pending)) {
+        take_exception(ctx, s.pc);
+        return;
     }
-    decode_exec(&s);
-    cpu.pc = s.dnpc;
+    R(0) = 0;
+    ctx->cpu.pc = s.dnpc;
+    ++ctx->ninst;
+    if (hooks & HOOK_PROFILE) {
+        prof_count(ctx->prof, s.pc);
+    }
+}
+
+void iss_exec_once(SimContext *ctx) {
+    iss_step(ctx, exec_hooks());
 }
 
-void iss_cpu_exec() {
-    while (running) {
-        iss_exec_once();
+__attribute__((always_inline))
+static inline int iss_commit_step(SimContext *ctx, CommitRec *r, int hooks) {
+    if (!ctx->running) return 0;
+    uint64_t pc = ctx->cpu.pc;
+    // the ISS may overwrite the decode cache entry, take what is needed first
+    const DecodedInst *d = decode_cache_lookup(ctx, pc);
+    const IsaInfo *info = &isa_info[d->op];
+    r->pc = pc;
+    r->inst = d->inst;
+    r->op = d->op;
+    r->rd = info->regs & USE_RD ? d->rd : 0;
+    r->rs1 = info->regs & USE_RS1 ? d->rs1 : 0;
+    r->rs2 = info->regs & USE_RS2 ? d->rs2 : 0;
+    r->addr = 0;
+    if (info->cls == CLASS_LOAD || info->cls == CLASS_STORE) r->addr = R(d->rs1) + d->imm;
+    else if (info->cls == CLASS_AMO) r->addr = R(d->rs1);
+    uint64_t ninst = ctx->ninst;
+    iss_step(ctx, hooks);
+    // a fault stopped the machine, the instruction never happened
+    r->fault = ctx->ninst == ninst;
+    r->next_pc = ctx->cpu.pc;
+    r->value = R(r->rd);
+    return 1;
+}
+
+int iss_exec_commit(SimContext *ctx, CommitRec *r) {
+    return iss_commit_step(ctx, r, exec_hooks());
+}
+
+int iss_exec_reference(SimContext *ctx, CommitRec *r) {
+    return iss_commit_step(ctx, r, 0);
+}
+
+void tb_exec(SimContext *ctx, TransBlock *tb) {
+    uint64_t gen = ctx->tb_generation;
+    const DecodedInst *d = tb->ops, *end = tb->ops + tb->ninst;
+    const DecodedInst *counted = tb->ops;   // ninst includes the ops before it
+    Decode s;
+    for (; d < end; d++) {
+        s.pc   = d->pc;
+        s.inst = d->inst;
+        s.snpc = s.pc + 4;
+        s.dnpc = s.snpc;
+        s.type = d->type;
+        hist_push(&ctx->hist, s.pc, s.inst);
+        // instret and cycle read what ran before, like the interpreter
+        if (unlikely(d->is_csr)) {
+            ctx->ninst += d - counted;
+            counted = d;
+        }
+        d->handler(ctx, &s, d);
+        // the instruction faulted, the block ends before it
+        if (unlikely(ctx->exc_pending)) {
+            ctx->ninst += d - counted;
+            ctx->cpu.pc = s.pc;
+            take_exception(ctx, s.pc);
+            return;
+        }
+        R(0) = 0;
+        // a store rewrote translated code, leave the stale block now
+        if (unlikely(d->is_store) && ctx->tb_generation != gen) {
+            d++;
+            break;
+        }
+    }
+    ctx->ninst += d - counted;
+    ctx->cpu.pc = s.dnpc;
+}
+
+// Run whole translated blocks, following the direct links between them.
+// The flags are only looked at on block boundaries.
+static void iss_block_exec(SimContext *ctx) {
+    TransBlock *tb = tb_lookup(ctx, ctx->cpu.pc);
+    while (ctx->running) {
+        uint64_t gen = ctx->tb_generation;
+        tb_exec(ctx, tb);
+        if (unlikely(!ctx->running)) {
+            break;
+        }
+        if (unlikely(ctx->tb_generation != gen)) {
+            tb = tb_lookup(ctx, ctx->cpu.pc);
+        } else {
+            tb = tb_chain(ctx, tb, ctx->cpu.pc);
+        }
+    }
+}
+
+// Compiled code does not keep the history, push the first n ops of tb after
+// it returned. Only the last HIST_SIZE of them can show up.
+static inline void hist_push_block(SimContext *ctx, const TransBlock *tb, int n) {
+    for (int k = n > HIST_SIZE ? n - HIST_SIZE : 0; k < n; k++) {
+        hist_push(&ctx->hist, tb->ops[k].pc, tb->ops[k].inst);
+    }
+}
+
+// Same as iss_block_exec(), but blocks that ran JIT_HOT_THRESHOLD times are
+// compiled to native code. Blocks the JIT can not handle stay interpreted.
+static void iss_jit_exec(SimContext *ctx) {
+    TransBlock *tb = tb_lookup(ctx, ctx->cpu.pc);
+    while (ctx->running) {
+        uint64_t gen = ctx->tb_generation;
+        if (tb->jit_code == NULL) {
+            if (++tb->exec_count == JIT_HOT_THRESHOLD) {
+                tb->jit_code = jit_compile(ctx, tb);
+            }
+        }
+        if (tb->jit_code == NULL) {
+            tb_exec(ctx, tb);
+        } else if (unlikely(jit_check_enabled)) {
+            jit_check_exec(ctx, tb);
+        } else {
+            ctx->cpu.pc = ((JitFunc)tb->jit_code)(ctx);
+            // compiled code only leaves early right after a store that
+            // rewrote translated code, or at an access that faulted
+            if (likely(ctx->tb_generation == gen && !ctx->exc_pending)) {
+                ctx->ninst += tb->ninst;
+                hist_push_block(ctx, tb, tb->ninst);
+            } else {
+                int n = (ctx->cpu.pc - tb->pc) / 4;
+                ctx->ninst += n;
+                // the faulting op is recorded too, as tb_exec() does
+                hist_push_block(ctx, tb, ctx->exc_pending ? n + 1 : n);
+                if (ctx->exc_pending) take_exception(ctx, ctx->cpu.pc);
+            }
+        }
+        if (unlikely(!ctx->running)) {
+            break;
+        }
+        if (unlikely(ctx->tb_generation != gen)) {
+            tb = tb_lookup(ctx, ctx->cpu.pc);
+        } else {
+            tb = tb_chain(ctx, tb, ctx->cpu.pc);
+        }
+    }
+}
+
+#define def_ISS_LOOP(hooks) \
+  static void concat(iss_loop_, hooks)(SimContext *ctx) { \
+    while (ctx->running) iss_step(ctx, hooks); \
+  }
+HOOK_FOREACH(def_ISS_LOOP)
+
+#define HOOK_LOOP_PREFIX iss_loop_
+static void (*const iss_loops[HOOK_NUM])(SimContext *ctx) = { HOOK_FOREACH(HOOK_TABLE_ENTRY) };
+#undef HOOK_LOOP_PREFIX
+
+static void iss_hart_exec(SimContext *ctx) {
+    // the hooks need the interpreter
+    int hooked = itrace_enabled || ftrace_enabled || profile_enabled || trace_enabled;
+    if (jit_enabled && !hooked) {
+        iss_jit_exec(ctx);
+        return;
+    }
+    if (block_enabled && !hooked) {
+        iss_block_exec(ctx);
+        return;
+    }
+    iss_loops[exec_hooks()](ctx);
+}
+
+// ------------ Harts ------------
+
+// Deterministic mode: one host thread runs the harts in turn, one
+// instruction each, until hart 0 halts
+#define def_ISS_RR_LOOP(hooks) \
+  static void concat(iss_rr_loop_, hooks)(SimContext *ctx) { \
+    while (ctx->running) { \
+      for (int i = 0; i < ctx->nharts; i++) { \
+        SimContext *h = ctx->harts[i]; \
+        if (h->running) iss_step(h, hooks); \
+      } \
+    } \
+  }
+HOOK_FOREACH(def_ISS_RR_LOOP)
+
+#define HOOK_LOOP_PREFIX iss_rr_loop_
+static void (*const iss_rr_loops[HOOK_NUM])(SimContext *ctx) = { HOOK_FOREACH(HOOK_TABLE_ENTRY) };
+#undef HOOK_LOOP_PREFIX
+
+static void *hart_thread(void *arg) {
+    iss_hart_exec(arg);
+    return NULL;
+}
+
+void iss_cpu_exec(SimContext *ctx) {
+    if (ctx->nharts == 1) {
+        iss_hart_exec(ctx);
+        return;
+    }
+    if (hart_rr_enabled) {
+        iss_rr_loops[exec_hooks()](ctx);
+        return;
+    }
+    // one host thread per hart, they only share the guest memory
+    pthread_t threads[ctx->nharts];
+    int started = 1;
+    for (; started < ctx->nharts; started++) {
+        if (pthread_create(&threads[started], NULL, hart_thread, ctx->harts[started]) != 0) {
+            log_err("Failed to start a thread for hart %d.", started);
+            halt_trap(ctx, ctx->cpu.pc, -1);
+            break;
+        }
+    }
+    iss_hart_exec(ctx);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
 }
 
 // --------- Multi-cycle SIM ---------
 
-void mc_exec_once() {
-    // uint64_t record = global_cycle_count;
-    ++ninst;
+__attribute__((always_inline))
+static inline void mc_step(SimContext *ctx, int hooks) {
+    // uint64_t record = ctx->global_cycle_count;
+    // the stages charge their stalls, the rest of the cycles is base
+    uint64_t start = ctx->global_cycle_count;
+    uint64_t charged = ctx->cpi ? cpi_cycles(ctx->cpi) : 0;
+    ++ctx->ninst;
     Decode s;
     Multi_Cycle_Stage stage = STAGE_IF;
     uint64_t alu_result = 0;
@@ -58,31 +388,36 @@ void mc_exec_once() {
     while (stage != STAGE_DONE) {
         switch (stage) {
             case STAGE_IF:
-                mc_IF(&s);
-                if (itrace_enabled)
+                mc_IF(ctx, &s);
+                if (unlikely(ctx->exc_pending))
+                    goto fault;
+                hist_push(&ctx->hist, s.pc, s.inst);
+                if (hooks & HOOK_ITRACE)
                     handle_itrace(&s);
                 push_stage(&s, &stage);
-                global_cycle_count++;
+                ctx->global_cycle_count++;
                 break;
             case STAGE_ID:
                 // add cycle count in func decode_ID
-                mc_ID(&s);
+                mc_ID(ctx, &s);
                 push_stage(&s, &stage);
                 break;
             case STAGE_EX:
                 // alu_result used to pass result to MEM or WB stage
                 // add cycle count in func decode_EX
-                mc_EX(&s, &alu_result);
+                mc_EX(ctx, &s, &alu_result);
                 push_stage(&s, &stage);
                 break;
             case STAGE_MEM:
                 // mem_result used to pass result to WB stage
                 // add cycle count in func decode_MEM
-                mc_MEM(&s, alu_result, &mem_result);
+                mc_MEM(ctx, &s, alu_result, &mem_result);
+                if (unlikely(ctx->exc_pending))
+                    goto fault;
                 push_stage(&s, &stage);
                 break;
             case STAGE_WB:
-                mc_WB(&s, alu_result, mem_result);
+                mc_WB(ctx, &s, alu_result, mem_result);
                 push_stage(&s, &stage);
                 break;
             case STAGE_DONE:
@@ -91,52 +426,299 @@ void mc_exec_once() {
         }
     }
 loop_end:
-    cpu.pc = s.dnpc;
-    // printf("spend %ld cycle\n", global_cycle_count - record);
+    ctx->cpu.pc = s.dnpc;
+    if (unlikely(ctx->dt != NULL)) {
+        difftest_commit(ctx, s.pc, s.inst, s.dnpc);
+        difftest_sync(ctx);
+    }
+    // printf("spend %ld cycle\n", ctx->global_cycle_count - record);
+    if (ctx->cpi) {
+        cpi_charge(ctx->cpi, CPI_BASE, s.pc, ctx->global_cycle_count - start - (cpi_cycles(ctx->cpi) - charged));
+        cpi_retire(ctx->cpi, s.pc);
+    }
+    return;
+fault:
+    // nothing of the instruction is kept, not even its count
+    --ctx->ninst;
+    if (ctx->cpi) {
+        cpi_charge(ctx->cpi, CPI_BASE, s.pc, ctx->global_cycle_count - start - (cpi_cycles(ctx->cpi) - charged));
+    }
+    take_exception(ctx, s.pc);
+}
+
+// Snapshot the statistics when an interval ends
+static inline void stats_tick(SimContext *ctx) {
+    if (unlikely(ctx->stats_next) && *ctx->stats_clock >= ctx->stats_next) {
+        ctx->stats_next = stats_interval(ctx->stats);
+    }
+}
+
+void mc_exec_once(SimContext *ctx) {
+    mc_step(ctx, exec_hooks());
+}
+
+#define def_MC_LOOP(hooks) \
+  static void concat(mc_loop_, hooks)(SimContext *ctx) { \
+    while (ctx->running) { \
+      mc_step(ctx, hooks); \
+      stats_tick(ctx); \
+    } \
+  }
+TIMING_HOOK_FOREACH(def_MC_LOOP)
+
+#define HOOK_LOOP_PREFIX mc_loop_
+static void (*const mc_loops[TIMING_HOOK_NUM])(SimContext *ctx) = { TIMING_HOOK_FOREACH(HOOK_TABLE_ENTRY) };
+#undef HOOK_LOOP_PREFIX
+
+static inline void show_performance(SimContext *ctx) {
+    printf(ANSI_FMT("Performance: \n\tINST NUM  = %4ld\n\tCYCLE NUM = %4ld\n\tCPI       = %.3f\n", ANSI_FG_YELLOW), ctx->ninst, ctx->global_cycle_count, (float)ctx->global_cycle_count/(float)ctx->ninst);
+}
+
+static void show_caches(SimContext *ctx) {
+    if (ctx->icache) cache_report(ctx->icache);
+    if (ctx->dcache) cache_report(ctx->dcache);
+    if (ctx->l2) cache_report(ctx->l2);
+}
+
+// --fast: the ISS runs the instruction and the latency table gives its
+// cycles, charged around the work where the stages would charge them. CSR
+// and device reads see the same cycle count as on the stages.
+__attribute__((always_inline))
+static inline void mc_fast_step(SimContext *ctx, const McLatency *lat, int hooks) {
+    uint64_t start = ctx->global_cycle_count;
+    uint64_t charged = ctx->cpi ? cpi_cycles(ctx->cpi) : 0;
+    ++ctx->ninst;
+    Decode s;
+    s.pc   = ctx->cpu.pc;
+    const DecodedInst *d = decode_cache_lookup(ctx, s.pc);
+    const McLatency *t = &lat[d->op];
+    s.inst = d->inst;
+    s.snpc = s.pc + 4;
+    s.dnpc = s.snpc;
+    s.type = d->type;
+    // a fetch fault costs nothing, the handler raises it
+    if (likely(mem_in_ram(ctx, s.pc, 4))) {
+        uint64_t addr = 0;
+        if (t->mem) addr = isa_info[d->op].cls == CLASS_AMO ? R(d->rs1) : R(d->rs1) + d->imm;
+        mc_charge(ctx, t, s.pc, addr);
+        hist_push(&ctx->hist, s.pc, s.inst);
+        if (hooks & HOOK_ITRACE) {
+            handle_itrace(&s);
+        }
+    }
+    d->handler(ctx, &s, d);
+    if (unlikely(ctx->exc_pending)) {
+        --ctx->ninst;
+        if (ctx->cpi) {
+            cpi_charge(ctx->cpi, CPI_BASE, s.pc, ctx->global_cycle_count - start - (cpi_cycles(ctx->cpi) - charged));
+        }
+        take_exception(ctx, s.pc);
+        return;
+    }
+    R(0) = 0;
+    ctx->cpu.pc = s.dnpc;
+    ctx->global_cycle_count += t->wb;
+    if (ctx->cpi) {
+        cpi_charge(ctx->cpi, CPI_BASE, s.pc, ctx->global_cycle_count - start - (cpi_cycles(ctx->cpi) - charged));
+        cpi_retire(ctx->cpi, s.pc);
+    }
 }
 
-static inline void show_performance() {
-    printf(ANSI_FMT("Performance: \n\tINST NUM  = %4ld\n\tCYCLE NUM = %4ld\n\tCPI       = %.3f\n", ANSI_FG_YELLOW), ninst, global_cycle_count, (float)global_cycle_count/(float)ninst);
+#define def_MC_FAST_LOOP(hooks) \
+  static void concat(mc_fast_loop_, hooks)(SimContext *ctx, const McLatency *lat) { \
+    while (ctx->running) { \
+      mc_fast_step(ctx, lat, hooks); \
+      stats_tick(ctx); \
+    } \
+  }
+TIMING_HOOK_FOREACH(def_MC_FAST_LOOP)
+
+#define HOOK_LOOP_PREFIX mc_fast_loop_
+static void (*const mc_fast_loops[TIMING_HOOK_NUM])(SimContext *ctx, const McLatency *lat) = { TIMING_HOOK_FOREACH(HOOK_TABLE_ENTRY) };
+#undef HOOK_LOOP_PREFIX
+
+// --fast-check: the stages run the program, ctx->mc_check times every
+// instruction again from the table with caches of its own. The first
+// instruction they disagree on stops the run.
+static void mc_check_loop(SimContext *ctx, const McLatency *lat) {
+    SimContext *chk = ctx->mc_check;
+    int hooks = exec_hooks();
+    CommitRec r;
+    while (ctx->running) {
+        const DecodedInst *d = decode_cache_lookup(ctx, ctx->cpu.pc);
+        r.pc = ctx->cpu.pc;
+        r.op = d->op;
+        r.addr = isa_info[d->op].cls == CLASS_AMO ? R(d->rs1) : R(d->rs1) + d->imm;
+        uint64_t ninst = ctx->ninst, cycles = ctx->global_cycle_count, expected = chk->global_cycle_count;
+        mc_step(ctx, hooks);
+        stats_tick(ctx);
+        r.fault = ctx->ninst == ninst;
+        mc_time(chk, lat, &r);
+        cycles = ctx->global_cycle_count - cycles;
+        expected = chk->global_cycle_count - expected;
+        if (cycles != expected) {
+            log_err("--fast-check: the %s at pc %08lx took %lu cycles on the stages, %lu from the table.",
+                    isa_info[r.op].name, r.pc, cycles, expected);
+            halt_trap(ctx, r.pc, -1);
+            return;
+        }
+    }
+    log_info("--fast-check: the table timed all %lu instructions like the stages.", ctx->ninst);
 }
 
-void mc_cpu_exec() {
-    while (running) {
-        mc_exec_once();
+// --decoupled: the ISS runs the program on its own thread, only the
+// cycles are counted here
+static void mc_decoupled_loop(SimContext *ctx, const McLatency *lat) {
+    CommitRec r;
+    if (decoupled_start(ctx) != 0) return;
+    while (commit_next(ctx, &r)) {
+        mc_time(ctx, lat, &r);
+        stats_tick(ctx);
     }
-    show_performance();
+}
+
+void mc_cpu_exec(SimContext *ctx) {
+    McLatency lat[OP_NUM];
+    mc_latency_table(&ctx->uarch, lat);
+    if (ctx->iss) mc_decoupled_loop(ctx, lat);
+    else if (ctx->mc_check) mc_check_loop(ctx, lat);
+    else if (ctx->mc_fast) mc_fast_loops[timing_hooks()](ctx, lat);
+    else mc_loops[timing_hooks()](ctx);
+    if (ctx->dt) difftest_finish(ctx);
+    show_performance(ctx);
+    show_caches(ctx);
+    if (ctx->cpi) cpi_report(ctx->cpi, &ctx->sym_table);
 }
 
 // --------- Pipeline SIM ---------
-void pl_exec_once() {
-    ++global_cycle_count;
-    pl_WB();
-    pl_MEM();
-    pl_EX();
-    pl_ID();
-    pl_IF();
+__attribute__((always_inline))
+static inline void pl_step(SimContext *ctx, int hooks) {
+    ++ctx->global_cycle_count;
+    // trace instructions as they retire, wrong-path ones never get here
+    if (hooks & HOOK_ITRACE) {
+        for (int k = 0; k < ctx->pl.width; k++) {
+            if (ctx->pl.mem_wb_reg[k].valid) handle_itrace(&ctx->pl.mem_wb_reg[k].s);
+        }
+    }
+    pl_WB(ctx);
+    pl_MEM(ctx);
+    // a faulting access stops the machine before anything younger runs. ID
+    // held everything behind a halting ecall or ebreak, MEM had nothing to do.
+    if (unlikely(!ctx->running)) {
+        return;
+    }
+    pl_EX(ctx);
+    pl_ID(ctx);
+    pl_IF(ctx);
+}
+
+void pl_exec_once(SimContext *ctx) {
+    pl_step(ctx, exec_hooks());
 }
 
-extern int RAW_harzard_count;
-extern int control_harzard_count;
+#define def_PL_LOOP(hooks) \
+  static void concat(pl_loop_, hooks)(SimContext *ctx) { \
+    while (ctx->running) { \
+      pl_step(ctx, hooks); \
+      stats_tick(ctx); \
+    } \
+  }
+TIMING_HOOK_FOREACH(def_PL_LOOP)
 
-static inline void pl_show_performance() {
-    printf(ANSI_FMT("Performance: \n\tINST NUM  = %4ld\n\tCYCLE NUM = %4ld\n\tCPI       = %.3f\n\tRAW_harzard_count = %4d\n\tcontrol_harzard_count = %4d\n", ANSI_FG_YELLOW), ninst, global_cycle_count, (float)global_cycle_count/(float)ninst, RAW_harzard_count, control_harzard_count);
+#define HOOK_LOOP_PREFIX pl_loop_
+static void (*const pl_loops[TIMING_HOOK_NUM])(SimContext *ctx) = { TIMING_HOOK_FOREACH(HOOK_TABLE_ENTRY) };
+#undef HOOK_LOOP_PREFIX
+
+static inline void pl_show_performance(SimContext *ctx) {
+    PipelineState *pl = &ctx->pl;
+    printf(ANSI_FMT("Performance: \n\tINST NUM  = %4ld\n\tCYCLE NUM = %4ld\n\tCPI       = %.3f\n\tRAW_harzard_count = %4lu\n\tcontrol_harzard_count = %4lu\n", ANSI_FG_YELLOW), ctx->ninst, ctx->global_cycle_count, (float)ctx->global_cycle_count/(float)ctx->ninst, pl->RAW_harzard_count, pl->control_harzard_count);
+    printf(ANSI_FMT("\tforwarding %s: %lu operands forwarded\n\tstalls: alu %lu, load-use %lu, ecall %lu, long latency %lu, unit busy %lu cycles\n", ANSI_FG_YELLOW), pl->forwarding ? "on" : "off", pl->forwarded, pl->stall_alu, pl->stall_load_use, pl->stall_ecall, pl->stall_long, pl->stall_fu);
+    // issue slots are width per cycle, a stall or a bubble leaves them all empty
+    printf(ANSI_FMT("\twidth %d: IPC = %.3f, issue slots used %.2f%%\n", ANSI_FG_YELLOW), pl->width,
+           (double)ctx->ninst / ctx->global_cycle_count, 100.0 * ctx->ninst / ((double)ctx->global_cycle_count * pl->width));
+    if (pl->width > 1) {
+        printf(ANSI_FMT("\tissued per cycle:", ANSI_FG_YELLOW));
+        for (int n = 0; n <= pl->width; n++) printf(ANSI_FMT(" %d: %lu", ANSI_FG_YELLOW), n, pl->issue_hist[n]);
+        printf(ANSI_FMT("\n\tgroups split by: dependence %lu, functional units %lu, serializing %lu\n", ANSI_FG_YELLOW),
+               pl->split_dep, pl->split_unit, pl->split_serial);
+    }
+}
+
+void pl_cpu_exec(SimContext *ctx) {
+    init_pipeline(ctx);
+    if (ctx->stats) pl_register_stats(ctx);
+    pl_loops[timing_hooks()](ctx);
+    if (ctx->dt) difftest_finish(ctx);
+    pl_show_performance(ctx);
+    show_caches(ctx);
+    if (ctx->bp) bp_report(ctx->bp);
+    if (ctx->cpi) cpi_report(ctx->cpi, &ctx->sym_table);
+}
+
+// -------- Out-of-order SIM ---------
+
+void ooo_cpu_exec(SimContext *ctx) {
+    // the ISS runs the instructions, tracing included, as they are fetched,
+    // or ahead of them on its own thread with --decoupled
+    if (ctx->iss && decoupled_start(ctx) != 0) return;
+    while (ooo_step(ctx)) stats_tick(ctx);
+    show_performance(ctx);
+    ooo_report(ctx);
+    show_caches(ctx);
+    if (ctx->bp) bp_report(ctx->bp);
 }
 
-void pl_cpu_exec() {
-    init_pipeline();
-    while (running) {
-        pl_exec_once();
+// ------------ Exceptions ------------
+
+void raise_exception(SimContext *ctx, uint64_t cause, uint64_t tval) {
+    // the first one raised by the instruction wins
+    if (ctx->exc_pending) return;
+    ctx->exc_pending = 1;
+    ctx->cpu.csr[CSR_MCAUSE] = cause;
+    ctx->cpu.csr[CSR_MTVAL] = tval;
+}
+
+static const char *exc_name(uint64_t cause) {
+    switch (cause) {
+        case EXC_INST_ACCESS:      return "Instruction access fault";
+        case EXC_LOAD_MISALIGNED:  return "Misaligned load";
+        case EXC_LOAD_ACCESS:      return "Load access fault";
+        case EXC_STORE_MISALIGNED: return "Misaligned store/AMO";
+        case EXC_STORE_ACCESS:     return "Store/AMO access fault";
+        default:                   return "Exception";
     }
-    pl_show_performance();
 }
 
-void halt_trap(uint64_t pc, uint64_t code){
+// The instruction at pc raised an exception. There is no trap vector (and
+// no mret), so the machine stops with the state from before the instruction
+// and mepc/mcause/mtval telling what happened.
+void take_exception(SimContext *ctx, uint64_t pc) {
+    ctx->exc_pending = 0;
+    ctx->cpu.csr[CSR_MEPC] = pc;
+    log_err("%s at pc %08lx, address %016lx.", exc_name(ctx->cpu.csr[CSR_MCAUSE]), pc, ctx->cpu.csr[CSR_MTVAL]);
+    halt_trap(ctx, pc, -1);
+}
+
+void halt_trap(SimContext *ctx, uint64_t pc, uint64_t code){
+    SimContext *boot = ctx->boot;
+    if (ctx != boot && code == 0) {
+        // this hart is done, the machine goes on until hart 0 halts
+        log_info("Hart %d parked at pc %08lx.", ctx->hartid, pc);
+        ctx->running = 0;
+        return;
+    }
     if(code){
+        hist_dump(ctx, HIST_SIZE);
         printf(ANSI_FMT("HIT BAD TRAP!\n", ANSI_FG_RED));
     }else{
         printf(ANSI_FMT("HIT GOOD TRAP!\n", ANSI_FG_GREEN));
     }
     log_info("Program ended at pc %08lx, with exit code %ld.", pc, code);
-    running = 0;
+    boot->exit_code = code;
+    boot->halt_pc = pc;
+    // stop every hart, the others may be running on other threads
+    for (int i = 1; boot->harts && i < boot->nharts; i++) {
+        __atomic_store_n(&boot->harts[i]->running, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&boot->running, 0, __ATOMIC_RELAXED);
 }
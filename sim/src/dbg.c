@@ -4,9 +4,9 @@
 #include <dbg.h>
 #include <isa_decode.h>
 #include <disasm.h>
+#include <sim.h>
 #include "ftrace.h"
 
-extern SymbolTable *sym_table;
 extern LLVMDisasmContextRef disasm_ctx;
 
 const char* riscv_abi_names[32] = {
@@ -24,10 +24,11 @@ static void cmd_help() {
     printf("  si   - Step execution by specified number of instructions\n");
     printf("  info - Display information about registers\n");
     printf("  x    - Examine memory\n");
+    printf("  hist - Show the last instructions that ran (up to %d)\n", HIST_SIZE);
 }
 
-static void cmd_continue() {
-    iss_cpu_exec();
+static void cmd_continue(SimContext *ctx) {
+    iss_cpu_exec(ctx);
 }
 
 static void cmd_quit() {
@@ -35,65 +36,64 @@ static void cmd_quit() {
     exit(0);
 }
 
-static void cmd_step(int steps) {
-    char asm_buf[128];
+static void cmd_step(SimContext *ctx, int steps) {
     for (int i = 0; i < steps; ++i) {
-        uint64_t current_pc = cpu.pc;
-        uint32_t inst_code = mem_read(current_pc, 4);
-
-        uint8_t bytes[4];
-        bytes[0] = inst_code & 0xFF;
-        bytes[1] = (inst_code >> 8) & 0xFF;
-        bytes[2] = (inst_code >> 16) & 0xFF;
-        bytes[3] = (inst_code >> 24) & 0xFF;
-
-        disassemble_inst(disasm_ctx, bytes, 4, current_pc, asm_buf, sizeof(asm_buf));
+        uint64_t current_pc = ctx->cpu.pc;
+        uint64_t inst_code = 0;
+        if (mem_peek(ctx, current_pc, 4, &inst_code) != 0) {
+            printf("\33[1;34m=> 0x%016lx\33[1;0m: \t<not in RAM>\n", current_pc);
+            iss_exec_once(ctx);
+            continue;
+        }
 
         // Print the address and the disassembled instruction
-        printf("\33[1;34m=> 0x%016lx\33[1;0m: \t%s\n", current_pc, asm_buf);
+        printf("\33[1;34m=> 0x%016lx\33[1;0m: \t%s\n", current_pc, disasm_memo(current_pc, inst_code));
 
         // Look up and print the function name if available
-        if (sym_table) {
-            const FuncSymbol *func_symbol = find_func(sym_table, current_pc);
-            if (func_symbol) {
-                printf("\33[1;34m0x%08lx\33[1;0m in \33[1;33m%s\33[1;0m ()\n", func_symbol->address, func_symbol->name);
-            }
+        const FuncSymbol *func_symbol = find_func(&ctx->sym_table, current_pc);
+        if (func_symbol) {
+            printf("\33[1;34m0x%08lx\33[1;0m in \33[1;33m%s\33[1;0m ()\n", func_symbol->address, func_symbol->name);
         }
 
         // Execute the instruction
-        iss_exec_once(); 
+        iss_exec_once(ctx);
     }
 }
 
-static void cmd_info(char arg) {
+static void cmd_info(SimContext *ctx, char arg) {
     if (arg == 'r') {
         for (int i = 0; i < 32; ++i) {
             char reg_id[5];
             sprintf(reg_id, "x%d", i);
             char reg_name[6];
             sprintf(reg_name, "(%s)", riscv_abi_names[i]);
-            printf("\33[1;34m%-4s %-6s\33[1;0m : 0x%016lx\n", reg_id, reg_name, cpu.reg[i]);
+            printf("\33[1;34m%-4s %-6s\33[1;0m : 0x%016lx\n", reg_id, reg_name, ctx->cpu.reg[i]);
         }
-        printf("\33[1;34mpc\33[1;0m          : 0x%016lx\n", cpu.pc);
+        printf("\33[1;34mpc\33[1;0m          : 0x%016lx\n", ctx->cpu.pc);
     } else {
         printf("Unknown info command '%c'\n", arg);
     }
 }
 
-static void cmd_examine(int len, uint64_t addr) {
+static void cmd_examine(SimContext *ctx, int len, uint64_t addr) {
     for (int i = 0; i < len; ++i) {
-        uint32_t data = mem_read(addr + i * 4, 4);
+        uint64_t data;
         if (i % 4 == 0) {
             printf("\33[1;34m0x%016lx\33[1;0m: ", addr + i * 4);
         }
-        printf("0x%08x ", data);
+        // devices are not read, that could change their state
+        if (mem_peek(ctx, addr + i * 4, 4, &data) == 0) {
+            printf("0x%08lx ", data);
+        } else {
+            printf("?????????? ");
+        }
         if (i % 4 == 3 || i == len - 1) {
             printf("\n");
         }
     }
 }
 
-void debug_loop() {
+void debug_loop(SimContext *ctx) {
     init_llvm_disassembler();
     char line[256];
     while (1) {
@@ -108,27 +108,30 @@ void debug_loop() {
         if (strcmp(cmd, "help") == 0) {
             cmd_help();
         } else if (strcmp(cmd, "c") == 0) {
-            cmd_continue();
+            cmd_continue(ctx);
         } else if (strcmp(cmd, "q") == 0) {
             cmd_quit();
         } else if (strcmp(cmd, "si") == 0) {
             char *arg = strtok(NULL, " \n");
             int steps = arg ? atoi(arg) : 1;
-            cmd_step(steps);
+            cmd_step(ctx, steps);
         } else if (strcmp(cmd, "info") == 0) {
             char *arg = strtok(NULL, " \n");
             if (arg) {
-                cmd_info(arg[0]);
+                cmd_info(ctx, arg[0]);
             } else {
                 printf("Usage: info r\n");
             }
+        } else if (strcmp(cmd, "hist") == 0) {
+            char *arg = strtok(NULL, " \n");
+            hist_dump(ctx, arg ? atoi(arg) : HIST_SIZE);
         } else if (strcmp(cmd, "x") == 0) {
             char *len_str = strtok(NULL, " \n");
             char *addr_str = strtok(NULL, " \n");
             if (len_str && addr_str) {
                 int len = atoi(len_str);
                 uint64_t addr = strtoull(addr_str, NULL, 0);
-                cmd_examine(len, addr);
+                cmd_examine(ctx, len, addr);
             } else {
                 printf("Usage: x <len> <addr>\n");
             }
@@ -0,0 +1,100 @@
+#include <common.h>
+#include <memory.h>
+#include <sim.h>
+#include <device.h>
+
+// Devices run on the thread of the hart that accesses them. The only state
+// they keep is mtimecmp, where each hart has a slot of its own.
+
+// ------------ Exit device ------------
+
+// Write 0x5555 to pass, or (code << 16) | 0x3333 to fail with code
+#define EXIT_PASS 0x5555
+#define EXIT_FAIL 0x3333
+
+static uint64_t exit_read(SimContext *ctx, void *dev, uint64_t off, int len) {
+    return 0;
+}
+
+static void exit_write(SimContext *ctx, void *dev, uint64_t off, int len, uint64_t data) {
+    if (off != 0) return;
+    switch (data & 0xffff) {
+        case EXIT_PASS: halt_trap(ctx, ctx->cpu.pc, 0); break;
+        case EXIT_FAIL: halt_trap(ctx, ctx->cpu.pc, (data >> 16) & 0xffff); break;
+        default: break;
+    }
+}
+
+static const MmioOps exit_ops = { exit_read, exit_write };
+
+// ------------ CLINT ------------
+
+#define CLINT_SIZE      0x10000
+#define CLINT_MTIMECMP  0x4000
+#define CLINT_MTIME     0xbff8
+#define CLINT_MAX_HARTS 64
+
+typedef struct {
+    uint64_t mtimecmp[CLINT_MAX_HARTS];
+} Clint;
+
+// mtime counts hart 0's cycles, or its instructions on the iss which has
+// no cycles, like mcycle. Timer interrupts are not modelled, mtimecmp only
+// reads back what was written.
+static uint64_t clint_mtime(SimContext *ctx) {
+    SimContext *b = ctx->boot;
+    return b->global_cycle_count ? b->global_cycle_count : b->ninst;
+}
+
+static uint64_t clint_read(SimContext *ctx, void *dev, uint64_t off, int len) {
+    Clint *c = dev;
+    uint64_t v = 0;
+    if (off >= CLINT_MTIME && off < CLINT_MTIME + 8) {
+        v = clint_mtime(ctx) >> ((off - CLINT_MTIME) * 8);
+    } else if (off >= CLINT_MTIMECMP && off < CLINT_MTIMECMP + 8 * CLINT_MAX_HARTS) {
+        uint64_t k = off - CLINT_MTIMECMP;
+        v = c->mtimecmp[k / 8] >> ((k % 8) * 8);
+    }
+    return len == 8 ? v : v & ((1ull << (len * 8)) - 1);
+}
+
+static void clint_write(SimContext *ctx, void *dev, uint64_t off, int len, uint64_t data) {
+    Clint *c = dev;
+    if (off >= CLINT_MTIMECMP && off + len <= CLINT_MTIMECMP + 8 * CLINT_MAX_HARTS) {
+        memcpy((uint8_t *)c->mtimecmp + (off - CLINT_MTIMECMP), &data, len);
+    }
+}
+
+static const MmioOps clint_ops = { clint_read, clint_write };
+
+// ------------ UART ------------
+
+#define UART_SIZE 0x1000
+#define UART_THR  0     // transmit holding register
+#define UART_LSR  5     // line status
+#define UART_LSR_TX_IDLE 0x60
+
+static uint64_t uart_read(SimContext *ctx, void *dev, uint64_t off, int len) {
+    // nothing to receive, always ready to send
+    return off == UART_LSR ? UART_LSR_TX_IDLE : 0;
+}
+
+static void uart_write(SimContext *ctx, void *dev, uint64_t off, int len, uint64_t data) {
+    if (off == UART_THR) {
+        putchar(data & 0xff);
+    }
+}
+
+static const MmioOps uart_ops = { uart_read, uart_write };
+
+int init_devices(SimContext *ctx) {
+    Clint *clint;
+    check(mem_add_mmio(ctx, "exit", DEV_EXIT_BASE, 0x1000, &exit_ops, NULL) == 0, "Failed to add the exit device.");
+    clint = calloc(1, sizeof(Clint));
+    check_mem(clint);
+    check(mem_add_mmio(ctx, "clint", DEV_CLINT_BASE, CLINT_SIZE, &clint_ops, clint) == 0, "Failed to add the CLINT.");
+    check(mem_add_mmio(ctx, "uart", DEV_UART_BASE, UART_SIZE, &uart_ops, NULL) == 0, "Failed to add the UART.");
+    return 0;
+error:
+    return -1;
+}
@@ -0,0 +1,179 @@
+#include <common.h>
+#include <difftest.h>
+#include <commit.h>
+#include <iss_core.h>
+#include <isa_table.h>
+#include <memory.h>
+#include <syscall.h>
+
+extern const char *riscv_abi_names[32];
+
+Difftest *difftest_create(const char *image, const SimConfig *cfg) {
+    Difftest *dt = calloc(1, sizeof(Difftest));
+    check_mem(dt);
+    // the ISS alone, no caches or units: it only runs the program
+    SimConfig ref_cfg = { .mem_base = cfg->mem_base, .mem_size = cfg->mem_size };
+    dt->ref = sim_create(image, &ref_cfg);
+    if (!dt->ref) goto error;
+    return dt;
+
+error:
+    free(dt);
+    return NULL;
+}
+
+void difftest_free(Difftest *dt) {
+    if (!dt) return;
+    sim_destroy(dt->ref);
+    free(dt);
+}
+
+// Every register the two machines disagree on
+static void show_regs(SimContext *ctx) {
+    SimContext *ref = ctx->dt->ref;
+    for (int i = 1; i < 32; i++) {
+        if (ctx->cpu.reg[i] != ref->cpu.reg[i]) {
+            fprintf(stderr, "  x%-2d %-4s model %016lx, ISS %016lx\n", i, riscv_abi_names[i], ctx->cpu.reg[i], ref->cpu.reg[i]);
+        }
+    }
+}
+
+static void fail(SimContext *ctx, uint64_t pc) {
+    ctx->dt->failed = 1;
+    show_regs(ctx);
+    halt_trap(ctx, pc, -1);
+}
+
+// Its outcome comes from the model: the cycle and instret counters, devices,
+// system calls
+static int model_dependent(SimContext *ref, const DecodedInst *d) {
+    switch (isa_info[d->op].cls) {
+        case CLASS_CSR: case CLASS_SYSTEM:
+            return 1;
+        case CLASS_LOAD: case CLASS_STORE:
+            return !mem_in_ram(ref, ref->cpu.reg[d->rs1] + d->imm, 1);
+        case CLASS_AMO:
+            return !mem_in_ram(ref, ref->cpu.reg[d->rs1], 1);
+        default:
+            return 0;
+    }
+}
+
+// The ISS does not run system instructions, but it knows from its own
+// registers whether this one ends the program: ebreak, and every system call
+// but write (an unknown one fails)
+static void system_halt(Difftest *dt, const DecodedInst *d) {
+    const CPU_state *cpu = &dt->ref->cpu;
+    uint64_t a7 = cpu->reg[17];
+    if (d->op == OP_ecall && a7 == SYSCALL_WRITE) return;
+    dt->halted = 1;
+    dt->halt_pc = cpu->pc;
+    dt->exit_code = d->op == OP_ecall && a7 != SYSCALL_EXIT ? (uint64_t)-1 : cpu->reg[10];
+}
+
+void difftest_commit(SimContext *ctx, uint64_t pc, uint32_t inst, uint64_t next_pc) {
+    Difftest *dt = ctx->dt;
+    SimContext *ref = dt->ref;
+    if (dt->failed) return;
+    uint64_t n = dt->compared + dt->copied + 1;
+    if (pc != ref->cpu.pc) {
+        log_err("--difftest: instruction %lu ran at pc %08lx, the ISS is at %08lx.", n, pc, ref->cpu.pc);
+        fail(ctx, pc);
+        return;
+    }
+    const DecodedInst *d = decode_cache_lookup(ref, pc);
+    if (inst != d->inst) {
+        log_err("--difftest: instruction %lu at pc %08lx is %08x, the ISS read %08x.", n, pc, inst, d->inst);
+        fail(ctx, pc);
+        return;
+    }
+    if (model_dependent(ref, d)) {
+        int cls = isa_info[d->op].cls;
+        if (cls == CLASS_SYSTEM) system_halt(dt, d);
+        if (cls == CLASS_STORE || cls == CLASS_AMO) dt->device_next = next_pc;
+        memcpy(ref->cpu.reg, ctx->cpu.reg, sizeof(ref->cpu.reg));
+        ref->cpu.pc = next_pc;
+        ref->ninst++;
+        dt->copied++;
+        return;
+    }
+
+    CommitRec r;
+    iss_exec_reference(ref, &r);
+    dt->compared++;
+    if (r.fault) {
+        log_err("--difftest: the %s at pc %08lx raised an exception on the ISS only.", isa_info[r.op].name, pc);
+        fail(ctx, pc);
+        return;
+    }
+    if (next_pc != r.next_pc) {
+        log_err("--difftest: the %s at pc %08lx went to %08lx, on the ISS to %08lx.", isa_info[r.op].name, pc, next_pc, r.next_pc);
+        fail(ctx, pc);
+        return;
+    }
+    if (r.rd && ctx->cpu.reg[r.rd] != r.value) {
+        log_err("--difftest: the %s at pc %08lx wrote %016lx to %s, the ISS %016lx.",
+                isa_info[r.op].name, pc, ctx->cpu.reg[r.rd], riscv_abi_names[r.rd], r.value);
+        fail(ctx, pc);
+        return;
+    }
+    int cls = isa_info[r.op].cls;
+    if (cls == CLASS_STORE || cls == CLASS_AMO) {
+        // sb/sh/sw/sd and the .w/.d AMOs: funct3 gives the size
+        dt->store_addr[dt->nstores] = r.addr;
+        dt->store_len[dt->nstores] = 1 << BITS(r.inst, 13, 12);
+        dt->store_pc[dt->nstores] = pc;
+        if (++dt->nstores == PL_MAX_WIDTH) difftest_sync(ctx);
+    }
+}
+
+void difftest_sync(SimContext *ctx) {
+    Difftest *dt = ctx->dt;
+    for (int i = 0; i < dt->nstores && !dt->failed; i++) {
+        uint64_t mine = 0, ref = 0;
+        mem_peek(ctx, dt->store_addr[i], dt->store_len[i], &mine);
+        mem_peek(dt->ref, dt->store_addr[i], dt->store_len[i], &ref);
+        if (mine != ref) {
+            log_err("--difftest: after the store at pc %08lx, the %d bytes at %016lx hold %lx, on the ISS %lx.",
+                    dt->store_pc[i], dt->store_len[i], dt->store_addr[i], mine, ref);
+            fail(ctx, dt->store_pc[i]);
+        }
+    }
+    dt->nstores = 0;
+}
+
+// The ISS never runs device accesses, so it can not see a store to the exit
+// device end the program: mc retires the store first, pl stops in MEM.
+static int device_halt(Difftest *dt) {
+    SimContext *ref = dt->ref;
+    if (dt->device_next == ref->cpu.pc) return 1;
+    const DecodedInst *d = decode_cache_lookup(ref, ref->cpu.pc);
+    return isa_info[d->op].cls == CLASS_STORE && model_dependent(ref, d);
+}
+
+void difftest_finish(SimContext *ctx) {
+    Difftest *dt = ctx->dt;
+    SimContext *ref = dt->ref;
+    if (!dt->failed && dt->halted && (ctx->halt_pc != dt->halt_pc || ctx->exit_code != dt->exit_code)) {
+        log_err("--difftest: the program ended at pc %08lx with exit code %ld, on the ISS at %08lx with %ld.",
+                ctx->halt_pc, (int64_t)ctx->exit_code, dt->halt_pc, (int64_t)dt->exit_code);
+        dt->failed = 1;
+        ctx->exit_code = -1;
+    }
+    // a fault ends the run before its instruction retires, the ISS waits at it
+    if (!dt->failed && !dt->halted && !(ctx->exit_code != 0 && ctx->halt_pc == ref->cpu.pc) && !device_halt(dt)) {
+        log_err("--difftest: the program ended at pc %08lx with exit code %ld, the ISS did not get there, it is at %08lx.",
+                ctx->halt_pc, (int64_t)ctx->exit_code, ref->cpu.pc);
+        dt->failed = 1;
+        ctx->exit_code = -1;
+    }
+    if (!dt->failed && memcmp(ctx->cpu.reg, dt->ref->cpu.reg, sizeof(ctx->cpu.reg)) != 0) {
+        log_err("--difftest: the registers differ at the end of the run.");
+        dt->failed = 1;
+        show_regs(ctx);
+        ctx->exit_code = -1;
+    }
+    if (!dt->failed) {
+        log_info("--difftest: %lu instructions matched the ISS, %lu more were taken from the model.", dt->compared, dt->copied);
+    }
+}
@@ -3,16 +3,31 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <disasm.h>
 
 extern LLVMDisasmContextRef disasm_ctx;
 
+#define DISASM_MEMO 4096    // pcs, a power of 2
+
+typedef struct {
+    uint64_t pc;
+    uint32_t inst;
+    char text[64];          // empty: not disassembled yet
+} DisasmMemo;
+
+// Per thread, the harts can trace on threads of their own
+static __thread DisasmMemo *memo;
+static pthread_key_t memo_key;
+static pthread_once_t memo_once = PTHREAD_ONCE_INIT;
+
 LLVMDisasmContextRef init_disasm(const char *triple) {
     LLVMInitializeAllTargetInfos();
     LLVMInitializeAllTargetMCs();
     LLVMInitializeAllDisassemblers();
 
-    LLVMDisasmContextRef disasm_ctx = LLVMCreateDisasm(triple, NULL, 0, NULL, NULL);
+    // the simulated ISA is RV64IMA + Zicsr
+    LLVMDisasmContextRef disasm_ctx = LLVMCreateDisasmCPUFeatures(triple, "", "+m,+a", NULL, 0, NULL, NULL);
     if (!disasm_ctx) {
         fprintf(stderr, "Failed to create LLVM disassembler for triple %s\n", triple);
     }
@@ -53,13 +68,32 @@ void cleanup_llvm_disassembler() {
     cleanup_disasm(disasm_ctx);
 }
 
+static void memo_key_create(void) {
+    pthread_key_create(&memo_key, free);
+}
+
+const char *disasm_memo(uint64_t pc, uint32_t inst) {
+    static __thread char single[64];
+    uint8_t bytes[4] = { inst & 0xFF, (inst >> 8) & 0xFF, (inst >> 16) & 0xFF, (inst >> 24) & 0xFF };
+    if (!memo) {
+        memo = calloc(DISASM_MEMO, sizeof(DisasmMemo));
+        if (!memo) {
+            disassemble_inst(disasm_ctx, bytes, 4, pc, single, sizeof(single));
+            return single;
+        }
+        // freed when the thread exits
+        pthread_once(&memo_once, memo_key_create);
+        pthread_setspecific(memo_key, memo);
+    }
+    DisasmMemo *m = &memo[(pc >> 2) & (DISASM_MEMO - 1)];
+    if (!m->text[0] || m->pc != pc || m->inst != inst) {
+        m->pc = pc;
+        m->inst = inst;
+        disassemble_inst(disasm_ctx, bytes, 4, pc, m->text, sizeof(m->text));
+    }
+    return m->text;
+}
+
 void handle_itrace(Decode *s) {
-    char asm_buf[128];
-    uint8_t bytes[4];
-    bytes[0] = s->inst & 0xFF;
-    bytes[1] = (s->inst >> 8) & 0xFF;
-    bytes[2] = (s->inst >> 16) & 0xFF;
-    bytes[3] = (s->inst >> 24) & 0xFF;
-    disassemble_inst(disasm_ctx, bytes, 4, s->pc, asm_buf, sizeof(asm_buf));
-    printf("\33[1;34m0x%016lx\33[1;0m: %08x          %s\n", s->pc, s->inst, asm_buf);
+    printf("\33[1;34m0x%016lx\33[1;0m: %08x          %s\n", s->pc, s->inst, disasm_memo(s->pc, s->inst));
 }
\ No newline at end of file
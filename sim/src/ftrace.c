@@ -3,6 +3,7 @@
 #include <string.h>
 #include <cpu.h>
 #include <macro.h>
+#include <sim.h>
 #include "ftrace.h" 
 
 void init_symbol_table(SymbolTable *table) {
@@ -85,34 +86,7 @@ void free_symbol_table(SymbolTable *table) {
     table->capacity = 0;
 }
 
-static int is_call(uint32_t inst) {
-    uint32_t opcode = inst & 0x7f;
-    uint32_t rd = (inst >> 7) & 0x1f;
-    if (opcode == 0x6f && rd == 1) { // JAL && rd == x1 (ra)
-        return 1;
-    }
-    if (opcode == 0x67 && rd == 1) { // JALR && rd == x1 (ra)
-        return 1;
-    }
-    return 0;
-}
-
-static int is_ret(uint32_t inst) {
-    uint32_t opcode = inst & 0x7f;
-    uint32_t rs1 = (inst >> 15) & 0x1f;
-    uint32_t rd = (inst >> 7) & 0x1f;
-    uint32_t imm = (inst >> 20) & 0xfff; 
-    if (opcode == 0x67 && rs1 == 1 && rd == 0 && imm == 0) { // JALR x0, 0(x1)
-        return 1;
-    }
-    return 0;
-}
-
-extern CPU_state cpu;
-extern int indentaton_level;
-extern SymbolTable *sym_table;
-
-static uint64_t get_call_target_addr(Decode *s) {
+uint64_t get_call_target_addr(SimContext *ctx, Decode *s) {
     uint32_t inst = s->inst;
     uint32_t opcode = inst & 0x7f;
 
@@ -128,31 +102,32 @@ static uint64_t get_call_target_addr(Decode *s) {
     else if (opcode == 0b1100111) {
         int rs1_idx = (inst >> 15) & 0x1f;
         int32_t imm_i = (int32_t)inst >> 20;
-        return cpu.reg[rs1_idx] + imm_i;
+        return ctx->cpu.reg[rs1_idx] + imm_i;
     }
 
     return 0;
 }
 
-void handle_ftrace(Decode *s) {
+void handle_ftrace(SimContext *ctx, Decode *s) {
+    SymbolTable *sym_table = &ctx->sym_table;
     if (is_call(s->inst)) {
-        uint64_t target_addr = get_call_target_addr(s);
+        uint64_t target_addr = get_call_target_addr(ctx, s);
         const FuncSymbol *func_symbol = find_func(sym_table, target_addr);
         const char *func_name = func_symbol ? func_symbol->name : "unknown_function";
         const uint64_t func_addr = func_symbol ? func_symbol->address : 0;
         printf("\33[1;34m0x%08lx\33[1;0m: ", s->pc);
-        for (int i = 0; i < indentaton_level; i++) {
+        for (int i = 0; i < ctx->indentation_level; i++) {
             printf("  ");
         }
         printf("call [%s@%08lx]\n", func_name, func_addr);
-        indentaton_level++;
+        ctx->indentation_level++;
     } else if (is_ret(s->inst)) {
-        indentaton_level--;
-        if (indentaton_level < 0) indentaton_level = 0;
+        ctx->indentation_level--;
+        if (ctx->indentation_level < 0) ctx->indentation_level = 0;
         const FuncSymbol *func_symbol = find_func(sym_table, s->pc);
         const char *func_name = func_symbol ? func_symbol->name : "unknown_function";
         printf("\33[1;34m0x%08lx\33[1;0m: ", s->pc);
-        for (int i = 0; i < indentaton_level; i++) {
+        for (int i = 0; i < ctx->indentation_level; i++) {
             printf("  ");
         }
         printf("ret  [%s]\n", func_name);
@@ -0,0 +1,38 @@
+#include <common.h>
+#include <pthread.h>
+#include <disasm.h>
+#include <history.h>
+#include <sim.h>
+
+extern LLVMDisasmContextRef disasm_ctx;
+
+static pthread_once_t disasm_once = PTHREAD_ONCE_INIT;
+
+// only needed when a run goes wrong or on request, --jobs may get there on
+// several threads at once
+static void start_disasm(void) {
+    if (!disasm_ctx) init_llvm_disassembler();
+}
+
+void hist_dump(SimContext *ctx, int n) {
+    const InstHistory *h = &ctx->hist;
+    if (n > HIST_SIZE) n = HIST_SIZE;
+    if ((uint64_t)n > h->n) n = h->n;
+    if (n <= 0) {
+        printf("No instruction ran yet.\n");
+        return;
+    }
+    pthread_once(&disasm_once, start_disasm);
+    // the dumps of several images share the disassembler and the output
+    flockfile(stdout);
+    printf("Last %d instructions:\n", n);
+    for (uint64_t k = h->n - n; k < h->n; k++) {
+        int i = k & (HIST_SIZE - 1);
+        const FuncSymbol *f = find_func(&ctx->sym_table, h->pc[i]);
+        char where[64] = "";
+        if (f) snprintf(where, sizeof(where), " <%s+%lu>", f->name, h->pc[i] - f->address);
+        printf("%s " ANSI_FMT("0x%016lx", ANSI_FG_BLUE) "%s: %08x          %s\n",
+               k + 1 == h->n ? "-->" : "   ", h->pc[i], where, h->inst[i], disasm_memo(h->pc[i], h->inst[i]));
+    }
+    funlockfile(stdout);
+}
@@ -0,0 +1,175 @@
+#include <common.h>
+#include <macro.h>
+#include <pattern.h>
+#include <cpu.h>
+#include <memory.h>
+#include <isa_table.h>
+#include <iss_core.h>
+#include <sim.h>
+#include "syscall.h"
+
+#define def_ISA_INFO(name, pattern, format, class, latency, regs, ...) \
+  [concat(OP_, name)] = { str(name), pattern, 0, 0, concat(TYPE_, format), \
+                          concat(CLASS_, class), latency, concat(REGS_, regs) },
+IsaInfo isa_info[OP_NUM] = { ISA_TABLE(def_ISA_INFO) };
+
+uint16_t isa_lut[1 << ISA_KEY_BITS];
+// Candidate lists, shared between all keys with the same candidates
+uint8_t isa_cand[1024];
+static int isa_cand_used = 0;
+
+// inst bits that make up the key
+#define ISA_KEY_MASK 0xfe00707cu
+
+static uint32_t key_to_inst(uint32_t key) {
+    return (BITS(key, 14, 10) << 2) | (BITS(key, 9, 7) << 12) | (BITS(key, 6, 0) << 25);
+}
+
+static uint16_t add_cand_list(const uint8_t *list, int n) {
+    for (int start = 0; start < isa_cand_used; ) {
+        int len = 1;
+        while (isa_cand[start + len - 1] != OP_unk) len++;
+        if (len == n && memcmp(&isa_cand[start], list, n) == 0) {
+            return start;
+        }
+        start += len;
+    }
+    check(isa_cand_used + n <= ARRLEN(isa_cand), "ISA decoder candidate table is full.");
+    memcpy(&isa_cand[isa_cand_used], list, n);
+    isa_cand_used += n;
+    return isa_cand_used - n;
+error:
+    exit(1);
+}
+
+void init_isa() {
+    if (isa_cand_used) return;
+    for (int op = 0; op < OP_NUM; op++) {
+        IsaInfo *info = &isa_info[op];
+        uint64_t key = 0, mask = 0, shift = 0;
+        pattern_decode(info->pattern, strlen(info->pattern), &key, &mask, &shift);
+        info->mask  = mask << shift;
+        info->match = key << shift;
+    }
+    // every key gets the instructions whose fixed bits agree with it
+    for (uint32_t key = 0; key < (1 << ISA_KEY_BITS); key++) {
+        uint32_t i = key_to_inst(key);
+        uint8_t list[OP_NUM];
+        int n = 0;
+        for (int op = 0; op < OP_NUM; op++) {
+            uint32_t m = isa_info[op].mask & ISA_KEY_MASK;
+            if ((i & m) == (isa_info[op].match & m)) {
+                list[n++] = op;
+            }
+            if (op == OP_unk) break;
+        }
+        isa_lut[key] = add_cand_list(list, n);
+    }
+}
+
+void isa_decode_inst(Decode *s) {
+    uint32_t i = s->inst;
+    const IsaInfo *info = &isa_info[isa_decode(i)];
+    s->op      = info - isa_info;
+    s->type    = info->type;
+    s->is_load = (info->cls == CLASS_LOAD || info->cls == CLASS_AMO);
+    s->rd      = BITS(i, 11,  7);
+    s->rs1     = BITS(i, 19, 15);
+    s->rs2     = BITS(i, 24, 20);
+    decode_imm(i, s->type, &s->imm);
+}
+
+// ------------ Semantics ------------
+
+// ISA_IF(class, group, ...) keeps the code if class belongs to group
+#define __CLS_ALU_ALU       X,
+#define __CLS_MUL_MUL       X,
+#define __CLS_DIV_DIV       X,
+#define __CLS_LOAD_LOAD     X,
+#define __CLS_STORE_STORE   X,
+#define __CLS_AMO_AMO       X,
+#define __CLS_CSR_CSR       X,
+#define __CLS_BRANCH_BRANCH X,
+#define __CLS_JUMP_JUMP     X,
+#define __CLS_ALU_VALUE     X,
+#define __CLS_MUL_VALUE     X,
+#define __CLS_DIV_VALUE     X,
+#define __CLS_SYSTEM_SYSTEM X,
+#define __CLS_FENCE_SYSTEM  X,
+#define __CLS_UNK_SYSTEM    X,
+#define ISA_IF(class, group, ...) \
+  MUX_WITH_COMMA(concat4(__CLS_, class, _, group), __KEEP, __IGNORE)(__VA_ARGS__)
+
+#define def_ALU(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, VALUE, case concat(OP_, name): return (__VA_ARGS__);)
+uint64_t isa_alu(const Decode *s, uint64_t src1, uint64_t src2) {
+    uint64_t imm = s->imm;
+    switch (s->op) {
+        ISA_TABLE(def_ALU)
+        default: return 0;
+    }
+}
+
+#define def_BRANCH(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, BRANCH, case concat(OP_, name): return (__VA_ARGS__);)
+int isa_branch_taken(const Decode *s, uint64_t src1, uint64_t src2) {
+    switch (s->op) {
+        ISA_TABLE(def_BRANCH)
+        default: return 0;
+    }
+}
+
+#define def_JUMP(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, JUMP, case concat(OP_, name): return (__VA_ARGS__);)
+uint64_t isa_jump_target(const Decode *s, uint64_t src1) {
+    uint64_t imm = s->imm;
+    switch (s->op) {
+        ISA_TABLE(def_JUMP)
+        default: return s->snpc;
+    }
+}
+
+#define def_LOAD(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, LOAD, case concat(OP_, name): return (__VA_ARGS__);)
+uint64_t isa_load(SimContext *ctx, const Decode *s, uint64_t addr) {
+    switch (s->op) {
+        ISA_TABLE(def_LOAD)
+        default: return 0;
+    }
+}
+
+#define def_STORE(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, STORE, case concat(OP_, name): __VA_ARGS__; break;)
+void isa_store(SimContext *ctx, const Decode *s, uint64_t addr, uint64_t src2) {
+    switch (s->op) {
+        ISA_TABLE(def_STORE)
+        default: break;
+    }
+}
+
+#define def_AMO(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, AMO, case concat(OP_, name): return (__VA_ARGS__);)
+uint64_t isa_amo(SimContext *ctx, const Decode *s, uint64_t addr, uint64_t src2) {
+    switch (s->op) {
+        ISA_TABLE(def_AMO)
+        default: return 0;
+    }
+}
+
+#define def_CSR(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, CSR, case concat(OP_, name): return (__VA_ARGS__);)
+uint64_t isa_csr(SimContext *ctx, const Decode *s, uint64_t src1) {
+    switch (s->op) {
+        ISA_TABLE(def_CSR)
+        default: return 0;
+    }
+}
+
+#define def_SYSTEM(name, pattern, format, class, latency, regs, ...) \
+  ISA_IF(class, SYSTEM, case concat(OP_, name): __VA_ARGS__; break;)
+void isa_system(SimContext *ctx, Decode *s) {
+    switch (s->op) {
+        ISA_TABLE(def_SYSTEM)
+        default: break;
+    }
+}
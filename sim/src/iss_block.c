@@ -0,0 +1,127 @@
+#include <common.h>
+#include <macro.h>
+#include <cpu.h>
+#include <memory.h>
+#include <sim.h>
+#include <iss_core.h>
+#include <iss_block.h>
+
+// Range of page offsets [lo, hi) covered by translated code, per guest page.
+// Stores outside of it (e.g. .data sharing a page with .text) are ignored.
+typedef struct {
+    uint16_t lo;
+    uint16_t hi;
+} CodeRange;
+
+typedef struct BlockCache {
+    TransBlock *tb_hash[TB_HASH_SIZE];
+    uint8_t *tb_arena;
+    size_t tb_arena_used;
+    CodeRange *code_range;  // one per page of guest RAM
+} BlockCache;
+
+#define TB_HASH(pc) (((pc) >> 2) & (TB_HASH_SIZE - 1))
+
+static void mark_code(SimContext *ctx, uint64_t start, uint64_t end) {
+    BlockCache *bc = ctx->bc;
+    while (start < end) {
+        uint64_t off = start - ctx->mem_base;
+        uint64_t page_end = ROUNDDOWN(start, 4096) + 4096;
+        uint64_t stop = end < page_end ? end : page_end;
+        if (off < ctx->mem_size) {
+            CodeRange *r = &bc->code_range[off >> 12];
+            uint16_t lo = off & 0xfff;
+            uint16_t hi = lo + (stop - start);
+            if (r->lo == r->hi) {
+                r->lo = lo;
+                r->hi = hi;
+            } else {
+                if (lo < r->lo) r->lo = lo;
+                if (hi > r->hi) r->hi = hi;
+            }
+        }
+        start = stop;
+    }
+}
+
+static TransBlock *tb_translate(SimContext *ctx, uint64_t pc) {
+    size_t max_size = sizeof(TransBlock) + TB_MAX_INSTS * sizeof(DecodedInst);
+    if (ctx->bc == NULL) {
+        ctx->bc = calloc(1, sizeof(BlockCache));
+        check_mem(ctx->bc);
+        ctx->bc->code_range = calloc(ctx->mem_size >> 12, sizeof(CodeRange));
+        check_mem(ctx->bc->code_range);
+    }
+    BlockCache *bc = ctx->bc;
+    if (bc->tb_arena == NULL) {
+        bc->tb_arena = malloc(TB_ARENA_SIZE);
+        check_mem(bc->tb_arena);
+    }
+    if (bc->tb_arena_used + max_size > TB_ARENA_SIZE) {
+        tb_flush(ctx);
+    }
+
+    TransBlock *tb = (TransBlock *)(bc->tb_arena + bc->tb_arena_used);
+    memset(tb, 0, sizeof(TransBlock));
+    tb->pc = pc;
+    int n = 0;
+    do {
+        tb->ops[n] = *decode_cache_lookup(ctx, pc + 4 * n);
+    } while (!tb->ops[n++].ends_block && n < TB_MAX_INSTS);
+    tb->ninst = n;
+    bc->tb_arena_used += ROUNDUP(sizeof(TransBlock) + n * sizeof(DecodedInst), 16);
+
+    int h = TB_HASH(pc);
+    tb->hnext = bc->tb_hash[h];
+    bc->tb_hash[h] = tb;
+    mark_code(ctx, pc, pc + 4 * n);
+    return tb;
+
+error:
+    exit(1);
+}
+
+TransBlock *tb_lookup(SimContext *ctx, uint64_t pc) {
+    if (ctx->bc != NULL) {
+        for (TransBlock *tb = ctx->bc->tb_hash[TB_HASH(pc)]; tb; tb = tb->hnext) {
+            if (tb->pc == pc) return tb;
+        }
+    }
+    return tb_translate(ctx, pc);
+}
+
+void tb_flush(SimContext *ctx) {
+    BlockCache *bc = ctx->bc;
+    if (bc != NULL) {
+        memset(bc->tb_hash, 0, sizeof(bc->tb_hash));
+        memset(bc->code_range, 0, (ctx->mem_size >> 12) * sizeof(CodeRange));
+        bc->tb_arena_used = 0;
+    }
+    ctx->tb_generation++;
+}
+
+void tb_free(SimContext *ctx) {
+    if (ctx->bc != NULL) {
+        free(ctx->bc->tb_arena);
+        free(ctx->bc->code_range);
+        free(ctx->bc);
+        ctx->bc = NULL;
+    }
+}
+
+// [off, last] must lie within one page
+static inline int overlaps_code(BlockCache *bc, uint64_t off, uint64_t last) {
+    CodeRange *r = &bc->code_range[off >> 12];
+    return (off & 0xfff) < r->hi && (last & 0xfff) >= r->lo;
+}
+
+void tb_invalidate(SimContext *ctx, uint64_t addr, int len) {
+    BlockCache *bc = ctx->bc;
+    uint64_t off = addr - ctx->mem_base, last = off + len - 1;
+    if (bc == NULL || off >= ctx->mem_size || last >= ctx->mem_size) return;
+    if ((off >> 12) == (last >> 12)) {
+        if (overlaps_code(bc, off, last)) tb_flush(ctx);
+    } else if (overlaps_code(bc, off, off | 0xfff) || overlaps_code(bc, last & ~0xfffull, last)) {
+        tb_flush(ctx);
+    }
+}
@@ -4,119 +4,137 @@
 #include <cpu.h>
 #include <memory.h>
 #include <isa_decode.h>
+#include <isa_table.h>
 #include <iss_core.h>
+#include <iss_block.h>
+#include <sim.h>
 #include "syscall.h"
 
-extern CPU_state cpu;
+// A faulting access must not write rd, the run loop takes the exception
+#define ISS_FAULTED if (unlikely(ctx->exc_pending)) return
 
-static void ecall_handler(Decode *s) {
-    cpu.csr[CSR_MEPC] = s->snpc;
-    cpu.csr[CSR_MCAUSE] = 8;
-    handle_syscall(s);
+// Execution of each class, operands come from the decode cache
+#define ISS_EXEC_ALU(...)    R(rd) = (__VA_ARGS__)
+#define ISS_EXEC_MUL         ISS_EXEC_ALU
+#define ISS_EXEC_DIV         ISS_EXEC_ALU
+#define ISS_EXEC_LOAD(...)   uint64_t addr = src1 + imm; uint64_t val = (__VA_ARGS__); ISS_FAULTED; R(rd) = val
+#define ISS_EXEC_STORE(...)  uint64_t addr = src1 + imm; __VA_ARGS__
+#define ISS_EXEC_AMO(...)    uint64_t addr = src1; uint64_t val = (__VA_ARGS__); ISS_FAULTED; R(rd) = val
+#define ISS_EXEC_CSR         ISS_EXEC_ALU
+#define ISS_EXEC_BRANCH(...) if (__VA_ARGS__) s->dnpc = s->pc + imm
+#define ISS_EXEC_JUMP(...)   uint64_t target = (__VA_ARGS__); R(rd) = s->pc + 4; s->dnpc = target
+#define ISS_EXEC_SYSTEM(...) __VA_ARGS__
+#define ISS_EXEC_FENCE       ISS_EXEC_SYSTEM
+#define ISS_EXEC_UNK         ISS_EXEC_SYSTEM
+
+// One execution handler per instruction
+#define def_EHelper(name, pattern, format, class, latency, regs, ... /* semantics */) \
+static void concat(exec_, name)(SimContext *ctx, Decode *s, const DecodedInst *d) { \
+  int rd = d->rd; \
+  uint64_t src1 = R(d->rs1), src2 = R(d->rs2), imm = d->imm; \
+  (void)rd; (void)src1; (void)src2; (void)imm; \
+  concat(ISS_EXEC_, class)(__VA_ARGS__); \
 }
+ISA_TABLE(def_EHelper)
 
-void decode_exec(Decode *s){
-    int rd = 0;
-    uint64_t src1 = 0, src2 = 0, imm = 0;
-    s->dnpc = s->snpc;
+#define def_EHelper_ptr(name, ...) [concat(OP_, name)] = concat(exec_, name),
+static const ExecHandler iss_handler[OP_NUM] = { ISA_TABLE(def_EHelper_ptr) };
+
+void iss_predecode(Decode *s, DecodedInst *d) {
+    uint32_t i = s->inst;
+    int op = isa_decode(i);
+    const IsaInfo *info = &isa_info[op];
 
-#define INSTPAT_INST(s) ((s)->inst)
-#define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-  __VA_ARGS__ ; \
+    d->pc      = s->pc;
+    d->inst    = i;
+    d->op      = op;
+    d->handler = iss_handler[op];
+    d->type    = info->type;
+    d->rd      = BITS(i, 11,  7);
+    d->rs1     = BITS(i, 19, 15);
+    d->rs2     = BITS(i, 24, 20);
+    decode_imm(i, d->type, &d->imm);
+
+    d->is_store = (info->cls == CLASS_STORE || info->cls == CLASS_AMO);
+    d->is_csr   = info->cls == CLASS_CSR;
+    d->ends_block = info->cls == CLASS_JUMP || info->cls == CLASS_BRANCH ||
+                    info->cls == CLASS_SYSTEM || info->cls == CLASS_UNK ||
+                    op == OP_fencei;
 }
-    INSTPAT_START();
-    //RV64I
-    INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui, U, R(rd) = imm);
-    INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
-    INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s->pc + 4, s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, R(rd) = s->pc + 4, s->dnpc = (src1 + imm) & ~1);
-    // BEQ, BNE, BLT, BGE, BLTU, BGEU
-    INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B, if (src1 == src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B, if (src1 != src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B, if ((int64_t)src1 < (int64_t)src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B, if ((int64_t)src1 >= (int64_t)src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B, if (src1 < src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B, if (src1 >= src2) s->dnpc = s->pc + imm);
-    // LB, LH, LW, LBU, LHU, LWU, LD
-    INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb     , I, R(rd) = SEXT(Mr(src1 + imm, 1), 8));
-    INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh     , I, R(rd) = SEXT(Mr(src1 + imm, 2), 16));
-    INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw     , I, R(rd) = SEXT(Mr(src1 + imm, 4), 32));
-    INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = Mr(src1 + imm, 1));
-    INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu    , I, R(rd) = Mr(src1 + imm, 2));
-    INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu    , I, R(rd) = Mr(src1 + imm, 4));
-    INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld     , I, R(rd) = Mr(src1 + imm, 8));
-    // SB, SH, SW
-    INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(src1 + imm, 1, src2));
-    INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh     , S, Mw(src1 + imm, 2, src2));
-    INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw     , S, Mw(src1 + imm, 4, src2));
-    INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd     , S, Mw(src1 + imm, 8, src2));
-    INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, R(rd) = src1 + imm);
-    // SLTI, SLTIU
-    INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, R(rd) = (int64_t)src1 < (int64_t)imm);
-    INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, R(rd) = src1 < imm);
-    // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-    INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli   , I, R(rd) = src1 << (imm & 0x3f));
-    INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli   , I, R(rd) = src1 >> (imm & 0x3f));
-    INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai   , I, R(rd) = (int64_t)src1 >> (imm & 0x3f));
-    INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw  , I, R(rd) = SEXT((uint32_t)src1 << (imm & 0x1f), 32));
-    INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw  , I, R(rd) = SEXT((uint32_t)src1 >> (imm & 0x1f), 32));
-    INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw  , I, R(rd) = SEXT((int32_t)src1 >> (imm & 0x1f), 32));
-    // XORI, ORI, ANDI, ADDIW
-    INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, R(rd) = src1 ^ imm);
-    INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, R(rd) = src1 | imm);
-    INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, R(rd) = src1 & imm);
-    INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw  , I, R(rd) = SEXT((int32_t)src1 + (int32_t)imm, 32));
-    // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-    INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R, R(rd) = src1 + src2);
-    INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R, R(rd) = src1 - src2);
-    INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll    , R, R(rd) = src1 << (src2 & 0x3f));
-    INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, R(rd) = (int64_t)src1 < (int64_t)src2);
-    INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu   , R, R(rd) = src1 < src2);
-    INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor    , R, R(rd) = src1 ^ src2);
-    INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl    , R, R(rd) = src1 >> (src2 & 0x3f));
-    INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra    , R, R(rd) = (int64_t)src1 >> (src2 & 0x3f));
-    INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or     , R, R(rd) = src1 | src2);
-    INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and    , R, R(rd) = src1 & src2);
-    // ADDW, SUBW, SLLW, SRLW, SRAW
-    INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw   , R, R(rd) = SEXT((uint32_t)src1 + (uint32_t)src2, 32));
-    INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw   , R, R(rd) = SEXT((uint32_t)src1 - (uint32_t)src2, 32));
-    INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw   , R, R(rd) = SEXT((uint32_t)src1 << (src2 & 0x1f), 32));
-    INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw   , R, R(rd) = SEXT((uint32_t)src1 >> (src2 & 0x1f), 32));
-    INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw   , R, R(rd) = SEXT((int32_t)src1 >> (src2 & 0x1f), 32));
-    // FENCE, FENCE.I
-    INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence  , N, NOP);
-    INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei , N, NOP);
-    INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, HALT(s->pc, R(10))); // R(10) is $a0
-
-    // Related to System Calls
-    // ECALL
-    INSTPAT("0000000 00000 00000 000 00000 11100 11", ecall  , N, ecall_handler(s));
-    // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
-
-    // RV64M
-    // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-    INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul    , R, R(rd) = src1 * src2);
-    INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh   , R, R(rd) = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(int64_t)src2 >> 64));
-    INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R, R(rd) = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(uint64_t)src2 >> 64));
-    INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R, R(rd) = (uint64_t)((__uint128_t)(uint64_t)src1 * (__uint128_t)(uint64_t)src2 >> 64));
-    INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div    , R, if (src2 == 0) R(rd) = -1; else R(rd) = (int64_t)src1 / (int64_t)src2);
-    INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu   , R, if (src2 == 0) R(rd) = -1; else R(rd) = src1 / src2);
-    INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem    , R, if (src2 == 0) R(rd) = src1; else R(rd) = (int64_t)src1 % (int64_t)src2);
-    INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R, if (src2 == 0) R(rd) = src1; else R(rd) = src1 % src2);
-
-    // MULW, DIVW, DIVUW, REMW, REMUW
-    INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw   , R, R(rd) = SEXT((int32_t)src1 * (int32_t)src2, 32));
-    INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw   , R, if (src2 == 0) R(rd) = -1; else R(rd) = SEXT((int32_t)(int64_t)src1 / (int32_t)(int64_t)src2, 32));
-    INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw  , R, if (src2 == 0) R(rd) = -1; else R(rd) = SEXT((uint32_t)(uint64_t)src1 / (uint32_t)(uint64_t)src2, 32));
-    INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw   , R, if (src2 == 0) R(rd) = SEXT((uint32_t)src1, 32); else R(rd) = SEXT((int32_t)(int64_t)src1 % (int32_t)(int64_t)src2, 32));
-    INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw  , R, if (src2 == 0) R(rd) = SEXT((uint32_t)src1, 32); else R(rd) = SEXT((uint32_t)(uint64_t)src1 % (uint32_t)(uint64_t)src2, 32));
-
-    //Invalid Opcode
-    INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk    , N, printf(ANSI_FMT("Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1));
-    INSTPAT_END();
+
+void decode_exec(SimContext *ctx, Decode *s){
+    DecodedInst d;
+    s->dnpc = s->snpc;
+    iss_predecode(s, &d);
+    s->type = d.type;
+    d.handler(ctx, s, &d);
 
     R(0) = 0;
 
     return;
 }
+
+// ------------ Decode Cache ------------
+
+int decode_cache_init(SimContext *ctx) {
+    ctx->dc = calloc(1, sizeof(DecodeCache));
+    check_mem(ctx->dc);
+    ctx->dc->code_page = calloc(ctx->mem_size >> 12, 1);
+    check_mem(ctx->dc->code_page);
+    return 0;
+error:
+    decode_cache_free(ctx);
+    return -1;
+}
+
+void decode_cache_free(SimContext *ctx) {
+    if (ctx->dc != NULL) {
+        free(ctx->dc->code_page);
+        free(ctx->dc);
+        ctx->dc = NULL;
+    }
+}
+
+// Stands in for an instruction outside of RAM. Blocks may be translated
+// past the end of the code, so the fault is only raised when it runs.
+static void exec_fetch_fault(SimContext *ctx, Decode *s, const DecodedInst *d) {
+    raise_exception(ctx, EXC_INST_ACCESS, s->pc);
+}
+
+DecodedInst *decode_cache_fill(SimContext *ctx, uint64_t pc) {
+    DecodedInst *d = &ctx->dc->entry[DC_INDEX(pc)];
+    Decode s;
+    s.pc = pc;
+    if (unlikely(!mem_in_ram(ctx, pc, 4))) {
+        s.inst = 0;
+        iss_predecode(&s, d);
+        d->handler = exec_fetch_fault;
+        return d;
+    }
+    s.inst = inst_fetch(ctx, pc);
+    iss_predecode(&s, d);
+    ctx->dc->code_page[(pc - ctx->mem_base) >> 12] = 1;
+    return d;
+}
+
+void decode_cache_flush(SimContext *ctx) {
+    memset(ctx->dc->entry, 0, sizeof(ctx->dc->entry));
+    memset(ctx->dc->code_page, 0, ctx->mem_size >> 12);
+    tb_flush(ctx);
+}
+
+void decode_cache_invalidate(SimContext *ctx, uint64_t addr, int len) {
+    DecodeCache *dc = ctx->dc;
+    uint64_t lo = addr - ctx->mem_base, hi = lo + len - 1;
+    if (hi >= ctx->mem_size) hi = lo;
+    if (likely(!dc->code_page[lo >> 12] && !dc->code_page[hi >> 12])) {
+        return;
+    }
+    for (uint64_t pc = addr & ~3ull; pc < addr + len; pc += 4) {
+        DecodedInst *d = &dc->entry[DC_INDEX(pc)];
+        if (d->pc == pc) {
+            d->handler = NULL;
+        }
+    }
+    tb_invalidate(ctx, addr, len);
+}
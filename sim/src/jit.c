@@ -0,0 +1,548 @@
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Transforms/InstCombine.h>
+#include <llvm-c/Transforms/Scalar.h>
+#include <llvm-c/Transforms/Utils.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <common.h>
+#include <macro.h>
+#include <cpu.h>
+#include <memory.h>
+#include <sim.h>
+#include <jit.h>
+
+// One JIT serves every SimContext. Code generation shares one LLVMContext,
+// so compiling is serialized; running compiled code is not.
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static LLVMOrcLLJITRef jit = NULL;
+static LLVMOrcThreadSafeContextRef jit_tsc = NULL;
+static unsigned jit_nfunc = 0;
+
+// Per-block code generation state
+typedef struct {
+    LLVMContextRef ctx;
+    LLVMModuleRef mod;
+    LLVMBuilderRef b;
+    LLVMValueRef fn;
+    LLVMTypeRef i8, i32, i64, i128;
+    LLVMValueRef sim;        // SimContext *ctx argument
+    LLVMValueRef regs;       // &ctx->cpu.reg[0]
+    LLVMValueRef slot[32];   // one alloca per guest register, promoted later
+    uint32_t written;        // registers to write back on exit
+    LLVMValueRef gen;        // tb_generation on entry
+} JitEmitter;
+
+static void jit_report(LLVMErrorRef err, const char *what) {
+    char *msg = LLVMGetErrorMessage(err);
+    log_err("JIT %s failed: %s", what, msg);
+    LLVMDisposeErrorMessage(msg);
+}
+
+void init_jit() {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+    LLVMErrorRef err = LLVMOrcCreateLLJIT(&jit, NULL);
+    if (err) {
+        jit_report(err, "initialization");
+        exit(1);
+    }
+    jit_tsc = LLVMOrcCreateNewThreadSafeContext();
+}
+
+// ------------ IR helpers ------------
+
+static LLVMValueRef c64(JitEmitter *e, uint64_t v) {
+    return LLVMConstInt(e->i64, v, 0);
+}
+
+// Host function baked into the IR as an absolute address
+static LLVMValueRef host_ptr(JitEmitter *e, void *p, LLVMTypeRef ty) {
+    return LLVMConstIntToPtr(c64(e, (uintptr_t)p), LLVMPointerType(ty, 0));
+}
+
+// Pointer to the SimContext field at offset off
+static LLVMValueRef ctx_field(JitEmitter *e, size_t off, LLVMTypeRef ty) {
+    LLVMValueRef p = LLVMBuildInBoundsGEP2(e->b, e->i8, e->sim, (LLVMValueRef[]){ c64(e, off) }, 1, "");
+    return LLVMBuildBitCast(e->b, p, LLVMPointerType(ty, 0), "");
+}
+
+static LLVMValueRef get_reg(JitEmitter *e, int r) {
+    if (r == 0) return c64(e, 0);
+    return LLVMBuildLoad2(e->b, e->i64, e->slot[r], "");
+}
+
+static void set_reg(JitEmitter *e, int r, LLVMValueRef v) {
+    if (r == 0) return;
+    LLVMBuildStore(e->b, v, e->slot[r]);
+    e->written |= 1u << r;
+}
+
+static LLVMValueRef sext32(JitEmitter *e, LLVMValueRef v) {
+    if (LLVMTypeOf(v) != e->i32) v = LLVMBuildTrunc(e->b, v, e->i32, "");
+    return LLVMBuildSExt(e->b, v, e->i64, "");
+}
+
+static LLVMValueRef lo32(JitEmitter *e, LLVMValueRef v) {
+    return LLVMBuildTrunc(e->b, v, e->i32, "");
+}
+
+// Write back the dirty registers and leave the block at next_pc
+static void emit_exit(JitEmitter *e, LLVMValueRef next_pc) {
+    for (int r = 1; r < 32; r++) {
+        if (e->written & (1u << r)) {
+            LLVMValueRef p = LLVMBuildInBoundsGEP2(e->b, e->i64, e->regs, (LLVMValueRef[]){ c64(e, r) }, 1, "");
+            LLVMBuildStore(e->b, LLVMBuildLoad2(e->b, e->i64, e->slot[r], ""), p);
+        }
+    }
+    LLVMBuildRet(e->b, next_pc);
+}
+
+// Leave the block at pc, without running it, if the access just made faulted
+static void emit_fault_check(JitEmitter *e, uint64_t pc) {
+    LLVMValueRef exc = LLVMBuildLoad2(e->b, e->i32, ctx_field(e, offsetof(SimContext, exc_pending), e->i32), "");
+    LLVMBasicBlockRef out = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "fault");
+    LLVMBasicBlockRef cont = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "");
+    LLVMBuildCondBr(e->b, LLVMBuildICmp(e->b, LLVMIntNE, exc, LLVMConstInt(e->i32, 0, 0), ""), out, cont);
+    LLVMPositionBuilderAtEnd(e->b, out);
+    emit_exit(e, c64(e, pc));
+    LLVMPositionBuilderAtEnd(e->b, cont);
+}
+
+// RAM is accessed inline, anything else goes through mem_read_slow() so
+// that devices and access faults behave the same as in the interpreter.
+static LLVMValueRef emit_load(JitEmitter *e, LLVMValueRef addr, int len, int is_signed, uint64_t pc) {
+    LLVMTypeRef ty = LLVMIntTypeInContext(e->ctx, len * 8);
+    LLVMValueRef mem_base = LLVMBuildLoad2(e->b, e->i64, ctx_field(e, offsetof(SimContext, mem_base), e->i64), "");
+    LLVMValueRef mem_size = LLVMBuildLoad2(e->b, e->i64, ctx_field(e, offsetof(SimContext, mem_size), e->i64), "");
+    LLVMValueRef off = LLVMBuildSub(e->b, addr, mem_base, "");
+    LLVMValueRef in_ram = LLVMBuildICmp(e->b, LLVMIntULT, off, LLVMBuildSub(e->b, mem_size, c64(e, len - 1), ""), "");
+    LLVMBasicBlockRef fast = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "ram");
+    LLVMBasicBlockRef slow = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "slow");
+    LLVMBasicBlockRef join = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "");
+    LLVMBuildCondBr(e->b, in_ram, fast, slow);
+
+    LLVMPositionBuilderAtEnd(e->b, fast);
+    LLVMTypeRef i8p = LLVMPointerType(e->i8, 0);
+    LLVMValueRef base = LLVMBuildLoad2(e->b, i8p, ctx_field(e, offsetof(SimContext, mem), i8p), "");
+    LLVMValueRef p = LLVMBuildInBoundsGEP2(e->b, e->i8, base, &off, 1, "");
+    p = LLVMBuildBitCast(e->b, p, LLVMPointerType(ty, 0), "");
+    LLVMValueRef v = LLVMBuildLoad2(e->b, ty, p, "");
+    LLVMSetAlignment(v, 1);
+    LLVMValueRef fast_v = LLVMBuildZExt(e->b, v, e->i64, "");
+    LLVMBuildBr(e->b, join);
+
+    LLVMPositionBuilderAtEnd(e->b, slow);
+    LLVMTypeRef rd_ty = LLVMFunctionType(e->i64, (LLVMTypeRef[]){ i8p, e->i64, e->i32 }, 3, 0);
+    LLVMValueRef slow_v = LLVMBuildCall2(e->b, rd_ty, host_ptr(e, mem_read_slow, rd_ty),
+                                         (LLVMValueRef[]){ e->sim, addr, LLVMConstInt(e->i32, len, 0) }, 3, "");
+    emit_fault_check(e, pc);
+    slow = LLVMGetInsertBlock(e->b);
+    LLVMBuildBr(e->b, join);
+
+    LLVMPositionBuilderAtEnd(e->b, join);
+    LLVMValueRef phi = LLVMBuildPhi(e->b, e->i64, "");
+    LLVMAddIncoming(phi, (LLVMValueRef[]){ fast_v, slow_v }, (LLVMBasicBlockRef[]){ fast, slow }, 2);
+    if (is_signed && len < 8) {
+        return LLVMBuildSExt(e->b, LLVMBuildTrunc(e->b, phi, ty, ""), e->i64, "");
+    }
+    return phi;
+}
+
+// Stores always call mem_write_slow(), which keeps the code caches coherent.
+// If the store hit translated code the block leaves right after it.
+static void emit_store(JitEmitter *e, LLVMValueRef addr, int len, LLVMValueRef data, uint64_t pc) {
+    LLVMTypeRef i8p = LLVMPointerType(e->i8, 0);
+    LLVMTypeRef wr_ty = LLVMFunctionType(LLVMVoidTypeInContext(e->ctx), (LLVMTypeRef[]){ i8p, e->i64, e->i32, e->i64 }, 4, 0);
+    LLVMBuildCall2(e->b, wr_ty, host_ptr(e, mem_write_slow, wr_ty),
+                   (LLVMValueRef[]){ e->sim, addr, LLVMConstInt(e->i32, len, 0), data }, 4, "");
+    emit_fault_check(e, pc);
+    LLVMValueRef gen = LLVMBuildLoad2(e->b, e->i64, ctx_field(e, offsetof(SimContext, tb_generation), e->i64), "");
+    LLVMValueRef stale = LLVMBuildICmp(e->b, LLVMIntNE, gen, e->gen, "");
+    LLVMBasicBlockRef out = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "smc");
+    LLVMBasicBlockRef cont = LLVMAppendBasicBlockInContext(e->ctx, e->fn, "");
+    LLVMBuildCondBr(e->b, stale, out, cont);
+    LLVMPositionBuilderAtEnd(e->b, out);
+    emit_exit(e, c64(e, pc + 4));
+    LLVMPositionBuilderAtEnd(e->b, cont);
+}
+
+// RISC-V division never traps: x/0 = -1, x%0 = x, and the signed overflow
+// case gives the dividend (quotient) or 0 (remainder).
+static LLVMValueRef emit_div(JitEmitter *e, LLVMValueRef a, LLVMValueRef b, int is_signed, int is_rem) {
+    LLVMTypeRef ty = LLVMTypeOf(a);
+    LLVMValueRef zero = LLVMBuildICmp(e->b, LLVMIntEQ, b, LLVMConstInt(ty, 0, 0), "");
+    LLVMValueRef bad = zero;
+    if (is_signed) {
+        LLVMValueRef min = LLVMBuildICmp(e->b, LLVMIntEQ, a, LLVMConstInt(ty, 1ull << (LLVMGetIntTypeWidth(ty) - 1), 0), "");
+        LLVMValueRef neg1 = LLVMBuildICmp(e->b, LLVMIntEQ, b, LLVMConstAllOnes(ty), "");
+        bad = LLVMBuildOr(e->b, zero, LLVMBuildAnd(e->b, min, neg1, ""), "");
+    }
+    // dividing by 1 instead already gives the overflow results
+    LLVMValueRef safe = LLVMBuildSelect(e->b, bad, LLVMConstInt(ty, 1, 0), b, "");
+    LLVMValueRef q;
+    if (is_rem) {
+        q = is_signed ? LLVMBuildSRem(e->b, a, safe, "") : LLVMBuildURem(e->b, a, safe, "");
+        return LLVMBuildSelect(e->b, zero, a, q, "");
+    }
+    q = is_signed ? LLVMBuildSDiv(e->b, a, safe, "") : LLVMBuildUDiv(e->b, a, safe, "");
+    return LLVMBuildSelect(e->b, zero, LLVMConstAllOnes(ty), q, "");
+}
+
+static LLVMValueRef emit_mulh(JitEmitter *e, LLVMValueRef a, LLVMValueRef b, int a_signed, int b_signed) {
+    a = a_signed ? LLVMBuildSExt(e->b, a, e->i128, "") : LLVMBuildZExt(e->b, a, e->i128, "");
+    b = b_signed ? LLVMBuildSExt(e->b, b, e->i128, "") : LLVMBuildZExt(e->b, b, e->i128, "");
+    LLVMValueRef p = LLVMBuildMul(e->b, a, b, "");
+    p = LLVMBuildLShr(e->b, p, LLVMConstInt(e->i128, 64, 0), "");
+    return LLVMBuildTrunc(e->b, p, e->i64, "");
+}
+
+// Lower a register-register (or register-immediate) ALU operation, 0 if the
+// encoding is not one the interpreter knows either.
+static LLVMValueRef emit_alu(JitEmitter *e, uint32_t f3, uint32_t f7, LLVMValueRef a, LLVMValueRef b) {
+    LLVMBuilderRef B = e->b;
+    LLVMValueRef sh = LLVMBuildAnd(B, b, c64(e, 0x3f), "");
+    switch (f7) {
+    case 0x00:
+        switch (f3) {
+        case 0: return LLVMBuildAdd(B, a, b, "");
+        case 1: return LLVMBuildShl(B, a, sh, "");
+        case 2: return LLVMBuildZExt(B, LLVMBuildICmp(B, LLVMIntSLT, a, b, ""), e->i64, "");
+        case 3: return LLVMBuildZExt(B, LLVMBuildICmp(B, LLVMIntULT, a, b, ""), e->i64, "");
+        case 4: return LLVMBuildXor(B, a, b, "");
+        case 5: return LLVMBuildLShr(B, a, sh, "");
+        case 6: return LLVMBuildOr(B, a, b, "");
+        case 7: return LLVMBuildAnd(B, a, b, "");
+        }
+        break;
+    case 0x20:
+        if (f3 == 0) return LLVMBuildSub(B, a, b, "");
+        if (f3 == 5) return LLVMBuildAShr(B, a, sh, "");
+        break;
+    case 0x01:
+        switch (f3) {
+        case 0: return LLVMBuildMul(B, a, b, "");
+        case 1: return emit_mulh(e, a, b, 1, 1);
+        case 2: return emit_mulh(e, a, b, 1, 0);
+        case 3: return emit_mulh(e, a, b, 0, 0);
+        case 4: return emit_div(e, a, b, 1, 0);
+        case 5: return emit_div(e, a, b, 0, 0);
+        case 6: return emit_div(e, a, b, 1, 1);
+        case 7: return emit_div(e, a, b, 0, 1);
+        }
+        break;
+    }
+    return NULL;
+}
+
+// Same for the 32-bit *W operations, the result is sign-extended
+static LLVMValueRef emit_alu32(JitEmitter *e, uint32_t f3, uint32_t f7, LLVMValueRef a, LLVMValueRef b) {
+    LLVMBuilderRef B = e->b;
+    LLVMValueRef a32 = lo32(e, a), b32 = lo32(e, b);
+    LLVMValueRef sh = LLVMBuildAnd(B, b32, LLVMConstInt(e->i32, 0x1f, 0), "");
+    LLVMValueRef r = NULL;
+    switch (f7) {
+    case 0x00:
+        if (f3 == 0) r = LLVMBuildAdd(B, a32, b32, "");
+        if (f3 == 1) r = LLVMBuildShl(B, a32, sh, "");
+        if (f3 == 5) r = LLVMBuildLShr(B, a32, sh, "");
+        break;
+    case 0x20:
+        if (f3 == 0) r = LLVMBuildSub(B, a32, b32, "");
+        if (f3 == 5) r = LLVMBuildAShr(B, a32, sh, "");
+        break;
+    case 0x01:
+        if (f3 == 0) r = LLVMBuildMul(B, a32, b32, "");
+        if (f3 == 4) r = emit_div(e, a32, b32, 1, 0);
+        if (f3 == 5) r = emit_div(e, a32, b32, 0, 0);
+        if (f3 == 6) r = emit_div(e, a32, b32, 1, 1);
+        if (f3 == 7) r = emit_div(e, a32, b32, 0, 1);
+        break;
+    }
+    return r ? sext32(e, r) : NULL;
+}
+
+// Emit one instruction. Returns 1 when it ended the block (the exit is
+// already emitted), 0 to go on, -1 if it can not be compiled.
+static int emit_inst(JitEmitter *e, const DecodedInst *d) {
+    LLVMBuilderRef B = e->b;
+    uint32_t i = d->inst;
+    uint32_t opcode = BITS(i, 6, 0), f3 = BITS(i, 14, 12), f7 = BITS(i, 31, 25);
+    uint64_t pc = d->pc;
+    LLVMValueRef imm = c64(e, d->imm), v;
+
+    switch (opcode) {
+    case 0b0110111: // lui
+        set_reg(e, d->rd, imm);
+        return 0;
+    case 0b0010111: // auipc
+        set_reg(e, d->rd, c64(e, pc + d->imm));
+        return 0;
+    case 0b1101111: // jal
+        set_reg(e, d->rd, c64(e, pc + 4));
+        emit_exit(e, c64(e, pc + d->imm));
+        return 1;
+    case 0b1100111: // jalr
+        if (f3 != 0) return -1;
+        v = LLVMBuildAnd(B, LLVMBuildAdd(B, get_reg(e, d->rs1), imm, ""), c64(e, ~1ull), "");
+        set_reg(e, d->rd, c64(e, pc + 4));
+        emit_exit(e, v);
+        return 1;
+    case 0b1100011: { // branches
+        static const LLVMIntPredicate pred[8] = {
+            [0] = LLVMIntEQ, [1] = LLVMIntNE, [4] = LLVMIntSLT,
+            [5] = LLVMIntSGE, [6] = LLVMIntULT, [7] = LLVMIntUGE,
+        };
+        if (f3 == 2 || f3 == 3) return -1;
+        LLVMValueRef taken = LLVMBuildICmp(B, pred[f3], get_reg(e, d->rs1), get_reg(e, d->rs2), "");
+        emit_exit(e, LLVMBuildSelect(B, taken, c64(e, pc + d->imm), c64(e, pc + 4), ""));
+        return 1;
+    }
+    case 0b0000011: { // loads
+        static const int len[8] = { 1, 2, 4, 8, 1, 2, 4, 0 };
+        if (f3 == 7) return -1;
+        LLVMValueRef addr = LLVMBuildAdd(B, get_reg(e, d->rs1), imm, "");
+        set_reg(e, d->rd, emit_load(e, addr, len[f3], f3 < 3, pc));
+        return 0;
+    }
+    case 0b0100011: // stores
+        if (f3 > 3) return -1;
+        emit_store(e, LLVMBuildAdd(B, get_reg(e, d->rs1), imm, ""), 1 << f3, get_reg(e, d->rs2), pc);
+        return 0;
+    case 0b0010011: { // OP-IMM
+        uint32_t f6 = BITS(i, 31, 26);
+        if (f3 == 1) {
+            if (f6 != 0) return -1;
+            f7 = 0;
+        } else if (f3 == 5) {
+            if (f6 != 0 && f6 != 0x10) return -1;
+            f7 = f6 << 1;
+        } else {
+            f7 = 0;
+        }
+        set_reg(e, d->rd, emit_alu(e, f3, f7, get_reg(e, d->rs1), imm));
+        return 0;
+    }
+    case 0b0011011: // OP-IMM-32
+        if (f3 == 0) {
+            f7 = 0;
+        } else if (f3 == 1 ? f7 != 0 : f3 != 5 || (f7 != 0 && f7 != 0x20)) {
+            return -1;
+        }
+        set_reg(e, d->rd, emit_alu32(e, f3, f7, get_reg(e, d->rs1), imm));
+        return 0;
+    case 0b0110011: // OP
+        v = emit_alu(e, f3, f7, get_reg(e, d->rs1), get_reg(e, d->rs2));
+        if (!v) return -1;
+        set_reg(e, d->rd, v);
+        return 0;
+    case 0b0111011: // OP-32
+        v = emit_alu32(e, f3, f7, get_reg(e, d->rs1), get_reg(e, d->rs2));
+        if (!v) return -1;
+        set_reg(e, d->rd, v);
+        return 0;
+    case 0b0001111: // fence is a nop, fence.i stays with the interpreter
+        if ((i & 0xf00fffff) == 0x0000000f) return 0;
+        return -1;
+    }
+    // ecall, ebreak and unknown instructions
+    return -1;
+}
+
+// ------------ Compilation ------------
+
+static void jit_optimize(LLVMModuleRef mod, LLVMValueRef fn) {
+    LLVMPassManagerRef fpm = LLVMCreateFunctionPassManagerForModule(mod);
+    LLVMAddPromoteMemoryToRegisterPass(fpm);
+    LLVMAddInstructionCombiningPass(fpm);
+    LLVMAddGVNPass(fpm);
+    LLVMAddCFGSimplificationPass(fpm);
+    LLVMInitializeFunctionPassManager(fpm);
+    LLVMRunFunctionPassManager(fpm, fn);
+    LLVMFinalizeFunctionPassManager(fpm);
+    LLVMDisposePassManager(fpm);
+}
+
+// Drop the native code of ctx's blocks
+static void jit_remove_tracker(SimContext *ctx) {
+    LLVMOrcResourceTrackerRef rt = ctx->jit_rt;
+    LLVMErrorRef err = LLVMOrcResourceTrackerRemove(rt);
+    if (err) jit_report(err, "removing code");
+    LLVMOrcReleaseResourceTracker(rt);
+    ctx->jit_rt = NULL;
+}
+
+// Every block compiled in one flush generation goes into one tracker, so the
+// code of a whole generation is removed at once. That happens here and not
+// in tb_flush(): a store from compiled code flushes while it still runs.
+static LLVMOrcResourceTrackerRef jit_tracker(SimContext *ctx) {
+    if (ctx->jit_rt != NULL && ctx->jit_rt_gen != ctx->tb_generation) {
+        jit_remove_tracker(ctx);
+    }
+    if (ctx->jit_rt == NULL) {
+        ctx->jit_rt = LLVMOrcJITDylibCreateResourceTracker(LLVMOrcLLJITGetMainJITDylib(jit));
+        ctx->jit_rt_gen = ctx->tb_generation;
+    }
+    return ctx->jit_rt;
+}
+
+// Lower tb to LLVM IR and compile it. Returns NULL if the block holds an
+// instruction only the interpreter can run (ecall, ebreak, fence.i, ...).
+static void *jit_compile_locked(SimContext *ctx, TransBlock *tb) {
+    if (jit == NULL) init_jit();
+
+    JitEmitter e = {};
+    e.ctx  = LLVMOrcThreadSafeContextGetContext(jit_tsc);
+    e.i8   = LLVMInt8TypeInContext(e.ctx);
+    e.i32  = LLVMInt32TypeInContext(e.ctx);
+    e.i64  = LLVMInt64TypeInContext(e.ctx);
+    e.i128 = LLVMInt128TypeInContext(e.ctx);
+
+    char name[64];
+    sprintf(name, "tb_%lx_%u", tb->pc, jit_nfunc++);
+    e.mod = LLVMModuleCreateWithNameInContext(name, e.ctx);
+    LLVMSetTarget(e.mod, LLVMOrcLLJITGetTripleString(jit));
+    LLVMSetDataLayout(e.mod, LLVMOrcLLJITGetDataLayoutStr(jit));
+
+    LLVMTypeRef fn_ty = LLVMFunctionType(e.i64, (LLVMTypeRef[]){ LLVMPointerType(e.i8, 0) }, 1, 0);
+    e.fn = LLVMAddFunction(e.mod, name, fn_ty);
+    e.sim = LLVMGetParam(e.fn, 0);
+    e.b = LLVMCreateBuilderInContext(e.ctx);
+    LLVMPositionBuilderAtEnd(e.b, LLVMAppendBasicBlockInContext(e.ctx, e.fn, "entry"));
+    e.regs = ctx_field(&e, offsetof(SimContext, cpu.reg), e.i64);
+
+    // Registers live in allocas for the whole block, mem2reg turns them
+    // into SSA values.
+    uint32_t used = 0;
+    for (int k = 0; k < tb->ninst; k++) {
+        used |= (1u << tb->ops[k].rd) | (1u << tb->ops[k].rs1) | (1u << tb->ops[k].rs2);
+    }
+    for (int r = 1; r < 32; r++) {
+        if (!(used & (1u << r))) continue;
+        e.slot[r] = LLVMBuildAlloca(e.b, e.i64, "");
+        LLVMValueRef p = LLVMBuildInBoundsGEP2(e.b, e.i64, e.regs, (LLVMValueRef[]){ c64(&e, r) }, 1, "");
+        LLVMBuildStore(e.b, LLVMBuildLoad2(e.b, e.i64, p, ""), e.slot[r]);
+    }
+    e.gen = LLVMBuildLoad2(e.b, e.i64, ctx_field(&e, offsetof(SimContext, tb_generation), e.i64), "");
+
+    int ret = 0;
+    for (int k = 0; k < tb->ninst && ret == 0; k++) {
+        ret = emit_inst(&e, &tb->ops[k]);
+    }
+    if (ret == 0) {
+        // block cut at TB_MAX_INSTS
+        emit_exit(&e, c64(&e, tb->pc + 4 * tb->ninst));
+    }
+    LLVMDisposeBuilder(e.b);
+    if (ret < 0) {
+        LLVMDisposeModule(e.mod);
+        return NULL;
+    }
+
+    char *msg = NULL;
+    if (LLVMVerifyModule(e.mod, LLVMReturnStatusAction, &msg)) {
+        log_err("JIT produced broken IR for block %lx: %s", tb->pc, msg);
+        LLVMDisposeMessage(msg);
+        LLVMDisposeModule(e.mod);
+        return NULL;
+    }
+    LLVMDisposeMessage(msg);
+    jit_optimize(e.mod, e.fn);
+
+    // The module is only compiled when its symbol is looked up
+    LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(e.mod, jit_tsc);
+    LLVMErrorRef err = LLVMOrcLLJITAddLLVMIRModuleWithRT(jit, jit_tracker(ctx), tsm);
+    if (err) {
+        jit_report(err, "adding module");
+        LLVMOrcDisposeThreadSafeModule(tsm);
+        return NULL;
+    }
+    LLVMOrcExecutorAddress addr = 0;
+    err = LLVMOrcLLJITLookup(jit, &addr, name);
+    if (err) {
+        jit_report(err, "lookup");
+        return NULL;
+    }
+    return (void *)addr;
+}
+
+void *jit_compile(SimContext *ctx, TransBlock *tb) {
+    pthread_mutex_lock(&jit_lock);
+    void *code = jit_compile_locked(ctx, tb);
+    pthread_mutex_unlock(&jit_lock);
+    return code;
+}
+
+void jit_free(SimContext *ctx) {
+    pthread_mutex_lock(&jit_lock);
+    if (ctx->jit_rt != NULL) jit_remove_tracker(ctx);
+    pthread_mutex_unlock(&jit_lock);
+}
+
+// ------------ Cross-check ------------
+
+static void undo_stores(SimContext *ctx, StoreLog *log) {
+    for (int k = log->n - 1; k >= 0; k--) {
+        mem_write(ctx, log->rec[k].addr, log->rec[k].len, log->rec[k].old);
+    }
+}
+
+// Run tb in the interpreter, roll it back, run the compiled code from the
+// same state and compare registers, next pc and the stores done.
+void jit_check_exec(SimContext *ctx, TransBlock *tb) {
+    StoreLog ref_log, jit_log;
+    CPU_state *cpu = &ctx->cpu;
+    uint64_t saved[32], ref[32];
+    uint64_t gen = ctx->tb_generation;
+    memcpy(saved, cpu->reg, sizeof(saved));
+
+    ref_log.n = 0;
+    ctx->store_log = &ref_log;
+    tb_exec(ctx, tb);
+    ctx->store_log = NULL;
+    // the block rewrote code and tb may be gone, or it faulted or halted:
+    // keep the interpreter result
+    if (ctx->tb_generation != gen || !ctx->running) {
+        return;
+    }
+    uint64_t ref_pc = cpu->pc;
+    memcpy(ref, cpu->reg, sizeof(ref));
+
+    undo_stores(ctx, &ref_log);
+    memcpy(cpu->reg, saved, sizeof(saved));
+    jit_log.n = 0;
+    ctx->store_log = &jit_log;
+    uint64_t jit_pc = ((JitFunc)tb->jit_code)(ctx);
+    ctx->store_log = NULL;
+    cpu->pc = jit_pc;
+
+    int bad = 0;
+    if (jit_pc != ref_pc) {
+        log_err("JIT check: block %lx next pc %lx, expected %lx", tb->pc, jit_pc, ref_pc);
+        bad = 1;
+    }
+    for (int r = 0; r < 32; r++) {
+        if (cpu->reg[r] != ref[r]) {
+            log_err("JIT check: block %lx x%d = %016lx, expected %016lx", tb->pc, r, cpu->reg[r], ref[r]);
+            bad = 1;
+        }
+    }
+    if (jit_log.n != ref_log.n) {
+        log_err("JIT check: block %lx did %d stores, expected %d", tb->pc, jit_log.n, ref_log.n);
+        bad = 1;
+    }
+    for (int k = 0; k < jit_log.n && k < ref_log.n; k++) {
+        StoreRecord *a = &jit_log.rec[k], *b = &ref_log.rec[k];
+        if (a->addr != b->addr || a->len != b->len || a->data != b->data) {
+            log_err("JIT check: block %lx store %d is %d bytes %016lx to %lx, expected %d bytes %016lx to %lx",
+                    tb->pc, k, a->len, a->data, a->addr, b->len, b->data, b->addr);
+            bad = 1;
+        }
+    }
+    if (bad) {
+        halt_trap(ctx, tb->pc, -1);
+    }
+}
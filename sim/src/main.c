@@ -1,40 +1,103 @@
 #include <common.h>
+#include <pthread.h>
 #include <memory.h>
 #include <cpu.h>
 #include <disasm.h>
+#include <isa_table.h>
+#include <profile.h>
+#include <sim.h>
 #include "ftrace.h"
 
-uint8_t *mem = NULL;
 int itrace_enabled = 0;
 int ftrace_enabled = 0;
-SymbolTable *sym_table = NULL;
+int block_enabled = 0;
+int jit_enabled = 0;
+int jit_check_enabled = 0;
+int hart_rr_enabled = 0;
+int profile_enabled = 0;
+int trace_enabled = 0;
 LLVMDisasmContextRef disasm_ctx;
 
-const char *help_string = "Usage: Simulator <model> <img_file> [options]\n"
+const char *help_string = "Usage: Simulator <model> <img_file>... [options]\n"
                                   "Models:\n"
                                   "  iss    Instruction Set Simulator\n"
                                   "  mc     Multi-cycle Performance Simulator\n"
-                                  "  pl     Pipeline Performance Simulator\n";
+                                  "  pl     Pipeline Performance Simulator\n"
+                                  "  ooo    Out-of-order Performance Simulator\n"
+                                  "Options (iss):\n"
+                                  "  --batch    Run to completion\n"
+                                  "  --debug    Start the interactive debugger\n"
+                                  "  --itrace   Run with instruction trace\n"
+                                  "  --ftrace   Run with function call trace\n"
+                                  "  --block    Execute translated basic blocks (ignored when tracing)\n"
+                                  "  --jit      Compile hot blocks to native code with LLVM (ignored when tracing)\n"
+                                  "  --jit-check  Like --jit, also run the interpreter and compare every compiled block\n"
+                                  "  --harts <n> Run n harts (up to 8) sharing the memory, each on its own host thread\n"
+                                  "  --rr       Run the harts in turn on one thread, for reproducible runs\n"
+                                  "  --profile <file>  Write a flat profile and a call graph of the run, in instructions\n"
+                                  "  --trace <file>    Write every instruction, call and return to a binary file, read by build/simtrace\n"
+                                  "Options (all models):\n"
+                                  "  --jobs <n> Run several images on n threads, in batch mode (default 1)\n"
+                                  "  --mem-size <size>  Guest RAM size, e.g. 512M or 4G (default 128M)\n"
+                                  "  --mem-base <addr>  Guest RAM start address (default 0x80000000)\n"
+                                  "Options (mc, pl, ooo):\n"
+                                  "  --icache <spec>    Model an L1 instruction cache, e.g. 32K:4:64\n"
+                                  "  --dcache <spec>    Model an L1 data cache, e.g. 32K:8:64:plru:wb\n"
+                                  "  --l2 <spec>        Model a unified L2 behind the L1s, e.g. 1M:16:64:lru:12\n"
+                                  "                     spec = size:ways:line[:lru|plru|random][:wb|wt][:hit cycles]\n"
+                                  "  --mem-latency <n>  Cycles of an access that misses every cache (default 100)\n"
+                                  "  --uarch <file>     Functional unit latencies, intervals and counts, see sim/configs/default.ini\n"
+                                  "  --stats <file>     Dump every statistic to a JSON file, or CSV if it ends in .csv\n"
+                                  "  --stats-interval <n>[c]  Also snapshot the statistics every n instructions (n cycles with c)\n"
+                                  "Options (mc, ooo):\n"
+                                  "  --decoupled        Run the program on an ISS thread ahead of the timing model\n"
+                                  "Options (mc, pl):\n"
+                                  "  --cpi-stack        Blame every cycle on a cause, report it per function and per instruction\n"
+                                  "  --difftest         Run an ISS next to the model, stop at the first instruction they disagree on\n"
+                                  "Options (pl, ooo):\n"
+                                  "  --width <n>        Fetch and retire up to n instructions a cycle (pl: 1 to 4, default 1; ooo: 1 to 8, default 4)\n"
+                                  "  --bp <kind>[:<n>]  Branch predictor: nt, btfn, bimodal, gshare or tage, with n counters (default 4096)\n"
+                                  "  --btb <n>          BTB entries (default 512)\n"
+                                  "  --ras <n>          Return address stack entries (default 0, returns use the BTB)\n"
+                                  "Options (mc):\n"
+                                  "  --fast             Run the ISS, take the cycles from a latency table of the stages\n"
+                                  "  --fast-check       Run the stages, check every instruction against the latency table\n"
+                                  "Options (pl):\n"
+                                  "  --forward          Bypass results into EX, only load-use hazards stall\n"
+                                  "  --pipeview <file>  Write every instruction's way through the stages for Konata\n"
+                                  "  --pipeview-window <from>:<to>[c]  Only instructions fetched in [from, to), in instructions (cycles with c)\n"
+                                  "Options (ooo):\n"
+                                  "  --issue <n>        Instructions sent to the functional units per cycle (default: the width)\n"
+                                  "  --rob <n>          Reorder buffer entries (default 128)\n"
+                                  "  --iq <n>           Issue queue entries (default 48)\n"
+                                  "  --lsq <n>          Load queue and store queue entries, each (default 32)\n"
+                                  "  --prf <n>          Physical registers (default 32 + ROB entries)\n";
 
 int run_iss_model(int argc, char *argv[]);
 int run_mc_model(int argc, char *argv[]);
 int run_pl_model(int argc, char *argv[]);
+int run_ooo_model(int argc, char *argv[]);
 
 int main(int argc, char *argv[]){
     if (argc < 3) {
         printf("%s\n", help_string);
+        return 0;
     }
 
     char *model = argv[1];
+    init_isa();
 
     if (strcmp(model, "iss") == 0) {
-        run_iss_model(argc - 1, argv + 1);
+        return run_iss_model(argc - 1, argv + 1);
     }
     else if (strcmp(model, "mc") == 0) {
-        run_mc_model(argc - 1, argv + 1);
+        return run_mc_model(argc - 1, argv + 1);
     }
     else if (strcmp(model, "pl") == 0) {
-        run_pl_model(argc - 1, argv + 1);
+        return run_pl_model(argc - 1, argv + 1);
+    }
+    else if (strcmp(model, "ooo") == 0) {
+        return run_ooo_model(argc - 1, argv + 1);
     }
     else {
         printf("Error: Unknown model '%s'.\n", model);
@@ -44,96 +107,551 @@ int main(int argc, char *argv[]){
     return 0;
 }
 
+// Options that take a value, shared by every model
+typedef struct {
+    int jobs;
+    int nharts;
+    const char *uarch;  // --uarch file, NULL: the ISA table latencies
+    const char *stats;  // --stats file, NULL: no statistics dump
+    const char *profile;    // --profile file, NULL: no profile
+    SimConfig cfg;
+} RunOptions;
+
+// ------------ Running many images ------------
+
+typedef struct {
+    char **images;
+    int nimages;
+    int next;            // next image to run, taken atomically
+    const RunOptions *ro;
+    void (*exec)(SimContext *ctx);
+    SimContext **done;   // finished contexts, mem already released
+} ImageQueue;
+
+static SimContext *load_sim(const char *image, const RunOptions *ro) {
+    SimContext *ctx = sim_create(image, &ro->cfg);
+    // the other harts share the symbol table, add them last
+    if (ctx && ro->nharts > 1 && sim_add_harts(ctx, ro->nharts) != 0) {
+        sim_destroy(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// With several images each one writes its own file, the image name in
+// front of the extension
+static void output_path(char *path, size_t size, const char *file, const char *image, int several) {
+    const char *dot = strrchr(file, '.');
+    if (several && dot && !strchr(dot, '/')) {
+        snprintf(path, size, "%.*s.%s%s", (int)(dot - file), file, image, dot);
+    }
+    else if (several) {
+        snprintf(path, size, "%s.%s", file, image);
+    }
+    else {
+        snprintf(path, size, "%s", file);
+    }
+}
+
+// Write the statistics of one finished image
+static void dump_stats(SimContext *ctx, const RunOptions *ro, int several) {
+    char path[512];
+    if (!ctx->stats) return;
+    output_path(path, sizeof(path), ro->stats, ctx->image, several);
+    if (stats_dump(ctx->stats, path, ctx->image) == 0) {
+        log_info("Statistics written to %s.", path);
+    }
+}
+
+static void dump_profile(SimContext *ctx, const RunOptions *ro, int several) {
+    char path[512];
+    if (!ctx->prof) return;
+    output_path(path, sizeof(path), ro->profile, ctx->image, several);
+    if (prof_report(ctx->prof, path, ctx->image, ctx->ninst) == 0) {
+        log_info("Profile written to %s.", path);
+    }
+}
+
+static void *image_worker(void *arg) {
+    ImageQueue *q = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->nimages) {
+        SimContext *ctx = load_sim(q->images[i], q->ro);
+        if (!ctx) continue;
+        q->exec(ctx);
+        dump_stats(ctx, q->ro, q->nimages > 1);
+        dump_profile(ctx, q->ro, q->nimages > 1);
+        // keep the statistics for the summary, drop the big buffers now
+        sim_release(ctx);
+        q->done[i] = ctx;
+    }
+    return NULL;
+}
+
+// Run every image to completion on `jobs` threads, one SimContext each
+static int run_images(char **images, int nimages, const RunOptions *ro,
+                      void (*exec)(SimContext *ctx)) {
+    ImageQueue q = { images, nimages, 0, ro, exec, NULL };
+    pthread_t *threads = NULL;
+    int nthreads = 0, failed = 0, jobs = ro->jobs;
+    q.done = calloc(nimages, sizeof(SimContext *));
+    check_mem(q.done);
+    if (jobs > nimages) jobs = nimages;
+    threads = calloc(jobs, sizeof(pthread_t));
+    check_mem(threads);
+
+    for (nthreads = 0; nthreads < jobs; nthreads++) {
+        check(pthread_create(&threads[nthreads], NULL, image_worker, &q) == 0, "Failed to start a worker thread.");
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    for (int i = 0; i < nimages; i++) {
+        SimContext *ctx = q.done[i];
+        if (ctx && ctx->exit_code == 0 && !ctx->running) {
+            printf(ANSI_FMT("[ PASS ]", ANSI_FG_GREEN) " %-20s INST = %ld, CYCLE = %ld\n", images[i], sim_ninst(ctx), ctx->global_cycle_count);
+        } else {
+            printf(ANSI_FMT("[ FAIL ]", ANSI_FG_RED) " %s\n", images[i]);
+            failed++;
+        }
+        sim_destroy(ctx);
+    }
+    printf("%d images, %d passed, %d failed.\n", nimages, nimages - failed, failed);
+    free(threads);
+    free(q.done);
+    return failed ? -1 : 0;
+
+error:
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (q.done) {
+        for (int i = 0; i < nimages; i++) sim_destroy(q.done[i]);
+    }
+    free(threads);
+    free(q.done);
+    return -1;
+}
+
+// "64K", "512M", "4G" or a plain number of bytes
+static uint64_t parse_size(const char *str) {
+    char *end;
+    uint64_t n = strtoull(str, &end, 0);
+    switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+        default: return n;
+    }
+}
+
+// "size:ways:line" then, in any order, a replacement policy, a write
+// policy and the hit latency. Returns -1 if spec is malformed.
+static int parse_cache(const char *spec, CacheConfig *c, int latency) {
+    char buf[64], *save = NULL, *tok;
+    c->repl = REPL_LRU;
+    c->write = WRITE_BACK;
+    c->latency = latency;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    tok = strtok_r(buf, ":", &save);
+    check(tok, "Bad cache spec '%s'.", spec);
+    c->size = parse_size(tok);
+    tok = strtok_r(NULL, ":", &save);
+    check(tok, "Bad cache spec '%s': no ways.", spec);
+    c->ways = atoi(tok);
+    tok = strtok_r(NULL, ":", &save);
+    check(tok, "Bad cache spec '%s': no line size.", spec);
+    c->line = atoi(tok);
+    while ((tok = strtok_r(NULL, ":", &save)) != NULL) {
+        if (strcmp(tok, "lru") == 0)         c->repl = REPL_LRU;
+        else if (strcmp(tok, "plru") == 0)   c->repl = REPL_PLRU;
+        else if (strcmp(tok, "random") == 0) c->repl = REPL_RANDOM;
+        else if (strcmp(tok, "wb") == 0)     c->write = WRITE_BACK;
+        else if (strcmp(tok, "wt") == 0)     c->write = WRITE_THROUGH;
+        else if (tok[0] >= '0' && tok[0] <= '9') c->latency = atoi(tok);
+        else sentinel("Bad cache spec '%s': unknown '%s'.", spec, tok);
+    }
+    check(c->size != 0, "Bad cache spec '%s': size 0.", spec);
+    return 0;
+
+error:
+    return -1;
+}
+
+// "kind" or "kind:counters"
+static int parse_bp(const char *spec, BpConfig *bp) {
+    static const char *kinds[] = { "none", "nt", "btfn", "bimodal", "gshare", "tage" };
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    bp->kind = BP_NONE;
+    for (int k = BP_NT; k <= BP_TAGE; k++) {
+        if (strlen(kinds[k]) == len && strncmp(spec, kinds[k], len) == 0) bp->kind = k;
+    }
+    check(bp->kind != BP_NONE, "Unknown branch predictor '%s'.", spec);
+    bp->entries = colon ? atoi(colon + 1) : 0;
+    return 0;
+
+error:
+    return -1;
+}
+
+// "from:to" in instructions, or in cycles with a c after either number.
+// Either end can be left out: "100000:" runs to the end.
+static int parse_window(const char *spec, PipeViewConfig *pv) {
+    char *end;
+    pv->from = strtoull(spec, &end, 0);
+    pv->cycles = *end == 'c';
+    if (*end == 'c') end++;
+    check(*end == ':', "Bad window '%s': no ':'.", spec);
+    pv->to = strtoull(end + 1, &end, 0);
+    pv->cycles |= *end == 'c';
+    check(*end == '\0' || strcmp(end, "c") == 0, "Bad window '%s'.", spec);
+    check(!pv->to || pv->to > pv->from, "Bad window '%s': it ends before it starts.", spec);
+    return 0;
+
+error:
+    return -1;
+}
+
+// Split argv[1..] into image names and options. Returns the number of
+// images, moved to the front of argv; the rest go to opts. Returns -1 if
+// an option has a bad value.
+static int parse_images(int argc, char *argv[], char **opts, int *nopts, RunOptions *ro) {
+    int nimages = 0;
+    *nopts = 0;
+    ro->jobs = 1;
+    ro->nharts = 1;
+    ro->cfg.mem_base = MEM_BASE;
+    ro->cfg.mem_size = MEM_SIZE;
+    ro->cfg.symbols = 0;
+    memset(&ro->cfg.icache, 0, sizeof(CacheConfig));
+    memset(&ro->cfg.dcache, 0, sizeof(CacheConfig));
+    memset(&ro->cfg.l2, 0, sizeof(CacheConfig));
+    ro->cfg.mem_latency = 100;
+    ro->uarch = NULL;
+    ro->stats = NULL;
+    ro->profile = NULL;
+    uarch_defaults(&ro->cfg.uarch);
+    memset(&ro->cfg.bp, 0, sizeof(BpConfig));
+    ro->cfg.bp.btb_entries = 512;
+    ro->cfg.forward = 0;
+    ro->cfg.width = 0;
+    memset(&ro->cfg.ooo, 0, sizeof(OooConfig));
+    ro->cfg.cpi_stack = 0;
+    ro->cfg.stats = 0;
+    ro->cfg.stats_interval = 0;
+    ro->cfg.stats_cycles = 0;
+    memset(&ro->cfg.pipeview, 0, sizeof(PipeViewConfig));
+    ro->cfg.decoupled = 0;
+    ro->cfg.fast = 0;
+    ro->cfg.fast_check = 0;
+    ro->cfg.difftest = 0;
+    ro->cfg.profile = 0;
+    ro->cfg.trace = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            ro->jobs = atoi(argv[++i]);
+            if (ro->jobs < 1) ro->jobs = 1;
+        }
+        else if (strcmp(argv[i], "--harts") == 0 && i + 1 < argc) {
+            ro->nharts = atoi(argv[++i]);
+            if (ro->nharts < 1) ro->nharts = 1;
+            check(ro->nharts <= MAX_HARTS, "--harts: at most %d, test/scripts/linker.ld only has stacks for %d.", MAX_HARTS, MAX_HARTS);
+        }
+        else if (strcmp(argv[i], "--mem-size") == 0 && i + 1 < argc) {
+            ro->cfg.mem_size = parse_size(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mem-base") == 0 && i + 1 < argc) {
+            ro->cfg.mem_base = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--icache") == 0 && i + 1 < argc) {
+            check(parse_cache(argv[++i], &ro->cfg.icache, 1) == 0, "Bad --icache.");
+        }
+        else if (strcmp(argv[i], "--dcache") == 0 && i + 1 < argc) {
+            check(parse_cache(argv[++i], &ro->cfg.dcache, 1) == 0, "Bad --dcache.");
+        }
+        else if (strcmp(argv[i], "--l2") == 0 && i + 1 < argc) {
+            check(parse_cache(argv[++i], &ro->cfg.l2, 10) == 0, "Bad --l2.");
+        }
+        else if (strcmp(argv[i], "--mem-latency") == 0 && i + 1 < argc) {
+            ro->cfg.mem_latency = atoi(argv[++i]);
+            check(ro->cfg.mem_latency >= 0, "--mem-latency can not be negative.");
+        }
+        else if (strcmp(argv[i], "--uarch") == 0 && i + 1 < argc) {
+            ro->uarch = argv[++i];
+            check(uarch_load(ro->uarch, &ro->cfg.uarch) == 0, "Bad --uarch.");
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            ro->profile = argv[++i];
+            ro->cfg.profile = 1;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            ro->cfg.trace = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            ro->stats = argv[++i];
+            ro->cfg.stats = 1;
+        }
+        else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            char *end;
+            ro->cfg.stats_interval = strtoull(argv[++i], &end, 0);
+            ro->cfg.stats_cycles = *end == 'c';
+            check(ro->cfg.stats_interval > 0 && (*end == '\0' || strcmp(end, "c") == 0),
+                  "--stats-interval must be a number of instructions, or of cycles with a c after it.");
+        }
+        else if (strcmp(argv[i], "--pipeview") == 0 && i + 1 < argc) {
+            ro->cfg.pipeview.path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pipeview-window") == 0 && i + 1 < argc) {
+            check(parse_window(argv[++i], &ro->cfg.pipeview) == 0, "Bad --pipeview-window.");
+        }
+        else if (strcmp(argv[i], "--bp") == 0 && i + 1 < argc) {
+            check(parse_bp(argv[++i], &ro->cfg.bp) == 0, "Bad --bp.");
+        }
+        else if (strcmp(argv[i], "--btb") == 0 && i + 1 < argc) {
+            ro->cfg.bp.btb_entries = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ras") == 0 && i + 1 < argc) {
+            ro->cfg.bp.ras_entries = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            ro->cfg.width = atoi(argv[++i]);
+            check(ro->cfg.width >= 1, "--width must be at least 1.");
+        }
+        else if (strcmp(argv[i], "--issue") == 0 && i + 1 < argc) {
+            ro->cfg.ooo.issue_width = atoi(argv[++i]);
+            check(ro->cfg.ooo.issue_width >= 1, "--issue must be at least 1.");
+        }
+        else if (strcmp(argv[i], "--rob") == 0 && i + 1 < argc) {
+            ro->cfg.ooo.rob = atoi(argv[++i]);
+            check(ro->cfg.ooo.rob >= 1, "--rob must be at least 1.");
+        }
+        else if (strcmp(argv[i], "--iq") == 0 && i + 1 < argc) {
+            ro->cfg.ooo.iq = atoi(argv[++i]);
+            check(ro->cfg.ooo.iq >= 1, "--iq must be at least 1.");
+        }
+        else if (strcmp(argv[i], "--lsq") == 0 && i + 1 < argc) {
+            ro->cfg.ooo.lq = ro->cfg.ooo.sq = atoi(argv[++i]);
+            check(ro->cfg.ooo.lq >= 1, "--lsq must be at least 1.");
+        }
+        else if (strcmp(argv[i], "--prf") == 0 && i + 1 < argc) {
+            ro->cfg.ooo.prf = atoi(argv[++i]);
+            check(ro->cfg.ooo.prf >= 1, "--prf must be at least 1.");
+        }
+        else if (argv[i][0] != '-') {
+            argv[1 + nimages++] = argv[i];
+        }
+        else {
+            opts[(*nopts)++] = argv[i];
+        }
+    }
+    check(ro->cfg.mem_size != 0 && ro->cfg.mem_size % 4096 == 0, "--mem-size must be a multiple of 4K.");
+    check(ro->cfg.mem_base % 4096 == 0, "--mem-base must be 4K aligned.");
+    check(!ro->cfg.l2.size || ro->cfg.icache.size || ro->cfg.dcache.size, "--l2 needs --icache or --dcache in front of it.");
+    check(ro->cfg.bp.kind != BP_NONE || (ro->cfg.bp.btb_entries == 512 && ro->cfg.bp.ras_entries == 0),
+          "--btb and --ras need --bp.");
+    check(!ro->cfg.stats_interval || ro->stats, "--stats-interval needs --stats.");
+    check((!ro->cfg.pipeview.from && !ro->cfg.pipeview.to) || ro->cfg.pipeview.path, "--pipeview-window needs --pipeview.");
+    check(ro->cfg.mem_base + ro->cfg.mem_size > ro->cfg.mem_base, "Guest memory wraps around the address space.");
+    return nimages;
+
+error:
+    return -1;
+}
+
+// ------------ Models ------------
+
+static int ooo_configured(const OooConfig *c) {
+    return c->issue_width || c->rob || c->iq || c->lq || c->prf;
+}
+
 int run_iss_model(int argc, char *argv[]) {
-    mem = (uint8_t *)malloc(MEM_SIZE);
-    check_mem(mem);
-    memset(mem, 0, MEM_SIZE);
-    
-    char image_file[128] = "";
-    sprintf(image_file, "test/build/%s.bin", argv[1]);
-    load_image(image_file);
-
-    char elf_file[128] = "";
-    sprintf(elf_file, "test/build/%s.elf", argv[1]);
-    sym_table = malloc(sizeof(SymbolTable));
-    load_elf_symbols(elf_file);
-    sort_symbols_by_address(sym_table);
-
-    init_cpu();
-    if (argc > 2 && strcmp(argv[2], "--debug") == 0) {
+    char *opts[argc];
+    int nopts;
+    RunOptions ro;
+    int nimages = parse_images(argc, argv, opts, &nopts, &ro);
+    const char *mode = NULL;
+    if (nimages < 0) return -1;
+    check(!ro.cfg.icache.size && !ro.cfg.dcache.size && !ro.cfg.l2.size, "Caches are only modelled by mc, pl and ooo.");
+    check(ro.cfg.bp.kind == BP_NONE, "Branch predictors are only modelled by pl and ooo.");
+    check(ro.cfg.width == 0, "--width is only supported by pl and ooo.");
+    check(!ro.uarch, "--uarch is only supported by mc, pl and ooo.");
+    check(!ro.stats, "--stats is only supported by mc, pl and ooo.");
+    check(!ro.cfg.pipeview.path, "--pipeview is only supported by pl.");
+    check(!ooo_configured(&ro.cfg.ooo), "--issue, --rob, --iq, --lsq and --prf are only supported by ooo.");
+    check(!ro.profile || ro.nharts == 1, "--profile only follows a single hart.");
+    check(!ro.cfg.trace || ro.nharts == 1, "--trace only follows a single hart.");
+    ro.cfg.symbols = 1;
+    if (ro.profile) profile_enabled = 1;
+    if (ro.cfg.trace) trace_enabled = 1;
+    for (int i = 0; i < nopts; i++) {
+        if (strcmp(opts[i], "--block") == 0) {
+            block_enabled = 1;
+        }
+        else if (strcmp(opts[i], "--jit") == 0) {
+            jit_enabled = 1;
+        }
+        else if (strcmp(opts[i], "--jit-check") == 0) {
+            jit_enabled = 1;
+            jit_check_enabled = 1;
+        }
+        else if (strcmp(opts[i], "--rr") == 0) {
+            hart_rr_enabled = 1;
+        }
+        else if (mode == NULL) {
+            mode = opts[i];
+        }
+    }
+    if (nimages == 0) {
+        printf("%s", help_string);
+        return 0;
+    }
+
+    if (nimages > 1 || ro.jobs > 1) {
+        check(mode && strcmp(mode, "--batch") == 0, "Several images can only run with --batch.");
+        check(!ro.cfg.trace, "--trace can only trace one image.");
+        return run_images(argv + 1, nimages, &ro, iss_cpu_exec);
+    }
+
+    SimContext *ctx = load_sim(argv[1], &ro);
+    check(ctx, "Failed to start the simulator.");
+
+    if (mode && strcmp(mode, "--debug") == 0) {
+        if (ro.nharts > 1) {
+            log_err("The debugger only drives a single hart.");
+            sim_destroy(ctx);
+            return -1;
+        }
         init_llvm_disassembler();
-        debug_loop();
+        debug_loop(ctx);
     }
-    else if (argc > 2 && strcmp(argv[2], "--batch") == 0) {
-        iss_cpu_exec();
+    else if (mode && strcmp(mode, "--batch") == 0) {
+        iss_cpu_exec(ctx);
     }
-    else if (argc > 2 && strcmp(argv[2], "--itrace") == 0) {
+    else if (mode && strcmp(mode, "--itrace") == 0) {
         itrace_enabled = 1;
         init_llvm_disassembler();
-        iss_cpu_exec();
+        iss_cpu_exec(ctx);
     }
-    else if (argc > 2 && strcmp(argv[2], "--ftrace") == 0) {
+    else if (mode && strcmp(mode, "--ftrace") == 0) {
         ftrace_enabled = 1;
-        iss_cpu_exec();
+        iss_cpu_exec(ctx);
     }
     else {
         printf("%s", help_string);
+        sim_destroy(ctx);
         exit(0);
     }
-    free(mem);
+    dump_profile(ctx, &ro, 0);
+    for (int i = 1; i < ctx->nharts; i++) {
+        log_info("Hart %d: %ld instructions.", i, ctx->harts[i]->ninst);
+    }
+    log_info("Total instructions: %ld.", sim_ninst(ctx));
+    sim_destroy(ctx);
     return 0;
 
 error:
-    if(mem) free(mem);
     return -1;
 }
 
-int run_mc_model(int argc, char *argv[]) {
-    mem = (uint8_t *)malloc(MEM_SIZE);
-    check_mem(mem);
-    memset(mem, 0, MEM_SIZE);
-    
-    char image_file[128] = "";
-    sprintf(image_file, "test/build/%s.bin", argv[1]);
-    load_image(image_file);
- 
-    if (argc > 2 && strcmp(argv[2], "--itrace") == 0) {
-        itrace_enabled = 1;
-        init_llvm_disassembler();
+// mc, pl and ooo take the same arguments
+static int run_timing_model(int argc, char *argv[], void (*exec)(SimContext *ctx)) {
+    char *opts[argc];
+    int nopts;
+    RunOptions ro;
+    int nimages = parse_images(argc, argv, opts, &nopts, &ro);
+    int itrace = 0;
+    if (nimages < 0) return -1;
+    for (int i = 0; i < nopts; i++) {
+        if (strcmp(opts[i], "--itrace") == 0) {
+            itrace = 1;
+        }
+        else if (strcmp(opts[i], "--forward") == 0) {
+            check(exec == pl_cpu_exec, "--forward is only supported by pl.");
+            ro.cfg.forward = 1;
+        }
+        else if (strcmp(opts[i], "--decoupled") == 0) {
+            check(exec != pl_cpu_exec, "--decoupled is only supported by mc and ooo.");
+            ro.cfg.decoupled = 1;
+        }
+        else if (strcmp(opts[i], "--fast") == 0) {
+            check(exec == mc_cpu_exec, "--fast is only supported by mc.");
+            ro.cfg.fast = 1;
+        }
+        else if (strcmp(opts[i], "--fast-check") == 0) {
+            check(exec == mc_cpu_exec, "--fast-check is only supported by mc.");
+            ro.cfg.fast_check = 1;
+        }
+        else if (strcmp(opts[i], "--difftest") == 0) {
+            check(exec != ooo_cpu_exec, "--difftest is only supported by mc and pl, ooo runs the ISS itself.");
+            ro.cfg.difftest = 1;
+        }
+        else if (strcmp(opts[i], "--cpi-stack") == 0) {
+            check(exec != ooo_cpu_exec, "--cpi-stack is only supported by mc and pl.");
+            // per function needs the symbols
+            ro.cfg.cpi_stack = 1;
+            ro.cfg.symbols = 1;
+        }
+    }
+    if (nimages == 0) {
+        printf("%s", help_string);
+        return 0;
+    }
+    check(ro.nharts == 1, "--harts is only supported by the iss.");
+    check(!ro.profile, "--profile is only supported by the iss.");
+    check(!ro.cfg.trace, "--trace is only supported by the iss.");
+    check(exec != mc_cpu_exec || ro.cfg.bp.kind == BP_NONE, "Branch predictors are only modelled by pl and ooo.");
+    check(exec != mc_cpu_exec || ro.cfg.width == 0, "--width is only supported by pl and ooo.");
+    check(exec != pl_cpu_exec || ro.cfg.width <= PL_MAX_WIDTH, "pl: --width must be 1 to %d.", PL_MAX_WIDTH);
+    check(exec == pl_cpu_exec || !ro.cfg.pipeview.path, "--pipeview is only supported by pl.");
+    check(!ro.cfg.fast_check || (!ro.cfg.fast && !ro.cfg.decoupled), "--fast-check runs the stages, it can not be combined with --fast or --decoupled.");
+    check(!ro.cfg.difftest || (!ro.cfg.fast && !ro.cfg.decoupled), "--difftest checks the stages, it can not be combined with --fast or --decoupled.");
+    if (exec == ooo_cpu_exec) {
+        // the window sizes left out get their defaults
+        OooConfig *c = &ro.cfg.ooo;
+        c->width = ro.cfg.width ? ro.cfg.width : 4;
+        if (!c->issue_width) c->issue_width = c->width;
+        if (!c->rob) c->rob = 128;
+        if (!c->iq) c->iq = 48;
+        if (!c->lq) c->lq = c->sq = 32;
+        if (!c->prf) c->prf = 32 + c->rob;
+    }
+    else {
+        check(!ooo_configured(&ro.cfg.ooo), "--issue, --rob, --iq, --lsq and --prf are only supported by ooo.");
+    }
+
+    if (nimages > 1 || ro.jobs > 1) {
+        check(!itrace, "--itrace can only trace one image.");
+        check(!ro.cfg.pipeview.path, "--pipeview can only trace one image.");
+        return run_images(argv + 1, nimages, &ro, exec);
     }
 
-    init_cpu();
-    mc_cpu_exec();
+    // the pipeline view labels instructions with their disassembly
+    if (itrace || ro.cfg.pipeview.path) init_llvm_disassembler();
+    SimContext *ctx = sim_create(argv[1], &ro.cfg);
+    check(ctx, "Failed to start the simulator.");
 
-    free(mem);
+    if (itrace) itrace_enabled = 1;
+
+    exec(ctx);
+    dump_stats(ctx, &ro, 0);
+
+    sim_destroy(ctx);
     return 0;
 
 error:
-    if(mem) free(mem);
     return -1;
 }
 
-int run_pl_model(int argc, char *argv[]) {
-    mem = (uint8_t *)malloc(MEM_SIZE);
-    check_mem(mem);
-    memset(mem, 0, MEM_SIZE);
-    
-    char image_file[128] = "";
-    sprintf(image_file, "test/build/%s.bin", argv[1]);
-    load_image(image_file);
- 
-    if (argc > 2 && strcmp(argv[2], "--itrace") == 0) {
-        itrace_enabled = 1;
-        init_llvm_disassembler();
-    }
-
-    init_cpu();
-    pl_cpu_exec();
+int run_mc_model(int argc, char *argv[]) {
+    return run_timing_model(argc, argv, mc_cpu_exec);
+}
 
-    free(mem);
-    return 0;
+int run_pl_model(int argc, char *argv[]) {
+    return run_timing_model(argc, argv, pl_cpu_exec);
+}
 
-error:
-    if(mem) free(mem);
-    return -1;
-}
\ No newline at end of file
+int run_ooo_model(int argc, char *argv[]) {
+    return run_timing_model(argc, argv, ooo_cpu_exec);
+}
@@ -1,31 +1,13 @@
 #include <mc_core.h>
+#include <isa_table.h>
 #include <cpu.h>
-
-extern CPU_state cpu;
-extern uint64_t global_cycle_count;
-extern uint64_t ninst;
+#include <memory.h>
+#include <sim.h>
 
 static inline void debug_mc(Decode *s) {
     printf("INST: 0x%08x\n", s->inst);
 }
 
-static int last_inst_was_div = 0;
-static int last_div_rs1 = 0; 
-static int last_div_rs2 = 0; 
-static int last_div_rdq = 0; 
-
-static inline int inst_fusion(Decode *s) {
-    uint32_t i = s->inst;
-    int rs1 = BITS(i, 19, 15);
-    int rs2 = BITS(i, 24, 20);
-    int rd  = BITS(i, 11,  7);
-    if (last_inst_was_div) {
-        if ((last_div_rdq == rd) && (last_div_rs1 == rs1) && (last_div_rs2 == rs2))
-            return 1;
-    }
-    return 0;
-}
-
 // Descripe the state machine of Multi-Cycle processor
 void push_stage(Decode *s, Multi_Cycle_Stage *stage) {
     switch (*stage) {
@@ -54,8 +36,6 @@ void push_stage(Decode *s, Multi_Cycle_Stage *stage) {
             switch (s->type)
             {
                 case TYPE_R:
-                    *stage = STAGE_WB;
-                    break;
                 case TYPE_I:
                     if (s->is_load) {
                         *stage = STAGE_MEM;
@@ -79,6 +59,7 @@ void push_stage(Decode *s, Multi_Cycle_Stage *stage) {
         case STAGE_MEM:
             switch (s->type)
             {
+                case TYPE_R:
                 case TYPE_I:
                     *stage = STAGE_WB;
                     break;
@@ -97,402 +78,191 @@ void push_stage(Decode *s, Multi_Cycle_Stage *stage) {
     }
 }
 
-void mc_IF(Decode *s) {
-    s->pc = cpu.pc;
-    s->inst = inst_fetch(s->pc);
+void mc_IF(SimContext *ctx, Decode *s) {
+    s->pc = ctx->cpu.pc;
+    s->inst = inst_fetch(ctx, s->pc);
+    // IF holds until the I$ delivers, a fault stops the machine anyway
+    if (!ctx->exc_pending) {
+        uint64_t stall = cache_stall(ctx->icache, s->pc, 0);
+        ctx->global_cycle_count += stall;
+        if (ctx->cpi) cpi_charge(ctx->cpi, CPI_ICACHE, s->pc, stall);
+    }
     s->snpc = s->pc + 4;
     s->dnpc = s->snpc;
 }
 
-void mc_ID(Decode *s) {
-    int rd = 0;
-    uint64_t src1 = 0, src2 = 0, imm = 0;
-    global_cycle_count++;
-    last_inst_was_div = 0;
+void mc_ID(SimContext *ctx, Decode *s) {
+    ctx->global_cycle_count++;
+    isa_decode_inst(s);
 
-    INSTPAT_START();
-    //RV64I
-    INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui, U);
-    INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U);
-    INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, s->is_load = 0);
-    // BEQ, BNE, BLT, BGE, BLTU, BGEU
-    INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B);
-    INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B);
-    INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B);
-    INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B);
-    INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B);
-    INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B);
-    // LB, LH, LW, LBU, LHU, LWU, LD
-    INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb     , I, s->is_load = 1);
-    INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh     , I, s->is_load = 1);
-    INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw     , I, s->is_load = 1);
-    INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, s->is_load = 1);
-    INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu    , I, s->is_load = 1);
-    INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu    , I, s->is_load = 1);
-    INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld     , I, s->is_load = 1);
-    // SB, SH, SW
-    INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S);
-    INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh     , S);
-    INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw     , S);
-    INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd     , S);
-    INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, s->is_load = 0);
-    // SLTI, SLTIU
-    INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, s->is_load = 0);
-    INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, s->is_load = 0);
-    // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-    INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli   , I, s->is_load = 0);
-    INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli   , I, s->is_load = 0);
-    INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai   , I, s->is_load = 0);
-    INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw  , I, s->is_load = 0);
-    INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw  , I, s->is_load = 0);
-    INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw  , I, s->is_load = 0);
-    // XORI, ORI, ANDI, ADDIW
-    INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, s->is_load = 0);
-    INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, s->is_load = 0);
-    INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, s->is_load = 0);
-    INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw  , I, s->is_load = 0);
-    // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-    INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R);
-    INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R);
-    INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll    , R);
-    INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R);
-    INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu   , R);
-    INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor    , R);
-    INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl    , R);
-    INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra    , R);
-    INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or     , R);
-    INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and    , R);
-    // ADDW, SUBW, SLLW, SRLW, SRAW
-    INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw   , R);
-    INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw   , R);
-    INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw   , R);
-    INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw   , R);
-    INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw   , R);
-    // FENCE, FENCE.I
-    INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence  , N);
-    INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei , N);
-    // ECALL
-    INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , I); // R(10) is $a0
-    // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
-
-    // RV64M
-    // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-    INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul    , R);
-    INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh   , R);
-    INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R);
-    INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R);
-    INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div    , R, last_inst_was_div = 1; last_div_rs1 = BITS(s->inst, 19, 15); last_div_rs2 = BITS(s->inst, 24, 20); last_div_rdq = rd;);
-    INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu   , R, last_inst_was_div = 1; last_div_rs1 = BITS(s->inst, 19, 15); last_div_rs2 = BITS(s->inst, 24, 20); last_div_rdq = rd;);
-    INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem    , R);
-    INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R);
-
-    // MULW, DIVW, DIVUW, REMW, REMUW
-    INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw   , R);
-    INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw   , R);
-    INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw  , R);
-    INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw   , R);
-    INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw  , R);
-
-    //Invalid Opcode
-    INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk    , N, printf(ANSI_FMT("[Stage ID]Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1));
-    INSTPAT_END();
-
-    R(0) = 0;
-
-    return;
+    switch (isa_info[s->op].cls) {
+        case CLASS_JUMP:
+            if (s->op == OP_jal) {
+                s->dnpc = s->pc + s->imm;
+            }
+            break;
+        case CLASS_UNK:
+            printf(ANSI_FMT("[Stage ID]Unknown Inst!\n", ANSI_FG_RED));
+            HALT(s->pc, -1);
+            break;
+        default:
+            break;
+    }
 }
 
-void mc_EX(Decode *s, uint64_t *alu_result) {
-    int rd = 0;
-    uint64_t src1 = 0, src2 = 0, imm = 0;
-    global_cycle_count += 1;
-
-    INSTPAT_START();
-    //RV64I
-    INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui    , U, *alu_result = imm + 0);
-    INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, *alu_result = s->pc + imm);
-    // INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J);
-    INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, s->dnpc = (src1 + imm) & ~1);
-    // BEQ, BNE, BLT, BGE, BLTU, BGEU
-    INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B, if (src1 == src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B, if (src1 != src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B, if ((int64_t)src1 < (int64_t)src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B, if ((int64_t)src1 >= (int64_t)src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B, if (src1 < src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B, if (src1 >= src2) s->dnpc = s->pc + imm);
-    // LB, LH, LW, LBU, LHU, LWU, LD
-    INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb     , I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh     , I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw     , I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu    , I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu    , I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld     , I, *alu_result = src1 + imm);
-    // SB, SH, SW
-    INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh     , S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw     , S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd     , S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, *alu_result = src1 + imm);
-    // SLTI, SLTIU
-    INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, *alu_result = (int64_t)src1 < (int64_t)imm);
-    INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, *alu_result = src1 < imm);
-    // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-    INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli   , I, *alu_result = src1 << (imm & 0x3f));
-    INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli   , I, *alu_result = src1 >> (imm & 0x3f));
-    INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai   , I, *alu_result = (int64_t)src1 >> (imm & 0x3f));
-    INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw  , I, *alu_result = SEXT((uint32_t)src1 << (imm & 0x1f), 32));
-    INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw  , I, *alu_result = SEXT((uint32_t)src1 >> (imm & 0x1f), 32));
-    INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw  , I, *alu_result = SEXT((int32_t)src1 >> (imm & 0x1f), 32));
-    // XORI, ORI, ANDI, ADDIW
-    INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, *alu_result = src1 ^ imm);
-    INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, *alu_result = src1 | imm);
-    INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, *alu_result = src1 & imm);
-    INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw  , I, *alu_result = SEXT((int32_t)src1 + (int32_t)imm, 32));
-    // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-    INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R, *alu_result = src1 + src2);
-    INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R, *alu_result = src1 - src2);
-    INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll    , R, *alu_result = src1 << (src2 & 0x3f));
-    INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, *alu_result = (int64_t)src1 < (int64_t)src2);
-    INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu   , R, *alu_result = src1 < src2);
-    INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor    , R, *alu_result = src1 ^ src2);
-    INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl    , R, *alu_result = src1 >> (src2 & 0x3f));
-    INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra    , R, *alu_result = (int64_t)src1 >> (src2 & 0x3f));
-    INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or     , R, *alu_result = src1 | src2);
-    INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and    , R, *alu_result = src1 & src2);
-    // ADDW, SUBW, SLLW, SRLW, SRAW
-    INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw   , R, *alu_result = SEXT((uint32_t)src1 + (uint32_t)src2, 32));
-    INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw   , R, *alu_result = SEXT((uint32_t)src1 - (uint32_t)src2, 32));
-    INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw   , R, *alu_result = SEXT((uint32_t)src1 << (src2 & 0x1f), 32));
-    INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw   , R, *alu_result = SEXT((uint32_t)src1 >> (src2 & 0x1f), 32));
-    INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw   , R, *alu_result = SEXT((int32_t)src1 >> (src2 & 0x1f), 32));
-    // FENCE, FENCE.I
-    INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence  , N, NOP);
-    INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei , N, NOP);
-    // ECALL
-    INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , I, HALT(s->pc, R(10))); // R(10) is $a0
-    // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
-
-    // RV64M
-    // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-    INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul    , R, *alu_result = src1 * src2; global_cycle_count += 1);
-    INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh   , R, *alu_result = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(int64_t)src2 >> 64); global_cycle_count += 1);
-    INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R, *alu_result = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(uint64_t)src2 >> 64); global_cycle_count += 1);
-    INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R, *alu_result = (uint64_t)((__uint128_t)(uint64_t)src1 * (__uint128_t)(uint64_t)src2 >> 64); global_cycle_count += 1);
-    INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div    , R, if (src2 == 0) *alu_result = -1; else *alu_result = (int64_t)src1 / (int64_t)src2; global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu   , R, if (src2 == 0) *alu_result = -1; else *alu_result = src1 / src2; global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem    , R, if (src2 == 0) *alu_result = src1; else *alu_result = (int64_t)src1 % (int64_t)src2; global_cycle_count += inst_fusion(s) ? -1 : 39);
-    INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R, if (src2 == 0) *alu_result = src1; else *alu_result = src1 % src2; global_cycle_count += inst_fusion(s) ? -1 : 39);
-
-    // MULW, DIVW, DIVUW, REMW, REMUW
-    INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw   , R, *alu_result = SEXT((int32_t)src1 * (int32_t)src2, 32));
-    INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw   , R, if (src2 == 0) *alu_result = -1; else *alu_result = SEXT((int32_t)(int64_t)src1 / (int32_t)(int64_t)src2, 32); global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw  , R, if (src2 == 0) *alu_result = -1; else *alu_result = SEXT((uint32_t)(uint64_t)src1 / (uint32_t)(uint64_t)src2, 32); global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw   , R, if (src2 == 0) *alu_result = SEXT((uint32_t)src1, 32); else *alu_result = SEXT((int32_t)(int64_t)src1 % (int32_t)(int64_t)src2, 32); global_cycle_count += inst_fusion(s) ? -1 : 39);
-    INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw  , R, if (src2 == 0) *alu_result = SEXT((uint32_t)src1, 32); else *alu_result = SEXT((uint32_t)(uint64_t)src1 % (uint32_t)(uint64_t)src2, 32); global_cycle_count += inst_fusion(s) ? -1 : 39);
-
-    //Invalid Opcode
-    INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk    , N, printf(ANSI_FMT("[Stage EX]Unknown Inst!\n", ANSI_FG_RED)), debug_mc(s), HALT(s->pc, -1));
-    INSTPAT_END();
+void mc_EX(SimContext *ctx, Decode *s, uint64_t *alu_result) {
+    uint64_t src1 = R(s->rs1), src2 = R(s->rs2);
+    const IsaInfo *info = &isa_info[s->op];
+    // one instruction at a time, EX takes the latency of its unit. Loads
+    // and stores only compute the address here, their unit is MEM.
+    int fu = fu_of_class[info->cls];
+    int latency = fu == FU_LOAD || fu == FU_STORE ? 1 : ctx->uarch.fu[fu].latency;
+    ctx->global_cycle_count += latency;
+    if (ctx->cpi) cpi_charge(ctx->cpi, CPI_LONG, s->pc, latency - 1);
+
+    switch (info->cls) {
+        case CLASS_ALU:
+        case CLASS_MUL:
+        case CLASS_DIV:
+            *alu_result = isa_alu(s, src1, src2);
+            break;
+        case CLASS_LOAD:
+        case CLASS_STORE:
+        case CLASS_AMO:
+            *alu_result = src1 + s->imm;
+            break;
+        case CLASS_BRANCH:
+            if (isa_branch_taken(s, src1, src2)) s->dnpc = s->pc + s->imm;
+            break;
+        case CLASS_JUMP:
+            s->dnpc = isa_jump_target(s, src1);
+            break;
+        case CLASS_CSR:
+            *alu_result = isa_csr(ctx, s, src1);
+            break;
+        case CLASS_SYSTEM:
+        case CLASS_FENCE:
+            isa_system(ctx, s);
+            break;
+        case CLASS_UNK:
+            printf(ANSI_FMT("[Stage EX]Unknown Inst!\n", ANSI_FG_RED));
+            debug_mc(s);
+            HALT(s->pc, -1);
+            break;
+    }
 
     R(0) = 0;
-
-    return;
 }
 
-void mc_MEM(Decode *s, uint64_t alu_result, uint64_t *mem_result) {
-    int rd = 0;
-    uint64_t src1 = 0, src2 = 0, imm = 0;
-    global_cycle_count += 1;
-
-    INSTPAT_START();
-    //RV64I
-    // INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui    , U, R(rd) = imm);
-    // INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
-    // INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s->pc + 4, s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, R(rd) = s->pc + 4, s->dnpc = (src1 + imm) & ~1);
-    // BEQ, BNE, BLT, BGE, BLTU, BGEU
-    // INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B, if (src1 == src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B, if (src1 != src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B, if ((int64_t)src1 < (int64_t)src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B, if ((int64_t)src1 >= (int64_t)src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B, if (src1 < src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B, if (src1 >= src2) s->dnpc = s->pc + imm);
-    // LB, LH, LW, LBU, LHU, LWU, LD
-    INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb     , I, *mem_result = SEXT(Mr(alu_result, 1), 8));
-    INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh     , I, *mem_result = SEXT(Mr(alu_result, 2), 16));
-    INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw     , I, *mem_result = SEXT(Mr(alu_result, 4), 32));
-    INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, *mem_result = Mr(alu_result, 1));
-    INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu    , I, *mem_result = Mr(alu_result, 2));
-    INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu    , I, *mem_result = Mr(alu_result, 4));
-    INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld     , I, *mem_result = Mr(alu_result, 8));
-    // SB, SH, SW
-    INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(alu_result, 1, src2));
-    INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh     , S, Mw(alu_result, 2, src2));
-    INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw     , S, Mw(alu_result, 4, src2));
-    INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd     , S, Mw(alu_result, 8, src2));
-    // INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, R(rd) = src1 + imm);
-    // SLTI, SLTIU
-    // INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, R(rd) = (int64_t)src1 < (int64_t)imm);
-    // INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, R(rd) = src1 < imm);
-    // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-    // INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli   , I, R(rd) = src1 << (imm & 0x3f));
-    // INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli   , I, R(rd) = src1 >> (imm & 0x3f));
-    // INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai   , I, R(rd) = (int64_t)src1 >> (imm & 0x3f));
-    // INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw  , I, R(rd) = SEXT((uint32_t)src1 << (imm & 0x1f), 32));
-    // INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw  , I, R(rd) = SEXT((uint32_t)src1 >> (imm & 0x1f), 32));
-    // INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw  , I, R(rd) = SEXT((int32_t)src1 >> (imm & 0x1f), 32));
-    // XORI, ORI, ANDI, ADDIW
-    // INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, R(rd) = src1 ^ imm);
-    // INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, R(rd) = src1 | imm);
-    // INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, R(rd) = src1 & imm);
-    // INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw  , I, R(rd) = SEXT((int32_t)src1 + (int32_t)imm, 32));
-    // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-    // INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R, R(rd) = src1 + src2);
-    // INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R, R(rd) = src1 - src2);
-    // INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll    , R, R(rd) = src1 << (src2 & 0x3f));
-    // INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, R(rd) = (int64_t)src1 < (int64_t)src2);
-    // INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu   , R, R(rd) = src1 < src2);
-    // INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor    , R, R(rd) = src1 ^ src2);
-    // INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl    , R, R(rd) = src1 >> (src2 & 0x3f));
-    // INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra    , R, R(rd) = (int64_t)src1 >> (src2 & 0x3f));
-    // INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or     , R, R(rd) = src1 | src2);
-    // INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and    , R, R(rd) = src1 & src2);
-    // ADDW, SUBW, SLLW, SRLW, SRAW
-    // INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw   , R, R(rd) = SEXT((uint32_t)src1 + (uint32_t)src2, 32));
-    // INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw   , R, R(rd) = SEXT((uint32_t)src1 - (uint32_t)src2, 32));
-    // INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw   , R, R(rd) = SEXT((uint32_t)src1 << (src2 & 0x1f), 32));
-    // INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw   , R, R(rd) = SEXT((uint32_t)src1 >> (src2 & 0x1f), 32));
-    // INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw   , R, R(rd) = SEXT((int32_t)src1 >> (src2 & 0x1f), 32));
-    // FENCE, FENCE.I
-    // INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence  , N, NOP);
-    // INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei , N, NOP);
-    // ECALL
-    // INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, HALT(s->pc, R(10))); // R(10) is $a0
-    // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
+void mc_MEM(SimContext *ctx, Decode *s, uint64_t alu_result, uint64_t *mem_result) {
+    const IsaInfo *info = &isa_info[s->op];
+    int latency = ctx->uarch.fu[fu_of_class[info->cls]].latency;
+    ctx->global_cycle_count += latency;
+    if (ctx->cpi) cpi_charge(ctx->cpi, CPI_LONG, s->pc, latency - 1);
+    // devices are not cached
+    if (mem_in_ram(ctx, alu_result, 1)) {
+        uint64_t stall = cache_stall(ctx->dcache, alu_result, info->cls != CLASS_LOAD);
+        ctx->global_cycle_count += stall;
+        if (ctx->cpi) cpi_charge(ctx->cpi, CPI_DCACHE, s->pc, stall);
+    }
 
-    // RV64M
-    // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-    // INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul    , R, R(rd) = src1 * src2);
-    // INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh   , R, R(rd) = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(int64_t)src2 >> 64));
-    // INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R, R(rd) = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(uint64_t)src2 >> 64));
-    // INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R, R(rd) = (uint64_t)((__uint128_t)(uint64_t)src1 * (__uint128_t)(uint64_t)src2 >> 64));
-    // INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div    , R, if (src2 == 0) R(rd) = -1; else R(rd) = (int64_t)src1 / (int64_t)src2);
-    // INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu   , R, if (src2 == 0) R(rd) = -1; else R(rd) = src1 / src2);
-    // INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem    , R, if (src2 == 0) R(rd) = src1; else R(rd) = (int64_t)src1 % (int64_t)src2);
-    // INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R, if (src2 == 0) R(rd) = src1; else R(rd) = src1 % src2);
+    switch (info->cls) {
+        case CLASS_LOAD:
+            *mem_result = isa_load(ctx, s, alu_result);
+            break;
+        case CLASS_STORE:
+            isa_store(ctx, s, alu_result, R(s->rs2));
+            break;
+        case CLASS_AMO:
+            *mem_result = isa_amo(ctx, s, alu_result, R(s->rs2));
+            break;
+        default:
+            printf(ANSI_FMT("[Stage MEM]Unknown Inst!\n", ANSI_FG_RED));
+            HALT(s->pc, -1);
+            break;
+    }
+}
 
-    // MULW, DIVW, DIVUW, REMW, REMUW
-    // INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw   , R, R(rd) = SEXT((int32_t)src1 * (int32_t)src2, 32));
-    // INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw   , R, if (src2 == 0) R(rd) = -1; else R(rd) = SEXT((int32_t)(int64_t)src1 / (int32_t)(int64_t)src2, 32));
-    // INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw  , R, if (src2 == 0) R(rd) = -1; else R(rd) = SEXT((uint32_t)(uint64_t)src1 / (uint32_t)(uint64_t)src2, 32));
-    // INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw   , R, if (src2 == 0) R(rd) = SEXT((uint32_t)src1, 32); else R(rd) = SEXT((int32_t)(int64_t)src1 % (int32_t)(int64_t)src2, 32));
-    // INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw  , R, if (src2 == 0) R(rd) = SEXT((uint32_t)src1, 32); else R(rd) = SEXT((uint32_t)(uint64_t)src1 % (uint32_t)(uint64_t)src2, 32));
+void mc_WB(SimContext *ctx, Decode *s, uint64_t alu_result, uint64_t mem_result) {
+    ctx->global_cycle_count += 1;
 
-    //Invalid Opcode
-    INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk    , N, printf(ANSI_FMT("[Stage MEM]Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1));
-    INSTPAT_END();
+    switch (isa_info[s->op].cls) {
+        case CLASS_ALU:
+        case CLASS_MUL:
+        case CLASS_DIV:
+        case CLASS_CSR:
+            R(s->rd) = alu_result;
+            break;
+        case CLASS_LOAD:
+        case CLASS_AMO:
+            R(s->rd) = mem_result;
+            break;
+        case CLASS_JUMP:
+            R(s->rd) = s->pc + 4;
+            break;
+        case CLASS_SYSTEM:
+        case CLASS_FENCE:
+            break;
+        default:
+            printf(ANSI_FMT("[Stage WB]Unknown Inst!\n", ANSI_FG_RED));
+            HALT(s->pc, -1);
+            break;
+    }
 
     R(0) = 0;
-
-    return;
 }
 
-void mc_WB(Decode *s, uint64_t alu_result, uint64_t mem_result) {
-    int rd = 0;
-    uint64_t src1 = 0, src2 = 0, imm = 0;
-    global_cycle_count += 1;
-
-    INSTPAT_START();
-    //RV64I
-    INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui, U, R(rd) = imm);
-    INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
-    INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s->pc + 4);
-    INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, R(rd) = s->pc + 4);
-    // BEQ, BNE, BLT, BGE, BLTU, BGEU
-    // INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B, if (src1 == src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B, if (src1 != src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B, if ((int64_t)src1 < (int64_t)src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B, if ((int64_t)src1 >= (int64_t)src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B, if (src1 < src2) s->dnpc = s->pc + imm);
-    // INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B, if (src1 >= src2) s->dnpc = s->pc + imm);
-    // LB, LH, LW, LBU, LHU, LWU, LD
-    INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb     , I, R(rd) = mem_result);
-    INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh     , I, R(rd) = mem_result);
-    INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw     , I, R(rd) = mem_result);
-    INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = mem_result);
-    INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu    , I, R(rd) = mem_result);
-    INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu    , I, R(rd) = mem_result);
-    INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld     , I, R(rd) = mem_result);
-    // SB, SH, SW
-    // INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(src1 + imm, 1, src2));
-    // INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh     , S, Mw(src1 + imm, 2, src2));
-    // INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw     , S, Mw(src1 + imm, 4, src2));
-    // INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd     , S, Mw(src1 + imm, 8, src2));
-    INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, R(rd) = alu_result);
-    // SLTI, SLTIU
-    INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, R(rd) = alu_result);
-    INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, R(rd) = alu_result);
-    // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-    INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli   , I, R(rd) = alu_result);
-    INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli   , I, R(rd) = alu_result);
-    INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai   , I, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw  , I, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw  , I, R(rd) = alu_result);
-    INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw  , I, R(rd) = alu_result);
-    // XORI, ORI, ANDI, ADDIW
-    INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, R(rd) = alu_result);
-    INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, R(rd) = alu_result);
-    INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, R(rd) = alu_result);
-    INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw  , I, R(rd) = alu_result);
-    // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-    INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R, R(rd) = alu_result);
-    INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll    , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu   , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor    , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl    , R, R(rd) = alu_result);
-    INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra    , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or     , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and    , R, R(rd) = alu_result);
-    // ADDW, SUBW, SLLW, SRLW, SRAW
-    INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw   , R, R(rd) = alu_result);
-    INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw   , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw   , R, R(rd) = alu_result);
-    INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw   , R, R(rd) = alu_result);
-    INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw   , R, R(rd) = alu_result);
-    // FENCE, FENCE.I
-    INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence  , N, NOP);
-    INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei , N, NOP);
-    // ECALL
-    INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , I); // R(10) is $a0
-    // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
-
-    // RV64M
-    // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-    INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul    , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh   , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div    , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu   , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem    , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R, R(rd) = alu_result);
-
-    // MULW, DIVW, DIVUW, REMW, REMUW
-    INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw   , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw   , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw  , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw   , R, R(rd) = alu_result);
-    INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw  , R, R(rd) = alu_result);
-
-    //Invalid Opcode
-    INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk    , N, printf(ANSI_FMT("[Stage WB]Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1));
-    INSTPAT_END();
-
-    R(0) = 0;
+void mc_latency_table(const UarchConfig *uarch, McLatency lat[OP_NUM]) {
+    for (int op = 0; op < OP_NUM; op++) {
+        const IsaInfo *info = &isa_info[op];
+        McLatency *t = &lat[op];
+        memset(t, 0, sizeof(McLatency));
+        Decode s = { .type = info->type };
+        s.is_load = info->cls == CLASS_LOAD || info->cls == CLASS_AMO;
+        int fu = fu_of_class[info->cls];
+        int latency;
+        for (Multi_Cycle_Stage stage = STAGE_IF; stage != STAGE_DONE; push_stage(&s, &stage)) {
+            switch (stage) {
+                case STAGE_IF:
+                case STAGE_ID:
+                    t->before++;
+                    break;
+                case STAGE_EX:
+                    // see mc_EX(): loads and stores only compute the address
+                    latency = fu == FU_LOAD || fu == FU_STORE ? 1 : uarch->fu[fu].latency;
+                    t->before += latency;
+                    t->extra += latency - 1;
+                    break;
+                case STAGE_MEM:
+                    latency = uarch->fu[fu].latency;
+                    t->before += latency;
+                    t->extra += latency - 1;
+                    t->mem = 1;
+                    break;
+                case STAGE_WB:
+                    t->wb = 1;
+                    break;
+                default:
+                    break;
+            }
+        }
+        t->write = info->cls != CLASS_LOAD;
+    }
+}
 
-    return;
-}
\ No newline at end of file
+// The stages without the work: the same latencies and the same cache
+// accesses, from the table
+void mc_time(SimContext *ctx, const McLatency lat[OP_NUM], const CommitRec *r) {
+    // a fetch fault stops the machine before IF is over
+    if (r->fault && !mem_in_ram(ctx, r->pc, 4)) return;
+    const McLatency *t = &lat[r->op];
+    uint64_t start = ctx->global_cycle_count;
+    uint64_t charged = ctx->cpi ? cpi_cycles(ctx->cpi) : 0;
+    mc_charge(ctx, t, r->pc, r->addr);
+    // a MEM fault stops it there
+    if (!r->fault) ctx->global_cycle_count += t->wb;
+    if (ctx->cpi) {
+        cpi_charge(ctx->cpi, CPI_BASE, r->pc, ctx->global_cycle_count - start - (cpi_cycles(ctx->cpi) - charged));
+        if (!r->fault) cpi_retire(ctx->cpi, r->pc);
+    }
+}
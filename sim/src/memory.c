@@ -2,104 +2,372 @@
 #include <gelf.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sim.h>
+#include <memory.h>
+#include <iss_core.h>
+#include <jit.h>
 #include "ftrace.h"
 
-extern uint8_t* mem;
-extern SymbolTable *sym_table;
+uint8_t* guest_to_host(SimContext *ctx, uint64_t addr) {return ctx->mem + addr - ctx->mem_base;}
 
-uint8_t* guest_to_host(uint64_t addr) {return mem + addr - MEM_BASE;}
+// ------------ Memory map ------------
 
-static inline uint64_t host_read(void *addr, int len){
-    switch(len){
-        case 1: return *(uint8_t  *)addr;
-        case 2: return *(uint16_t *)addr;
-	    case 4: return *(uint32_t *)addr;
-        case 8: return *(uint64_t *)addr;
-        default: sentinel("Invalid len for read.");
+static void tlb_flush(MemTlb *tlb) {
+    memset(tlb, 0, sizeof(MemTlb));
+}
+
+static int map_add(MemMap *map, MemRegion r) {
+    uint64_t mask = (1ull << MEM_PAGE_SHIFT) - 1;
+    check(r.size != 0 && (r.base & mask) == 0 && (r.size & mask) == 0,
+          "Region %s is not page aligned.", r.name);
+    check(r.base + r.size > r.base, "Region %s wraps around the address space.", r.name);
+    check(map->nregions < MEM_MAX_REGIONS, "Too many memory regions.");
+    int i = map->nregions;
+    while (i > 0 && map->region[i - 1].base > r.base) {
+        map->region[i] = map->region[i - 1];
+        i--;
+    }
+    map->region[i] = r;
+    map->nregions++;
+    // regions are sorted, so only the neighbours can overlap
+    if ((i > 0 && map->region[i - 1].base + map->region[i - 1].size > r.base) ||
+        (i + 1 < map->nregions && r.base + r.size > map->region[i + 1].base)) {
+        memmove(&map->region[i], &map->region[i + 1], (map->nregions - i - 1) * sizeof(MemRegion));
+        map->nregions--;
+        sentinel("Region %s [%016lx, %016lx) overlaps another one.", r.name, r.base, r.base + r.size);
     }
-error:
     return 0;
+error:
+    return -1;
 }
 
-static inline void host_write(void *addr, int len, uint64_t data){
-    switch(len){
-        case 1: *(uint8_t  *)addr = data; return;
-        case 2: *(uint16_t *)addr = data; return;
-        case 4: *(uint32_t *)addr = data; return;
-        case 8: *(uint64_t *)addr = data; return;
-        default: sentinel("Invalid len for write.");
+// Binary search, the TLB in front of it catches nearly every lookup
+static MemRegion *map_find(MemMap *map, uint64_t addr) {
+    int lo = 0, hi = map->nregions - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        MemRegion *r = &map->region[mid];
+        if (addr < r->base) {
+            hi = mid - 1;
+        } else if (addr - r->base >= r->size) {
+            lo = mid + 1;
+        } else {
+            return r;
+        }
     }
+    return NULL;
+}
+
+static inline MemRegion *mem_region(SimContext *ctx, uint64_t addr) {
+    uint64_t page = addr >> MEM_PAGE_SHIFT;
+    MemTlb *tlb = ctx->tlb;
+    int i = page & (MEM_TLB_SIZE - 1);
+    if (likely(tlb->e[i].r != NULL && tlb->e[i].page == page)) {
+        return tlb->e[i].r;
+    }
+    MemRegion *r = map_find(ctx->map, addr);
+    if (r != NULL) {
+        tlb->e[i].page = page;
+        tlb->e[i].r = r;
+    }
+    return r;
+}
+
+// Guest RAM is an anonymous mapping: the kernel hands out zero pages on
+// first touch, so only the pages the guest uses take host memory and
+// nothing has to be cleared up front.
+int mem_map(SimContext *ctx) {
+    ctx->map = calloc(1, sizeof(MemMap));
+    check_mem(ctx->map);
+    ctx->tlb = calloc(1, sizeof(MemTlb));
+    check_mem(ctx->tlb);
+    void *p = mmap(NULL, ctx->mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    check(p != MAP_FAILED, "mmap of guest memory failed.");
+    ctx->mem = p;
+    MemRegion ram = { "ram", ctx->mem_base, ctx->mem_size, ctx->mem, NULL, NULL };
+    return map_add(ctx->map, ram);
 error:
-    return;
+    return -1;
 }
 
-uint32_t inst_fetch(uint64_t pc){
-    check(pc, "PC is zero.");
-    return (*(uint32_t *)guest_to_host(pc));
+int mem_share(SimContext *h, SimContext *boot) {
+    h->mem = boot->mem;
+    h->mem_base = boot->mem_base;
+    h->mem_size = boot->mem_size;
+    h->map = boot->map;
+    h->tlb = calloc(1, sizeof(MemTlb));
+    check_mem(h->tlb);
+    return 0;
 error:
+    return -1;
+}
+
+void mem_unmap(SimContext *ctx) {
+    free(ctx->tlb);
+    ctx->tlb = NULL;
+    if (ctx == ctx->boot) {
+        if (ctx->mem != NULL) {
+            munmap(ctx->mem, ctx->mem_size);
+        }
+        if (ctx->map != NULL) {
+            for (int i = 0; i < ctx->map->nregions; i++) {
+                free(ctx->map->region[i].dev);
+            }
+            free(ctx->map);
+        }
+    }
+    ctx->mem = NULL;
+    ctx->map = NULL;
+}
+
+// Takes ownership of dev
+int mem_add_mmio(SimContext *ctx, const char *name, uint64_t base, uint64_t size,
+                 const MmioOps *ops, void *dev) {
+    MemRegion r = { name, base, size, NULL, ops, dev };
+    if (map_add(ctx->map, r) != 0) {
+        free(dev);
+        return -1;
+    }
+    tlb_flush(ctx->tlb);
     return 0;
 }
 
-uint64_t mem_read(uint64_t addr, int len){
-    check(addr - MEM_BASE < MEM_SIZE, "Read addr %016lx out of bound.", addr);
-    uint64_t ret = host_read(guest_to_host(addr), len);
-    return ret;
-error:
+void mem_dump_map(SimContext *ctx) {
+    for (int i = 0; i < ctx->map->nregions; i++) {
+        MemRegion *r = &ctx->map->region[i];
+        log_info("%-6s [%016lx, %016lx] %s", r->name, r->base, r->base + r->size - 1, r->host ? "RAM" : "MMIO");
+    }
+}
+
+// ------------ Accesses ------------
+
+uint32_t inst_fetch(SimContext *ctx, uint64_t pc){
+    // instructions only come from RAM
+    if (unlikely(!mem_in_ram(ctx, pc, 4))) {
+        raise_exception(ctx, EXC_INST_ACCESS, pc);
+        return 0;
+    }
+    return (*(uint32_t *)guest_to_host(ctx, pc));
+}
+
+// The access must fall inside the region. Crossing into the next one (or
+// the end of RAM) faults like an unmapped address.
+static inline MemRegion *mem_lookup(SimContext *ctx, uint64_t addr, int len) {
+    MemRegion *r = mem_region(ctx, addr);
+    if (r != NULL && addr - r->base <= r->size - len) {
+        return r;
+    }
+    return NULL;
+}
+
+uint64_t mem_read_slow(SimContext *ctx, uint64_t addr, int len){
+    if (mem_in_ram(ctx, addr, len)) {
+        return host_read(guest_to_host(ctx, addr), len);
+    }
+    MemRegion *r = mem_lookup(ctx, addr, len);
+    if (unlikely(r == NULL)) {
+        raise_exception(ctx, EXC_LOAD_ACCESS, addr);
+        return 0;
+    }
+    if (r->host) {
+        return host_read(r->host + (addr - r->base), len);
+    }
+    return r->ops->read(ctx, r->dev, addr - r->base, len);
+}
+
+static inline void log_store(StoreLog *log, uint64_t addr, int len, uint64_t data, uint64_t old) {
+    if (log->n < TB_MAX_INSTS) {
+        StoreRecord *r = &log->rec[log->n++];
+        r->addr = addr;
+        r->len  = len;
+        r->data = data;
+        r->old  = old;
+    }
+}
+
+void mem_write_slow(SimContext *ctx, uint64_t addr, int len, uint64_t data){
+    if (mem_in_ram(ctx, addr, len)) {
+        if (unlikely(ctx->store_log != NULL)) {
+            log_store(ctx->store_log, addr, len, data, host_read(guest_to_host(ctx, addr), len));
+        }
+        host_write(guest_to_host(ctx, addr), len, data);
+        decode_cache_invalidate(ctx, addr, len);
+        return;
+    }
+    MemRegion *r = mem_lookup(ctx, addr, len);
+    if (unlikely(r == NULL)) {
+        raise_exception(ctx, EXC_STORE_ACCESS, addr);
+        return;
+    }
+    if (r->host) {
+        host_write(r->host + (addr - r->base), len, data);
+        return;
+    }
+    r->ops->write(ctx, r->dev, addr - r->base, len, data);
+}
+
+int mem_peek(SimContext *ctx, uint64_t addr, int len, uint64_t *data) {
+    if (!mem_in_ram(ctx, addr, len)) {
+        return -1;
+    }
+    *data = host_read(guest_to_host(ctx, addr), len);
     return 0;
 }
 
-void mem_write(uint64_t addr, int len, uint64_t data){
-    check(addr - MEM_BASE < MEM_SIZE, "Write addr %016lx out of bound.", addr);
-    host_write(guest_to_host(addr), len, data);
-error:
-    return;
-}
-
-void load_image(char *filepath){
-    log_info("Physical Memory Range:[%016x, %016x].", MEM_BASE, MEM_BASE + MEM_SIZE - 1);
-    check(filepath[0] != '\0', "IMAGE file path wrong.");
-    FILE *fp = fopen(filepath, "rb");
-    check(fp, "Failed to read %s.", filepath);
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    log_info("The image is %s, size = %ld.", filepath, size);
-    fseek(fp, 0, SEEK_SET);
-    int ret = fread(guest_to_host(MEM_BASE), size, 1, fp);
-    check(ret == 1, "Load image failed.");
-    fclose(fp);
-    return;
+// ------------ Atomics ------------
 
-error:
-    if(fp) fclose(fp);
-    return;
+static uint64_t amo_minmax(AmoOp op, uint64_t a, uint64_t b, int len) {
+    int64_t sa = len == 4 ? (int32_t)a : (int64_t)a;
+    int64_t sb = len == 4 ? (int32_t)b : (int64_t)b;
+    switch (op) {
+        case AMO_MIN:  return sa < sb ? a : b;
+        case AMO_MAX:  return sa > sb ? a : b;
+        case AMO_MINU: return a < b ? a : b;
+        default:       return a > b ? a : b;
+    }
 }
 
-void load_elf_symbols(const char *file_path) {
-    int fd;
-    Elf *elf;
-    GElf_Ehdr ehdr;
-    init_symbol_table(sym_table);
+#define AMO_ON(type, p, op, data, old) do { \
+    type *ptr = (type *)(p), val = (data), cur, next; \
+    switch (op) { \
+        case AMO_SWAP: cur = __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST); break; \
+        case AMO_ADD:  cur = __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST); break; \
+        case AMO_XOR:  cur = __atomic_fetch_xor(ptr, val, __ATOMIC_SEQ_CST); break; \
+        case AMO_AND:  cur = __atomic_fetch_and(ptr, val, __ATOMIC_SEQ_CST); break; \
+        case AMO_OR:   cur = __atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST); break; \
+        default: \
+            cur = __atomic_load_n(ptr, __ATOMIC_RELAXED); \
+            do { \
+                next = amo_minmax(op, cur, val, sizeof(type)); \
+            } while (!__atomic_compare_exchange_n(ptr, &cur, next, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)); \
+            break; \
+    } \
+    old = cur; \
+} while (0)
 
-    if (elf_version(EV_CURRENT) == EV_NONE) {
-        fprintf(stderr, "ELF library initialization failed: %s\n", elf_errmsg(-1));
-        exit(1);
+// Atomics only work on naturally aligned RAM
+static inline int amo_ok(SimContext *ctx, uint64_t addr, int len, uint64_t misaligned, uint64_t fault) {
+    if (unlikely((addr & (len - 1)) != 0)) {
+        raise_exception(ctx, misaligned, addr);
+        return 0;
+    }
+    if (unlikely(!mem_in_ram(ctx, addr, len))) {
+        raise_exception(ctx, fault, addr);
+        return 0;
     }
+    return 1;
+}
 
-    if ((fd = open(file_path, O_RDONLY, 0)) < 0) {
-        perror("open");
-        exit(1);
+// Returns the old value, zero-extended
+uint64_t mem_amo(SimContext *ctx, uint64_t addr, int len, AmoOp op, uint64_t data) {
+    uint64_t old;
+    if (unlikely(!amo_ok(ctx, addr, len, EXC_STORE_MISALIGNED, EXC_STORE_ACCESS))) {
+        return 0;
+    }
+    if (len == 4) {
+        AMO_ON(uint32_t, guest_to_host(ctx, addr), op, data, old);
+    } else {
+        AMO_ON(uint64_t, guest_to_host(ctx, addr), op, data, old);
     }
+    if (unlikely(ctx->store_log != NULL)) {
+        log_store(ctx->store_log, addr, len, host_read(guest_to_host(ctx, addr), len), old);
+    }
+    decode_cache_invalidate(ctx, addr, len);
+    return old;
+}
 
-    if ((elf = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
-        fprintf(stderr, "elf_begin() failed: %s\n", elf_errmsg(-1));
-        exit(1);
+uint64_t mem_lr(SimContext *ctx, uint64_t addr, int len) {
+    uint64_t val;
+    if (unlikely(!amo_ok(ctx, addr, len, EXC_LOAD_MISALIGNED, EXC_LOAD_ACCESS))) {
+        return 0;
     }
+    val = len == 4 ? __atomic_load_n((uint32_t *)guest_to_host(ctx, addr), __ATOMIC_SEQ_CST)
+                   : __atomic_load_n((uint64_t *)guest_to_host(ctx, addr), __ATOMIC_SEQ_CST);
+    ctx->resv_valid = 1;
+    ctx->resv_addr  = addr;
+    ctx->resv_value = val;
+    return val;
+}
 
-    if (gelf_getehdr(elf, &ehdr) == NULL) {
-        fprintf(stderr, "gelf_getehdr() failed: %s\n", elf_errmsg(-1));
-        exit(1);
+// The reservation holds as long as memory still has the value lr read, so
+// sc is a compare-and-swap against it. Returns 0 on success, 1 on failure.
+uint64_t mem_sc(SimContext *ctx, uint64_t addr, int len, uint64_t data) {
+    if (unlikely(!amo_ok(ctx, addr, len, EXC_STORE_MISALIGNED, EXC_STORE_ACCESS))) {
+        return 0;
+    }
+    int ok = ctx->resv_valid && ctx->resv_addr == addr;
+    ctx->resv_valid = 0;
+    if (!ok) {
+        return 1;
+    }
+    if (len == 4) {
+        uint32_t expect = ctx->resv_value;
+        ok = __atomic_compare_exchange_n((uint32_t *)guest_to_host(ctx, addr), &expect, (uint32_t)data,
+                                         0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    } else {
+        uint64_t expect = ctx->resv_value;
+        ok = __atomic_compare_exchange_n((uint64_t *)guest_to_host(ctx, addr), &expect, data,
+                                         0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    if (!ok) {
+        return 1;
     }
+    if (unlikely(ctx->store_log != NULL)) {
+        log_store(ctx->store_log, addr, len, data, ctx->resv_value);
+    }
+    decode_cache_invalidate(ctx, addr, len);
+    return 0;
+}
 
+// ------------ ELF loading ------------
+
+static int read_full(int fd, uint8_t *dst, uint64_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, dst, len, off);
+        check(n > 0, "Short read from the ELF file.");
+        dst += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+error:
+    return -1;
+}
+
+// Whole pages of the segment that line up with the file are mapped from it
+// with MAP_PRIVATE, so they share the page cache until the guest writes
+// them. The partial pages at either end are copied. Guest RAM is a fresh
+// anonymous mapping, so the rest of p_memsz (.bss) is already zero.
+static int load_segment(SimContext *ctx, int fd, const GElf_Phdr *ph) {
+    uint64_t pgsize = sysconf(_SC_PAGESIZE);
+    uint8_t *host = guest_to_host(ctx, ph->p_paddr);
+    uint64_t len = ph->p_filesz, off = ph->p_offset;
+    uint64_t head = 0, mapped = 0;
+    if (((uintptr_t)host & (pgsize - 1)) == (off & (pgsize - 1))) {
+        head = (pgsize - (off & (pgsize - 1))) & (pgsize - 1);
+        if (len > head) {
+            mapped = (len - head) & ~(pgsize - 1);
+        }
+    }
+    if (mapped > 0) {
+        void *p = mmap(host + head, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off + head);
+        check(p != MAP_FAILED, "mmap of segment at %016lx failed.", ph->p_paddr);
+    } else {
+        head = len;
+    }
+    check(read_full(fd, host, head, off) == 0, "Failed to load segment at %016lx.", ph->p_paddr);
+    check(read_full(fd, host + head + mapped, len - head - mapped, off + head + mapped) == 0,
+          "Failed to load segment at %016lx.", ph->p_paddr);
+    log_info("Segment [%016lx, %016lx), %lu bytes from the file, %lu of them mapped.",
+             ph->p_paddr, ph->p_paddr + ph->p_memsz, len, mapped);
+    return 0;
+error:
+    return -1;
+}
+
+static void load_symbols(SimContext *ctx, Elf *elf) {
     Elf_Scn *scn = NULL;
     GElf_Shdr shdr;
     while ((scn = elf_nextscn(elf, scn)) != NULL) {
@@ -115,14 +383,51 @@ void load_elf_symbols(const char *file_path) {
 
                 if (GELF_ST_TYPE(sym.st_info) == STT_FUNC) {
                     const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
-                    if (sym_table) {
-                        add_func_symbol(sym_table, sym.st_value, name);
-                    }
+                    add_func_symbol(&ctx->sym_table, sym.st_value, name);
                 }
             }
         }
     }
+    sort_symbols_by_address(&ctx->sym_table);
+}
+
+int load_elf(SimContext *ctx, const char *filepath, int symbols) {
+    int fd = -1;
+    Elf *elf = NULL;
+    GElf_Ehdr ehdr;
+    size_t nphdr;
+    check(elf_version(EV_CURRENT) != EV_NONE, "ELF library initialization failed: %s", elf_errmsg(-1));
+    fd = open(filepath, O_RDONLY, 0);
+    check(fd >= 0, "Failed to read %s.", filepath);
+    elf = elf_begin(fd, ELF_C_READ, NULL);
+    check(elf, "elf_begin() failed: %s", elf_errmsg(-1));
+    check(gelf_getehdr(elf, &ehdr), "gelf_getehdr() failed: %s", elf_errmsg(-1));
+    check(ehdr.e_ident[EI_CLASS] == ELFCLASS64 && ehdr.e_machine == EM_RISCV, "%s is not a RV64 ELF.", filepath);
+    check(elf_getphdrnum(elf, &nphdr) == 0, "elf_getphdrnum() failed: %s", elf_errmsg(-1));
+
+    for (size_t i = 0; i < nphdr; i++) {
+        GElf_Phdr ph;
+        check(gelf_getphdr(elf, i, &ph), "gelf_getphdr() failed: %s", elf_errmsg(-1));
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0) continue;
+        check(ph.p_filesz <= ph.p_memsz, "Bad segment at %016lx.", ph.p_paddr);
+        check(ph.p_paddr - ctx->mem_base < ctx->mem_size &&
+              ph.p_memsz <= ctx->mem_size - (ph.p_paddr - ctx->mem_base),
+              "Segment [%016lx, %016lx) does not fit in memory.", ph.p_paddr, ph.p_paddr + ph.p_memsz);
+        check(load_segment(ctx, fd, &ph) == 0, "Load image failed.");
+    }
+    check(ehdr.e_entry - ctx->mem_base < ctx->mem_size, "Entry point %016lx is outside memory.", ehdr.e_entry);
+    ctx->entry = ehdr.e_entry;
+    log_info("The image is %s, entry = %016lx.", filepath, ctx->entry);
 
+    if (symbols) {
+        load_symbols(ctx, elf);
+    }
     elf_end(elf);
     close(fd);
-}
\ No newline at end of file
+    return 0;
+
+error:
+    if (elf) elf_end(elf);
+    if (fd >= 0) close(fd);
+    return -1;
+}
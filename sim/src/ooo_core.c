@@ -0,0 +1,394 @@
+#include <common.h>
+#include <ooo_core.h>
+#include <commit.h>
+#include <isa_table.h>
+#include <memory.h>
+#include <sim.h>
+#include <stats.h>
+
+// Cycles from fetch to rename: decode and rename
+#define OOO_FRONTEND 2
+
+// Why rename sent nothing in a cycle
+enum {
+    STALL_FRONTEND,     // nothing fetched yet, after a misprediction or an I$ miss
+    STALL_ROB,
+    STALL_IQ,
+    STALL_LQ,
+    STALL_SQ,
+    STALL_REGS,         // no free physical register
+    STALL_SERIAL,       // CSR, system, fence and AMO run alone
+    STALL_NUM
+};
+
+// What the oldest instruction was when commit retired nothing
+enum { HEAD_LOAD, HEAD_STORE, HEAD_MULDIV, HEAD_OTHER, HEAD_NUM };
+
+typedef struct {
+    uint64_t seq;           // program order, from 1
+    uint64_t pc;
+    uint8_t op;
+    uint8_t cls;
+    uint8_t rd;             // 0: writes no register
+    uint8_t rs[2];          // 0: not read
+    uint64_t src[2];        // producers of rs, after rename
+    uint64_t addr;          // loads, stores and AMOs
+    int size;
+    int latency;
+    int serial;
+    int mispredicted;       // fetch waits until it has executed
+    uint64_t ready;         // cycle it reaches rename
+    int issued;
+    uint64_t done;          // cycle its result is there, once issued
+} OooInst;
+
+typedef struct {
+    uint64_t committed;
+    uint64_t mispredicts;
+    uint64_t rob_occupancy;     // summed every cycle
+    uint64_t iq_occupancy;
+    uint64_t rename_stall[STALL_NUM];
+    uint64_t commit_stall[HEAD_NUM];
+    uint64_t issued;
+    uint64_t loads_forwarded;   // from an older store in the store queue
+    uint64_t load_wait_addr;    // cycles an older store address was unknown
+    uint64_t load_wait_partial; // cycles an older store covered part of the load
+} OooStats;
+
+struct OooCore {
+    OooConfig cfg;
+    uint64_t cycle;
+    uint64_t next_seq;          // given to the next instruction fetched
+    // fetch queue, between fetch and rename
+    OooInst *fq;
+    int fq_size, fq_head, fq_count;
+    // reorder buffer, the entry of seq is rob[seq % cfg.rob]
+    OooInst *rob;
+    uint64_t rob_head;          // seq of the oldest instruction in flight
+    uint64_t rob_tail;          // seq of the next one to rename
+    uint64_t rename[32];        // youngest producer of each architectural register
+    uint64_t *iq;               // seqs waiting to issue, oldest first
+    int iq_count;
+    uint64_t *sq;               // seqs of the stores in flight, oldest first
+    int sq_head, sq_count;
+    int lq_count;
+    int free_regs;
+    int serial;                 // a serializing instruction is in flight
+    uint64_t fetch_resume;      // an I$ miss holds fetch until this cycle
+    uint64_t redirect;          // seq of the mispredicted transfer fetch waits for
+    uint64_t fu_free[FU_NUM][FU_MAX_UNITS];    // cycle each unit takes a new operation
+    OooStats st;
+};
+
+OooCore *ooo_create(const OooConfig *cfg) {
+    OooCore *o = NULL;
+    check(cfg->width >= 1 && cfg->width <= OOO_MAX_WIDTH, "ooo: the width must be 1 to %d.", OOO_MAX_WIDTH);
+    check(cfg->issue_width >= 1 && cfg->issue_width <= OOO_MAX_WIDTH, "ooo: the issue width must be 1 to %d.", OOO_MAX_WIDTH);
+    check(cfg->rob >= cfg->width, "ooo: the ROB needs at least width entries.");
+    check(cfg->iq >= 1 && cfg->lq >= 1 && cfg->sq >= 1, "ooo: the issue, load and store queues need an entry.");
+    check(cfg->prf > 32, "ooo: there must be more than 32 physical registers.");
+
+    o = calloc(1, sizeof(OooCore));
+    check_mem(o);
+    o->cfg = *cfg;
+    o->fq_size = cfg->width * (OOO_FRONTEND + 2);
+    o->fq = calloc(o->fq_size, sizeof(OooInst));
+    check_mem(o->fq);
+    o->rob = calloc(cfg->rob, sizeof(OooInst));
+    check_mem(o->rob);
+    o->iq = calloc(cfg->iq, sizeof(uint64_t));
+    check_mem(o->iq);
+    o->sq = calloc(cfg->sq, sizeof(uint64_t));
+    check_mem(o->sq);
+    o->next_seq = o->rob_head = o->rob_tail = 1;
+    o->free_regs = cfg->prf - 32;
+    return o;
+
+error:
+    ooo_free(o);
+    return NULL;
+}
+
+void ooo_free(OooCore *o) {
+    if (!o) return;
+    free(o->fq);
+    free(o->rob);
+    free(o->iq);
+    free(o->sq);
+    free(o);
+}
+
+static inline OooInst *rob_entry(OooCore *o, uint64_t seq) {
+    return &o->rob[seq % o->cfg.rob];
+}
+
+static inline int ooo_is_load(const OooInst *e) {
+    return e->cls == CLASS_LOAD || e->cls == CLASS_AMO;
+}
+
+static inline int ooo_is_store(const OooInst *e) {
+    return e->cls == CLASS_STORE || e->cls == CLASS_AMO;
+}
+
+// Has the producer seq written its result by now? 0 and committed
+// instructions are in the architectural registers.
+static inline int src_ready(OooCore *o, uint64_t seq) {
+    if (seq < o->rob_head) return 1;
+    OooInst *p = rob_entry(o, seq);
+    return p->issued && p->done <= o->cycle;
+}
+
+// ------------ Commit ------------
+
+static void ooo_commit(SimContext *ctx, OooCore *o) {
+    int n;
+    for (n = 0; n < o->cfg.width && o->rob_head != o->rob_tail; n++) {
+        OooInst *e = rob_entry(o, o->rob_head);
+        if (!e->issued || e->done > o->cycle) break;
+        if (ooo_is_store(e)) {
+            // stores write the D$ when they commit, from a write buffer
+            if (ctx->dcache && mem_in_ram(ctx, e->addr, 1)) cache_access(ctx->dcache, e->addr, 1);
+            o->sq_head = (o->sq_head + 1) % o->cfg.sq;
+            o->sq_count--;
+        }
+        if (ooo_is_load(e)) o->lq_count--;
+        if (e->rd) o->free_regs++;
+        if (e->serial) o->serial = 0;
+        o->rob_head++;
+    }
+    o->st.committed += n;
+    if (n == 0 && o->rob_head != o->rob_tail) {
+        OooInst *e = rob_entry(o, o->rob_head);
+        if (ooo_is_load(e)) o->st.commit_stall[HEAD_LOAD]++;
+        else if (ooo_is_store(e)) o->st.commit_stall[HEAD_STORE]++;
+        else if (e->cls == CLASS_MUL || e->cls == CLASS_DIV) o->st.commit_stall[HEAD_MULDIV]++;
+        else o->st.commit_stall[HEAD_OTHER]++;
+    }
+}
+
+// ------------ Issue ------------
+
+// Latency of the load e, or 0 if it has to wait. The youngest older store
+// writing any of its bytes decides: one writing all of them forwards its
+// data, one writing a part must reach the D$ first. A store whose address
+// is not known yet holds every younger load.
+static int load_latency(SimContext *ctx, OooCore *o, OooInst *e) {
+    for (int i = o->sq_count - 1; i >= 0; i--) {
+        OooInst *s = rob_entry(o, o->sq[(o->sq_head + i) % o->cfg.sq]);
+        if (s->seq >= e->seq) continue;
+        if (!s->issued || s->done > o->cycle) {
+            o->st.load_wait_addr++;
+            return 0;
+        }
+        if (s->addr + s->size <= e->addr || e->addr + e->size <= s->addr) continue;
+        if (s->addr <= e->addr && e->addr + e->size <= s->addr + s->size) {
+            o->st.loads_forwarded++;
+            return ctx->uarch.fu[FU_LOAD].latency + 1;
+        }
+        o->st.load_wait_partial++;
+        return 0;
+    }
+    // address generation, then the D$. Devices are not cached.
+    int agen = ctx->uarch.fu[FU_LOAD].latency;
+    if (ctx->dcache && mem_in_ram(ctx, e->addr, 1)) return agen + cache_access(ctx->dcache, e->addr, 0);
+    return agen + 1;
+}
+
+// A unit of fu free this cycle, or -1
+static int free_unit(SimContext *ctx, OooCore *o, int fu) {
+    for (int u = 0; u < ctx->uarch.fu[fu].units; u++) {
+        if (o->fu_free[fu][u] <= o->cycle) return u;
+    }
+    return -1;
+}
+
+// Oldest first, up to issue_width a cycle, each to a free unit of its kind
+// (--uarch). A unit that is not pipelined stays busy for its interval.
+static void ooo_issue(SimContext *ctx, OooCore *o) {
+    int issued = 0;
+    int left = 0;
+    for (int i = 0; i < o->iq_count; i++) {
+        OooInst *e = rob_entry(o, o->iq[i]);
+        int fu = fu_of_class[e->cls];
+        int latency = e->latency;
+        int unit = -1;
+        int go = issued < o->cfg.issue_width &&
+                 src_ready(o, e->src[0]) && src_ready(o, e->src[1]) &&
+                 (unit = free_unit(ctx, o, fu)) >= 0;
+        if (go && ooo_is_load(e)) {
+            go = (latency = load_latency(ctx, o, e)) != 0;
+        }
+        if (!go) {
+            o->iq[left++] = o->iq[i];
+            continue;
+        }
+        e->issued = 1;
+        e->done = o->cycle + latency;
+        issued++;
+        o->fu_free[fu][unit] = o->cycle + ctx->uarch.fu[fu].interval;
+    }
+    o->iq_count = left;
+    o->st.issued += issued;
+}
+
+// ------------ Rename and dispatch ------------
+
+static int rename_stall(OooCore *o, const OooInst *f) {
+    if (o->rob_tail - o->rob_head == (uint64_t)o->cfg.rob) return STALL_ROB;
+    if (o->serial || (f->serial && o->rob_head != o->rob_tail)) return STALL_SERIAL;
+    if (o->iq_count == o->cfg.iq) return STALL_IQ;
+    if (ooo_is_load(f) && o->lq_count == o->cfg.lq) return STALL_LQ;
+    if (ooo_is_store(f) && o->sq_count == o->cfg.sq) return STALL_SQ;
+    if (f->rd && !o->free_regs) return STALL_REGS;
+    return -1;
+}
+
+static void ooo_dispatch(OooCore *o) {
+    for (int n = 0; n < o->cfg.width; n++) {
+        OooInst *f = &o->fq[o->fq_head];
+        int stall = !o->fq_count || f->ready > o->cycle ? STALL_FRONTEND : rename_stall(o, f);
+        if (stall >= 0) {
+            if (n == 0) o->st.rename_stall[stall]++;
+            return;
+        }
+        OooInst *e = rob_entry(o, f->seq);
+        *e = *f;
+        o->fq_head = (o->fq_head + 1) % o->fq_size;
+        o->fq_count--;
+        o->rob_tail++;
+
+        // read the rename table, then point rd at the new instruction
+        for (int i = 0; i < 2; i++) {
+            e->src[i] = e->rs[i] ? o->rename[e->rs[i]] : 0;
+        }
+        if (e->rd) {
+            o->rename[e->rd] = e->seq;
+            o->free_regs--;
+        }
+        o->iq[o->iq_count++] = e->seq;
+        if (ooo_is_load(e)) o->lq_count++;
+        if (ooo_is_store(e)) {
+            o->sq[(o->sq_head + o->sq_count) % o->cfg.sq] = e->seq;
+            o->sq_count++;
+        }
+        if (e->serial) o->serial = 1;
+    }
+}
+
+// ------------ Fetch ------------
+
+// Up to width instructions in a row, run by the ISS as they are fetched. A
+// group ends after a taken transfer, and fetch stops at a mispredicted one
+// until it has executed.
+static void ooo_fetch(SimContext *ctx, OooCore *o) {
+    if (o->redirect) {
+        if (o->redirect >= o->rob_tail || !src_ready(o, o->redirect)) return;
+        o->redirect = 0;
+    }
+    if (o->cycle < o->fetch_resume) return;
+
+    for (int n = 0; n < o->cfg.width && ctx->running && o->fq_count < o->fq_size; n++) {
+        CommitRec r;
+        if (!commit_next(ctx, &r)) return;
+        uint64_t pc = r.pc;
+        OooInst *e = &o->fq[(o->fq_head + o->fq_count) % o->fq_size];
+        memset(e, 0, sizeof(OooInst));
+        e->pc = pc;
+        e->op = r.op;
+        e->cls = isa_info[r.op].cls;
+        e->rd = r.rd;
+        e->rs[0] = r.rs1;
+        e->rs[1] = r.rs2;
+        e->latency = ctx->uarch.fu[fu_of_class[e->cls]].latency;
+        e->serial = e->cls == CLASS_CSR || e->cls == CLASS_SYSTEM ||
+                    e->cls == CLASS_FENCE || e->cls == CLASS_AMO;
+        if (ooo_is_load(e) || ooo_is_store(e)) {
+            e->addr = r.addr;
+            e->size = 1 << (BITS(r.inst, 14, 12) & 3);
+        }
+        int stall = mem_in_ram(ctx, pc, 4) ? cache_stall(ctx->icache, pc, 0) : 0;
+
+        // without a predictor, always not-taken
+        BpMeta m;
+        uint64_t predicted = pc + 4;
+        if (ctx->bp) {
+            bp_predict(ctx->bp, pc, &m);
+            predicted = m.next_pc;
+        }
+        // a fault stopped the machine, the instruction never happened
+        if (r.fault) return;
+        uint64_t next = r.next_pc;
+        if (ctx->bp) {
+            bp_update(ctx->bp, pc, &m, bp_classify(r.inst), next != pc + 4, next, next != predicted);
+        }
+
+        e->seq = o->next_seq++;
+        e->ready = o->cycle + stall + OOO_FRONTEND;
+        o->fq_count++;
+        if (stall) {
+            o->fetch_resume = o->cycle + stall + 1;
+            return;
+        }
+        if (next != predicted) {
+            e->mispredicted = 1;
+            o->redirect = e->seq;
+            o->st.mispredicts++;
+            return;
+        }
+        if (next != pc + 4) return;
+    }
+}
+
+int ooo_step(SimContext *ctx) {
+    OooCore *o = ctx->ooo;
+    ctx->global_cycle_count = ++o->cycle;
+    ooo_commit(ctx, o);
+    ooo_issue(ctx, o);
+    ooo_dispatch(o);
+    ooo_fetch(ctx, o);
+    o->st.rob_occupancy += o->rob_tail - o->rob_head;
+    o->st.iq_occupancy += o->iq_count;
+    return ctx->running || o->fq_count || o->rob_head != o->rob_tail;
+}
+
+void ooo_report(const SimContext *ctx) {
+    const OooCore *o = ctx->ooo;
+    const OooStats *st = &o->st;
+    double cycles = o->cycle ? o->cycle : 1;
+    printf(ANSI_FMT("\twidth %d, issue %d: IPC = %.3f, %.2f issued per cycle\n"
+                    "\tROB %d: %.1f in flight on average, IQ %d: %.1f waiting, LQ %d, SQ %d, %d physical registers\n"
+                    "\tmispredicts = %lu\n", ANSI_FG_YELLOW),
+           o->cfg.width, o->cfg.issue_width, st->committed / cycles, st->issued / cycles,
+           o->cfg.rob, st->rob_occupancy / cycles, o->cfg.iq, st->iq_occupancy / cycles,
+           o->cfg.lq, o->cfg.sq, o->cfg.prf, st->mispredicts);
+    printf(ANSI_FMT("\trename stalled: frontend %lu, rob full %lu, iq full %lu, lq full %lu, sq full %lu, registers %lu, serializing %lu cycles\n"
+                    "\tcommit stalled on: load %lu, store %lu, mul/div %lu, other %lu cycles\n"
+                    "\tloads: %lu forwarded from stores, waited %lu cycles for store addresses, %lu for partial overlaps\n", ANSI_FG_YELLOW),
+           st->rename_stall[STALL_FRONTEND], st->rename_stall[STALL_ROB], st->rename_stall[STALL_IQ],
+           st->rename_stall[STALL_LQ], st->rename_stall[STALL_SQ], st->rename_stall[STALL_REGS],
+           st->rename_stall[STALL_SERIAL],
+           st->commit_stall[HEAD_LOAD], st->commit_stall[HEAD_STORE], st->commit_stall[HEAD_MULDIV],
+           st->commit_stall[HEAD_OTHER],
+           st->loads_forwarded, st->load_wait_addr, st->load_wait_partial);
+}
+
+void ooo_register_stats(const OooCore *o, Stats *s) {
+    static const char *stall_name[STALL_NUM] = { "frontend", "rob", "iq", "lq", "sq", "regs", "serial" };
+    static const char *head_name[HEAD_NUM] = { "load", "store", "muldiv", "other" };
+    const OooStats *st = &o->st;
+    stats_counter(s, &o->cycle, "ooo.cycles");
+    stats_counter(s, &st->committed, "ooo.committed");
+    stats_counter(s, &st->issued, "ooo.issued");
+    stats_counter(s, &st->mispredicts, "ooo.mispredicts");
+    stats_counter(s, &st->rob_occupancy, "ooo.rob_occupancy");
+    stats_counter(s, &st->iq_occupancy, "ooo.iq_occupancy");
+    for (int k = 0; k < STALL_NUM; k++) stats_counter(s, &st->rename_stall[k], "ooo.rename_stall.%s", stall_name[k]);
+    for (int k = 0; k < HEAD_NUM; k++) stats_counter(s, &st->commit_stall[k], "ooo.commit_stall.%s", head_name[k]);
+    stats_counter(s, &st->loads_forwarded, "ooo.loads.forwarded");
+    stats_counter(s, &st->load_wait_addr, "ooo.loads.wait_addr");
+    stats_counter(s, &st->load_wait_partial, "ooo.loads.wait_partial");
+    stats_formula(s, "ooo.committed", "ooo.cycles", 1, "ooo.ipc");
+    stats_formula(s, "ooo.issued", "ooo.cycles", 1, "ooo.issued_per_cycle");
+    stats_formula(s, "ooo.rob_occupancy", "ooo.cycles", 1, "ooo.rob_avg");
+    stats_formula(s, "ooo.iq_occupancy", "ooo.cycles", 1, "ooo.iq_avg");
+}
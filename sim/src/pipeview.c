@@ -0,0 +1,257 @@
+#include <common.h>
+#include <disasm.h>
+#include <pipeview.h>
+
+extern LLVMDisasmContextRef disasm_ctx;
+
+#define PV_BUF_SIZE (4 << 20)
+#define PV_LINE_MAX 256     // longest command, with its label
+#define PV_INFLIGHT 256     // more than the pipeline can hold, a power of 2
+#define PV_PENDING  32      // retired in one cycle, at most PL_MAX_WIDTH
+#define PV_MEMO     4096    // disassembled instructions, a power of 2
+
+static const char *stage_name[PV_NUM] = { "F", "D", "X", "M", "W" };
+
+typedef struct {
+    uint64_t id;            // 0: free
+    int stage;              // -1 before IF
+    const char *note;       // the last one written
+} PvInst;
+
+typedef struct {
+    uint64_t pc;
+    uint32_t inst;
+    char text[64];          // empty: not disassembled yet
+} PvMemo;
+
+struct PipeView {
+    FILE *fp;
+    const char *path;
+    char *buf;              // commands not written yet
+    size_t len;
+    const uint64_t *cycle, *ninst;
+    uint64_t from, to;
+    int cycles;
+    uint64_t last_cycle;    // of the last command
+    uint64_t next_id;
+    uint64_t retired;
+    PvInst inflight[PV_INFLIGHT];
+    // Konata ends an instruction at the cycle of R, so WB would not show.
+    // Retirements are written when the next cycle starts.
+    uint64_t pending[PV_PENDING];
+    int npending;
+    PvMemo *memo;
+};
+
+// ------------ Buffered writer ------------
+
+static void pv_drain(PipeView *pv) {
+    if (pv->len) fwrite(pv->buf, 1, pv->len, pv->fp);
+    pv->len = 0;
+}
+
+// Appends build in a local copy and memcpy it, a byte at a time through
+// pv->buf would reload pv->len after every store
+static inline void put_str(PipeView *pv, const char *s) {
+    size_t n = strlen(s);
+    memcpy(pv->buf + pv->len, s, n);
+    pv->len += n;
+}
+
+static inline void put_u64(PipeView *pv, uint64_t v) {
+    char tmp[20];
+    int n = sizeof(tmp);
+    do {
+        tmp[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    memcpy(pv->buf + pv->len, tmp + n, sizeof(tmp) - n);
+    pv->len += sizeof(tmp) - n;
+}
+
+// At least 8 digits, like the pcs of itrace
+static inline void put_hex(PipeView *pv, uint64_t v) {
+    char tmp[16];
+    int n = sizeof(tmp);
+    do {
+        tmp[--n] = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v || n > (int)sizeof(tmp) - 8);
+    memcpy(pv->buf + pv->len, tmp + n, sizeof(tmp) - n);
+    pv->len += sizeof(tmp) - n;
+}
+
+// Start a command, the buffer has room for one line
+static inline void put_cmd(PipeView *pv, const char *cmd, uint64_t id) {
+    if (pv->len > PV_BUF_SIZE - PV_LINE_MAX) pv_drain(pv);
+    put_str(pv, cmd);
+    put_str(pv, "\t");
+    put_u64(pv, id - 1);    // Konata counts from 0
+}
+
+static void put_retire(PipeView *pv, uint64_t id, int flush) {
+    put_cmd(pv, "R", id);
+    put_str(pv, "\t");
+    put_u64(pv, flush ? 0 : pv->retired++);
+    put_str(pv, flush ? "\t1\n" : "\t0\n");
+}
+
+static void put_cycles(PipeView *pv, uint64_t n) {
+    if (pv->len > PV_BUF_SIZE - PV_LINE_MAX) pv_drain(pv);
+    put_str(pv, "C\t");
+    put_u64(pv, n);
+    put_str(pv, "\n");
+}
+
+// Bring the file to the current cycle, the retirements of the last one go
+// to the cycle after it
+static void pv_sync(PipeView *pv) {
+    uint64_t now = *pv->cycle;
+    if (now == pv->last_cycle) return;
+    uint64_t delta = now - pv->last_cycle;
+    if (pv->npending) {
+        put_cycles(pv, 1);
+        for (int i = 0; i < pv->npending; i++) put_retire(pv, pv->pending[i], 0);
+        pv->npending = 0;
+        delta--;
+    }
+    if (delta) put_cycles(pv, delta);
+    pv->last_cycle = now;
+}
+
+// ------------ Instructions ------------
+
+static inline PvInst *pv_inst(PipeView *pv, uint64_t id) {
+    return &pv->inflight[id & (PV_INFLIGHT - 1)];
+}
+
+// Disassembly of a hot loop is looked up, not redone by LLVM
+static const char *pv_disasm(PipeView *pv, uint64_t pc, uint32_t inst) {
+    PvMemo *m = &pv->memo[(pc >> 2) & (PV_MEMO - 1)];
+    if (m->text[0] && m->pc == pc && m->inst == inst) return m->text;
+    uint8_t bytes[4] = { inst & 0xFF, (inst >> 8) & 0xFF, (inst >> 16) & 0xFF, (inst >> 24) & 0xFF };
+    disassemble_inst(disasm_ctx, bytes, 4, pc, m->text, sizeof(m->text));
+    m->pc = pc;
+    m->inst = inst;
+    // LLVM starts with a tab, and Konata splits commands at tabs
+    char *c = m->text;
+    while (*c == '\t' || *c == ' ') c++;
+    memmove(m->text, c, strlen(c) + 1);
+    for (c = m->text; *c; c++) {
+        if (*c == '\t') *c = ' ';
+    }
+    return m->text;
+}
+
+PipeView *pv_create(const PipeViewConfig *cfg, const uint64_t *cycle, const uint64_t *ninst) {
+    PipeView *pv = calloc(1, sizeof(PipeView));
+    check_mem(pv);
+    pv->path = cfg->path;
+    pv->buf = malloc(PV_BUF_SIZE);
+    pv->memo = calloc(PV_MEMO, sizeof(PvMemo));
+    check_mem(pv->buf && pv->memo);
+    pv->fp = fopen(cfg->path, "w");
+    check(pv->fp, "Can not write the pipeline view to %s.", cfg->path);
+    pv->cycle = cycle;
+    pv->ninst = ninst;
+    pv->from = cfg->from;
+    pv->to = cfg->to;
+    pv->cycles = cfg->cycles;
+    pv->last_cycle = *cycle;
+    pv->next_id = 1;
+    put_str(pv, "Kanata\t0004\nC=\t");
+    put_u64(pv, *cycle);
+    put_str(pv, "\n");
+    return pv;
+
+error:
+    if (pv) {
+        free(pv->buf);
+        free(pv->memo);
+        free(pv);
+    }
+    return NULL;
+}
+
+void pv_close(PipeView *pv) {
+    if (!pv) return;
+    pv_sync(pv);
+    if (pv->npending) put_cycles(pv, 1);
+    for (int i = 0; i < pv->npending; i++) put_retire(pv, pv->pending[i], 0);
+    for (int i = 0; i < PV_INFLIGHT; i++) {
+        if (pv->inflight[i].id) put_retire(pv, pv->inflight[i].id, 1);
+    }
+    pv_drain(pv);
+    if (fclose(pv->fp) == 0) log_info("Pipeline view written to %s.", pv->path);
+    else log_err("Can not write the pipeline view to %s.", pv->path);
+    free(pv->buf);
+    free(pv->memo);
+    free(pv);
+}
+
+uint64_t pv_fetch(PipeView *pv, uint64_t pc, uint32_t inst) {
+    uint64_t clock = pv->cycles ? *pv->cycle : *pv->ninst;
+    if (clock < pv->from || (pv->to && clock >= pv->to)) return 0;
+    pv_sync(pv);
+    uint64_t id = pv->next_id++;
+    PvInst *p = pv_inst(pv, id);
+    p->id = id;
+    p->stage = -1;
+    p->note = NULL;
+    put_cmd(pv, "I", id);
+    put_str(pv, "\t");
+    put_u64(pv, id - 1);
+    put_str(pv, "\t0\n");
+    put_cmd(pv, "L", id);
+    put_str(pv, "\t0\t");
+    put_hex(pv, pc);
+    put_str(pv, ": ");
+    put_str(pv, pv_disasm(pv, pc, inst));
+    put_str(pv, "\n");
+    pv_stage(pv, id, PV_IF);
+    return id;
+}
+
+void pv_stage(PipeView *pv, uint64_t id, PvStage stage) {
+    if (!id) return;
+    PvInst *p = pv_inst(pv, id);
+    if (p->stage == (int)stage) return;
+    pv_sync(pv);
+    p->stage = stage;
+    put_cmd(pv, "S", id);
+    put_str(pv, "\t0\t");
+    put_str(pv, stage_name[stage]);
+    put_str(pv, "\n");
+}
+
+void pv_note(PipeView *pv, uint64_t id, const char *note) {
+    if (!id) return;
+    PvInst *p = pv_inst(pv, id);
+    if (p->note == note) return;
+    pv_sync(pv);
+    p->note = note;
+    put_cmd(pv, "L", id);
+    put_str(pv, "\t1\t");
+    put_str(pv, stage_name[p->stage]);
+    put_str(pv, ": ");
+    put_str(pv, note);
+    put_str(pv, "\\n\n");
+}
+
+void pv_retire(PipeView *pv, uint64_t id) {
+    if (!id) return;
+    pv_sync(pv);
+    pv_inst(pv, id)->id = 0;
+    if (pv->npending == PV_PENDING) {
+        put_retire(pv, id, 0);
+        return;
+    }
+    pv->pending[pv->npending++] = id;
+}
+
+void pv_flush(PipeView *pv, uint64_t id) {
+    if (!id) return;
+    pv_sync(pv);
+    pv_inst(pv, id)->id = 0;
+    put_retire(pv, id, 1);
+}
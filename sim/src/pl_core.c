@@ -1,394 +1,502 @@
 #include <pl_core.h>
+#include <isa_table.h>
 #include <stdbool.h>
 #include <cpu.h>
+#include <memory.h>
+#include <sim.h>
 #include <disasm.h>
+#include <stats.h>
+#include <pipeview.h>
+#include <difftest.h>
 
-IF_ID_Reg if_id_reg = {0};
-ID_EX_Reg id_ex_reg = {0};
-EX_MEM_Reg ex_mem_reg = {0};
-MEM_WB_Reg mem_wb_reg = {0};
-
-bool PC_Write_Enable = 1;
-bool IF_ID_Write_Enbale = 1;
-bool ID_EX_Bubble_Insert = 0;
-bool Predict_Right = 1;
-
-int RAW_harzard_count = 0;
-int control_harzard_count = 0;
-
-extern CPU_state cpu;
-extern int itrace_enabled;
-extern int ftrace_enabled;
-extern LLVMDisasmContextRef disasm_ctx;
-extern int ninst;
-extern int global_cycle_count;
-
-static bool last_inst_is_div;
-
-static inline void reg_use(uint64_t inst, int *use_rs1, int *use_rs2);
 static inline bool check_read_after_write_hazard(
     bool is_writing, int write_dst,
     bool use_rs1, int rs1_idx,
     bool use_rs2, int rs2_idx);
-static inline bool inst_fusion(Decode *s);
-
-void init_pipeline() {
-    memset(&if_id_reg, 0, sizeof(IF_ID_Reg));
-    memset(&id_ex_reg, 0, sizeof(ID_EX_Reg));
-    memset(&ex_mem_reg, 0, sizeof(EX_MEM_Reg));
-    memset(&mem_wb_reg, 0, sizeof(MEM_WB_Reg));
-    PC_Write_Enable = true;
-    IF_ID_Write_Enbale = true;
-    Predict_Right = true;
+
+// Pipeline view: id enters a stage, or waits in it for note
+static inline void pl_view(SimContext *ctx, uint64_t id, PvStage stage)
+{
+    if (unlikely(ctx->pv != NULL)) pv_stage(ctx->pv, id, stage);
 }
 
-void pl_IF()
+static inline void pl_note(SimContext *ctx, uint64_t id, const char *note)
 {
-    if (!Predict_Right) {
-        if_id_reg.valid = 0;
+    if (unlikely(ctx->pv != NULL)) pv_note(ctx->pv, id, note);
+}
+
+void init_pipeline(SimContext *ctx) {
+    PipelineState *pl = &ctx->pl;
+    memset(pl->if_id_reg, 0, sizeof(pl->if_id_reg));
+    memset(pl->id_ex_reg, 0, sizeof(pl->id_ex_reg));
+    memset(pl->ex_mem_reg, 0, sizeof(pl->ex_mem_reg));
+    memset(pl->mem_wb_reg, 0, sizeof(pl->mem_wb_reg));
+    memset(pl->reg_ready, 0, sizeof(pl->reg_ready));
+    memset(pl->fu_free, 0, sizeof(pl->fu_free));
+    // filling the pipeline counts as base
+    for (int i = 0; i < 4; i++) {
+        pl->bubble_cause[i] = CPI_BASE;
+        pl->bubble_pc[i] = ctx->cpu.pc;
     }
-    if (PC_Write_Enable && IF_ID_Write_Enbale)
+    if (pl->width < 1) pl->width = 1;
+    pl->PC_Write_Enable = true;
+    pl->IF_ID_Write_Enbale = true;
+    pl->Predict_Right = true;
+}
+
+void pl_IF(SimContext *ctx)
+{
+    PipelineState *pl = &ctx->pl;
+    if (!pl->Predict_Right) {
+        for (int k = 0; k < pl->width; k++) {
+            if (pl->if_id_reg[k].valid && ctx->pv) pv_flush(ctx->pv, pl->if_id_reg[k].id);
+            pl->if_id_reg[k].valid = 0;
+        }
+        pl->bubble_cause[0] = CPI_CONTROL;
+        pl->bubble_pc[0] = pl->mispredict_pc;
+    }
+    if (pl->PC_Write_Enable && pl->IF_ID_Write_Enbale)
     {
-        // printf("IF: ");
-        Decode *s = &if_id_reg.s;
-        s->pc = cpu.pc;
-        s->inst = inst_fetch(s->pc);
-        s->snpc = s->pc + 4;
-        s->dnpc = s->snpc;
-        // if (itrace_enabled)
-        //     handle_itrace(s);
-        // printf("\n");
-        cpu.pc = s->pc + 4;
-        if_id_reg.predict_pc = s->pc + 4;
-        if_id_reg.valid = 1;
+        // fetch up to width instructions in a row, a group ends after an
+        // instruction predicted taken, the next one starts at its target
+        uint64_t next_pc = ctx->cpu.pc;
+        int k = 0;
+        while (k < pl->width) {
+            IF_ID_Reg *out = &pl->if_id_reg[k++];
+            Decode *s = &out->s;
+            s->pc = next_pc;
+            // fetches can be on the wrong path, they must not fault. An
+            // illegal instruction (0) stands in, MEM raises the fault if it
+            // turns out to be on the right path.
+            s->inst = 0;
+            bool in_ram = mem_in_ram(ctx, s->pc, 4);
+            if (in_ram)
+                s->inst = inst_fetch(ctx, s->pc);
+            out->id = ctx->pv ? pv_fetch(ctx->pv, s->pc, s->inst) : 0;
+            if (in_ram) {
+                // a miss holds the whole pipeline
+                uint64_t stall = cache_stall(ctx->icache, s->pc, 0);
+                ctx->global_cycle_count += stall;
+                if (ctx->cpi) cpi_charge(ctx->cpi, CPI_ICACHE, s->pc, stall);
+                if (stall) pl_note(ctx, out->id, "I$ miss");
+            }
+            s->snpc = s->pc + 4;
+            s->dnpc = s->snpc;
+            // without a predictor, always not-taken
+            next_pc = s->pc + 4;
+            if (ctx->bp) {
+                bp_predict(ctx->bp, s->pc, &out->bp);
+                next_pc = out->bp.next_pc;
+            }
+            out->predict_pc = next_pc;
+            out->valid = 1;
+            if (next_pc != s->pc + 4) break;
+        }
+        for (; k < pl->width; k++)
+            pl->if_id_reg[k].valid = 0;
+        ctx->cpu.pc = next_pc;
     }
-    else {
-        // printf("IF: not fetch, state:\n PC_Write_Enable: %d, IF_ID_Write_Enable: %d, Predict_Right: %d\n\n", PC_Write_Enable, IF_ID_Write_Enbale, Predict_Right);
+}
+
+// Decode the instruction of an IF/ID lane into an ID/EX lane
+static void pl_decode(const IF_ID_Reg *in, const Decode *d, int use_rs1, int use_rs2, ID_EX_Reg *p)
+{
+    const IsaInfo *info = &isa_info[d->op];
+    p->s = *d;
+    p->predict_pc = in->predict_pc;
+    p->bp = in->bp;
+    p->id = in->id;
+    p->valid = in->valid;
+    // defaults: no ALU, no memory access, no register write
+    p->ALU_use = NOT_USE_ALU;
+    p->ALU_src1 = NOT_CARE;
+    p->ALU_src2 = NOT_CARE;
+    p->rs1 = use_rs1 ? d->rs1 : NOT_CARE;
+    p->rs2 = use_rs2 ? d->rs2 : NOT_CARE;
+    p->MEM_read = NOT_READ_MEM;
+    p->MEM_write = NOT_WRITE_MEM;
+    p->REG_write = NOT_WRITE_REG;
+    p->REG_dst = NOT_CARE;
+    p->REG_src = NOT_CARE;
+    switch (info->cls)
+    {
+    case CLASS_ALU:
+    case CLASS_MUL:
+    case CLASS_DIV:
+        p->ALU_use = USE_ALU;
+        p->ALU_src1 = d->op == OP_lui ? REG_ZERO : d->op == OP_auipc ? SELECT_PC : RS1;
+        p->ALU_src2 = info->type == TYPE_R ? RS2 : IMM;
+        p->REG_write = WRITE_REG;
+        p->REG_dst = d->rd;
+        p->REG_src = ALU_RES;
+        break;
+    case CLASS_LOAD:
+        p->ALU_use = USE_ALU;
+        p->ALU_src1 = RS1;
+        p->ALU_src2 = IMM;
+        p->MEM_read = READ_MEM;
+        p->REG_write = WRITE_REG;
+        p->REG_dst = d->rd;
+        p->REG_src = MEM_RES;
+        break;
+    case CLASS_STORE:
+        p->ALU_use = USE_ALU;
+        p->ALU_src1 = RS1;
+        p->ALU_src2 = IMM;
+        p->MEM_write = WRITE_MEM;
+        break;
+    case CLASS_AMO:
+        // read-modify-write in MEM, the old value goes to rd
+        p->ALU_use = USE_ALU;
+        p->ALU_src1 = RS1;
+        p->ALU_src2 = IMM;
+        p->MEM_read = READ_MEM;
+        p->MEM_write = WRITE_MEM;
+        p->REG_write = WRITE_REG;
+        p->REG_dst = d->rd;
+        p->REG_src = MEM_RES;
+        break;
+    case CLASS_CSR:
+        // the CSR is accessed in EX
+        p->REG_write = WRITE_REG;
+        p->REG_dst = d->rd;
+        p->REG_src = ALU_RES;
+        break;
+    case CLASS_BRANCH:
+        p->ALU_use = USE_ALU;
+        p->ALU_src1 = RS1;
+        p->ALU_src2 = RS2;
+        break;
+    case CLASS_JUMP:
+        p->ALU_use = USE_ALU;
+        p->ALU_src1 = d->op == OP_jal ? SELECT_PC : RS1;
+        p->ALU_src2 = IMM;
+        p->REG_write = WRITE_REG;
+        p->REG_dst = d->rd;
+        p->REG_src = PC_PLUS_4;
+        break;
+    default: // SYSTEM (ecall/ebreak), FENCE and unknown instructions
+        break;
     }
 }
 
-void pl_ID()
+void pl_ID(SimContext *ctx)
 {
-    if (!Predict_Right) {
-        // printf("ID: Clear\n");
-        PC_Write_Enable = false;
-        IF_ID_Write_Enbale = false;
-        id_ex_reg.valid = 0;
+    PipelineState *pl = &ctx->pl;
+    if (!pl->Predict_Right) {
+        pl->PC_Write_Enable = false;
+        pl->IF_ID_Write_Enbale = false;
+        for (int k = 0; k < pl->width; k++)
+            pl->id_ex_reg[k].valid = 0;
+        ++pl->issue_hist[0];
+        pl->bubble_cause[1] = CPI_CONTROL;
+        pl->bubble_pc[1] = pl->mispredict_pc;
         return;
     }
-    // printf("ID: ");
-    // if (if_id_reg.valid)
-    //     handle_itrace(&if_id_reg.s);
-    // else 
-    //     printf("Bubble\n");
-    // read rs1 & rs2 from inst
-    uint64_t i = if_id_reg.s.inst;
-    REG_NO rd = BITS(i, 11, 7);
-    REG_NO rs1 = BITS(i, 19, 15);
-    REG_NO rs2 = BITS(i, 24, 20);
-
-    // does this instruction use rs1 / rs2?
-    int use_rs1, use_rs2;
-    reg_use(i, &use_rs1, &use_rs2);
-
-    // harzard check
-
-    bool ex_is_writing = ex_mem_reg.valid &&
-                          ex_mem_reg.REG_write &&
-                          (ex_mem_reg.REG_dst != 0);
-    int ex_rd_dst = ex_mem_reg.REG_dst;
-
-    bool mem_is_writing = mem_wb_reg.valid &&
-                            mem_wb_reg.REG_write &&
-                            (mem_wb_reg.REG_dst != 0);
-    int mem_rd_dst = mem_wb_reg.REG_dst;
-
-    bool hazard_EX = check_read_after_write_hazard(
-        ex_is_writing, ex_rd_dst,
-        use_rs1, rs1, use_rs2, rs2);
-
-    bool hazard_MEM = check_read_after_write_hazard(
-        mem_is_writing, mem_rd_dst,
-        use_rs1, rs1, use_rs2, rs2);
-
-    // harzard? lock PC and IF_ID_Reg
-    if (hazard_EX || hazard_MEM)
-    {
-        ++RAW_harzard_count;
-        // if (hazard_EX)
-        //     printf("harzard: EX and ID\n");
-        // if (hazard_MEM)
-        //     printf("harzard: MEM and ID\n");
-        PC_Write_Enable = false;
-        IF_ID_Write_Enbale = false;
-        // insert a bubble
-        id_ex_reg.valid = 0;
+
+    // Issue the lanes of IF/ID in order, as long as each one is free of
+    // hazards. The first one that is not waits with the rest behind it.
+    int issued = 0, nvalid = 0;
+    int used[FU_NUM] = { 0 };   // units taken by the lanes issued so far
+    // a bubble in IF/ID goes on as it is, a stall makes a new one
+    CpiCause cause = pl->bubble_cause[0];
+    uint64_t cause_pc = pl->bubble_pc[0];
+    uint64_t next = ctx->global_cycle_count + 1;    // when the group is in EX
+    for (int k = 0; k < pl->width; k++) {
+        if (pl->if_id_reg[k].valid) pl_view(ctx, pl->if_id_reg[k].id, PV_ID);
     }
-    // harzard resolved. exec normally
-    else
-    {
-        PC_Write_Enable = true;
-        IF_ID_Write_Enbale = true;
-        // decode logic
-        ID_EX_Reg *p = &id_ex_reg;
-        p->s = if_id_reg.s;
-        p->predict_pc = if_id_reg.predict_pc;
-        p->valid = if_id_reg.valid;
-        switch (get_inst_type(i))
+    for (int k = 0; k < pl->width; k++) {
+        IF_ID_Reg *in = &pl->if_id_reg[k];
+        // a bubble only ever sits in lane 0, behind it the group has ended
+        if (k > 0 && !in->valid) break;
+        // decode once, later stages only look at s->op
+        Decode d = in->s;
+        isa_decode_inst(&d);
+        const IsaInfo *info = &isa_info[d.op];
+        REG_NO rs1 = d.rs1;
+        REG_NO rs2 = d.rs2;
+
+        // does this instruction use rs1 / rs2?
+        int use_rs1 = (info->regs & USE_RS1) != 0;
+        int use_rs2 = (info->regs & USE_RS2) != 0;
+
+        // harzard check, against every lane of the groups in EX and MEM
+
+        bool ex_is_writing = false, mem_is_writing = false;
+        bool hazard_EX = false, hazard_MEM = false;
+        bool load_in_EX = false, load_in_MEM = false;
+        bool system_in_EX = false;
+        for (int j = 0; j < pl->width; j++) {
+            EX_MEM_Reg *e = &pl->ex_mem_reg[j];
+            bool writing = e->valid && e->REG_write && (e->REG_dst != 0);
+            bool hazard = check_read_after_write_hazard(
+                writing, e->REG_dst,
+                use_rs1, rs1, use_rs2, rs2);
+            ex_is_writing |= writing;
+            hazard_EX |= hazard;
+            load_in_EX |= hazard && e->MEM_read == READ_MEM;
+            system_in_EX |= e->valid && isa_info[e->s.op].cls == CLASS_SYSTEM;
+
+            MEM_WB_Reg *w = &pl->mem_wb_reg[j];
+            writing = w->valid && w->REG_write && (w->REG_dst != 0);
+            hazard = check_read_after_write_hazard(
+                writing, w->REG_dst,
+                use_rs1, rs1, use_rs2, rs2);
+            mem_is_writing |= writing;
+            hazard_MEM |= hazard;
+            load_in_MEM |= hazard && w->REG_src == MEM_RES;
+        }
+
+        // ecall and ebreak read the argument registers, they wait until every
+        // older write is done. They run in WB, nothing younger may get to EX
+        // before they have: it waits while they are in MEM.
+        bool hazard_SYS = (info->cls == CLASS_SYSTEM && (ex_is_writing || mem_is_writing)) ||
+                          (in->valid && system_in_EX);
+
+        // With forwarding, WB runs before EX in a cycle, so the instruction two
+        // ahead is already in the register file and the one just ahead is
+        // bypassed from MEM/WB. Only a load just ahead is too late: its data
+        // comes at the end of MEM, one bubble.
+        if (pl->forwarding) {
+            hazard_EX = load_in_EX;
+            hazard_MEM = false;
+        }
+
+        // Scoreboard: a result of more than one cycle is still on its way.
+        // A later write to the register waits for it too, so that the
+        // late result can not land on top of it.
+        bool writes_rd = (info->regs & USE_RD) && d.rd != 0;
+        bool hazard_LONG = in->valid &&
+            ((use_rs1 && pl->reg_ready[rs1] > next) ||
+             (use_rs2 && pl->reg_ready[rs2] > next) ||
+             (writes_rd && pl->reg_ready[d.rd] > next));
+
+        // harzard? lock PC and IF_ID_Reg
+        if (hazard_EX || hazard_MEM || hazard_SYS || hazard_LONG)
         {
-        case TYPE_R:
-            p->ALU_use = USE_ALU;
-            p->ALU_src1 = RS1;
-            p->ALU_src2 = RS2;
-            p->rs1 = rs1;
-            p->rs2 = rs2;
-            p->MEM_read = NOT_READ_MEM;
-            p->MEM_write = NOT_WRITE_MEM;
-            p->REG_write = WRITE_REG;
-            p->REG_dst = rd;
-            p->REG_src = ALU_RES;
-            break;
-        case TYPE_I:
-            if (is_load(i))
-            {
-                p->ALU_use = USE_ALU;
-                p->ALU_src1 = RS1;
-                p->ALU_src2 = IMM;
-                p->rs1 = rs1;
-                p->rs2 = NOT_CARE;
-                p->MEM_read = READ_MEM;
-                p->MEM_write = NOT_WRITE_MEM;
-                p->REG_write = WRITE_REG;
-                p->REG_dst = rd;
-                p->REG_src = MEM_RES;
+            if (k > 0) {
+                ++pl->split_dep;
+                pl_note(ctx, in->id, "group split, dependence");
+                break;
             }
-            else if ((i & 0x7F) == 0b1100111)
-            { // jalr
-                p->ALU_use = USE_ALU;
-                p->ALU_src1 = RS1;
-                p->ALU_src2 = IMM;
-                p->rs1 = rs1;
-                p->rs2 = NOT_CARE;
-                p->MEM_read = 0;
-                p->MEM_write = 0;
-                p->REG_write = WRITE_REG;
-                p->REG_dst = rd;
-                p->REG_src = PC_PLUS_4;
+            ++pl->RAW_harzard_count;
+            // ecall and ebreak wait for register writes, like any RAW hazard
+            CpiCause why = CPI_RAW;
+            if (hazard_SYS) {
+                ++pl->stall_ecall;
+                pl_note(ctx, in->id, "system stall");
             }
-            else if ((i & 0x7F) == 0b1110011 || (i & 0x7F) == 0b0001111)
-            { // SYSTEM (ecall/ebreak) or FENCE
-                p->ALU_use = NOT_USE_ALU;
-                p->ALU_src1 = NOT_CARE;
-                p->ALU_src2 = NOT_CARE;
-                p->rs1 = NOT_CARE;
-                p->rs2 = NOT_CARE;
-                p->MEM_read = NOT_READ_MEM;
-                p->MEM_write = NOT_WRITE_MEM;
-                p->REG_write = NOT_WRITE_REG;
-                p->REG_dst = NOT_CARE;
-                p->REG_src = NOT_CARE;
+            else if (hazard_LONG) {
+                ++pl->stall_long;
+                why = CPI_LONG;
+                pl_note(ctx, in->id, "long latency stall");
             }
-            else
-            {
-                p->ALU_use = USE_ALU;
-                p->ALU_src1 = RS1;
-                p->ALU_src2 = IMM;
-                p->rs1 = rs1;
-                p->rs2 = NOT_CARE;
-                p->MEM_read = NOT_READ_MEM;
-                p->MEM_write = NOT_WRITE_MEM;
-                p->REG_write = WRITE_REG;
-                p->REG_dst = rd;
-                p->REG_src = ALU_RES;
+            else if (load_in_EX || load_in_MEM) {
+                ++pl->stall_load_use;
+                why = CPI_LOAD_USE;
+                pl_note(ctx, in->id, "load-use stall");
             }
-            break;
-        case TYPE_S:
-            p->ALU_use = USE_ALU;
-            p->ALU_src1 = RS1;
-            p->ALU_src2 = IMM;
-            p->rs1 = rs1;
-            p->rs2 = rs2;
-            p->MEM_read = NOT_READ_MEM;
-            p->MEM_write = WRITE_MEM;
-            p->REG_write = NOT_WRITE_REG;
-            p->REG_dst = NOT_CARE;
-            p->REG_src = NOT_CARE;
-            break;
-        case TYPE_B:
-            p->ALU_use = USE_ALU;
-            p->ALU_src1 = RS1;
-            p->ALU_src2 = RS2;
-            p->rs1 = rs1;
-            p->rs2 = rs2;
-            p->MEM_read = NOT_READ_MEM;
-            p->MEM_write = NOT_WRITE_MEM;
-            p->REG_write = NOT_WRITE_REG;
-            p->REG_dst = NOT_CARE;
-            p->REG_src = NOT_CARE;
-            break;
-        case TYPE_U:
-            if ((i & 0x7F) == 0b0010111)
-            { // auipc
-                p->ALU_use = USE_ALU;
-                p->ALU_src1 = SELECT_PC;
-                p->ALU_src2 = IMM;
-                p->rs1 = NOT_CARE;
-                p->rs2 = NOT_CARE;
-                p->MEM_read = NOT_READ_MEM;
-                p->MEM_write = NOT_WRITE_MEM;
-                p->REG_write = WRITE_REG;
-                p->REG_dst = rd;
-                p->REG_src = ALU_RES;
+            else {
+                ++pl->stall_alu;
+                pl_note(ctx, in->id, "RAW stall");
             }
-            else
-            { // lui
-                p->ALU_use = USE_ALU;
-                p->ALU_src1 = REG_ZERO;
-                p->ALU_src2 = IMM;
-                p->rs1 = NOT_CARE;
-                p->rs2 = NOT_CARE;
-                p->MEM_read = NOT_READ_MEM;
-                p->MEM_write = NOT_WRITE_MEM;
-                p->REG_write = WRITE_REG;
-                p->REG_dst = rd;
-                p->REG_src = ALU_RES;
+            if (in->valid) {
+                cause = why;
+                cause_pc = in->s.pc;
             }
             break;
-        case TYPE_J:
-            p->ALU_use = USE_ALU;
-            p->ALU_src1 = SELECT_PC;
-            p->ALU_src2 = IMM;
-            p->rs1 = NOT_CARE;
-            p->rs2 = NOT_CARE;
-            p->MEM_read = NOT_READ_MEM;
-            p->MEM_write = NOT_WRITE_MEM;
-            p->REG_write = WRITE_REG;
-            p->REG_dst = rd;
-            p->REG_src = PC_PLUS_4;
-            break;
-        default:
+        }
+
+        // a functional unit of its kind must be free when it gets to EX
+        int fu = fu_of_class[info->cls];
+        int free_units = 0;
+        for (int u = 0; u < ctx->uarch.fu[fu].units; u++)
+            free_units += pl->fu_free[fu][u] <= next;
+        bool unit_busy = in->valid && free_units <= used[fu];
+        if (k == 0 && unit_busy) {
+            ++pl->stall_fu;
+            pl_note(ctx, in->id, "unit busy stall");
+            cause = CPI_STRUCT;
+            cause_pc = in->s.pc;
             break;
         }
+
+        // Lanes after the first leave the group for what a single issue
+        // slot cannot take: a result of the same group (there is no
+        // bypass within it), a functional unit the older lanes took, and
+        // instructions with side effects in EX.
+        bool serial = info->cls == CLASS_SYSTEM || info->cls == CLASS_CSR || info->cls == CLASS_FENCE;
+        if (k > 0) {
+            bool hazard_group = false;
+            for (int j = 0; j < issued; j++) {
+                ID_EX_Reg *p = &pl->id_ex_reg[j];
+                hazard_group |= check_read_after_write_hazard(
+                    p->REG_write && p->REG_dst != 0, p->REG_dst,
+                    use_rs1, rs1, use_rs2, rs2);
+            }
+            const char *split = NULL;
+            if (hazard_group)       { ++pl->split_dep;    split = "group split, dependence"; }
+            else if (serial)        { ++pl->split_serial; split = "group split, serializing"; }
+            else if (unit_busy)     { ++pl->split_unit;   split = "group split, unit busy"; }
+            if (split) {
+                pl_note(ctx, in->id, split);
+                break;
+            }
+        }
+
+        // harzard resolved. exec normally
+        pl_decode(in, &d, use_rs1, use_rs2, &pl->id_ex_reg[issued++]);
+        nvalid += in->valid;
+        used[fu] += in->valid;
+        if (serial) break;
     }
+    ++pl->issue_hist[nvalid];
+    pl->bubble_cause[1] = cause;
+    pl->bubble_pc[1] = cause_pc;
+
+    // insert bubbles in the lanes not issued
+    for (int k = issued; k < pl->width; k++)
+        pl->id_ex_reg[k].valid = 0;
+    // what is left waits in IF/ID, moved to the front
+    int left = 0;
+    for (int k = issued; k < pl->width; k++) {
+        if (pl->if_id_reg[k].valid)
+            pl->if_id_reg[left++] = pl->if_id_reg[k];
+    }
+    for (int k = left; k < pl->width; k++)
+        pl->if_id_reg[k].valid = 0;
+    bool stall = issued == 0 || left > 0;
+    pl->PC_Write_Enable = !stall;
+    pl->IF_ID_Write_Enbale = !stall;
 }
 
-void pl_EX()
+// Source register r for EX, from the bypass if an instruction just ahead
+// (now in MEM/WB) writes it. The youngest one of its group wins.
+static inline uint64_t pl_operand(SimContext *ctx, int r)
 {
-    // bubble
-    if (!id_ex_reg.valid) {
-        // printf("EX: Bubble\n");
-        ex_mem_reg.valid = 0;
-        return;
+    PipelineState *pl = &ctx->pl;
+    if (!pl->forwarding || r == 0) return R(r);
+    for (int k = pl->width - 1; k >= 0; k--) {
+        MEM_WB_Reg *w = &pl->mem_wb_reg[k];
+        if (w->valid && w->REG_write && w->REG_dst == r) {
+            ++pl->forwarded;
+            switch (w->REG_src) {
+            case ALU_RES:   return w->alu_result;
+            case MEM_RES:   return w->mem_result;
+            case PC_PLUS_4: return w->s.pc + 4;
+            }
+        }
     }
+    return R(r);
+}
 
-    // printf("EX: ");
-    // handle_itrace(&id_ex_reg.s);
-
-    ++ninst;
-    int rd = 0;
-    uint64_t src1 = 0, src2 = 0, imm = 0;
-    Decode *s = &id_ex_reg.s;
-    uint64_t *alu_result = &ex_mem_reg.alu_result;
-
-
-    INSTPAT_START();
-    // RV64I
-    INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui, U, *alu_result = imm + 0);
-    INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc, U, *alu_result = s->pc + imm);
-    INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal, J, s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr, I, s->dnpc = (src1 + imm) & ~1);
-    // BEQ, BNE, BLT, BGE, BLTU, BGEU
-    INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq, B, if (src1 == src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne, B, if (src1 != src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt, B, if ((int64_t)src1 < (int64_t)src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge, B, if ((int64_t)src1 >= (int64_t)src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu, B, if (src1 < src2) s->dnpc = s->pc + imm);
-    INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu, B, if (src1 >= src2) s->dnpc = s->pc + imm);
-    // LB, LH, LW, LBU, LHU, LWU, LD
-    INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb, I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh, I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw, I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu, I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu, I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu, I, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld, I, *alu_result = src1 + imm);
-    // SB, SH, SW
-    INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb, S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh, S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw, S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd, S, *alu_result = src1 + imm);
-    INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi, I, *alu_result = src1 + imm);
-    // SLTI, SLTIU
-    INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti, I, *alu_result = (int64_t)src1 < (int64_t)imm);
-    INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu, I, *alu_result = src1 < imm);
-    // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-    INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli, I, *alu_result = src1 << (imm & 0x3f));
-    INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli, I, *alu_result = src1 >> (imm & 0x3f));
-    INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai, I, *alu_result = (int64_t)src1 >> (imm & 0x3f));
-    INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw, I, *alu_result = SEXT((uint32_t)src1 << (imm & 0x1f), 32));
-    INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw, I, *alu_result = SEXT((uint32_t)src1 >> (imm & 0x1f), 32));
-    INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw, I, *alu_result = SEXT((int32_t)src1 >> (imm & 0x1f), 32));
-    // XORI, ORI, ANDI, ADDIW
-    INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori, I, *alu_result = src1 ^ imm);
-    INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori, I, *alu_result = src1 | imm);
-    INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi, I, *alu_result = src1 & imm);
-    INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw, I, *alu_result = SEXT((int32_t)src1 + (int32_t)imm, 32));
-    // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-    INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add, R, *alu_result = src1 + src2);
-    INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub, R, *alu_result = src1 - src2);
-    INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll, R, *alu_result = src1 << (src2 & 0x3f));
-    INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt, R, *alu_result = (int64_t)src1 < (int64_t)src2);
-    INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu, R, *alu_result = src1 < src2);
-    INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor, R, *alu_result = src1 ^ src2);
-    INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl, R, *alu_result = src1 >> (src2 & 0x3f));
-    INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra, R, *alu_result = (int64_t)src1 >> (src2 & 0x3f));
-    INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or, R, *alu_result = src1 | src2);
-    INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and, R, *alu_result = src1 & src2);
-    // ADDW, SUBW, SLLW, SRLW, SRAW
-    INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw, R, *alu_result = SEXT((uint32_t)src1 + (uint32_t)src2, 32));
-    INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw, R, *alu_result = SEXT((uint32_t)src1 - (uint32_t)src2, 32));
-    INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw, R, *alu_result = SEXT((uint32_t)src1 << (src2 & 0x1f), 32));
-    INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw, R, *alu_result = SEXT((uint32_t)src1 >> (src2 & 0x1f), 32));
-    INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw, R, *alu_result = SEXT((int32_t)src1 >> (src2 & 0x1f), 32));
-    // FENCE, FENCE.I
-    INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence, I, NOP);
-    INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei, I, NOP);
-    // ECALL
-    INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak, I, HALT(s->pc, R(10))); // R(10) is $a0
-    // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
-
-    // RV64M
-    // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-    INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul, R, *alu_result = src1 * src2;);
-    INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh, R, *alu_result = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(int64_t)src2 >> 64));
-    INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu, R, *alu_result = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(uint64_t)src2 >> 64));
-    INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu, R, *alu_result = (uint64_t)((__uint128_t)(uint64_t)src1 * (__uint128_t)(uint64_t)src2 >> 64));
-    INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div, R, if (src2 == 0) *alu_result = -1; else *alu_result = (int64_t)src1 / (int64_t)src2; global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu, R, if (src2 == 0) *alu_result = -1; else *alu_result = src1 / src2; global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem, R, if (src2 == 0) *alu_result = src1; else *alu_result = (int64_t)src1 % (int64_t)src2; global_cycle_count += inst_fusion(s) ? -1 : 39);
-    INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu, R, if (src2 == 0) *alu_result = src1; else *alu_result = src1 % src2; global_cycle_count += inst_fusion(s) ? -1 : 39);
-
-    // MULW, DIVW, DIVUW, REMW, REMUW
-    INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw, R, *alu_result = SEXT((int32_t)src1 * (int32_t)src2, 32));
-    INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw, R, if (src2 == 0) *alu_result = -1; else *alu_result = SEXT((int32_t)(int64_t)src1 / (int32_t)(int64_t)src2, 32); global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw, R, if (src2 == 0) *alu_result = -1; else *alu_result = SEXT((uint32_t)(uint64_t)src1 / (uint32_t)(uint64_t)src2, 32); global_cycle_count += 39);
-    INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw, R, if (src2 == 0) *alu_result = SEXT((uint32_t)src1, 32); else *alu_result = SEXT((int32_t)(int64_t)src1 % (int32_t)(int64_t)src2, 32); global_cycle_count += inst_fusion(s) ? -1 : 39);
-    INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw, R, if (src2 == 0) *alu_result = SEXT((uint32_t)src1, 32); else *alu_result = SEXT((uint32_t)(uint64_t)src1 % (uint32_t)(uint64_t)src2, 32); global_cycle_count += inst_fusion(s) ? -1 : 39);
-
-    // Invalid Opcode
-    INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk, N, printf(ANSI_FMT("[Stage EX]Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1));
-    INSTPAT_END();
+// Occupy a unit for the instruction in EX, ID made sure one is free. A
+// result of more than one cycle goes to the scoreboard, loads get theirs
+// in MEM.
+static inline void pl_start_unit(SimContext *ctx, const IsaInfo *info, const ID_EX_Reg *in)
+{
+    PipelineState *pl = &ctx->pl;
+    int fu = fu_of_class[info->cls];
+    const FuConfig *c = &ctx->uarch.fu[fu];
+    uint64_t now = ctx->global_cycle_count;
+    for (int u = 0; u < c->units; u++) {
+        if (pl->fu_free[fu][u] <= now) {
+            pl->fu_free[fu][u] = now + c->interval;
+            break;
+        }
+    }
+    if (c->latency > 1 && fu != FU_LOAD && in->REG_write && in->REG_dst != 0)
+        pl->reg_ready[in->REG_dst] = now + c->latency;
+}
 
-    R(0) = 0;
+void pl_EX(SimContext *ctx)
+{
+    PipelineState *pl = &ctx->pl;
+    // set when a lane went the wrong way, the younger ones are on the wrong path
+    bool squash = false;
+    pl->bubble_cause[2] = pl->bubble_cause[1];
+    pl->bubble_pc[2] = pl->bubble_pc[1];
+    for (int k = 0; k < pl->width; k++) {
+        ID_EX_Reg *in = &pl->id_ex_reg[k];
+        EX_MEM_Reg *out = &pl->ex_mem_reg[k];
+        // bubble
+        if (!in->valid || squash) {
+            if (in->valid && ctx->pv) pv_flush(ctx->pv, in->id);
+            out->valid = 0;
+            continue;
+        }
+        pl_view(ctx, in->id, PV_EX);
+
+        Decode *s = &in->s;
+        // in order from here on, a lane that gets to EX is on the right path
+        hist_push(&ctx->hist, s->pc, s->inst);
+        // rs1/rs2 of ID_EX_Reg are NOT_CARE when the instruction does not read them
+        uint64_t src1 = in->rs1 == NOT_CARE ? R(s->rs1) : pl_operand(ctx, s->rs1);
+        uint64_t src2 = in->rs2 == NOT_CARE ? R(s->rs2) : pl_operand(ctx, s->rs2);
+        uint64_t *alu_result = &out->alu_result;
+        const IsaInfo *info = &isa_info[s->op];
+
+        switch (info->cls)
+        {
+        case CLASS_ALU:
+        case CLASS_MUL:
+        case CLASS_DIV:
+            *alu_result = isa_alu(s, src1, src2);
+            break;
+        case CLASS_LOAD:
+        case CLASS_STORE:
+        case CLASS_AMO:
+            *alu_result = src1 + s->imm;
+            break;
+        case CLASS_BRANCH:
+            if (isa_branch_taken(s, src1, src2)) s->dnpc = s->pc + s->imm;
+            break;
+        case CLASS_JUMP:
+            s->dnpc = isa_jump_target(s, src1);
+            break;
+        case CLASS_CSR: {
+            // instret counts at WB, but the older lanes still in MEM/WB and
+            // in this group have run: the CSR reads what ran before it
+            uint64_t retired = ctx->ninst;
+            for (int j = 0; j < pl->width; j++)
+                ctx->ninst += pl->mem_wb_reg[j].valid + (j < k && pl->ex_mem_reg[j].valid);
+            *alu_result = isa_csr(ctx, s, src1);
+            ctx->ninst = retired;
+            break;
+        }
+        case CLASS_FENCE:
+            isa_system(ctx, s);
+            break;
+        case CLASS_SYSTEM:
+            // in WB, once every older instruction has retired
+            break;
+        case CLASS_UNK:
+            // a fetch outside RAM faults in MEM, after the older lanes of its group
+            if (!mem_in_ram(ctx, s->pc, 4)) break;
+            printf(ANSI_FMT("[Stage EX]Unknown Inst!\n", ANSI_FG_RED));
+            HALT(s->pc, -1);
+            break;
+        }
 
-    Predict_Right = (s->dnpc == id_ex_reg.predict_pc);
-    if (!Predict_Right) {
-        ++control_harzard_count;
-        cpu.pc = s->dnpc;
-        // printf("INST 0x%08x find mis-predict:\n Predict addr: 0x%08lx\n Actural addr: 0x%08lx\n", s->inst, id_ex_reg.predict_pc, s->dnpc);
-    }
-        
+        R(0) = 0;
+        pl_start_unit(ctx, info, in);
 
+        bool mispredicted = s->dnpc != in->predict_pc;
+        if (ctx->bp) {
+            bp_update(ctx->bp, s->pc, &in->bp, bp_classify(s->inst),
+                      s->dnpc != s->pc + 4, s->dnpc, mispredicted);
+        }
+        // fence.i: the older stores are done (MEM ran first), what IF and ID
+        // hold was fetched before them and may be stale, fetch it again
+        bool refetch = s->op == OP_fencei;
+        pl->Predict_Right = !mispredicted && !refetch;
+        if (!pl->Predict_Right) {
+            ++pl->control_harzard_count;
+            pl->mispredict_pc = s->pc;
+            ctx->cpu.pc = s->dnpc;
+            squash = true;
+            pl_note(ctx, in->id, refetch ? "fence.i refetch" : "mispredicted");
+        }
 
 /*
 typedef struct {
@@ -403,127 +511,99 @@ typedef struct {
     int valid;
 } EX_MEM_Reg;
 */
-    ex_mem_reg.s = id_ex_reg.s;
-    ex_mem_reg.MEM_read = id_ex_reg.MEM_read;
-    ex_mem_reg.MEM_write = id_ex_reg.MEM_write;
-    ex_mem_reg.rs2 = id_ex_reg.rs2;
-    ex_mem_reg.REG_write = id_ex_reg.REG_write;
-    ex_mem_reg.REG_dst = id_ex_reg.REG_dst;
-    ex_mem_reg.REG_src = id_ex_reg.REG_src;
-    ex_mem_reg.valid = id_ex_reg.valid;
-
-    return;
+        out->s = in->s;
+        out->MEM_read = in->MEM_read;
+        out->MEM_write = in->MEM_write;
+        out->rs2 = in->rs2;
+        out->REG_write = in->REG_write;
+        out->REG_dst = in->REG_dst;
+        out->REG_src = in->REG_src;
+        out->id = in->id;
+        out->valid = in->valid;
+    }
 }
 
-void pl_MEM()
+static void pl_writeback(SimContext *ctx, const MEM_WB_Reg *w)
 {
-    if (!ex_mem_reg.valid) {
-        // printf("MEM: Bubble\n");
-        mem_wb_reg.valid = 0;
-        return;
-    }
-    // printf("MEM: ");
-    // handle_itrace(&ex_mem_reg.s);
-    Predict_Right = true;
-    last_inst_is_div = false;
-    uint64_t *mem_result = &mem_wb_reg.mem_result;
-    Decode *s = &ex_mem_reg.s;
-    if (ex_mem_reg.MEM_read == READ_MEM || ex_mem_reg.MEM_write == WRITE_MEM)
+    if (w->REG_write)
     {
-        int rd = 0;
-        uint64_t src1 = 0, src2 = 0, imm = 0;
-        uint64_t alu_result = ex_mem_reg.alu_result;
-
-        INSTPAT_START();
-        // RV64I
-        //  INSTPAT("??????? ????? ????? ??? ????? 01101 11", lui    , U, R(rd) = imm);
-        //  INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s->pc + 4, s->dnpc = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, R(rd) = s->pc + 4, s->dnpc = (src1 + imm) & ~1);
-        //  BEQ, BNE, BLT, BGE, BLTU, BGEU
-        //  INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B, if (src1 == src2) s->dnpc = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B, if (src1 != src2) s->dnpc = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B, if ((int64_t)src1 < (int64_t)src2) s->dnpc = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B, if ((int64_t)src1 >= (int64_t)src2) s->dnpc = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B, if (src1 < src2) s->dnpc = s->pc + imm);
-        //  INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B, if (src1 >= src2) s->dnpc = s->pc + imm);
-        //  LB, LH, LW, LBU, LHU, LWU, LD
-        INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb, I, *mem_result = SEXT(Mr(alu_result, 1), 8));
-        INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh, I, *mem_result = SEXT(Mr(alu_result, 2), 16));
-        INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw, I, *mem_result = SEXT(Mr(alu_result, 4), 32));
-        INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu, I, *mem_result = Mr(alu_result, 1));
-        INSTPAT("??????? ????? ????? 101 ????? 00000 11", lhu, I, *mem_result = Mr(alu_result, 2));
-        INSTPAT("??????? ????? ????? 110 ????? 00000 11", lwu, I, *mem_result = Mr(alu_result, 4));
-        INSTPAT("??????? ????? ????? 011 ????? 00000 11", ld, I, *mem_result = Mr(alu_result, 8));
-        // SB, SH, SW
-        INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb, S, Mw(alu_result, 1, src2));
-        INSTPAT("??????? ????? ????? 001 ????? 01000 11", sh, S, Mw(alu_result, 2, src2));
-        INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw, S, Mw(alu_result, 4, src2));
-        INSTPAT("??????? ????? ????? 011 ????? 01000 11", sd, S, Mw(alu_result, 8, src2));
-        // INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, R(rd) = src1 + imm);
-        // SLTI, SLTIU
-        // INSTPAT("??????? ????? ????? 010 ????? 00100 11", slti   , I, R(rd) = (int64_t)src1 < (int64_t)imm);
-        // INSTPAT("??????? ????? ????? 011 ????? 00100 11", sltiu  , I, R(rd) = src1 < imm);
-        // SLLI, SRLI, SRAI, SLLIW, SRLIW, SRAIW
-        // INSTPAT("000000? ????? ????? 001 ????? 00100 11", slli   , I, R(rd) = src1 << (imm & 0x3f));
-        // INSTPAT("000000? ????? ????? 101 ????? 00100 11", srli   , I, R(rd) = src1 >> (imm & 0x3f));
-        // INSTPAT("010000? ????? ????? 101 ????? 00100 11", srai   , I, R(rd) = (int64_t)src1 >> (imm & 0x3f));
-        // INSTPAT("0000000 ????? ????? 001 ????? 00110 11", slliw  , I, R(rd) = SEXT((uint32_t)src1 << (imm & 0x1f), 32));
-        // INSTPAT("0000000 ????? ????? 101 ????? 00110 11", srliw  , I, R(rd) = SEXT((uint32_t)src1 >> (imm & 0x1f), 32));
-        // INSTPAT("0100000 ????? ????? 101 ????? 00110 11", sraiw  , I, R(rd) = SEXT((int32_t)src1 >> (imm & 0x1f), 32));
-        // XORI, ORI, ANDI, ADDIW
-        // INSTPAT("??????? ????? ????? 100 ????? 00100 11", xori   , I, R(rd) = src1 ^ imm);
-        // INSTPAT("??????? ????? ????? 110 ????? 00100 11", ori    , I, R(rd) = src1 | imm);
-        // INSTPAT("??????? ????? ????? 111 ????? 00100 11", andi   , I, R(rd) = src1 & imm);
-        // INSTPAT("??????? ????? ????? 000 ????? 00110 11", addiw  , I, R(rd) = SEXT((int32_t)src1 + (int32_t)imm, 32));
-        // ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND
-        // INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R, R(rd) = src1 + src2);
-        // INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R, R(rd) = src1 - src2);
-        // INSTPAT("0000000 ????? ????? 001 ????? 01100 11", sll    , R, R(rd) = src1 << (src2 & 0x3f));
-        // INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, R(rd) = (int64_t)src1 < (int64_t)src2);
-        // INSTPAT("0000000 ????? ????? 011 ????? 01100 11", sltu   , R, R(rd) = src1 < src2);
-        // INSTPAT("0000000 ????? ????? 100 ????? 01100 11", xor    , R, R(rd) = src1 ^ src2);
-        // INSTPAT("0000000 ????? ????? 101 ????? 01100 11", srl    , R, R(rd) = src1 >> (src2 & 0x3f));
-        // INSTPAT("0100000 ????? ????? 101 ????? 01100 11", sra    , R, R(rd) = (int64_t)src1 >> (src2 & 0x3f));
-        // INSTPAT("0000000 ????? ????? 110 ????? 01100 11", or     , R, R(rd) = src1 | src2);
-        // INSTPAT("0000000 ????? ????? 111 ????? 01100 11", and    , R, R(rd) = src1 & src2);
-        // ADDW, SUBW, SLLW, SRLW, SRAW
-        // INSTPAT("0000000 ????? ????? 000 ????? 01110 11", addw   , R, R(rd) = SEXT((uint32_t)src1 + (uint32_t)src2, 32));
-        // INSTPAT("0100000 ????? ????? 000 ????? 01110 11", subw   , R, R(rd) = SEXT((uint32_t)src1 - (uint32_t)src2, 32));
-        // INSTPAT("0000000 ????? ????? 001 ????? 01110 11", sllw   , R, R(rd) = SEXT((uint32_t)src1 << (src2 & 0x1f), 32));
-        // INSTPAT("0000000 ????? ????? 101 ????? 01110 11", srlw   , R, R(rd) = SEXT((uint32_t)src1 >> (src2 & 0x1f), 32));
-        // INSTPAT("0100000 ????? ????? 101 ????? 01110 11", sraw   , R, R(rd) = SEXT((int32_t)src1 >> (src2 & 0x1f), 32));
-        // FENCE, FENCE.I
-        // INSTPAT("0000??? ????? 00000 000 00000 00011 11", fence  , N, NOP);
-        // INSTPAT("0000000 00000 00000 000 00000 00011 11", fencei , N, NOP);
-        // ECALL
-        // INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, HALT(s->pc, R(10))); // R(10) is $a0
-        // CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI
-
-        // RV64M
-        // MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU
-        // INSTPAT("0000001 ????? ????? 000 ????? 01100 11", mul    , R, R(rd) = src1 * src2);
-        // INSTPAT("0000001 ????? ????? 001 ????? 01100 11", mulh   , R, R(rd) = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(int64_t)src2 >> 64));
-        // INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R, R(rd) = (int64_t)((__int128_t)(int64_t)src1 * (__int128_t)(uint64_t)src2 >> 64));
-        // INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R, R(rd) = (uint64_t)((__uint128_t)(uint64_t)src1 * (__uint128_t)(uint64_t)src2 >> 64));
-        INSTPAT("0000001 ????? ????? 100 ????? 01100 11", div    , R, last_inst_is_div = true);
-        INSTPAT("0000001 ????? ????? 101 ????? 01100 11", divu   , R, last_inst_is_div = true);
-        // INSTPAT("0000001 ????? ????? 110 ????? 01100 11", rem    , R, if (src2 == 0) R(rd) = src1; else R(rd) = (int64_t)src1 % (int64_t)src2);
-        // INSTPAT("0000001 ????? ????? 111 ????? 01100 11", remu   , R, if (src2 == 0) R(rd) = src1; else R(rd) = src1 % src2);
-
-        // MULW, DIVW, DIVUW, REMW, REMUW
-        // INSTPAT("0000001 ????? ????? 000 ????? 01110 11", mulw   , R, R(rd) = SEXT((int32_t)src1 * (int32_t)src2, 32));
-        INSTPAT("0000001 ????? ????? 100 ????? 01110 11", divw   , R, last_inst_is_div = true);
-        INSTPAT("0000001 ????? ????? 101 ????? 01110 11", divuw  , R, last_inst_is_div = true);
-        // INSTPAT("0000001 ????? ????? 110 ????? 01110 11", remw   , R, if (src2 == 0) R(rd) = SEXT((uint32_t)src1, 32); else R(rd) = SEXT((int32_t)(int64_t)src1 % (int32_t)(int64_t)src2, 32));
-        // INSTPAT("0000001 ????? ????? 111 ????? 01110 11", remuw  , R, if (src2 == 0) R(rd) = SEXT((uint32_t)src1, 32); else R(rd) = SEXT((uint32_t)(uint64_t)src1 % (uint32_t)(uint64_t)src2, 32));
-
-        // Invalid Opcode
-        INSTPAT("??????? ????? ????? ??? ????? ????? ??", unk, N, printf(ANSI_FMT("[Stage MEM]Unknown Inst!\n", ANSI_FG_RED)), HALT(s->pc, -1));
-        INSTPAT_END();
-
-        R(0) = 0;
+        switch (w->REG_src)
+        {
+        case ALU_RES:
+            R(w->REG_dst) = w->alu_result;
+            break;
+        case MEM_RES:
+            R(w->REG_dst) = w->mem_result;
+            break;
+        case PC_PLUS_4:
+            R(w->REG_dst) = w->s.pc + 4;
+            break;
+        default:
+            break;
+        }
     }
+    R(0) = 0;
+}
+
+void pl_MEM(SimContext *ctx)
+{
+    PipelineState *pl = &ctx->pl;
+    pl->bubble_cause[3] = pl->bubble_cause[2];
+    pl->bubble_pc[3] = pl->bubble_pc[2];
+    for (int k = 0; k < pl->width; k++) {
+        EX_MEM_Reg *in = &pl->ex_mem_reg[k];
+        MEM_WB_Reg *out = &pl->mem_wb_reg[k];
+        if (!in->valid) {
+            out->valid = 0;
+            continue;
+        }
+        pl_view(ctx, in->id, PV_MEM);
+        pl->Predict_Right = true;
+        uint64_t *mem_result = &out->mem_result;
+        Decode *s = &in->s;
+        // blocking D$, devices are not cached
+        if ((in->MEM_read || in->MEM_write) && mem_in_ram(ctx, in->alu_result, 1)) {
+            uint64_t stall = cache_stall(ctx->dcache, in->alu_result, in->MEM_write);
+            ctx->global_cycle_count += stall;
+            if (ctx->cpi) cpi_charge(ctx->cpi, CPI_DCACHE, s->pc, stall);
+            if (stall) pl_note(ctx, in->id, "D$ miss");
+        }
+        if (in->MEM_read == READ_MEM && in->MEM_write == WRITE_MEM)
+        {
+            *mem_result = isa_amo(ctx, s, in->alu_result, R(s->rs2));
+        }
+        else if (in->MEM_read == READ_MEM)
+        {
+            *mem_result = isa_load(ctx, s, in->alu_result);
+        }
+        else if (in->MEM_write == WRITE_MEM)
+        {
+            isa_store(ctx, s, in->alu_result, R(s->rs2));
+        }
+        else if (isa_info[s->op].cls == CLASS_UNK)
+        {
+            // EX let it through, it was fetched from outside RAM
+            raise_exception(ctx, EXC_INST_ACCESS, s->pc);
+        }
+        // a load unit of more than one cycle delivers late
+        if (in->MEM_read == READ_MEM && ctx->uarch.fu[FU_LOAD].latency > 1 && in->REG_dst != 0)
+            pl->reg_ready[in->REG_dst] = ctx->global_cycle_count + ctx->uarch.fu[FU_LOAD].latency;
+        if (unlikely(ctx->exc_pending)) {
+            // the older lanes of the group retire, this one and the younger
+            // ones never reach WB
+            for (int j = 0; j < k; j++) {
+                const Decode *o = &pl->mem_wb_reg[j].s;
+                pl_writeback(ctx, &pl->mem_wb_reg[j]);
+                ++ctx->ninst;
+                if (ctx->dt) difftest_commit(ctx, o->pc, o->inst, o->dnpc);
+                if (ctx->pv) pv_retire(ctx->pv, pl->mem_wb_reg[j].id);
+            }
+            if (ctx->dt) difftest_sync(ctx);
+            take_exception(ctx, s->pc);
+            for (int j = 0; j < pl->width; j++)
+                pl->mem_wb_reg[j].valid = 0;
+            return;
+        }
 /*
 typedef struct {
     Decode s;
@@ -535,68 +615,68 @@ typedef struct {
     int valid;
 } MEM_WB_Reg;
 */
-    mem_wb_reg.alu_result = ex_mem_reg.alu_result;
-    mem_wb_reg.s = ex_mem_reg.s;
-    mem_wb_reg.REG_write = ex_mem_reg.REG_write;
-    mem_wb_reg.REG_dst = ex_mem_reg.REG_dst;
-    mem_wb_reg.REG_src = ex_mem_reg.REG_src;
-    mem_wb_reg.valid = ex_mem_reg.valid;
-
-    return;
+        out->alu_result = in->alu_result;
+        out->s = in->s;
+        out->REG_write = in->REG_write;
+        out->REG_dst = in->REG_dst;
+        out->REG_src = in->REG_src;
+        out->id = in->id;
+        out->valid = in->valid;
+    }
 }
 
-void pl_WB()
+void pl_WB(SimContext *ctx)
 {
-    if (!mem_wb_reg.valid) {
-        // printf("WB: Bubble\n");
-        R(0) = 0;
-        return;
+    PipelineState *pl = &ctx->pl;
+    // the cycle is base if something retires, else it goes to the bubble
+    if (ctx->cpi) {
+        if (pl->mem_wb_reg[0].valid)
+            cpi_charge(ctx->cpi, CPI_BASE, pl->mem_wb_reg[0].s.pc, 1);
+        else
+            cpi_charge(ctx->cpi, pl->bubble_cause[3], pl->bubble_pc[3], 1);
     }
-    // printf("WB: ");
-    // handle_itrace(&mem_wb_reg.s);
-    if (mem_wb_reg.REG_write)
-    {
-        switch (mem_wb_reg.REG_src)
-        {
-        case ALU_RES:
-            R(mem_wb_reg.REG_dst) = mem_wb_reg.alu_result;
-            break;
-        case MEM_RES:
-            R(mem_wb_reg.REG_dst) = mem_wb_reg.mem_result;
-            break;
-        case PC_PLUS_4:
-            R(mem_wb_reg.REG_dst) = mem_wb_reg.s.pc + 4;
-            break;
-        default:
-            break;
+    // in order, the youngest write to a register wins
+    for (int k = 0; k < pl->width; k++) {
+        if (!pl->mem_wb_reg[k].valid) {
+            R(0) = 0;
+            continue;
+        }
+        Decode *s = &pl->mem_wb_reg[k].s;
+        pl_writeback(ctx, &pl->mem_wb_reg[k]);
+        ++ctx->ninst;
+        // ecall and ebreak, alone in their group: a halt stops the machine
+        // with every older instruction retired
+        if (isa_info[s->op].cls == CLASS_SYSTEM)
+            isa_system(ctx, s);
+        if (unlikely(ctx->dt != NULL))
+            difftest_commit(ctx, s->pc, s->inst, s->dnpc);
+        if (unlikely(ctx->pv != NULL)) {
+            pv_stage(ctx->pv, pl->mem_wb_reg[k].id, PV_WB);
+            pv_retire(ctx->pv, pl->mem_wb_reg[k].id);
         }
+        if (ctx->cpi) cpi_retire(ctx->cpi, s->pc);
     }
-
-    R(0) = 0;
-    return;
+    if (unlikely(ctx->dt != NULL)) difftest_sync(ctx);
 }
 
-static inline void reg_use(uint64_t inst, int *use_rs1, int *use_rs2)
+void pl_register_stats(SimContext *ctx)
 {
-    switch (get_inst_type(inst))
-    {
-    case TYPE_R:
-    case TYPE_S:
-    case TYPE_B:
-        *use_rs1 = 1;
-        *use_rs2 = 1;
-        break;
-    case TYPE_I:
-        *use_rs1 = 1;
-        *use_rs2 = 0;
-        break;
-    case TYPE_U:
-    case TYPE_J:
-    default:
-        *use_rs1 = 0;
-        *use_rs2 = 0;
-        break;
-    }
+    PipelineState *pl = &ctx->pl;
+    Stats *s = ctx->stats;
+    stats_counter(s, &pl->RAW_harzard_count, "pl.hazards.raw");
+    stats_counter(s, &pl->control_harzard_count, "pl.hazards.control");
+    stats_counter(s, &pl->stall_alu, "pl.stalls.alu");
+    stats_counter(s, &pl->stall_load_use, "pl.stalls.load_use");
+    stats_counter(s, &pl->stall_ecall, "pl.stalls.ecall");
+    stats_counter(s, &pl->stall_long, "pl.stalls.long_latency");
+    stats_counter(s, &pl->stall_fu, "pl.stalls.unit_busy");
+    stats_counter(s, &pl->forwarded, "pl.forwarded");
+    // cycles ID issued 0, 1, ... width instructions
+    stats_histogram(s, pl->issue_hist, pl->width + 1, "pl.issued_per_cycle");
+    stats_counter(s, &pl->split_dep, "pl.group_split.dependence");
+    stats_counter(s, &pl->split_unit, "pl.group_split.unit");
+    stats_counter(s, &pl->split_serial, "pl.group_split.serial");
+    stats_formula(s, "core.insts", "core.cycles", 1.0 / pl->width, "pl.issue_slots_used");
 }
 
 static inline bool check_read_after_write_hazard(
@@ -614,17 +694,3 @@ static inline bool check_read_after_write_hazard(
 
     return (conflict_rs1 || conflict_rs2);
 }
-
-static inline bool inst_fusion(Decode *s) {
-    uint32_t i = s->inst;
-    int rs1 = BITS(i, 19, 15);
-    int rs2 = BITS(i, 24, 20);
-    int rd  = BITS(i, 11,  7);
-    i = mem_wb_reg.s.inst;
-    int p_rs1 = BITS(i, 19, 15);
-    int p_rs2 = BITS(i, 24, 20);
-    int p_rd  = BITS(i, 11,  7);
-    if (last_inst_is_div && (rs1 == p_rs1) && (rs2 == p_rs2) && (rd == p_rd))
-        return true;
-    return false;
-}
\ No newline at end of file
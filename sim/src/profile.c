@@ -0,0 +1,309 @@
+#include <common.h>
+#include <sys/mman.h>
+#include <profile.h>
+
+#define PROF_TOP 20         // hottest instructions listed
+
+typedef struct ProfFunc {
+    uint64_t self;          // instructions run in it, from the counts
+    uint64_t total;         // in it and in what it called, outermost calls only
+    uint64_t calls;         // from other functions
+    uint64_t self_calls;    // from itself
+    int active;             // calls of it on the stack
+    int index;              // in the call graph, 0: not listed
+} ProfFunc;
+
+typedef struct ProfArc {
+    int used;
+    int caller, callee;
+    uint64_t calls;
+    uint64_t total;         // of the callee, through this arc
+} ProfArc;
+
+static inline int nfuncs(const Profile *p) {
+    return p->symbols->count + 1;
+}
+
+static inline int func_of(Profile *p, uint64_t addr) {
+    const FuncSymbol *f = find_func(p->symbols, addr);
+    return f ? f - p->symbols->symbols : p->symbols->count;
+}
+
+static const char *func_name(const Profile *p, int func) {
+    return func < p->symbols->count ? p->symbols->symbols[func].name : "?";
+}
+
+static int push(Profile *p, int func, uint64_t ret, uint64_t entry) {
+    if (p->depth == p->stack_cap) {
+        ProfFrame *grown = realloc(p->stack, 2 * p->stack_cap * sizeof(ProfFrame));
+        if (!grown) return -1;
+        p->stack = grown;
+        p->stack_cap *= 2;
+    }
+    p->stack[p->depth++] = (ProfFrame){ func, ret, entry };
+    p->funcs[func].active++;
+    return 0;
+}
+
+Profile *prof_create(uint64_t base, uint64_t size, SymbolTable *symbols, uint64_t entry) {
+    Profile *p = calloc(1, sizeof(Profile));
+    check_mem(p);
+    p->base = base;
+    p->size = size;
+    p->symbols = symbols;
+    p->lo = size;
+    // like the guest memory, only the pages of code that runs are touched
+    p->count = mmap(NULL, size / 4 * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p->count == MAP_FAILED) p->count = NULL;
+    check(p->count, "mmap of the profile counts failed.");
+    p->funcs = calloc(nfuncs(p), sizeof(ProfFunc));
+    p->arc_cap = 256;
+    p->arcs = calloc(p->arc_cap, sizeof(ProfArc));
+    p->stack_cap = 256;
+    p->stack = malloc(p->stack_cap * sizeof(ProfFrame));
+    check_mem(p->funcs && p->arcs && p->stack);
+    // nothing called the function it starts in
+    push(p, func_of(p, entry), 0, 0);
+    return p;
+
+error:
+    prof_free(p);
+    return NULL;
+}
+
+void prof_free(Profile *p) {
+    if (!p) return;
+    if (p->count) munmap(p->count, p->size / 4 * sizeof(uint64_t));
+    free(p->funcs);
+    free(p->arcs);
+    free(p->stack);
+    free(p);
+}
+
+static inline int arc_slot(const Profile *p, int caller, int callee) {
+    return ((uint32_t)caller * 2654435761u ^ (uint32_t)callee) & (p->arc_cap - 1);
+}
+
+static ProfArc *arc_get(Profile *p, int caller, int callee) {
+    if (p->narcs * 2 >= p->arc_cap) {
+        ProfArc *old = p->arcs;
+        int old_cap = p->arc_cap;
+        ProfArc *grown = calloc(old_cap * 2, sizeof(ProfArc));
+        if (!grown) return NULL;
+        p->arcs = grown;
+        p->arc_cap = old_cap * 2;
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].used) continue;
+            int k = arc_slot(p, old[i].caller, old[i].callee);
+            while (p->arcs[k].used) k = (k + 1) & (p->arc_cap - 1);
+            p->arcs[k] = old[i];
+        }
+        free(old);
+    }
+    int k = arc_slot(p, caller, callee);
+    while (p->arcs[k].used) {
+        if (p->arcs[k].caller == caller && p->arcs[k].callee == callee) return &p->arcs[k];
+        k = (k + 1) & (p->arc_cap - 1);
+    }
+    p->arcs[k] = (ProfArc){ 1, caller, callee, 0, 0 };
+    p->narcs++;
+    return &p->arcs[k];
+}
+
+void prof_call(Profile *p, uint64_t pc, uint64_t target, uint64_t ninst) {
+    int callee = func_of(p, target);
+    int caller = p->stack[p->depth - 1].func;
+    if (caller == callee) {
+        p->funcs[callee].self_calls++;
+    } else {
+        p->funcs[callee].calls++;
+        ProfArc *a = arc_get(p, caller, callee);
+        if (a) a->calls++;
+    }
+    // the call is the caller's, what follows up to the return the callee's
+    push(p, callee, pc + 4, ninst + 1);
+}
+
+// The callee of the top frame returned, exit instructions had run then
+static void pop(Profile *p, uint64_t exit) {
+    ProfFrame *fr = &p->stack[--p->depth];
+    ProfFunc *f = &p->funcs[fr->func];
+    // a recursive call is part of the outermost one
+    if (--f->active) return;
+    uint64_t n = exit - fr->entry;
+    f->total += n;
+    if (p->depth) {
+        ProfArc *a = arc_get(p, p->stack[p->depth - 1].func, fr->func);
+        if (a) a->total += n;
+    }
+}
+
+void prof_ret(Profile *p, uint64_t target, uint64_t ninst) {
+    int i = p->depth - 1;
+    // the frame at the bottom was never called, it can not return
+    while (i > 0 && p->stack[i].ret != target) i--;
+    if (i == 0) return;
+    while (p->depth > i) pop(p, ninst + 1);
+}
+
+// ------------ Report ------------
+
+typedef struct {
+    uint64_t pc;
+    uint64_t count;
+} ProfPc;
+
+// Sort arrays of function indices, arg is the profile
+static int by_self(const void *a, const void *b, void *arg) {
+    const Profile *p = arg;
+    const ProfFunc *x = &p->funcs[*(const int *)a], *y = &p->funcs[*(const int *)b];
+    if (x->self != y->self) return x->self < y->self ? 1 : -1;
+    return strcmp(func_name(p, *(const int *)a), func_name(p, *(const int *)b));
+}
+
+static int by_total(const void *a, const void *b, void *arg) {
+    const Profile *p = arg;
+    const ProfFunc *x = &p->funcs[*(const int *)a], *y = &p->funcs[*(const int *)b];
+    if (x->total != y->total) return x->total < y->total ? 1 : -1;
+    return by_self(a, b, arg);
+}
+
+static int by_arc_total(const void *a, const void *b) {
+    const ProfArc *x = *(ProfArc *const *)a, *y = *(ProfArc *const *)b;
+    if (x->total != y->total) return x->total < y->total ? 1 : -1;
+    return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+static int by_count(const void *a, const void *b) {
+    const ProfPc *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->pc < y->pc ? -1 : 1;
+}
+
+static void print_flat(FILE *fp, const Profile *p, int *order, int n, uint64_t ninst) {
+    uint64_t cumulative = 0;
+    fprintf(fp, "Flat profile:\n\n");
+    fprintf(fp, "  %% self  cumulative        self       calls   self/call  total/call  name\n");
+    for (int i = 0; i < n; i++) {
+        const ProfFunc *f = &p->funcs[order[i]];
+        uint64_t calls = f->calls + f->self_calls;
+        cumulative += f->self;
+        fprintf(fp, "%7.2f %11lu %11lu", ninst ? 100.0 * f->self / ninst : 0.0, cumulative, f->self);
+        if (calls) fprintf(fp, " %11lu %11.2f", calls, (double)f->self / calls);
+        else fprintf(fp, " %11s %11s", "", "");
+        if (f->calls) fprintf(fp, " %11.2f", (double)f->total / f->calls);
+        else fprintf(fp, " %11s", "");
+        fprintf(fp, "  %s\n", func_name(p, order[i]));
+    }
+}
+
+static void print_arc(FILE *fp, const Profile *p, const ProfArc *a, int func) {
+    char called[48];
+    // out of all the calls of the callee, as gprof
+    snprintf(called, sizeof(called), "%lu/%lu", a->calls, p->funcs[a->callee].calls);
+    fprintf(fp, "%6s %7s %11s %11lu %15s      %s [%d]\n", "", "", "", a->total, called,
+            func_name(p, func), p->funcs[func].index);
+}
+
+static void print_graph(FILE *fp, const Profile *p, int *order, int n, uint64_t ninst) {
+    ProfArc **arcs = malloc((p->narcs + 1) * sizeof(ProfArc *));
+    if (!arcs) return;
+    fprintf(fp, "\nCall graph:\n\n");
+    fprintf(fp, "index  %% total        self       total          called      name\n");
+    for (int i = 0; i < n; i++) {
+        int func = order[i];
+        const ProfFunc *f = &p->funcs[func];
+        int m = 0;
+        // who called it
+        for (int k = 0; k < p->arc_cap; k++) {
+            if (p->arcs[k].used && p->arcs[k].callee == func) arcs[m++] = &p->arcs[k];
+        }
+        qsort(arcs, m, sizeof(ProfArc *), by_arc_total);
+        if (m == 0) fprintf(fp, "%6s %7s %11s %11s %15s      <spontaneous>\n", "", "", "", "", "");
+        for (int k = 0; k < m; k++) print_arc(fp, p, arcs[k], arcs[k]->caller);
+
+        char called[48] = "";
+        if (f->self_calls) snprintf(called, sizeof(called), "%lu+%lu", f->calls, f->self_calls);
+        else if (f->calls) snprintf(called, sizeof(called), "%lu", f->calls);
+        char index[16];
+        snprintf(index, sizeof(index), "[%d]", f->index);
+        fprintf(fp, "%-6s %7.1f %11lu %11lu %15s  %s [%d]\n", index, ninst ? 100.0 * f->total / ninst : 0.0,
+                f->self, f->total, called, func_name(p, func), f->index);
+
+        // what it called
+        m = 0;
+        for (int k = 0; k < p->arc_cap; k++) {
+            if (p->arcs[k].used && p->arcs[k].caller == func) arcs[m++] = &p->arcs[k];
+        }
+        qsort(arcs, m, sizeof(ProfArc *), by_arc_total);
+        for (int k = 0; k < m; k++) print_arc(fp, p, arcs[k], arcs[k]->callee);
+        fprintf(fp, "-----------------------------------------------------------------------\n");
+    }
+    free(arcs);
+}
+
+static void print_hot(FILE *fp, Profile *p, uint64_t ninst) {
+    int n = 0, cap = 1024;
+    ProfPc *pcs = malloc(cap * sizeof(ProfPc));
+    if (!pcs) return;
+    for (uint64_t off = p->lo; off <= p->hi && off < p->size; off += 4) {
+        uint64_t c = p->count[off >> 2];
+        if (!c) continue;
+        if (n == cap) {
+            ProfPc *grown = realloc(pcs, 2 * cap * sizeof(ProfPc));
+            if (!grown) break;
+            pcs = grown;
+            cap *= 2;
+        }
+        pcs[n++] = (ProfPc){ p->base + off, c };
+    }
+    qsort(pcs, n, sizeof(ProfPc), by_count);
+    fprintf(fp, "\nHottest instructions:\n\n");
+    fprintf(fp, "  %% all           runs  pc\n");
+    for (int i = 0; i < n && i < PROF_TOP; i++) {
+        const FuncSymbol *f = find_func(p->symbols, pcs[i].pc);
+        fprintf(fp, "%7.2f %14lu  %08lx", 100.0 * pcs[i].count / ninst, pcs[i].count, pcs[i].pc);
+        if (f) fprintf(fp, " %s+0x%lx", f->name, pcs[i].pc - f->address);
+        fprintf(fp, "\n");
+    }
+    free(pcs);
+}
+
+int prof_report(Profile *p, const char *path, const char *image, uint64_t ninst) {
+    FILE *fp = NULL;
+    int *order = NULL;
+    // still running when it stopped, the bottom frame included
+    while (p->depth) pop(p, ninst);
+    for (uint64_t off = p->lo; off <= p->hi && off < p->size; off += 4) {
+        uint64_t c = p->count[off >> 2];
+        if (c) p->funcs[func_of(p, p->base + off)].self += c;
+    }
+
+    order = malloc(nfuncs(p) * sizeof(int));
+    check_mem(order);
+    int n = 0;
+    for (int i = 0; i < nfuncs(p); i++) {
+        const ProfFunc *f = &p->funcs[i];
+        if (f->self || f->total || f->calls || f->self_calls) order[n++] = i;
+    }
+    fp = fopen(path, "w");
+    check(fp, "Can not write the profile to %s.", path);
+    fprintf(fp, "Profile of %s: %lu instructions\n\n", image, ninst);
+
+    qsort_r(order, n, sizeof(int), by_total, p);
+    for (int i = 0; i < n; i++) p->funcs[order[i]].index = i + 1;
+    qsort_r(order, n, sizeof(int), by_self, p);
+    print_flat(fp, p, order, n, ninst);
+    qsort_r(order, n, sizeof(int), by_total, p);
+    print_graph(fp, p, order, n, ninst);
+    if (ninst) print_hot(fp, p, ninst);
+
+    free(order);
+    check(fclose(fp) == 0, "Can not write the profile to %s.", path);
+    return 0;
+
+error:
+    free(order);
+    return -1;
+}
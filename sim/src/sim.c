@@ -0,0 +1,216 @@
+#include <common.h>
+#include <sim.h>
+#include <memory.h>
+#include <iss_core.h>
+#include <iss_block.h>
+#include <jit.h>
+#include <commit.h>
+#include <device.h>
+#include <profile.h>
+#include <trace.h>
+#include <difftest.h>
+#include "ftrace.h"
+
+static int init_caches(SimContext *ctx, const SimConfig *cfg) {
+    if (cfg->l2.size) {
+        ctx->l2 = cache_create("L2", &cfg->l2, NULL, cfg->mem_latency);
+        if (!ctx->l2) return -1;
+    }
+    if (cfg->icache.size) {
+        ctx->icache = cache_create("L1I", &cfg->icache, ctx->l2, cfg->mem_latency);
+        if (!ctx->icache) return -1;
+    }
+    if (cfg->dcache.size) {
+        ctx->dcache = cache_create("L1D", &cfg->dcache, ctx->l2, cfg->mem_latency);
+        if (!ctx->dcache) return -1;
+    }
+    return 0;
+}
+
+// The statistics of what sim_create() built. The models add their own
+// before they run.
+static int register_stats(SimContext *ctx, const SimConfig *cfg) {
+    ctx->stats_clock = cfg->stats_cycles ? &ctx->global_cycle_count : &ctx->ninst;
+    ctx->stats_next = cfg->stats_interval;
+    ctx->stats = stats_create(ctx->stats_clock, cfg->stats_interval);
+    if (!ctx->stats) return -1;
+    stats_counter(ctx->stats, &ctx->ninst, "core.insts");
+    stats_counter(ctx->stats, &ctx->global_cycle_count, "core.cycles");
+    stats_formula(ctx->stats, "core.cycles", "core.insts", 1, "core.cpi");
+    stats_formula(ctx->stats, "core.insts", "core.cycles", 1, "core.ipc");
+    if (ctx->icache) cache_register_stats(ctx->icache, ctx->stats);
+    if (ctx->dcache) cache_register_stats(ctx->dcache, ctx->stats);
+    if (ctx->l2) cache_register_stats(ctx->l2, ctx->stats);
+    if (ctx->bp) bp_register_stats(ctx->bp, ctx->stats);
+    if (ctx->ooo) ooo_register_stats(ctx->ooo, ctx->stats);
+    if (ctx->cpi) cpi_register_stats(ctx->cpi, ctx->stats);
+    return 0;
+}
+
+SimContext *sim_create(const char *image, const SimConfig *cfg) {
+    char image_file[256];
+    SimContext *ctx = calloc(1, sizeof(SimContext));
+    check_mem(ctx);
+    ctx->image = image;
+    ctx->boot = ctx;
+    ctx->nharts = 1;
+    ctx->mem_base = cfg->mem_base;
+    ctx->mem_size = cfg->mem_size;
+    ctx->pl.forwarding = cfg->forward;
+    ctx->pl.width = cfg->width;
+    ctx->uarch = cfg->uarch;
+    ctx->mc_fast = cfg->fast;
+
+    check(mem_map(ctx) == 0, "Failed to map %lu bytes of guest memory.", ctx->mem_size);
+    check(init_devices(ctx) == 0, "Failed to add the devices.");
+    mem_dump_map(ctx);
+    check(decode_cache_init(ctx) == 0, "Failed to allocate the decode cache.");
+    check(init_caches(ctx, cfg) == 0, "Failed to build the caches.");
+    if (cfg->bp.kind != BP_NONE) {
+        ctx->bp = bp_create(&cfg->bp);
+        check(ctx->bp, "Failed to build the branch predictor.");
+    }
+    if (cfg->ooo.rob) {
+        ctx->ooo = ooo_create(&cfg->ooo);
+        check(ctx->ooo, "Failed to build the out-of-order core.");
+    }
+    if (cfg->cpi_stack) {
+        ctx->cpi = cpi_create();
+        check(ctx->cpi, "Failed to allocate the CPI stack.");
+    }
+    if (cfg->decoupled) {
+        // the same machine without any timing, it never counts cycles
+        SimConfig iss_cfg = { .mem_base = cfg->mem_base, .mem_size = cfg->mem_size, .symbols = cfg->symbols };
+        ctx->iss = sim_create(image, &iss_cfg);
+        check(ctx->iss, "Failed to build the ISS of --decoupled.");
+    }
+    if (cfg->fast_check) {
+        // the same caches, nothing else: it only counts cycles
+        SimConfig check_cfg = { .mem_base = cfg->mem_base, .mem_size = cfg->mem_size,
+                                .icache = cfg->icache, .dcache = cfg->dcache, .l2 = cfg->l2,
+                                .mem_latency = cfg->mem_latency, .uarch = cfg->uarch };
+        ctx->mc_check = sim_create(image, &check_cfg);
+        check(ctx->mc_check, "Failed to build the machine of --fast-check.");
+    }
+    if (cfg->difftest) {
+        ctx->dt = difftest_create(image, cfg);
+        check(ctx->dt, "Failed to build the ISS of --difftest.");
+    }
+    if (cfg->pipeview.path) {
+        ctx->pv = pv_create(&cfg->pipeview, &ctx->global_cycle_count, &ctx->ninst);
+        check(ctx->pv, "Failed to open the pipeline view.");
+    }
+    if (cfg->stats) {
+        check(register_stats(ctx, cfg) == 0, "Failed to allocate the statistics.");
+    }
+    init_symbol_table(&ctx->sym_table);
+
+    snprintf(image_file, sizeof(image_file), "test/build/%s.elf", image);
+    check(load_elf(ctx, image_file, cfg->symbols) == 0, "Failed to load %s.", image);
+    if (cfg->profile) {
+        // the symbols are sorted now
+        ctx->prof = prof_create(ctx->mem_base, ctx->mem_size, &ctx->sym_table, ctx->entry);
+        check(ctx->prof, "Failed to allocate the profile.");
+    }
+    if (cfg->trace) {
+        ctx->trace = trace_create(cfg->trace, &ctx->sym_table);
+        check(ctx->trace, "Failed to open the trace.");
+    }
+
+    init_cpu(ctx);
+    return ctx;
+
+error:
+    sim_destroy(ctx);
+    return NULL;
+}
+
+int sim_add_harts(SimContext *ctx, int nharts) {
+    check(ctx->harts == NULL, "Harts were already added.");
+    ctx->harts = calloc(nharts, sizeof(SimContext *));
+    check_mem(ctx->harts);
+    ctx->harts[0] = ctx;
+    for (int i = 1; i < nharts; i++) {
+        SimContext *h = calloc(1, sizeof(SimContext));
+        check_mem(h);
+        ctx->harts[i] = h;
+        ctx->nharts = i + 1;
+        h->image = ctx->image;
+        h->entry = ctx->entry;
+        h->sym_table = ctx->sym_table;
+        h->hartid = i;
+        h->boot = ctx;
+        check(mem_share(h, ctx) == 0, "Failed to share the memory.");
+        check(decode_cache_init(h) == 0, "Failed to allocate the decode cache.");
+    }
+    // a1 tells every hart how many there are
+    for (int i = 0; i < nharts; i++) {
+        init_cpu(ctx->harts[i]);
+    }
+    return 0;
+
+error:
+    return -1;
+}
+
+static void free_hart(SimContext *h) {
+    tb_free(h);
+    jit_free(h);
+    decode_cache_free(h);
+    cache_free(h->icache);
+    cache_free(h->dcache);
+    cache_free(h->l2);
+    h->icache = h->dcache = h->l2 = NULL;
+    bp_free(h->bp);
+    h->bp = NULL;
+    ooo_free(h->ooo);
+    h->ooo = NULL;
+    cpi_free(h->cpi);
+    h->cpi = NULL;
+    stats_free(h->stats);
+    h->stats = NULL;
+    pv_close(h->pv);
+    h->pv = NULL;
+    decoupled_free(h);
+    sim_destroy(h->iss);
+    h->iss = NULL;
+    sim_destroy(h->mc_check);
+    h->mc_check = NULL;
+    difftest_free(h->dt);
+    h->dt = NULL;
+    prof_free(h->prof);
+    h->prof = NULL;
+    trace_close(h->trace);
+    h->trace = NULL;
+}
+
+void sim_release(SimContext *ctx) {
+    for (int i = 1; ctx->harts && i < ctx->nharts; i++) {
+        free_hart(ctx->harts[i]);
+        mem_unmap(ctx->harts[i]);
+    }
+    free_hart(ctx);
+    mem_unmap(ctx);
+}
+
+void sim_destroy(SimContext *ctx) {
+    if (!ctx) return;
+    for (int i = 1; ctx->harts && i < ctx->nharts; i++) {
+        free_hart(ctx->harts[i]);
+        mem_unmap(ctx->harts[i]);
+        free(ctx->harts[i]);
+    }
+    free(ctx->harts);
+    free_hart(ctx);
+    free_symbol_table(&ctx->sym_table);
+    mem_unmap(ctx);
+    free(ctx);
+}
+
+uint64_t sim_ninst(SimContext *ctx) {
+    uint64_t n = ctx->ninst;
+    for (int i = 1; ctx->harts && i < ctx->nharts; i++) {
+        n += ctx->harts[i]->ninst;
+    }
+    return n;
+}
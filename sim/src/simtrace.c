@@ -0,0 +1,246 @@
+#include <common.h>
+#include <unistd.h>
+#include <disasm.h>
+#include <trace.h>
+
+// simtrace: print a trace written by the ISS with --trace, the way --itrace
+// and --ftrace would have printed the run
+
+LLVMDisasmContextRef disasm_ctx;
+
+static const char *usage = "Usage: simtrace <trace> [options]\n"
+                           "Prints every instruction like --itrace, with the calls and returns like --ftrace.\n"
+                           "Options:\n"
+                           "  --insts    Only the instructions\n"
+                           "  --calls    Only the calls and returns\n"
+                           "  --summary  Only count the records\n";
+
+// The word at every pc the trace has shown, and its disassembly
+typedef struct {
+    uint64_t pc;
+    uint32_t inst;
+    int used;
+    char text[64];          // empty: not disassembled yet
+} Slot;
+
+typedef struct {
+    Slot *slots;
+    uint64_t size, used;    // size is a power of 2
+} InstMap;
+
+static Slot *map_find(InstMap *m, uint64_t pc) {
+    uint64_t i = (pc >> 2) * 0x9e3779b97f4a7c15ull >> 20;
+    for (;; i++) {
+        Slot *s = &m->slots[i & (m->size - 1)];
+        if (!s->used || s->pc == pc) return s;
+    }
+}
+
+static Slot *map_put(InstMap *m, uint64_t pc, uint32_t inst) {
+    if (2 * (m->used + 1) > m->size) {
+        InstMap grown = { calloc(m->size * 2, sizeof(Slot)), m->size * 2, m->used };
+        if (!grown.slots) return NULL;
+        for (uint64_t i = 0; i < m->size; i++) {
+            if (m->slots[i].used) *map_find(&grown, m->slots[i].pc) = m->slots[i];
+        }
+        free(m->slots);
+        *m = grown;
+    }
+    Slot *s = map_find(m, pc);
+    if (!s->used) m->used++;
+    if (!s->used || s->inst != inst) s->text[0] = '\0';
+    s->pc = pc;
+    s->inst = inst;
+    s->used = 1;
+    return s;
+}
+
+typedef struct {
+    FILE *fp;
+    SymbolTable symbols;
+    InstMap map;
+    int insts, calls, color;
+    int depth;              // of the calls, like ftrace
+    uint64_t pc;            // of the last instruction
+    uint64_t ninst, ncalls, nrets, nwords;
+} Reader;
+
+static int read_varint(FILE *fp, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc_unlocked(fp);
+        if (c == EOF) return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static int read_header(Reader *r) {
+    char magic[sizeof(TRACE_MAGIC)];
+    uint32_t head[2];
+    check(fread(magic, sizeof(magic), 1, r->fp) == 1 && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0,
+          "Not a trace of the simulator.");
+    check(fread(head, sizeof(head), 1, r->fp) == 1, "The trace ends in its header.");
+    check(head[0] == TRACE_VERSION, "Trace version %u, this simtrace reads version %d.", head[0], TRACE_VERSION);
+    for (uint32_t i = 0; i < head[1]; i++) {
+        uint64_t addr;
+        uint16_t len;
+        char name[UINT16_MAX + 1];
+        check(fread(&addr, sizeof(addr), 1, r->fp) == 1 && fread(&len, sizeof(len), 1, r->fp) == 1 &&
+              fread(name, 1, len, r->fp) == len, "The trace ends in its symbols.");
+        name[len] = '\0';
+        add_func_symbol(&r->symbols, addr, name);
+    }
+    check(r->symbols.count == (int)head[1], "Out of memory.");
+    return 0;
+
+error:
+    return -1;
+}
+
+static void print_inst(Reader *r, Slot *s) {
+    if (!s->text[0]) {
+        disassemble_inst(disasm_ctx, (uint8_t *)&s->inst, 4, s->pc, s->text, sizeof(s->text));
+    }
+    if (r->color) printf(ANSI_FG_BLUE "0x%016lx" ANSI_NONE ": %08x          %s\n", s->pc, s->inst, s->text);
+    else printf("0x%016lx: %08x          %s\n", s->pc, s->inst, s->text);
+}
+
+static void print_pc(Reader *r) {
+    if (r->color) printf(ANSI_FG_BLUE "0x%08lx" ANSI_NONE ": ", r->pc);
+    else printf("0x%08lx: ", r->pc);
+    for (int i = 0; i < r->depth; i++) printf("  ");
+}
+
+// The symbol pc falls in, like find_func
+static const FuncSymbol *symbol_of(Reader *r, uint64_t pc) {
+    int lo = 0, hi = r->symbols.count - 1, best = -1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (r->symbols.symbols[mid].address <= pc) {
+            best = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return best < 0 ? NULL : &r->symbols.symbols[best];
+}
+
+static int read_records(Reader *r) {
+    uint64_t next_pc = 0, v;
+    int tag;
+    while ((tag = getc_unlocked(r->fp)) != EOF) {
+        switch (tag) {
+            case TR_SEQ: case TR_SEQ_INST: case TR_JUMP: case TR_JUMP_INST: {
+                uint64_t pc = next_pc;
+                if (tag >= TR_JUMP) {
+                    check(read_varint(r->fp, &v) == 0, "The trace ends in a record.");
+                    pc += (v >> 1) ^ -(v & 1);
+                }
+                Slot *s;
+                if (tag == TR_SEQ_INST || tag == TR_JUMP_INST) {
+                    uint32_t inst;
+                    check(fread(&inst, sizeof(inst), 1, r->fp) == 1, "The trace ends in a record.");
+                    s = map_put(&r->map, pc, inst);
+                    check_mem(s);
+                    r->nwords++;
+                } else {
+                    s = map_find(&r->map, pc);
+                    check(s->used, "Record %lu: no word was given for pc %08lx.", r->ninst, pc);
+                }
+                if (r->insts) print_inst(r, s);
+                r->pc = pc;
+                next_pc = pc + 4;
+                r->ninst++;
+                break;
+            }
+            case TR_CALL: {
+                check(read_varint(r->fp, &v) == 0, "The trace ends in a record.");
+                check(v <= (uint64_t)r->symbols.count, "Record %lu: no symbol %lu.", r->ninst, v - 1);
+                const FuncSymbol *f = v ? &r->symbols.symbols[v - 1] : NULL;
+                if (r->calls) {
+                    print_pc(r);
+                    printf("call [%s@%08lx]\n", f ? f->name : "unknown_function", f ? f->address : 0);
+                }
+                r->depth++;
+                r->ncalls++;
+                break;
+            }
+            case TR_RET: {
+                if (r->depth > 0) r->depth--;
+                if (r->calls) {
+                    const FuncSymbol *f = symbol_of(r, r->pc);
+                    print_pc(r);
+                    printf("ret  [%s]\n", f ? f->name : "unknown_function");
+                }
+                r->nrets++;
+                break;
+            }
+            case TR_END:
+                check(read_varint(r->fp, &v) == 0, "The trace ends in a record.");
+                check(v == r->ninst, "The trace says %lu instructions, it holds %lu.", v, r->ninst);
+                return 0;
+            default:
+                sentinel("Record %lu: bad tag %d.", r->ninst, tag);
+        }
+    }
+    log_warn("The trace stops after %lu instructions, the run did not close it.", r->ninst);
+    return -1;
+
+error:
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    Reader r = { 0 };
+    const char *path = NULL;
+    int summary = 0, rc = -1;
+    r.insts = r.calls = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--insts") == 0) r.calls = 0;
+        else if (strcmp(argv[i], "--calls") == 0) r.insts = 0;
+        else if (strcmp(argv[i], "--summary") == 0) summary = 1;
+        else if (argv[i][0] != '-' && !path) path = argv[i];
+        else {
+            printf("%s", usage);
+            return strcmp(argv[i], "--help") == 0 ? 0 : -1;
+        }
+    }
+    if (!path || (!r.insts && !r.calls)) {
+        printf("%s", usage);
+        return -1;
+    }
+    if (summary) r.insts = r.calls = 0;
+    r.color = isatty(STDOUT_FILENO);
+    errno = 0;
+
+    init_symbol_table(&r.symbols);
+    r.map.size = 4096;
+    r.map.slots = calloc(r.map.size, sizeof(Slot));
+    check_mem(r.map.slots);
+    r.fp = fopen(path, "rb");
+    check(r.fp, "Can not read %s.", path);
+    check(read_header(&r) == 0, "Bad trace %s.", path);
+    if (r.insts) {
+        init_llvm_disassembler();
+        check(disasm_ctx, "Failed to start the disassembler.");
+    }
+
+    rc = read_records(&r);
+    if (summary) {
+        long size = ftell(r.fp);
+        printf("%lu instructions at %lu pcs, %lu calls, %lu returns, %lu symbols\n",
+               r.ninst, r.map.used, r.ncalls, r.nrets, (uint64_t)r.symbols.count);
+        printf("%ld bytes, %.2f per instruction, %lu instruction words\n",
+               size, r.ninst ? (double)size / r.ninst : 0.0, r.nwords);
+    }
+
+error:
+    if (disasm_ctx) cleanup_llvm_disassembler();
+    if (r.fp) fclose(r.fp);
+    free(r.map.slots);
+    free_symbol_table(&r.symbols);
+    return rc;
+}
@@ -0,0 +1,324 @@
+#include <common.h>
+#include <stdarg.h>
+#include <stats.h>
+
+#define STATS_MAX_TERMS 8
+
+typedef enum { STAT_COUNTER, STAT_HISTOGRAM, STAT_FORMULA } StatKind;
+
+typedef struct {
+    char *name;
+    StatKind kind;
+    const uint64_t *val;    // counter and histogram
+    int n;                  // histogram buckets
+    int slot;               // first value in a snapshot
+    // formula: scale * sum(num) / sum(den), slots of counters
+    int num[STATS_MAX_TERMS], nnum;
+    int den[STATS_MAX_TERMS], nden;
+    double scale;
+} Stat;
+
+struct Stats {
+    Stat *stats;
+    int n, cap;
+    int nslots;             // values in a snapshot
+    const uint64_t *clock;
+    uint64_t period;
+    // the values at the end of each interval, nslots each
+    uint64_t *snaps;
+    int nsnaps, snap_cap;
+    uint64_t last_clock;    // at the last snapshot
+    int sealed;             // a snapshot was taken, the layout is fixed
+};
+
+Stats *stats_create(const uint64_t *clock, uint64_t period) {
+    Stats *s = calloc(1, sizeof(Stats));
+    check_mem(s);
+    s->clock = clock;
+    s->period = period;
+    return s;
+
+error:
+    return NULL;
+}
+
+void stats_free(Stats *s) {
+    if (!s) return;
+    for (int i = 0; i < s->n; i++) free(s->stats[i].name);
+    free(s->stats);
+    free(s->snaps);
+    free(s);
+}
+
+static Stat *stats_add(Stats *s, StatKind kind, const char *fmt, va_list ap) {
+    check(!s->sealed, "Statistics must be registered before the first snapshot.");
+    if (s->n == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 64;
+        Stat *grown = realloc(s->stats, cap * sizeof(Stat));
+        check_mem(grown);
+        s->stats = grown;
+        s->cap = cap;
+    }
+    Stat *st = &s->stats[s->n];
+    memset(st, 0, sizeof(Stat));
+    char name[128];
+    vsnprintf(name, sizeof(name), fmt, ap);
+    st->name = strdup(name);
+    check_mem(st->name);
+    st->kind = kind;
+    st->slot = s->nslots;
+    s->n++;
+    return st;
+
+error:
+    return NULL;
+}
+
+void stats_counter(Stats *s, const uint64_t *val, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    Stat *st = stats_add(s, STAT_COUNTER, fmt, ap);
+    va_end(ap);
+    if (!st) return;
+    st->val = val;
+    st->n = 1;
+    s->nslots++;
+}
+
+void stats_histogram(Stats *s, const uint64_t *buckets, int n, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    Stat *st = stats_add(s, STAT_HISTOGRAM, fmt, ap);
+    va_end(ap);
+    if (!st) return;
+    st->val = buckets;
+    st->n = n;
+    s->nslots += n;
+}
+
+// "a+b+c" to the slots of counters a, b and c
+static int parse_terms(Stats *s, const char *expr, int *slots) {
+    char buf[256];
+    int n = 0;
+    snprintf(buf, sizeof(buf), "%s", expr);
+    for (char *save, *name = strtok_r(buf, "+", &save); name; name = strtok_r(NULL, "+", &save)) {
+        int found = -1;
+        for (int i = 0; i < s->n; i++) {
+            if (s->stats[i].kind == STAT_COUNTER && strcmp(s->stats[i].name, name) == 0) found = s->stats[i].slot;
+        }
+        check(found >= 0, "No counter %s to compute a statistic from.", name);
+        check(n < STATS_MAX_TERMS, "Too many terms in %s.", expr);
+        slots[n++] = found;
+    }
+    return n;
+
+error:
+    return -1;
+}
+
+void stats_formula(Stats *s, const char *num, const char *den, double scale, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    Stat *st = stats_add(s, STAT_FORMULA, fmt, ap);
+    va_end(ap);
+    if (!st) return;
+    st->scale = scale;
+    st->nnum = parse_terms(s, num, st->num);
+    st->nden = parse_terms(s, den, st->den);
+    if (st->nnum < 0 || st->nden < 0) {
+        free(st->name);
+        s->n--;
+    }
+}
+
+static void read_values(const Stats *s, uint64_t *out) {
+    for (int i = 0; i < s->n; i++) {
+        const Stat *st = &s->stats[i];
+        if (st->kind == STAT_FORMULA) continue;
+        memcpy(out + st->slot, st->val, st->n * sizeof(uint64_t));
+    }
+}
+
+static int take_snapshot(Stats *s) {
+    if (s->nsnaps == s->snap_cap) {
+        int cap = s->snap_cap ? s->snap_cap * 2 : 64;
+        uint64_t *grown = realloc(s->snaps, (size_t)cap * s->nslots * sizeof(uint64_t));
+        check_mem(grown);
+        s->snaps = grown;
+        s->snap_cap = cap;
+    }
+    read_values(s, s->snaps + (size_t)s->nsnaps * s->nslots);
+    s->nsnaps++;
+    s->last_clock = *s->clock;
+    s->sealed = 1;
+    return 0;
+
+error:
+    return -1;
+}
+
+uint64_t stats_interval(Stats *s) {
+    if (take_snapshot(s) != 0) return 0;
+    return (*s->clock / s->period + 1) * s->period;
+}
+
+// ------------ Output ------------
+
+static double formula_value(const Stat *st, const uint64_t *v, int *defined) {
+    uint64_t num = 0, den = 0;
+    for (int i = 0; i < st->nnum; i++) num += v[st->num[i]];
+    for (int i = 0; i < st->nden; i++) den += v[st->den[i]];
+    *defined = den != 0;
+    return den ? st->scale * num / den : 0;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp((*(const Stat **)a)->name, (*(const Stat **)b)->name);
+}
+
+// Length of the leading path components name and path have in common
+static int common_depth(const char *name, char path[][64], int depth) {
+    int d = 0;
+    while (d < depth) {
+        size_t len = strlen(path[d]);
+        if (strncmp(name, path[d], len) != 0 || name[len] != '.') break;
+        name += len + 1;
+        d++;
+    }
+    return d;
+}
+
+// One JSON object of every statistic, nested by the dots of their names
+static void json_values(FILE *fp, Stat **sorted, int n, const uint64_t *v, int indent) {
+    char path[16][64];
+    int depth = 0, first = 1;
+    fprintf(fp, "{");
+    for (int i = 0; i < n; i++) {
+        const Stat *st = sorted[i];
+        int d = common_depth(st->name, path, depth);
+        for (; depth > d; depth--) {
+            fprintf(fp, "\n%*s}", indent + 2 * depth, "");
+            first = 0;
+        }
+        // skip what is already open, open the rest but the leaf
+        const char *leaf = st->name;
+        for (int k = 0; k < d; k++) leaf += strlen(path[k]) + 1;
+        const char *dot;
+        while ((dot = strchr(leaf, '.')) && depth < 16) {
+            snprintf(path[depth], sizeof(path[depth]), "%.*s", (int)(dot - leaf), leaf);
+            fprintf(fp, "%s\n%*s\"%s\": {", first ? "" : ",", indent + 2 * (depth + 1), "", path[depth]);
+            depth++;
+            first = 1;
+            leaf = dot + 1;
+        }
+        fprintf(fp, "%s\n%*s\"%s\": ", first ? "" : ",", indent + 2 * (depth + 1), "", leaf);
+        first = 0;
+        if (st->kind == STAT_COUNTER) {
+            fprintf(fp, "%lu", v[st->slot]);
+        }
+        else if (st->kind == STAT_HISTOGRAM) {
+            fprintf(fp, "[");
+            for (int k = 0; k < st->n; k++) fprintf(fp, "%s%lu", k ? ", " : "", v[st->slot + k]);
+            fprintf(fp, "]");
+        }
+        else {
+            int defined;
+            double x = formula_value(st, v, &defined);
+            if (defined) fprintf(fp, "%.6g", x);
+            else fprintf(fp, "null");
+        }
+    }
+    for (; depth > 0; depth--) fprintf(fp, "\n%*s}", indent + 2 * depth, "");
+    fprintf(fp, "\n%*s}", indent, "");
+}
+
+static void csv_row(FILE *fp, const Stats *s, const char *label, const uint64_t *v) {
+    fprintf(fp, "%s", label);
+    for (int i = 0; i < s->n; i++) {
+        const Stat *st = &s->stats[i];
+        if (st->kind == STAT_FORMULA) {
+            int defined;
+            double x = formula_value(st, v, &defined);
+            if (defined) fprintf(fp, ",%.6g", x);
+            else fprintf(fp, ",");
+            continue;
+        }
+        for (int k = 0; k < st->n; k++) fprintf(fp, ",%lu", v[st->slot + k]);
+    }
+    fprintf(fp, "\n");
+}
+
+int stats_dump(Stats *s, const char *path, const char *image) {
+    FILE *fp = NULL;
+    Stat **sorted = NULL;
+    uint64_t *total = NULL, *delta = NULL;
+    // the last interval ends with the run, it may be shorter
+    if (s->period && (s->nsnaps == 0 || *s->clock != s->last_clock)) {
+        check(take_snapshot(s) == 0, "Failed to take the last snapshot.");
+    }
+    total = calloc(s->nslots + 1, sizeof(uint64_t));
+    delta = calloc(s->nslots + 1, sizeof(uint64_t));
+    sorted = calloc(s->n + 1, sizeof(Stat *));
+    check_mem(total && delta && sorted);
+    read_values(s, total);
+    for (int i = 0; i < s->n; i++) sorted[i] = &s->stats[i];
+    qsort(sorted, s->n, sizeof(Stat *), by_name);
+
+    fp = fopen(path, "w");
+    check(fp, "Can not write the statistics to %s.", path);
+    size_t len = strlen(path);
+    int csv = len >= 4 && strcmp(path + len - 4, ".csv") == 0;
+
+    if (csv) {
+        fprintf(fp, "interval");
+        for (int i = 0; i < s->n; i++) {
+            const Stat *st = &s->stats[i];
+            if (st->kind == STAT_HISTOGRAM) {
+                for (int k = 0; k < st->n; k++) fprintf(fp, ",%s.%d", st->name, k);
+            }
+            else {
+                fprintf(fp, ",%s", st->name);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+    else {
+        fprintf(fp, "{\n  \"image\": \"%s\",\n  \"total\": ", image);
+        json_values(fp, sorted, s->n, total, 2);
+        fprintf(fp, ",\n  \"intervals\": [");
+    }
+
+    // each interval from its own counts
+    for (int i = 0; i < s->nsnaps; i++) {
+        const uint64_t *cur = s->snaps + (size_t)i * s->nslots;
+        const uint64_t *prev = i ? cur - s->nslots : NULL;
+        for (int k = 0; k < s->nslots; k++) delta[k] = cur[k] - (prev ? prev[k] : 0);
+        if (csv) {
+            char label[32];
+            snprintf(label, sizeof(label), "%d", i);
+            csv_row(fp, s, label, delta);
+        }
+        else {
+            fprintf(fp, "%s\n    ", i ? "," : "");
+            json_values(fp, sorted, s->n, delta, 4);
+        }
+    }
+
+    if (csv) csv_row(fp, s, "total", total);
+    else fprintf(fp, "%s]\n}\n", s->nsnaps ? "\n  " : "");
+    // closed even when it fails, the error path must not close it again
+    int closed = fclose(fp);
+    fp = NULL;
+    check(closed == 0, "Can not write the statistics to %s.", path);
+    free(total);
+    free(delta);
+    free(sorted);
+    return 0;
+
+error:
+    if (fp) fclose(fp);
+    free(total);
+    free(delta);
+    free(sorted);
+    return -1;
+}
@@ -0,0 +1,59 @@
+#include <common.h>
+#include <trace.h>
+
+// n is at most a symbol name, far below the buffer
+static void put_bytes(TraceWriter *t, const void *p, size_t n) {
+    if (t->len + n > TRACE_BUF_SIZE) trace_drain(t);
+    memcpy(t->buf + t->len, p, n);
+    t->len += n;
+}
+
+void trace_drain(TraceWriter *t) {
+    if (t->len && fwrite(t->buf, 1, t->len, t->fp) != t->len) t->failed = 1;
+    t->len = 0;
+}
+
+TraceWriter *trace_create(const char *path, const SymbolTable *symbols) {
+    TraceWriter *t = calloc(1, sizeof(TraceWriter));
+    check_mem(t);
+    t->path = path;
+    t->buf = malloc(TRACE_BUF_SIZE);
+    check_mem(t->buf);
+    t->fp = fopen(path, "wb");
+    check(t->fp, "Can not write the trace to %s.", path);
+    // a pc is a multiple of 4, an odd one never matches
+    memset(t->seen_pc, 0xff, sizeof(t->seen_pc));
+
+    uint32_t head[2] = { TRACE_VERSION, symbols->count };
+    put_bytes(t, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    put_bytes(t, head, sizeof(head));
+    for (int i = 0; i < symbols->count; i++) {
+        const FuncSymbol *f = &symbols->symbols[i];
+        size_t n = strlen(f->name);
+        uint16_t len = n > UINT16_MAX ? UINT16_MAX : n;
+        put_bytes(t, &f->address, sizeof(f->address));
+        put_bytes(t, &len, sizeof(len));
+        put_bytes(t, f->name, len);
+    }
+    return t;
+
+error:
+    if (t) free(t->buf);
+    free(t);
+    return NULL;
+}
+
+void trace_close(TraceWriter *t) {
+    if (!t) return;
+    uint8_t end[TRACE_REC_MAX];
+    end[0] = TR_END;
+    put_bytes(t, end, trace_varint(end + 1, t->ninst) - end);
+    trace_drain(t);
+    if (fclose(t->fp) == 0 && !t->failed) {
+        log_info("Trace of %lu instructions written to %s.", t->ninst, t->path);
+    } else {
+        log_err("Can not write the trace to %s.", t->path);
+    }
+    free(t->buf);
+    free(t);
+}
@@ -0,0 +1,121 @@
+#include <common.h>
+#include <ctype.h>
+#include <isa_table.h>
+#include <uarch.h>
+
+const char *fu_names[FU_NUM] = { "alu", "branch", "mul", "div", "load", "store" };
+
+const uint8_t fu_of_class[] = {
+    [CLASS_ALU] = FU_ALU,       [CLASS_MUL] = FU_MUL,       [CLASS_DIV] = FU_DIV,
+    [CLASS_LOAD] = FU_LOAD,     [CLASS_STORE] = FU_STORE,   [CLASS_AMO] = FU_LOAD,
+    [CLASS_BRANCH] = FU_BRANCH, [CLASS_JUMP] = FU_BRANCH,   [CLASS_CSR] = FU_ALU,
+    [CLASS_SYSTEM] = FU_ALU,    [CLASS_FENCE] = FU_ALU,     [CLASS_UNK] = FU_ALU,
+};
+
+void uarch_defaults(UarchConfig *u) {
+    for (int f = 0; f < FU_NUM; f++) {
+        u->fu[f].latency = 1;
+        u->fu[f].units = 1;
+    }
+    // the slowest instruction of a unit sets its latency
+    for (int op = 0; op < OP_NUM; op++) {
+        FuConfig *fu = &u->fu[fu_of_class[isa_info[op].cls]];
+        if (isa_info[op].latency > fu->latency) fu->latency = isa_info[op].latency;
+    }
+    for (int f = 0; f < FU_NUM; f++) {
+        u->fu[f].interval = f == FU_DIV ? u->fu[f].latency : 1;
+    }
+    // as many ALUs and branch units as any width needs
+    u->fu[FU_ALU].units = FU_MAX_UNITS;
+    u->fu[FU_BRANCH].units = FU_MAX_UNITS;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+    return s;
+}
+
+static int parse_int(const char *val, int *out) {
+    char *end;
+    long n = strtol(val, &end, 0);
+    if (end == val || *end || n < 1) return -1;
+    *out = n;
+    return 0;
+}
+
+int uarch_load(const char *path, UarchConfig *u) {
+    char line[256];
+    int lineno = 0;
+    FuConfig *fu = NULL;
+    // Without an interval, a pipelined unit takes an operation every cycle
+    // and one that is not takes one per latency, even if only the latency
+    // changed
+    int pipelined[FU_NUM], interval_set[FU_NUM];
+    for (int f = 0; f < FU_NUM; f++) {
+        FuConfig *c = &u->fu[f];
+        pipelined[f] = c->interval == 1 ? 1 : c->interval == c->latency ? 0 : -1;
+        interval_set[f] = 0;
+    }
+    FILE *fp = fopen(path, "r");
+    check(fp, "Can not open the microarchitecture file %s.", path);
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        line[strcspn(line, "#;")] = '\0';
+        char *s = trim(line);
+        if (!*s) continue;
+
+        if (*s == '[') {
+            char *close = strchr(s, ']');
+            check(close && !*trim(close + 1), "%s:%d: bad section header.", path, lineno);
+            *close = '\0';
+            char *name = trim(s + 1);
+            fu = NULL;
+            for (int f = 0; f < FU_NUM; f++) {
+                if (strcmp(name, fu_names[f]) == 0) fu = &u->fu[f];
+            }
+            check(fu, "%s:%d: unknown unit '%s', expected alu, branch, mul, div, load or store.", path, lineno, name);
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        check(eq, "%s:%d: expected key = value.", path, lineno);
+        check(fu, "%s:%d: key outside a [unit] section.", path, lineno);
+        *eq = '\0';
+        char *key = trim(s), *val = trim(eq + 1);
+        int f = fu - u->fu;
+        if (strcmp(key, "latency") == 0) {
+            check(parse_int(val, &fu->latency) == 0, "%s:%d: the latency is a number of cycles, at least 1.", path, lineno);
+        }
+        else if (strcmp(key, "interval") == 0) {
+            check(parse_int(val, &fu->interval) == 0, "%s:%d: the interval is a number of cycles, at least 1.", path, lineno);
+            interval_set[f] = 1;
+        }
+        else if (strcmp(key, "units") == 0) {
+            check(parse_int(val, &fu->units) == 0 && fu->units <= FU_MAX_UNITS,
+                  "%s:%d: units must be 1 to %d.", path, lineno, FU_MAX_UNITS);
+        }
+        else if (strcmp(key, "pipelined") == 0) {
+            if (strcmp(val, "yes") == 0 || strcmp(val, "true") == 0 || strcmp(val, "1") == 0) pipelined[f] = 1;
+            else if (strcmp(val, "no") == 0 || strcmp(val, "false") == 0 || strcmp(val, "0") == 0) pipelined[f] = 0;
+            else sentinel("%s:%d: pipelined is yes or no.", path, lineno);
+        }
+        else {
+            sentinel("%s:%d: unknown key '%s', expected latency, interval, units or pipelined.", path, lineno, key);
+        }
+    }
+    fclose(fp);
+
+    for (int f = 0; f < FU_NUM; f++) {
+        if (pipelined[f] >= 0 && !interval_set[f]) {
+            u->fu[f].interval = pipelined[f] ? 1 : u->fu[f].latency;
+        }
+    }
+    return 0;
+
+error:
+    if (fp) fclose(fp);
+    return -1;
+}
@@ -13,8 +13,21 @@ typedef struct {
 } Area;
 
 
+// Multiprocessor: every hart starts at _start, only hart 0 runs main().
+// mpe_init() runs entry on all harts, this one included, and never returns.
+int cpu_count();
+int cpu_current();
+void mpe_init(void (*entry)());
+int atomic_xchg(int *addr, int newval);
+
+// RAM starts at _pmem_start (PMEM_BASE in the Makefile), its size comes
+// from the simulator at boot, see --mem-size
 extern char _pmem_start;
-#define PMEM_SIZE (128 * 1024 * 1024)
-#define PMEM_END  ((uint64_t *)&_pmem_start + PMEM_SIZE)
+extern Area heap;
+
+// Devices, see sim/include/device.h
+#define EXIT_ADDR   0x00100000          // write 0x5555 to pass, (code << 16) | 0x3333 to fail
+#define MTIME_ADDR  0x0200bff8          // CLINT timer, counts instructions (cycles on mc/pl)
+#define UART_ADDR   0x10000000          // 16550 transmit register
 
 #endif
\ No newline at end of file
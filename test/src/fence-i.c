@@ -0,0 +1,25 @@
+#include <trap.h>
+
+// Store a new instruction right after a fence.i and run it. The instruction
+// is `addi a0, zero, imm`, a model that runs the word fetched before the
+// store returns the last imm instead of this one.
+
+#define N 200
+
+static long patch(unsigned imm) {
+  register long a0 asm("a0");
+  unsigned inst = imm << 20 | 0x513;
+  asm volatile(
+    "   la t0, 1f\n"
+    "   sw %1, 0(t0)\n"
+    "   fence.i\n"
+    "1: addi a0, zero, 0\n"
+    : "=r"(a0) : "r"(inst) : "t0", "memory");
+  return a0;
+}
+
+int main() {
+  for (unsigned i = 1; i <= N; i++)
+    check(patch(i) == i);
+  return 0;
+}
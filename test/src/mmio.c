@@ -0,0 +1,28 @@
+#include <trap.h>
+#include <sim.h>
+
+// Talks to the simulator through its devices instead of ebreak
+
+#define REG8(addr)  (*(volatile uint8_t  *)(addr))
+#define REG32(addr) (*(volatile uint32_t *)(addr))
+#define REG64(addr) (*(volatile uint64_t *)(addr))
+
+static void uart_puts(const char *s) {
+  while (*s) {
+    while (!(REG8(UART_ADDR + 5) & 0x20));  // transmitter empty
+    REG8(UART_ADDR) = *s++;
+  }
+}
+
+int main() {
+  uart_puts("Hello from the UART\n");
+
+  uint64_t t0 = REG64(MTIME_ADDR);
+  int spins = 0;
+  while (REG64(MTIME_ADDR) == t0 && spins < 1000) spins++;
+  check(REG64(MTIME_ADDR) > t0);
+
+  REG32(EXIT_ADDR) = 0x5555;
+  // should not reach here
+  return 1;
+}
@@ -0,0 +1,66 @@
+#include <trap.h>
+#include <sim.h>
+
+// Parallel reduction: each hart sums its share of data[] and merges the
+// partial results with amoadd.d, amomin.d and amomax.d. Run it with
+// --harts <n>.
+
+#define N 4096
+
+static int64_t data[N];
+static int64_t sum = 0;
+static int64_t min = 0x7fffffffffffffffll;
+static int64_t max = -0x7fffffffffffffffll - 1;
+static int ready = 0;
+static int finished = 0;
+
+static void atomic_min(int64_t *p, int64_t v) {
+  asm volatile("amomin.d zero, %1, (%0)" : : "r"(p), "r"(v) : "memory");
+}
+
+static void atomic_max(int64_t *p, int64_t v) {
+  asm volatile("amomax.d zero, %1, (%0)" : : "r"(p), "r"(v) : "memory");
+}
+
+static void entry() {
+  int id = cpu_current(), n = cpu_count();
+
+  if (id == 0) {
+    for (int i = 0; i < N; i ++) {
+      data[i] = (i * 7919) % 1000 - 500;
+    }
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+  } else {
+    while (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE));
+  }
+
+  int64_t part = 0, lo = data[id], hi = data[id];
+  for (int i = id; i < N; i += n) {
+    part += data[i];
+    if (data[i] < lo) lo = data[i];
+    if (data[i] > hi) hi = data[i];
+  }
+  __atomic_fetch_add(&sum, part, __ATOMIC_SEQ_CST);
+  atomic_min(&min, lo);
+  atomic_max(&max, hi);
+  __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+
+  if (id == 0) {
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) != n);
+    int64_t expect = 0, expect_lo = data[0], expect_hi = data[0];
+    for (int i = 0; i < N; i ++) {
+      expect += data[i];
+      if (data[i] < expect_lo) expect_lo = data[i];
+      if (data[i] > expect_hi) expect_hi = data[i];
+    }
+    check(sum == expect);
+    check(min == expect_lo);
+    check(max == expect_hi);
+    halt(0);
+  }
+}
+
+int main() {
+  mpe_init(entry);
+  return 0;
+}
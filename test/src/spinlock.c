@@ -0,0 +1,53 @@
+#include <trap.h>
+#include <sim.h>
+
+// Every hart bumps two shared counters, one under an amoswap lock and one
+// under an lr/sc lock. Run it with --harts <n>.
+
+#define N 500
+
+static int swap_lock = 0;
+static int lrsc_lock = 0;
+static volatile int counter1 = 0;
+static volatile int counter2 = 0;
+static int finished = 0;
+
+static void lrsc_acquire(int *lock) {
+  int tmp;
+  asm volatile(
+    "1: lr.w.aq %0, (%1)\n"
+    "   bnez %0, 1b\n"
+    "   li %0, 1\n"
+    "   sc.w %0, %0, (%1)\n"
+    "   bnez %0, 1b\n"
+    : "=&r"(tmp) : "r"(lock) : "memory");
+}
+
+static void lrsc_release(int *lock) {
+  asm volatile("amoswap.w.rl zero, zero, (%0)" : : "r"(lock) : "memory");
+}
+
+static void entry() {
+  for (int i = 0; i < N; i ++) {
+    while (atomic_xchg(&swap_lock, 1));
+    counter1 = counter1 + 1;
+    atomic_xchg(&swap_lock, 0);
+
+    lrsc_acquire(&lrsc_lock);
+    counter2 = counter2 + 1;
+    lrsc_release(&lrsc_lock);
+  }
+  __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+
+  if (cpu_current() == 0) {
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) != cpu_count());
+    check(counter1 == N * cpu_count());
+    check(counter2 == N * cpu_count());
+    halt(0);
+  }
+}
+
+int main() {
+  mpe_init(entry);
+  return 0;
+}
@@ -3,12 +3,15 @@
 extern char _heap_start;
 int main(const char *args);
 
-Area heap = RANGE(&_heap_start, PMEM_END);
+Area heap;
 #ifndef MAINARGS
 #define MAINARGS ""
 #endif
 static const char mainargs[] = MAINARGS;
 
+static int nr_cpu = 1;
+static void (*mpe_entry)() = NULL;
+
 void halt(int code) {
   sim_trap(code);
 
@@ -16,7 +19,38 @@ void halt(int code) {
   while (1);
 }
 
-void _trm_init() {
+int cpu_count() {
+  return nr_cpu;
+}
+
+int cpu_current() {
+  int id;
+  asm volatile("csrr %0, mhartid" : "=r"(id));
+  return id;
+}
+
+int atomic_xchg(int *addr, int newval) {
+  int old;
+  asm volatile("amoswap.w.aqrl %0, %2, (%1)" : "=r"(old) : "r"(addr), "r"(newval) : "memory");
+  return old;
+}
+
+void mpe_init(void (*entry)()) {
+  __atomic_store_n(&mpe_entry, entry, __ATOMIC_RELEASE);
+  entry();
+  halt(0);
+}
+
+void _trm_init(int hartid, int ncpu, uintptr_t pmem_size) {
+  if (hartid != 0) {
+    // the other harts wait for main() to call mpe_init()
+    void (*entry)();
+    while ((entry = __atomic_load_n(&mpe_entry, __ATOMIC_ACQUIRE)) == NULL);
+    entry();
+    halt(0);
+  }
+  nr_cpu = ncpu;
+  heap = RANGE(&_heap_start, &_pmem_start + pmem_size);
   int ret = main(mainargs);
   halt(ret);
-}
\ No newline at end of file
+}